@@ -0,0 +1,81 @@
+#include <stdlib.h>
+#include <string.h>
+#include <vl.h>
+#include "types.h"
+#include "ah_cache.h"
+
+/* capacity is rounded up to a power of 2 sets */
+int ah_cache_init(struct ah_cache_t *cache, struct ibv_pd *pd, uint32_t capacity)
+{
+	uint32_t sets = 1;
+
+	memset(cache, 0, sizeof(*cache));
+	cache->pd = pd;
+
+	while (sets * AH_CACHE_WAYS < capacity)
+		sets *= 2;
+	cache->set_mask = sets - 1;
+
+	cache->ent = calloc(sets * AH_CACHE_WAYS, sizeof(*cache->ent));
+	if (!cache->ent) {
+		VL_MEM_ERR(("Fail to alloc an AH cache of %u entries", sets * AH_CACHE_WAYS));
+		return FAIL;
+	}
+
+	return SUCCESS;
+}
+
+struct ibv_ah *ah_cache_miss(struct ah_cache_t *cache, uint32_t key,
+			     struct ibv_ah_attr *attr)
+{
+	struct ah_cache_entry_t *set = ah_cache_set(cache, key);
+	struct ah_cache_entry_t *victim = &set[0];
+	struct ibv_ah *ah;
+	cycles_t t1;
+	int i;
+
+	cache->misses++;
+
+	for (i = 1; i < AH_CACHE_WAYS && victim->ah; i++)
+		if (!set[i].ah || set[i].last_use < victim->last_use)
+			victim = &set[i];
+
+	t1 = get_cycles();
+	ah = ibv_create_ah(cache->pd, attr);
+	cache->create_cycles += get_cycles() - t1;
+	if (!ah) {
+		VL_DATA_ERR(("Fail in ibv_create_ah of destination 0x%x", key));
+		return NULL;
+	}
+
+	if (victim->ah) {
+		if (ibv_destroy_ah(victim->ah))
+			VL_DATA_ERR(("Fail in ibv_destroy_ah of destination 0x%x", victim->key));
+		cache->evictions++;
+	}
+
+	victim->key = key;
+	victim->ah = ah;
+	victim->last_use = ++cache->clock;
+
+	return ah;
+}
+
+/* Destroy every AH, the statistics stay */
+void ah_cache_flush(struct ah_cache_t *cache)
+{
+	uint32_t i;
+
+	for (i = 0; cache->ent && i < (cache->set_mask + 1) * AH_CACHE_WAYS; i++) {
+		if (cache->ent[i].ah && ibv_destroy_ah(cache->ent[i].ah))
+			VL_DATA_ERR(("Fail in ibv_destroy_ah of destination 0x%x", cache->ent[i].key));
+		cache->ent[i].ah = NULL;
+	}
+}
+
+void ah_cache_destroy(struct ah_cache_t *cache)
+{
+	ah_cache_flush(cache);
+	free(cache->ent);
+	cache->ent = NULL;
+}
@@ -0,0 +1,60 @@
+#ifndef AH_CACHE_H
+#define AH_CACHE_H
+
+#include <stdint.h>
+#include <infiniband/verbs.h>
+#include "get_clock.h"
+
+#define AH_CACHE_WAYS 4
+
+struct ah_cache_entry_t {
+	uint32_t	key;
+	struct ibv_ah	*ah;		/* NULL - a free way */
+	uint64_t	last_use;
+};
+
+/*
+ * Address handles by destination, set associative: a key hashes to a set
+ * of AH_CACHE_WAYS entries and a miss replaces the least recently used
+ * entry of its set. The cache owns its AHs. A hit is inlined, it is on
+ * the post path of every UD message.
+ */
+struct ah_cache_t {
+	struct ibv_pd		*pd;
+	uint32_t		set_mask;
+	uint64_t		clock;
+	uint64_t		hits;
+	uint64_t		misses;
+	uint64_t		evictions;
+	cycles_t		create_cycles;	/* ibv_create_ah of the misses */
+	struct ah_cache_entry_t	*ent;
+};
+
+int ah_cache_init(struct ah_cache_t *cache, struct ibv_pd *pd, uint32_t capacity);
+struct ibv_ah *ah_cache_miss(struct ah_cache_t *cache, uint32_t key,
+			     struct ibv_ah_attr *attr);
+void ah_cache_flush(struct ah_cache_t *cache);
+void ah_cache_destroy(struct ah_cache_t *cache);
+
+static inline struct ah_cache_entry_t *ah_cache_set(struct ah_cache_t *cache, uint32_t key)
+{
+	return &cache->ent[(((key * 0x9e3779b1u) >> 16) & cache->set_mask) * AH_CACHE_WAYS];
+}
+
+static inline struct ibv_ah *ah_cache_get(struct ah_cache_t *cache, uint32_t key,
+					  struct ibv_ah_attr *attr)
+{
+	struct ah_cache_entry_t *set = ah_cache_set(cache, key);
+	int i;
+
+	for (i = 0; i < AH_CACHE_WAYS; i++)
+		if (set[i].ah && set[i].key == key) {
+			set[i].last_use = ++cache->clock;
+			cache->hits++;
+			return set[i].ah;
+		}
+
+	return ah_cache_miss(cache, key, attr);
+}
+
+#endif /* AH_CACHE_H */
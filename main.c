@@ -23,6 +23,52 @@ struct config_t config = {
 	.use_inl = 0,
 	.num_sge = DEF_NUM_SGE,
 	.ext_atomic = 0,
+	.perf_counters = 0,
+	.rate = 0,
+	.rate_step = 0,
+	.arrival = ARRIVAL_CONST,
+	.workload = 0,
+	.replay = REPLAY_FAST,
+	.thread_domain = 0,
+	.ring_alloc = 0,
+	.comp_cpu = -1,
+	.num_qps = 1,
+	.producers = 0,
+	.cq_share = CQ_SHARE_QP,
+	.threads = 1,
+	.cq_depth = 0,
+	.split_cq = 0,
+	.coalesce_n = 0,
+	.coalesce_ns = 0,
+	.loopback = 0,
+	.lb_cpu = { -1, -1 },
+	.gid_idx = -1,
+	.s2c = S2C_DEFAULT,
+	.size_sweep = 0,
+	.cqe_comp = CQE_COMP_NONE,
+	.cq_moder_cnt = 0,
+	.cq_moder_usec = 0,
+	.mr_mode = MR_PINNED,
+	.prefetch = 0,
+	.mr_bench = 0,
+	.atomic_targets = 0,
+	.rd_atomic = 8,
+	.depth_sweep = 0,
+	.mtu = 0,
+	.mtu_sweep = 0,
+	.srq_refill = SRQ_REFILL_INLINE,
+	.srq_watermark = 0,
+	.xrcd_path = "/tmp/post_send_test.xrcd",
+	.xrc_procs = 0,
+	.dc_targets = 0,
+	.dc_pattern = DC_PATTERN_RR,
+	.dci_policy = DCI_POLICY_HASH,
+	.ud_dests = 0,
+	.ah_cache = 0,
+	.duration = 0,
+	.interval_ms = 1000,
+	.warmup = 0,
+	.repeat = 1,
 };
 
 struct VL_usage_descriptor_t usage_descriptor[] = {
@@ -42,7 +88,7 @@ struct VL_usage_descriptor_t usage_descriptor[] = {
 
 	{
 		'r', "ring_sz", "RING_SZ",
-		"the ring to be used on the TX and RX queues (Default 64)",
+		"the ring to be used on the TX and RX queues, up to the device max_qp_wr (Default 64)",
 #define RING_CMD_CASE				2
 		RING_CMD_CASE
 	},
@@ -130,6 +176,358 @@ struct VL_usage_descriptor_t usage_descriptor[] = {
 		"Enforce QPs type [RC/DC/UD/RAW/XRC (Default: RC)]",
 #define QP_TYPE_CMD_CASE			16
 		QP_TYPE_CMD_CASE
+	},
+
+	{
+		' ', "perf_counters", "",
+		"Collect HW counters (instructions, cycles, cache/branch/TLB misses) on the post and poll flows",
+#define PERF_CNT_CMD_CASE			17
+		PERF_CNT_CMD_CASE
+	},
+
+	{
+		' ', "rate", "MSG_RATE",
+		"Open-loop sender: post at MSG_RATE [msg/s] and measure latency from the intended send time",
+#define RATE_CMD_CASE				18
+		RATE_CMD_CASE
+	},
+
+	{
+		' ', "rate_sweep", "FACTOR",
+		"Open-loop: multiply the rate by FACTOR per step until saturation (e.g. 1.5)",
+#define RATE_SWEEP_CMD_CASE			19
+		RATE_SWEEP_CMD_CASE
+	},
+
+	{
+		' ', "arrival", "ARRIVAL",
+		"Open-loop arrivals [CONST, POISSON] (default: CONST)",
+#define ARRIVAL_CMD_CASE			20
+		ARRIVAL_CMD_CASE
+	},
+
+	{
+		' ', "workload", "OP:WEIGHT,...",
+		"Weighted opcode mix, e.g. SEND:60,WRITE:30,READ:10 (NEW method only, both sides)"
+		"\n\tOpcodes: SEND, SEND_IMM, WRITE, WRITE_IMM, READ, ATOMIC_FA, ATOMIC_CS",
+#define WORKLOAD_CMD_CASE			21
+		WORKLOAD_CMD_CASE
+	},
+
+	{
+		' ', "msg_sizes", "SIZE:WEIGHT,...",
+		"Message size distribution of the workload, e.g. 64:80,4096:20 (Default: 8)",
+#define MSG_SIZES_CMD_CASE			22
+		MSG_SIZES_CMD_CASE
+	},
+
+	{
+		' ', "trace", "TRACE_FILE",
+		"Replay a binary trace of (ts, opcode, size, dest, phase) records (NEW method only, both sides)",
+#define TRACE_CMD_CASE				23
+		TRACE_CMD_CASE
+	},
+
+	{
+		' ', "replay", "REPLAY",
+		"Trace replay pacing [FAST, TIMED] (default: FAST)",
+#define REPLAY_CMD_CASE				24
+		REPLAY_CMD_CASE
+	},
+
+	{
+		' ', "trace_out", "TRACE_FILE",
+		"Capture the posted WRs to a replayable trace (phase per traffic step)",
+#define TRACE_OUT_CMD_CASE			25
+		TRACE_OUT_CMD_CASE
+	},
+
+	{
+		' ', "thread_domain", "",
+		"Create the QP and CQ on a thread domain (parent domain), so the provider skips locking",
+#define THREAD_DOMAIN_CMD_CASE			26
+		THREAD_DOMAIN_CMD_CASE
+	},
+
+	{
+		' ', "ring_alloc", "PLACEMENT,...",
+		"Allocate the QP/CQ/SRQ rings through a parent domain allocator [DEFAULT, HUGE, NUMA, COLOR]"
+		"\n\te.g. HUGE,NUMA - hugepages bound to the HCA NUMA node (default: DEFAULT)",
+#define RING_ALLOC_CMD_CASE			27
+		RING_ALLOC_CMD_CASE
+	},
+
+	{
+		' ', "comp_thread", "CPU",
+		"Poll the CQ from a completion thread pinned to CPU and compare it with inline polling",
+#define COMP_THREAD_CMD_CASE			28
+		COMP_THREAD_CMD_CASE
+	},
+
+	{
+		' ', "num_qps", "NUM_QPS",
+		"Number of QPs (RC, UC and UD), the server receives them on a shared SRQ (both sides, default: 1)",
+#define NUM_QPS_CMD_CASE			29
+		NUM_QPS_CMD_CASE
+	},
+
+	{
+		' ', "producers", "NUM_PRODUCERS",
+		"Scale 1..N producer threads over a lock-free MPSC ring, a mutex around the QP and"
+		"\n\ta QP per thread (up to --num_qps) (NEW method only)",
+#define PRODUCERS_CMD_CASE			30
+		PRODUCERS_CMD_CASE
+	},
+
+	{
+		' ', "cq_share", "CQ_SHARE",
+		"How the client QPs share send CQs [QP, THREAD, GLOBAL] (default: QP)",
+#define CQ_SHARE_CMD_CASE			31
+		CQ_SHARE_CMD_CASE
+	},
+
+	{
+		' ', "threads", "NUM_THREADS",
+		"Sender threads, QP i is driven by thread i % NUM_THREADS (default: 1)",
+#define THREADS_CMD_CASE			32
+		THREADS_CMD_CASE
+	},
+
+	{
+		' ', "cq_depth", "CQ_DEPTH",
+		"CQ depth (default: ring size times the QPs sharing the CQ)",
+#define CQ_DEPTH_CMD_CASE			33
+		CQ_DEPTH_CMD_CASE
+	},
+
+	{
+		' ', "split_cq", "",
+		"Separate send and recv CQs",
+#define SPLIT_CQ_CMD_CASE			34
+		SPLIT_CQ_CMD_CASE
+	},
+
+	{
+		' ', "coalesce", "N:NS",
+		"Coalesce open-loop arrivals, ring the doorbell once N are pending or the first waited NS",
+#define COALESCE_CMD_CASE			35
+		COALESCE_CMD_CASE
+	},
+
+	{
+		' ', "loopback", "",
+		"Run client and server in this process over the same device",
+#define LOOPBACK_CMD_CASE			36
+		LOOPBACK_CMD_CASE
+	},
+
+	{
+		' ', "loopback_cpus", "CLIENT,SERVER",
+		"Pin the loopback sender and receiver threads",
+#define LOOPBACK_CPUS_CMD_CASE			37
+		LOOPBACK_CPUS_CMD_CASE
+	},
+
+	{
+		' ', "gid_index", "INDEX",
+		"GID index for GRH addressing (default: a RoCE v2 GID on Ethernet, none on IB)",
+#define GID_INDEX_CMD_CASE			38
+		GID_INDEX_CMD_CASE
+	},
+
+	{
+		' ', "scatter2cqe", "ON|OFF",
+		"Scatter small messages to the CQE on the QPs of this side (default: provider)",
+#define S2C_CMD_CASE				39
+		S2C_CMD_CASE
+	},
+
+	{
+		' ', "size_sweep", "MAX",
+		"Step the message size from -s doubling up to MAX, the receiver reports each size",
+#define SIZE_SWEEP_CMD_CASE			40
+		SIZE_SWEEP_CMD_CASE
+	},
+
+	{
+		' ', "cqe_comp", "HASH|CSUM",
+		"Compress the receive CQ CQEs, mini CQEs in the given format (server)",
+#define CQE_COMP_CMD_CASE			41
+		CQE_COMP_CMD_CASE
+	},
+
+	{
+		' ', "cq_moder", "COUNT:USEC",
+		"Moderate the receive CQ events, the receiver sleeps on them instead of busy polling (server)",
+#define CQ_MODER_CMD_CASE			42
+		CQ_MODER_CMD_CASE
+	},
+
+	{
+		' ', "mr_mode", "PINNED|ODP|IMPLICIT_ODP",
+		"Register the buffer pinned or on demand paging (default: PINNED)",
+#define MR_MODE_CMD_CASE			43
+		MR_MODE_CMD_CASE
+	},
+
+	{
+		' ', "prefetch", "",
+		"Prefetch the ODP buffer with ibv_advise_mr before traffic",
+#define PREFETCH_CMD_CASE			44
+		PREFETCH_CMD_CASE
+	},
+
+	{
+		' ', "mr_bench", "MAX",
+		"Time ibv_reg_mr/ibv_dereg_mr and compare per message registration, a registration cache"
+		" and a bounce buffer for sizes from -s doubling up to MAX",
+#define MR_BENCH_CMD_CASE			45
+		MR_BENCH_CMD_CASE
+	},
+
+	{
+		' ', "atomic_bench", "TARGETS",
+		"Step the atomics from a single remote address up to TARGETS (power of 2) of them,"
+		" extended atomics also step the argument size up to the device max (both sides)",
+#define ATOMIC_BENCH_CMD_CASE			46
+		ATOMIC_BENCH_CMD_CASE
+	},
+
+	{
+		' ', "rd_atomic", "N",
+		"READ/atomic operations in flight as initiator and responder, capped by the HCA (default: 8)",
+#define RD_ATOMIC_CMD_CASE			47
+		RD_ATOMIC_CMD_CASE
+	},
+
+	{
+		' ', "depth_sweep", "",
+		"Step the READs kept in flight from 1 up to the ring depth, per size of --size_sweep (both sides)",
+#define DEPTH_SWEEP_CMD_CASE			48
+		DEPTH_SWEEP_CMD_CASE
+	},
+
+	{
+		' ', "mtu", "256|512|1024|2048|4096",
+		"Path MTU, capped by the active MTU of both ports (default: the smaller active MTU)",
+#define MTU_CMD_CASE				49
+		MTU_CMD_CASE
+	},
+
+	{
+		' ', "mtu_sweep", "",
+		"Reconnect at every MTU up to the negotiated one, per size of --size_sweep or at -s"
+		" (RC, both sides)",
+#define MTU_SWEEP_CMD_CASE			50
+		MTU_SWEEP_CMD_CASE
+	},
+
+	{
+		' ', "srq_refill", "INLINE|EVENT|THREAD",
+		"Refill the SRQ of a multi-QP server after every poll, on the SRQ limit event"
+		" or from a thread sleeping on it (server, default: INLINE)",
+#define SRQ_REFILL_CMD_CASE			51
+		SRQ_REFILL_CMD_CASE
+	},
+
+	{
+		' ', "srq_watermark", "N",
+		"SRQ limit the refill waits for (server, default: a quarter of the ring)",
+#define SRQ_WATERMARK_CMD_CASE			52
+		SRQ_WATERMARK_CMD_CASE
+	},
+
+	{
+		' ', "xrcd_file", "PATH",
+		"File naming the XRC domain, processes opening it share the XRCD"
+		" (default: /tmp/post_send_test.xrcd)",
+#define XRCD_FILE_CMD_CASE			53
+		XRCD_FILE_CMD_CASE
+	},
+
+	{
+		' ', "xrc_procs", "N",
+		"Fork N worker processes sharing the XRCD, each receiving on an XRC SRQ of its own"
+		" (XRC server, the client sends round-robin over them)",
+#define XRC_PROCS_CMD_CASE			54
+		XRC_PROCS_CMD_CASE
+	},
+
+	{
+		' ', "dc_targets", "T",
+		"DC fan-out over T DCTs of the server, from --num_qps DCIs of the client."
+		" The client steps the targets in use up to T (both sides, -m NEW)",
+#define DC_TARGETS_CMD_CASE			55
+		DC_TARGETS_CMD_CASE
+	},
+
+	{
+		' ', "dc_pattern", "RR|RANDOM",
+		"Target of each DC fan-out message: in turn or uniformly random (default: RR)",
+#define DC_PATTERN_CMD_CASE			56
+		DC_PATTERN_CMD_CASE
+	},
+
+	{
+		' ', "dci_policy", "HASH|RR|LRU",
+		"DCI of each DC fan-out message: by target, in turn, or the one still at the"
+		" target else the least recently used (default: HASH)",
+#define DCI_POLICY_CMD_CASE			57
+		DCI_POLICY_CMD_CASE
+	},
+
+	{
+		' ', "ud_dests", "N",
+		"UD fan-out to N UD QPs of the server, the client sends to them in turn"
+		" from one QP (both sides, -m NEW)",
+#define UD_DESTS_CMD_CASE			58
+		UD_DESTS_CMD_CASE
+	},
+
+	{
+		' ', "ah_cache", "N",
+		"AH cache entries of the UD fan-out client (default: an entry per destination)",
+#define AH_CACHE_CMD_CASE			59
+		AH_CACHE_CMD_CASE
+	},
+
+	{
+		' ', "duration", "SECONDS",
+		"Post for SECONDS instead of a number of iterations, the client reports"
+		" every --interval",
+#define DURATION_CMD_CASE			60
+		DURATION_CMD_CASE
+	},
+
+	{
+		' ', "interval", "MS",
+		"Report period of a duration run: message rate, post cost percentiles and"
+		" completions (default: 1000)",
+#define INTERVAL_CMD_CASE			61
+		INTERVAL_CMD_CASE
+	},
+
+	{
+		' ', "warmup", "N",
+		"Post N messages before the measured runs and drop their samples, at least"
+		" the ring size (default: 0)",
+#define WARMUP_CMD_CASE				62
+		WARMUP_CMD_CASE
+	},
+
+	{
+		' ', "repeat", "K",
+		"Run the measured iterations K times over the same connection and report"
+		" the spread of the runs (default: 1)",
+#define REPEAT_CMD_CASE				63
+		REPEAT_CMD_CASE
+	},
+
+	{
+		's', "size", "MSG_SZ",
+		"Message size, the start of the size sweeps (Default 8)",
+#define SIZE_CMD_CASE				64
+		SIZE_CMD_CASE
 	}
 
 };
@@ -154,12 +552,24 @@ static void print_config(void)
 {
 	VL_MISC_TRACE((" ---------------------- config data  ---------------"));
 
-	VL_MISC_TRACE((" Test side                      : %s", ((config.is_daemon) ? "Server" : "Client")));
-	if (!config.is_daemon)
+	VL_MISC_TRACE((" Test side                      : %s", config.loopback ? "Loopback" :
+		       ((config.is_daemon) ? "Server" : "Client")));
+	if (config.loopback && config.lb_cpu[0] >= 0)
+		VL_MISC_TRACE((" Loopback CPUs                  : %d,%d", config.lb_cpu[0], config.lb_cpu[1]));
+	if (!config.is_daemon && !config.loopback)
 		VL_MISC_TRACE((" IP                             : %s", config.ip));
 	VL_MISC_TRACE((" TCPort                         : %d", config.tcp));
 	VL_MISC_TRACE((" HCA                            : %s", config.hca_type));
-	VL_MISC_TRACE((" Number of iterations           : %d", config.num_of_iter));
+	if (config.gid_idx >= 0)
+		VL_MISC_TRACE((" GID index                      : %d", config.gid_idx));
+	if (config.duration)
+		VL_MISC_TRACE((" Duration                       : %u[s], reports every %u[ms]",
+			       config.duration, config.interval_ms));
+	else
+		VL_MISC_TRACE((" Number of iterations           : %lu", config.num_of_iter));
+	if (config.warmup || config.repeat > 1)
+		VL_MISC_TRACE((" Warm-up, measured runs         : %u messages, %u runs",
+			       config.warmup, config.repeat));
 	VL_MISC_TRACE((" QP Type                        : %s", (VL_ibv_qp_type_str(config.qp_type))));
 	VL_MISC_TRACE((" MAC                            : %s", config.mac));
 	VL_MISC_TRACE((" Opcode                         : %s", (VL_ibv_wr_opcode_str(config.opcode))));
@@ -170,6 +580,83 @@ static void print_config(void)
 	VL_MISC_TRACE((" Use inline:                    : %s", bool_to_str(config.use_inl)));
 	VL_MISC_TRACE((" Use post send method           : %d", config.send_method));
 	VL_MISC_TRACE((" Wait before exit               : %s", bool_to_str(config.wait)));
+	VL_MISC_TRACE((" HW perf counters               : %s", bool_to_str(config.perf_counters)));
+	VL_MISC_TRACE((" Thread domain                  : %s", bool_to_str(config.thread_domain)));
+	VL_MISC_TRACE((" Ring placement                 : %s", ring_alloc_str(config.ring_alloc)));
+	if (config.comp_cpu >= 0)
+		VL_MISC_TRACE((" Completion thread CPU          : %d", config.comp_cpu));
+	if (config.s2c)
+		VL_MISC_TRACE((" Scatter to CQE                 : %s", config.s2c == S2C_ON ? "ON" : "OFF"));
+	if (config.size_sweep)
+		VL_MISC_TRACE((" Size sweep up to               : %u", config.size_sweep));
+	VL_MISC_TRACE((" MR mode                        : %s%s", mr_mode_str(config.mr_mode),
+		       config.prefetch ? ", prefetch" : ""));
+	if (config.mr_bench)
+		VL_MISC_TRACE((" Registration benchmark         : %u..%u", config.mr_bench_min, config.mr_bench));
+	VL_MISC_TRACE((" Outstanding READ/atomic        : %u%s", config.rd_atomic,
+		       config.depth_sweep ? ", window sweep" : ""));
+	if (config.mtu)
+		VL_MISC_TRACE((" Path MTU                       : %d%s", 128 << config.mtu,
+			       config.mtu_sweep ? ", MTU sweep" : ""));
+	else
+		VL_MISC_TRACE((" Path MTU                       : active%s",
+			       config.mtu_sweep ? ", MTU sweep" : ""));
+	if (config.srq_refill)
+		VL_MISC_TRACE((" SRQ refill                     : %s below %u WRs",
+			       config.srq_refill == SRQ_REFILL_EVENT ? "EVENT" : "THREAD",
+			       config.srq_watermark));
+	if (config.qp_type == IBV_QPT_XRC_SEND || config.qp_type == IBV_QPT_XRC_RECV)
+		VL_MISC_TRACE((" XRC domain                     : %s", config.xrcd_path));
+	if (config.xrc_procs)
+		VL_MISC_TRACE((" XRC workers                    : %d", config.xrc_procs));
+	if (config.ud_dests)
+		VL_MISC_TRACE((" UD fan-out                     : %u destinations, AH cache %u",
+			       config.ud_dests, config.ah_cache));
+	if (config.dc_targets)
+		VL_MISC_TRACE((" DC fan-out                     : %u targets %s, DCI policy %s",
+			       config.dc_targets, config.dc_pattern == DC_PATTERN_RANDOM ? "RANDOM" : "RR",
+			       dci_policy_str(config.dci_policy)));
+	if (config.atomic_targets)
+		VL_MISC_TRACE((" Atomic targets                 : 1..%u, %lu[B] apart",
+			       config.atomic_targets, config.atomic_stride));
+	if (config.cqe_comp)
+		VL_MISC_TRACE((" Receive CQE compression        : %s",
+			       config.cqe_comp == CQE_COMP_HASH ? "HASH" : "CSUM"));
+	if (config.cq_moder_cnt)
+		VL_MISC_TRACE((" Receive CQ moderation          : %u CQEs or %u[usec]",
+			       config.cq_moder_cnt, config.cq_moder_usec));
+	VL_MISC_TRACE((" Number of QPs                  : %d", config.num_qps));
+	VL_MISC_TRACE((" Sender threads                 : %d", config.threads));
+	VL_MISC_TRACE((" CQ sharing                     : %s%s", cq_share_str(config.cq_share),
+		       config.split_cq ? ", split send/recv" : ""));
+	if (config.cq_depth)
+		VL_MISC_TRACE((" CQ depth                       : %u", config.cq_depth));
+	if (config.producers)
+		VL_MISC_TRACE((" Producer threads               : %d", config.producers));
+	if (config.rate) {
+		VL_MISC_TRACE((" Open-loop rate                 : %.0lf[msg/s]", config.rate));
+		VL_MISC_TRACE((" Arrivals                       : %s", config.arrival == ARRIVAL_POISSON ? "POISSON" : "CONST"));
+		if (config.rate_step)
+			VL_MISC_TRACE((" Rate sweep factor              : %.2lf", config.rate_step));
+		if (config.coalesce_n)
+			VL_MISC_TRACE((" Doorbell coalescing            : %u messages or %u[ns]",
+				       config.coalesce_n, config.coalesce_ns));
+	}
+	if (config.trace_path)
+		VL_MISC_TRACE((" Trace replay                   : %s (%s)", config.trace_path,
+			       config.replay == REPLAY_TIMED ? "TIMED" : "FAST"));
+	if (config.trace_out)
+		VL_MISC_TRACE((" Trace capture                  : %s", config.trace_out));
+	if (config.workload && !config.trace_path) {
+		int i;
+
+		for (i = 0; i < config.wl.num_ops; i++)
+			VL_MISC_TRACE((" Workload opcode                : %s (weight %u)",
+				       wl_opcode_str(config.wl.ops[i]), config.wl.op_weight[i]));
+		for (i = 0; i < config.wl.num_sizes; i++)
+			VL_MISC_TRACE((" Workload msg size              : %u (weight %u)",
+				       config.wl.sizes[i], config.wl.size_weight[i]));
+	}
 
 	VL_MISC_TRACE((" --------------------------------------------------"));
 }
@@ -194,6 +681,404 @@ static int process_arg(
 		config.use_inl = 1;
 		break;
 
+	case PERF_CNT_CMD_CASE:
+		config.perf_counters = 1;
+		break;
+
+	case THREAD_DOMAIN_CMD_CASE:
+		config.thread_domain = 1;
+		break;
+
+	case COMP_THREAD_CMD_CASE:
+		config.comp_cpu = strtol(equ_ptr, NULL, 0);
+		if (config.comp_cpu < 0) {
+			VL_MISC_ERR(("Invalid completion thread CPU %s\n", equ_ptr));
+			exit(1);
+		}
+		break;
+
+	case NUM_QPS_CMD_CASE:
+		config.num_qps = strtol(equ_ptr, NULL, 0);
+		if (config.num_qps < 1) {
+			VL_MISC_ERR(("Number of QPs must be positive\n"));
+			exit(1);
+		}
+		break;
+
+	case PRODUCERS_CMD_CASE:
+		config.producers = strtol(equ_ptr, NULL, 0);
+		if (config.producers < 1 || config.producers > MAX_PRODUCERS) {
+			VL_MISC_ERR(("Producers must be 1..%d\n", MAX_PRODUCERS));
+			exit(1);
+		}
+		break;
+
+	case CQ_SHARE_CMD_CASE:
+		if (!strcmp("QP",equ_ptr))
+			config.cq_share = CQ_SHARE_QP;
+		else if (!strcmp("THREAD",equ_ptr))
+			config.cq_share = CQ_SHARE_THREAD;
+		else if (!strcmp("GLOBAL",equ_ptr))
+			config.cq_share = CQ_SHARE_GLOBAL;
+		else {
+			VL_MISC_ERR(("Unsupported CQ sharing %s\n", equ_ptr));
+			exit(1);
+		}
+		break;
+
+	case THREADS_CMD_CASE:
+		config.threads = strtol(equ_ptr, NULL, 0);
+		if (config.threads < 1 || config.threads > MAX_PRODUCERS) {
+			VL_MISC_ERR(("Threads must be 1..%d\n", MAX_PRODUCERS));
+			exit(1);
+		}
+		break;
+
+	case CQ_DEPTH_CMD_CASE:
+		config.cq_depth = strtoul(equ_ptr, NULL, 0);
+		if (!config.cq_depth) {
+			VL_MISC_ERR(("CQ depth must be positive\n"));
+			exit(1);
+		}
+		break;
+
+	case COALESCE_CMD_CASE: {
+		char *end;
+
+		config.coalesce_n = strtoul(equ_ptr, &end, 0);
+		config.coalesce_ns = *end == ':' ? strtoul(end + 1, NULL, 0) : 0;
+		if (!config.coalesce_n || *end != ':') {
+			VL_MISC_ERR(("Coalescing takes N:NS, N > 0\n"));
+			exit(1);
+		}
+		break;
+	}
+
+	case SPLIT_CQ_CMD_CASE:
+		config.split_cq = 1;
+		break;
+
+	case S2C_CMD_CASE:
+		if (!strcmp("ON", equ_ptr)) {
+			config.s2c = S2C_ON;
+		} else if (!strcmp("OFF", equ_ptr)) {
+			config.s2c = S2C_OFF;
+		} else {
+			VL_MISC_ERR(("Unsupported scatter to CQE mode %s\n", equ_ptr));
+			exit(1);
+		}
+		break;
+
+	case SIZE_SWEEP_CMD_CASE:
+		config.size_sweep = strtoul(equ_ptr, NULL, 0);
+		if (!config.size_sweep) {
+			VL_MISC_ERR(("Size sweep takes the max message size\n"));
+			exit(1);
+		}
+		break;
+
+	case MR_MODE_CMD_CASE:
+		if (!strcmp("PINNED", equ_ptr)) {
+			config.mr_mode = MR_PINNED;
+		} else if (!strcmp("ODP", equ_ptr)) {
+			config.mr_mode = MR_ODP;
+		} else if (!strcmp("IMPLICIT_ODP", equ_ptr)) {
+			config.mr_mode = MR_IMPLICIT_ODP;
+		} else {
+			VL_MISC_ERR(("Unsupported MR mode %s\n", equ_ptr));
+			exit(1);
+		}
+		break;
+
+	case MR_BENCH_CMD_CASE:
+		config.mr_bench = strtoul(equ_ptr, NULL, 0);
+		if (!config.mr_bench || config.mr_bench > MR_BENCH_MAX) {
+			VL_MISC_ERR(("Registration benchmark max size must be 1..%u\n", MR_BENCH_MAX));
+			exit(1);
+		}
+		break;
+
+	case RD_ATOMIC_CMD_CASE: {
+		unsigned long val = strtoul(equ_ptr, NULL, 0);
+
+		if (!val || val > UINT8_MAX) {
+			VL_MISC_ERR(("Outstanding READ/atomic must be 1..%u\n", UINT8_MAX));
+			exit(1);
+		}
+		config.rd_atomic = val;
+		break;
+	}
+
+	case MTU_CMD_CASE:
+		if (!strcmp("256", equ_ptr)) {
+			config.mtu = IBV_MTU_256;
+		} else if (!strcmp("512", equ_ptr)) {
+			config.mtu = IBV_MTU_512;
+		} else if (!strcmp("1024", equ_ptr)) {
+			config.mtu = IBV_MTU_1024;
+		} else if (!strcmp("2048", equ_ptr)) {
+			config.mtu = IBV_MTU_2048;
+		} else if (!strcmp("4096", equ_ptr)) {
+			config.mtu = IBV_MTU_4096;
+		} else {
+			VL_MISC_ERR(("Unsupported MTU %s\n", equ_ptr));
+			exit(1);
+		}
+		break;
+
+	case SRQ_REFILL_CMD_CASE:
+		if (!strcmp("INLINE", equ_ptr)) {
+			config.srq_refill = SRQ_REFILL_INLINE;
+		} else if (!strcmp("EVENT", equ_ptr)) {
+			config.srq_refill = SRQ_REFILL_EVENT;
+		} else if (!strcmp("THREAD", equ_ptr)) {
+			config.srq_refill = SRQ_REFILL_THREAD;
+		} else {
+			VL_MISC_ERR(("Unsupported SRQ refill %s\n", equ_ptr));
+			exit(1);
+		}
+		break;
+
+	case SRQ_WATERMARK_CMD_CASE:
+		config.srq_watermark = strtoul(equ_ptr, NULL, 0);
+		if (!config.srq_watermark) {
+			VL_MISC_ERR(("SRQ watermark cant be zero\n"));
+			exit(1);
+		}
+		break;
+
+	case MTU_SWEEP_CMD_CASE:
+		config.mtu_sweep = 1;
+		break;
+
+	case XRCD_FILE_CMD_CASE:
+		config.xrcd_path = equ_ptr;
+		break;
+
+	case DC_TARGETS_CMD_CASE:
+		config.dc_targets = strtoul(equ_ptr, NULL, 0);
+		if (!config.dc_targets || config.dc_targets > DC_MAX_TARGETS) {
+			VL_MISC_ERR(("DC targets must be 1..%d\n", DC_MAX_TARGETS));
+			exit(1);
+		}
+		break;
+
+	case DC_PATTERN_CMD_CASE:
+		if (!strcmp("RR", equ_ptr)) {
+			config.dc_pattern = DC_PATTERN_RR;
+		} else if (!strcmp("RANDOM", equ_ptr)) {
+			config.dc_pattern = DC_PATTERN_RANDOM;
+		} else {
+			VL_MISC_ERR(("Unsupported DC pattern %s\n", equ_ptr));
+			exit(1);
+		}
+		break;
+
+	case DCI_POLICY_CMD_CASE:
+		if (!strcmp("HASH", equ_ptr)) {
+			config.dci_policy = DCI_POLICY_HASH;
+		} else if (!strcmp("RR", equ_ptr)) {
+			config.dci_policy = DCI_POLICY_RR;
+		} else if (!strcmp("LRU", equ_ptr)) {
+			config.dci_policy = DCI_POLICY_LRU;
+		} else {
+			VL_MISC_ERR(("Unsupported DCI policy %s\n", equ_ptr));
+			exit(1);
+		}
+		break;
+
+	case UD_DESTS_CMD_CASE:
+		config.ud_dests = strtoul(equ_ptr, NULL, 0);
+		if (!config.ud_dests || config.ud_dests > UD_MAX_DESTS) {
+			VL_MISC_ERR(("UD destinations must be 1..%d\n", UD_MAX_DESTS));
+			exit(1);
+		}
+		break;
+
+	case AH_CACHE_CMD_CASE:
+		config.ah_cache = strtoul(equ_ptr, NULL, 0);
+		if (!config.ah_cache) {
+			VL_MISC_ERR(("AH cache cant be empty\n"));
+			exit(1);
+		}
+		break;
+
+	case DURATION_CMD_CASE:
+		config.duration = strtoul(equ_ptr, NULL, 0);
+		if (!config.duration) {
+			VL_MISC_ERR(("Duration cant be zero\n"));
+			exit(1);
+		}
+		break;
+
+	case INTERVAL_CMD_CASE:
+		config.interval_ms = strtoul(equ_ptr, NULL, 0);
+		if (!config.interval_ms) {
+			VL_MISC_ERR(("Report interval cant be zero\n"));
+			exit(1);
+		}
+		break;
+
+	case WARMUP_CMD_CASE:
+		config.warmup = strtoul(equ_ptr, NULL, 0);
+		break;
+
+	case SIZE_CMD_CASE:
+		config.msg_sz = strtoul(equ_ptr, NULL, 0);
+		if (!config.msg_sz) {
+			VL_MISC_ERR(("Message size cant be zero\n"));
+			exit(1);
+		}
+		break;
+
+	case REPEAT_CMD_CASE:
+		config.repeat = strtoul(equ_ptr, NULL, 0);
+		if (!config.repeat) {
+			VL_MISC_ERR(("Number of runs cant be zero\n"));
+			exit(1);
+		}
+		break;
+
+	case XRC_PROCS_CMD_CASE:
+		config.xrc_procs = strtol(equ_ptr, NULL, 0);
+		if (config.xrc_procs < 1 || config.xrc_procs > XRC_MAX_PROCS) {
+			VL_MISC_ERR(("XRC workers must be 1..%d\n", XRC_MAX_PROCS));
+			exit(1);
+		}
+		break;
+
+	case DEPTH_SWEEP_CMD_CASE:
+		config.depth_sweep = 1;
+		break;
+
+	case ATOMIC_BENCH_CMD_CASE:
+		config.atomic_targets = strtoul(equ_ptr, NULL, 0);
+		if (!config.atomic_targets || config.atomic_targets > ATOMIC_MAX_TARGETS ||
+		    (config.atomic_targets & (config.atomic_targets - 1))) {
+			VL_MISC_ERR(("Atomic targets must be a power of 2 up to %u\n", ATOMIC_MAX_TARGETS));
+			exit(1);
+		}
+		break;
+
+	case PREFETCH_CMD_CASE:
+		config.prefetch = 1;
+		break;
+
+	case CQE_COMP_CMD_CASE:
+		if (!strcmp("HASH", equ_ptr)) {
+			config.cqe_comp = CQE_COMP_HASH;
+		} else if (!strcmp("CSUM", equ_ptr)) {
+			config.cqe_comp = CQE_COMP_CSUM;
+		} else {
+			VL_MISC_ERR(("Unsupported CQE compression format %s\n", equ_ptr));
+			exit(1);
+		}
+		break;
+
+	case CQ_MODER_CMD_CASE: {
+		char *end;
+
+		config.cq_moder_cnt = strtoul(equ_ptr, &end, 0);
+		config.cq_moder_usec = *end == ':' ? strtoul(end + 1, NULL, 0) : 0;
+		if (!config.cq_moder_cnt || *end != ':') {
+			VL_MISC_ERR(("CQ moderation takes COUNT:USEC, COUNT > 0\n"));
+			exit(1);
+		}
+		break;
+	}
+
+	case GID_INDEX_CMD_CASE:
+		config.gid_idx = strtol(equ_ptr, NULL, 0);
+		if (config.gid_idx < 0) {
+			VL_MISC_ERR(("GID index can't be negative\n"));
+			exit(1);
+		}
+		break;
+
+	case LOOPBACK_CMD_CASE:
+		config.loopback = 1;
+		break;
+
+	case LOOPBACK_CPUS_CMD_CASE: {
+		char *end;
+
+		config.lb_cpu[0] = strtol(equ_ptr, &end, 0);
+		config.lb_cpu[1] = *end == ',' ? strtol(end + 1, NULL, 0) : -1;
+		if (config.lb_cpu[0] < 0 || config.lb_cpu[1] < 0) {
+			VL_MISC_ERR(("Loopback CPUs take CLIENT,SERVER\n"));
+			exit(1);
+		}
+		break;
+	}
+
+	case RING_ALLOC_CMD_CASE:
+		if (ring_alloc_parse(equ_ptr, &config.ring_alloc)) {
+			VL_MISC_ERR(("Unsupported ring placement %s\n", equ_ptr));
+			exit(1);
+		}
+		break;
+
+	case RATE_CMD_CASE:
+		config.rate = strtod(equ_ptr, NULL);
+		if (config.rate <= 0) {
+			VL_MISC_ERR(("Rate must be positive\n"));
+			exit(1);
+		}
+		break;
+
+	case RATE_SWEEP_CMD_CASE:
+		config.rate_step = strtod(equ_ptr, NULL);
+		if (config.rate_step <= 1) {
+			VL_MISC_ERR(("Rate sweep factor must be above 1\n"));
+			exit(1);
+		}
+		break;
+
+	case WORKLOAD_CMD_CASE:
+		if (wl_parse_ops(&config.wl, equ_ptr)) {
+			VL_MISC_ERR(("Invalid workload %s\n", equ_ptr));
+			exit(1);
+		}
+		config.workload = 1;
+		break;
+
+	case MSG_SIZES_CMD_CASE:
+		if (wl_parse_sizes(&config.wl, equ_ptr)) {
+			VL_MISC_ERR(("Invalid message sizes %s\n", equ_ptr));
+			exit(1);
+		}
+		break;
+
+	case TRACE_CMD_CASE:
+		config.trace_path = equ_ptr;
+		break;
+
+	case TRACE_OUT_CMD_CASE:
+		config.trace_out = equ_ptr;
+		break;
+
+	case REPLAY_CMD_CASE:
+		if (!strcmp("FAST",equ_ptr))
+			config.replay = REPLAY_FAST;
+		else if (!strcmp("TIMED",equ_ptr))
+			config.replay = REPLAY_TIMED;
+		else {
+			VL_MISC_ERR(("Unsupported replay mode %s\n", equ_ptr));
+			exit(1);
+		}
+		break;
+
+	case ARRIVAL_CMD_CASE:
+		if (!strcmp("CONST",equ_ptr))
+			config.arrival = ARRIVAL_CONST;
+		else if (!strcmp("POISSON",equ_ptr))
+			config.arrival = ARRIVAL_POISSON;
+		else {
+			VL_MISC_ERR(("Unsupported arrival type %s\n", equ_ptr));
+			exit(1);
+		}
+		break;
+
 	case RING_CMD_CASE:
 		config.ring_depth = strtoul(equ_ptr, NULL, 0);
 		if (!config.ring_depth) {
@@ -213,7 +1098,7 @@ static int process_arg(
 		break;
 
 	case NUM_OF_ITER_CMD_CASE:
-		config.num_of_iter = strtoul(equ_ptr, NULL, 0);
+		config.num_of_iter = strtoull(equ_ptr, NULL, 0);
 		break;
 
 	case HOST_CMD_CASE:
@@ -354,7 +1239,12 @@ int main(
 			.ip = "127.0.0.1",
 			.port = 15000
 		},
-		.fd = -1
+		.fd = -1,
+		.loop_fd = -1
+	};
+	struct resources_t peer = {
+		.fd = -1,
+		.loop_fd = -1
 	};
 	int rc = SUCCESS;
 
@@ -374,6 +1264,27 @@ int main(
 	rc = resource_init(&resource);
 	CHECK_RC(rc, "resource_init");
 
+	if (config.loopback) {
+		rc = loopback_init(&resource, &peer);
+		CHECK_RC(rc, "loopback_init");
+
+		rc = loopback_connect(&resource, &peer);
+		CHECK_RC(rc, "loopback_connect");
+
+		rc = loopback_test(&resource, &peer);
+		CHECK_RC(rc, "loopback_test");
+
+		rc = print_results(&resource);
+		CHECK_RC(rc, "print_results");
+
+		config.is_daemon = 1;
+		rc = print_results(&peer);
+		config.is_daemon = 0;
+		CHECK_RC(rc, "print_results");
+
+		goto cleanup;
+	}
+
 	rc = sync_configurations(&resource);
 	CHECK_RC(rc, "sync_configurations");
 
@@ -386,15 +1297,20 @@ int main(
 	rc = do_test(&resource);
 	CHECK_RC(rc, "do_test");
 
-	if (!config.is_daemon) {
-		rc = print_results(&resource);
-		CHECK_RC(rc, "print_results");
-	}
+	rc = print_results(&resource);
+	CHECK_RC(rc, "print_results");
 
 cleanup:
 	if (config.wait)
 		VL_keypress_wait();
 
+	if (config.loopback) {
+		config.is_daemon = 1;
+		if (resource_destroy(&peer) != SUCCESS)
+			rc = FAIL;
+		config.is_daemon = 0;
+	}
+
 	if (resource_destroy(&resource) != SUCCESS)
 		rc = FAIL;
 
@@ -0,0 +1,88 @@
+#ifndef MPSC_H
+#define MPSC_H
+
+#include <stdint.h>
+#include "get_clock.h"
+
+/* A send descriptor a producer hands to the poster */
+struct mpsc_desc_t {
+	cycles_t	enq_ts;
+	uint32_t	size;
+	uint16_t	producer;
+};
+
+struct mpsc_slot_t {
+	volatile uint64_t	seq;
+	struct mpsc_desc_t	desc;
+};
+
+/*
+ * Bounded multi-producer single-consumer ring (Vyukov style): a slot's
+ * sequence tells whose turn it is, so producers only contend on tail and
+ * the consumer never takes a lock.
+ */
+struct mpsc_ring_t {
+	struct mpsc_slot_t	*slots;
+	uint64_t		mask;
+	volatile uint64_t	tail __attribute__ ((aligned(64)));	/* producers */
+	uint64_t		head __attribute__ ((aligned(64)));	/* consumer */
+};
+
+static inline void mpsc_init(struct mpsc_ring_t *ring, struct mpsc_slot_t *slots, uint64_t size)
+{
+	uint64_t i;
+
+	ring->slots = slots;
+	ring->mask = size - 1;
+	ring->tail = 0;
+	ring->head = 0;
+
+	for (i = 0; i < size; i++)
+		slots[i].seq = i;
+}
+
+/* Returns 0 on success, -1 when the ring is full */
+static inline int mpsc_enqueue(struct mpsc_ring_t *ring, const struct mpsc_desc_t *desc)
+{
+	uint64_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	struct mpsc_slot_t *slot;
+
+	for (;;) {
+		int64_t dif;
+
+		slot = &ring->slots[pos & ring->mask];
+		dif = (int64_t)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (int64_t)pos;
+
+		if (!dif) {
+			if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			return -1;
+		} else {
+			pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->desc = *desc;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/* Returns 0 on success, -1 when the ring is empty */
+static inline int mpsc_dequeue(struct mpsc_ring_t *ring, struct mpsc_desc_t *desc)
+{
+	struct mpsc_slot_t *slot = &ring->slots[ring->head & ring->mask];
+
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ring->head + 1)
+		return -1;
+
+	*desc = slot->desc;
+	__atomic_store_n(&slot->seq, ring->head + ring->mask + 1, __ATOMIC_RELEASE);
+	ring->head++;
+
+	return 0;
+}
+
+#endif /* MPSC_H */
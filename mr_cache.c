@@ -0,0 +1,125 @@
+#include <string.h>
+#include <vl.h>
+#include "types.h"
+#include "mr_cache.h"
+
+void mr_cache_init(struct mr_cache_t *cache, struct ibv_pd *pd, int access)
+{
+	memset(cache, 0, sizeof(*cache));
+	cache->pd = pd;
+	cache->access = access;
+}
+
+/* Index of the last entry starting at or below addr, -1 if none */
+static int mr_cache_find(const struct mr_cache_t *cache, uintptr_t addr)
+{
+	int lo = 0, hi = cache->num - 1, found = -1;
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+
+		if (cache->ent[mid].start <= addr) {
+			found = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+
+	return found;
+}
+
+static int mr_cache_remove(struct mr_cache_t *cache, int idx)
+{
+	int rc = ibv_dereg_mr(cache->ent[idx].mr);
+
+	if (rc)
+		VL_MEM_ERR(("Fail in ibv_dereg_mr of a cached MR (%s)", strerror(rc)));
+
+	memmove(&cache->ent[idx], &cache->ent[idx + 1],
+		(cache->num - idx - 1) * sizeof(cache->ent[0]));
+	cache->num--;
+
+	return rc ? FAIL : SUCCESS;
+}
+
+static int mr_cache_evict_lru(struct mr_cache_t *cache)
+{
+	int i, lru = 0;
+
+	for (i = 1; i < cache->num; i++)
+		if (cache->ent[i].last_use < cache->ent[lru].last_use)
+			lru = i;
+
+	cache->evictions++;
+
+	return mr_cache_remove(cache, lru);
+}
+
+/*
+ * A miss registers the range, grown over the entries it overlaps (they
+ * are dropped), so entries stay disjoint.
+ */
+struct ibv_mr *mr_cache_get(struct mr_cache_t *cache, void *addr, size_t len)
+{
+	uintptr_t start = (uintptr_t)addr;
+	uintptr_t end = start + len;
+	struct mr_cache_entry_t *e;
+	struct ibv_mr *mr;
+	int idx, i;
+
+	cache->clock++;
+
+	idx = mr_cache_find(cache, start);
+	if (idx >= 0 && cache->ent[idx].end >= end) {
+		cache->ent[idx].last_use = cache->clock;
+		cache->hits++;
+		return cache->ent[idx].mr;
+	}
+
+	cache->misses++;
+
+	/* The overlapped entries are contiguous from idx (or 0) on */
+	i = idx >= 0 && cache->ent[idx].end > start ? idx : idx + 1;
+	while (i < cache->num && cache->ent[i].start < end) {
+		if (cache->ent[i].start < start)
+			start = cache->ent[i].start;
+		if (cache->ent[i].end > end)
+			end = cache->ent[i].end;
+		if (mr_cache_remove(cache, i))
+			return NULL;
+	}
+
+	if (cache->num == MR_CACHE_ENTRIES && mr_cache_evict_lru(cache))
+		return NULL;
+
+	mr = ibv_reg_mr(cache->pd, (void *)start, end - start, cache->access);
+	if (!mr) {
+		VL_MEM_ERR(("Fail in ibv_reg_mr of a cached range"));
+		return NULL;
+	}
+
+	idx = mr_cache_find(cache, start) + 1;
+	memmove(&cache->ent[idx + 1], &cache->ent[idx],
+		(cache->num - idx) * sizeof(cache->ent[0]));
+	cache->num++;
+
+	e = &cache->ent[idx];
+	e->start = start;
+	e->end = end;
+	e->mr = mr;
+	e->last_use = cache->clock;
+
+	return mr;
+}
+
+int mr_cache_flush(struct mr_cache_t *cache)
+{
+	int rc = SUCCESS;
+
+	while (cache->num)
+		if (mr_cache_remove(cache, cache->num - 1))
+			rc = FAIL;
+
+	return rc;
+}
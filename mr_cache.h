@@ -0,0 +1,39 @@
+#ifndef MR_CACHE_H
+#define MR_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <infiniband/verbs.h>
+
+#define MR_CACHE_ENTRIES 64
+
+struct mr_cache_entry_t {
+	uintptr_t	start;
+	uintptr_t	end;		/* exclusive */
+	struct ibv_mr	*mr;
+	uint64_t	last_use;
+};
+
+/*
+ * Pin-down cache of user buffer registrations. Entries never overlap and
+ * are kept sorted by start, so a lookup is a binary search. The least
+ * recently used entry is evicted once the cache is full. The caller must
+ * not let it evict or merge an MR which is still in flight, and must flush
+ * it before the buffers it covers are freed.
+ */
+struct mr_cache_t {
+	struct ibv_pd		*pd;
+	int			access;
+	int			num;
+	uint64_t		clock;
+	uint64_t		hits;
+	uint64_t		misses;
+	uint64_t		evictions;
+	struct mr_cache_entry_t	ent[MR_CACHE_ENTRIES];
+};
+
+void mr_cache_init(struct mr_cache_t *cache, struct ibv_pd *pd, int access);
+struct ibv_mr *mr_cache_get(struct mr_cache_t *cache, void *addr, size_t len);
+int mr_cache_flush(struct mr_cache_t *cache);
+
+#endif /* MR_CACHE_H */
@@ -0,0 +1,138 @@
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <vl.h>
+#include "types.h"
+#include "perf_counters.h"
+
+struct perf_event_desc {
+	const char	*name;
+	uint32_t	type;
+	uint64_t	config;
+};
+
+#define HW_CACHE_EVENT(cache, op, result)		\
+	((cache) | ((op) << 8) | ((result) << 16))
+
+static const struct perf_event_desc events[PC_NUM_COUNTERS] = {
+	[PC_INSTRUCTIONS] = {
+		"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS
+	},
+	[PC_CYCLES] = {
+		"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES
+	},
+	[PC_L1D_MISSES] = {
+		"L1d-misses", PERF_TYPE_HW_CACHE,
+		HW_CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D,
+			       PERF_COUNT_HW_CACHE_OP_READ,
+			       PERF_COUNT_HW_CACHE_RESULT_MISS)
+	},
+	[PC_LLC_MISSES] = {
+		"LLC-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES
+	},
+	[PC_BRANCH_MISSES] = {
+		"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES
+	},
+	[PC_DTLB_MISSES] = {
+		"dTLB-misses", PERF_TYPE_HW_CACHE,
+		HW_CACHE_EVENT(PERF_COUNT_HW_CACHE_DTLB,
+			       PERF_COUNT_HW_CACHE_OP_READ,
+			       PERF_COUNT_HW_CACHE_RESULT_MISS)
+	},
+};
+
+const char *perf_counter_name(int idx)
+{
+	return events[idx].name;
+}
+
+static int perf_event_open(struct perf_event_attr *attr, int group_fd)
+{
+	/* Count the calling thread on any CPU */
+	return syscall(__NR_perf_event_open, attr, 0, -1, group_fd, 0);
+}
+
+int perf_counters_open(struct perf_counters_t *pc)
+{
+	long page_sz = sysconf(_SC_PAGESIZE);
+	int i;
+
+	memset(pc, 0, sizeof(*pc));
+	for (i = 0; i < PC_NUM_COUNTERS; i++)
+		pc->cnt[i].fd = -1;
+
+	for (i = 0; i < PC_NUM_COUNTERS; i++) {
+		struct perf_event_attr attr;
+		void *page;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = events[i].type;
+		attr.config = events[i].config;
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.pinned = (i == PC_INSTRUCTIONS);
+
+		pc->cnt[i].fd = perf_event_open(&attr, i ? pc->cnt[PC_INSTRUCTIONS].fd : -1);
+		if (pc->cnt[i].fd < 0) {
+			if (i == PC_INSTRUCTIONS) {
+				VL_MISC_ERR(("perf_event_open failed for %s (errno %d)",
+					     events[i].name, errno));
+				return FAIL;
+			}
+
+			/* Not every PMU exposes every event, report it as n/a */
+			VL_MISC_TRACE1(("perf event %s is not available", events[i].name));
+			continue;
+		}
+
+		page = mmap(NULL, page_sz, PROT_READ, MAP_SHARED, pc->cnt[i].fd, 0);
+		if (page == MAP_FAILED) {
+			VL_MISC_ERR(("Fail to mmap perf event %s", events[i].name));
+			return FAIL;
+		}
+		pc->cnt[i].page = page;
+	}
+
+	pc->use_rdpmc = pc->cnt[PC_INSTRUCTIONS].page->cap_user_rdpmc;
+
+	VL_MISC_TRACE1(("perf counters are open (rdpmc %s)",
+			pc->use_rdpmc ? "enabled" : "disabled, using read()"));
+
+	return SUCCESS;
+}
+
+void perf_counters_close(struct perf_counters_t *pc)
+{
+	long page_sz = sysconf(_SC_PAGESIZE);
+	int i;
+
+	for (i = PC_NUM_COUNTERS - 1; i >= 0; i--) {
+		if (pc->cnt[i].page)
+			munmap(pc->cnt[i].page, page_sz);
+		if (pc->cnt[i].fd >= 0)
+			close(pc->cnt[i].fd);
+		pc->cnt[i].page = NULL;
+		pc->cnt[i].fd = -1;
+	}
+}
+
+/* Fallback when rdpmc isn't allowed: a single group read() on the leader */
+int perf_counters_read_slow(struct perf_counters_t *pc, struct perf_sample_t *s)
+{
+	uint64_t buf[1 + PC_NUM_COUNTERS];
+	int i, j = 1;
+
+	memset(s, 0, sizeof(*s));
+
+	if (read(pc->cnt[PC_INSTRUCTIONS].fd, buf, sizeof(buf)) < (ssize_t)sizeof(uint64_t))
+		return FAIL;
+
+	for (i = 0; i < PC_NUM_COUNTERS && j <= (int)buf[0]; i++)
+		if (pc->cnt[i].fd >= 0)
+			s->val[i] = buf[j++];
+
+	return SUCCESS;
+}
@@ -0,0 +1,107 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdint.h>
+#include <linux/perf_event.h>
+
+enum perf_counter_idx {
+	PC_INSTRUCTIONS = 0,
+	PC_CYCLES,
+	PC_L1D_MISSES,
+	PC_LLC_MISSES,
+	PC_BRANCH_MISSES,
+	PC_DTLB_MISSES,
+	PC_NUM_COUNTERS,
+};
+
+struct perf_counter_t {
+	int				fd;
+	struct perf_event_mmap_page	*page;
+};
+
+/* One counter group per thread, opened once and read in user space (rdpmc) */
+struct perf_counters_t {
+	struct perf_counter_t	cnt[PC_NUM_COUNTERS];
+	int			use_rdpmc;
+};
+
+struct perf_sample_t {
+	uint64_t val[PC_NUM_COUNTERS];
+};
+
+struct perf_measure_t {
+	uint64_t batches;
+	uint64_t msgs;
+	uint64_t tot[PC_NUM_COUNTERS];
+};
+
+int perf_counters_open(struct perf_counters_t *pc);
+void perf_counters_close(struct perf_counters_t *pc);
+const char *perf_counter_name(int idx);
+int perf_counters_read_slow(struct perf_counters_t *pc, struct perf_sample_t *s);
+
+#if defined (__x86_64__) || defined(__i386__)
+static inline uint64_t perf_rdpmc(uint32_t counter)
+{
+	unsigned low, high;
+
+	asm volatile ("rdpmc" : "=a" (low), "=d" (high) : "c" (counter));
+	return ((uint64_t)high << 32) | low;
+}
+
+/* Lock-free read of the mmap-ed counter page, see perf_event.h */
+static inline uint64_t perf_counter_read(const struct perf_counter_t *c)
+{
+	volatile struct perf_event_mmap_page *pc = c->page;
+	uint32_t seq, idx;
+	uint64_t count;
+
+	do {
+		seq = pc->lock;
+		asm volatile ("" ::: "memory");
+		idx = pc->index;
+		count = pc->offset;
+		if (pc->cap_user_rdpmc && idx) {
+			int64_t pmc = perf_rdpmc(idx - 1);
+
+			pmc <<= 64 - pc->pmc_width;
+			pmc >>= 64 - pc->pmc_width;
+			count += pmc;
+		}
+		asm volatile ("" ::: "memory");
+	} while (pc->lock != seq);
+
+	return count;
+}
+#endif
+
+static inline void perf_counters_read(struct perf_counters_t *pc,
+				      struct perf_sample_t *s)
+{
+#if defined (__x86_64__) || defined(__i386__)
+	int i;
+
+	if (pc->use_rdpmc) {
+		for (i = 0; i < PC_NUM_COUNTERS; i++)
+			s->val[i] = pc->cnt[i].page ? perf_counter_read(&pc->cnt[i]) : 0;
+		return;
+	}
+#endif
+	perf_counters_read_slow(pc, s);
+}
+
+static inline void perf_measure_add(struct perf_measure_t *m,
+				    const struct perf_sample_t *start,
+				    const struct perf_sample_t *end,
+				    uint32_t msgs)
+{
+	int i;
+
+	for (i = 0; i < PC_NUM_COUNTERS; i++)
+		m->tot[i] += end->val[i] - start->val[i];
+
+	m->batches++;
+	m->msgs += msgs;
+}
+
+#endif /* PERF_COUNTERS_H */
@@ -9,27 +9,11 @@
 
 extern struct config_t config;
 
-int resource_alloc(struct resources_t *resource)
+/* WR, SGE and WC arrays are private to whoever posts and polls on a QP */
+static int alloc_wr_arrays(struct resources_t *resource)
 {
 	size_t size;
 
-	size = sizeof(struct mr_data_t);
-	resource->mr = VL_MALLOC(size, struct mr_data_t);
-	if (!resource->mr) {
-		VL_MEM_ERR((" Failed to malloc mr"));
-		return FAIL;
-	}
-	memset(resource->mr, 0, size);
-
-	resource->mr->addr = VL_MALLOC(config.msg_sz, void);
-	if (!resource->mr->addr) {
-		VL_MEM_ERR(("Failed to malloc data-buffer"));
-		return FAIL;
-	}
-	VL_MEM_TRACE1(("Data buffer address %p", resource->mr->addr));
-
-	memset(resource->mr->addr, 0xE, config.msg_sz);
-
 	size = config.batch_size * sizeof(struct ibv_wc);
 	resource->wc_arr = VL_MALLOC(size, struct ibv_wc);
 	if (!resource->wc_arr) {
@@ -70,6 +54,260 @@ int resource_alloc(struct resources_t *resource)
 	}
 	memset(resource->recv_wr_arr, 0, size);
 
+	return SUCCESS;
+}
+
+static void free_wr_arrays(struct resources_t *resource)
+{
+	if (resource->wc_arr)
+		VL_FREE(resource->wc_arr);
+	if (resource->send_wr_arr)
+		VL_FREE(resource->send_wr_arr);
+	if (resource->recv_wr_arr)
+		VL_FREE(resource->recv_wr_arr);
+	if (resource->sge_arr)
+		VL_FREE(resource->sge_arr);
+	if (resource->data_buf_arr)
+		VL_FREE(resource->data_buf_arr);
+}
+
+/* The atomic benchmark exposes a slot per target, plus one to align the first */
+static size_t buf_size(void)
+{
+	if (config.atomic_targets)
+		return (config.atomic_targets + 1) * config.atomic_stride;
+
+	return config.msg_sz;
+}
+
+int resource_alloc(struct resources_t *resource)
+{
+	size_t size;
+
+	size = sizeof(struct mr_data_t);
+	resource->mr = VL_MALLOC(size, struct mr_data_t);
+	if (!resource->mr) {
+		VL_MEM_ERR((" Failed to malloc mr"));
+		return FAIL;
+	}
+	memset(resource->mr, 0, size);
+
+	resource->mr->addr = VL_MALLOC(buf_size(), void);
+	if (!resource->mr->addr) {
+		VL_MEM_ERR(("Failed to malloc data-buffer"));
+		return FAIL;
+	}
+	VL_MEM_TRACE1(("Data buffer address %p", resource->mr->addr));
+
+	memset(resource->mr->addr, 0xE, buf_size());
+
+	if (alloc_wr_arrays(resource))
+		return FAIL;
+
+	if (config.rate) {
+		size = config.num_of_iter * sizeof(cycles_t);
+		resource->sched = VL_MALLOC(size, cycles_t);
+		resource->lat = VL_MALLOC(size, cycles_t);
+		if (!resource->sched || !resource->lat) {
+			VL_MEM_ERR((" Fail in alloc open-loop schedule"));
+			return FAIL;
+		}
+
+		size = MAX_RATE_STEPS * sizeof(struct rate_step_t);
+		resource->rate_steps = VL_MALLOC(size, struct rate_step_t);
+		if (!resource->rate_steps) {
+			VL_MEM_ERR((" Fail in alloc rate_steps"));
+			return FAIL;
+		}
+		memset(resource->rate_steps, 0, size);
+	}
+
+	if ((config.depth_sweep || config.mtu_sweep) && !config.is_daemon) {
+		size = SWEEP_MAX_STEPS * sizeof(struct sweep_step_t);
+		resource->sweep_steps = VL_MALLOC(size, struct sweep_step_t);
+		if (!resource->sweep_steps) {
+			VL_MEM_ERR((" Fail in alloc sweep_steps"));
+			return FAIL;
+		}
+		memset(resource->sweep_steps, 0, size);
+	}
+
+	if (config.atomic_targets && !config.is_daemon) {
+		size = ATOMIC_MAX_STEPS * sizeof(struct atomic_step_t);
+		resource->atomic_steps = VL_MALLOC(size, struct atomic_step_t);
+		if (!resource->atomic_steps) {
+			VL_MEM_ERR((" Fail in alloc atomic_steps"));
+			return FAIL;
+		}
+		memset(resource->atomic_steps, 0, size);
+	}
+
+	if (config.dc_targets && !config.is_daemon) {
+		resource->dc = VL_MALLOC(sizeof(struct dc_fanout_t), struct dc_fanout_t);
+		if (!resource->dc) {
+			VL_MEM_ERR((" Fail in alloc dc"));
+			return FAIL;
+		}
+		memset(resource->dc, 0, sizeof(struct dc_fanout_t));
+
+		size = config.num_qps * config.ring_depth * sizeof(cycles_t);
+		resource->dc->post_ts = VL_MALLOC(size, cycles_t);
+		if (!resource->dc->post_ts) {
+			VL_MEM_ERR((" Fail in alloc DC post times"));
+			return FAIL;
+		}
+	}
+
+	if (config.ud_dests && !config.is_daemon) {
+		resource->ud = VL_MALLOC(sizeof(struct ud_fanout_t), struct ud_fanout_t);
+		if (!resource->ud) {
+			VL_MEM_ERR((" Fail in alloc ud"));
+			return FAIL;
+		}
+		memset(resource->ud, 0, sizeof(struct ud_fanout_t));
+	}
+
+	if (config.repeat > 1 && !config.is_daemon) {
+		size = config.repeat * sizeof(struct run_sample_t);
+		resource->runs = VL_MALLOC(size, struct run_sample_t);
+		if (!resource->runs) {
+			VL_MEM_ERR((" Fail in alloc runs"));
+			return FAIL;
+		}
+		memset(resource->runs, 0, size);
+	}
+
+	if (config.duration && !config.is_daemon) {
+		resource->soak = VL_MALLOC(sizeof(struct soak_t), struct soak_t);
+		if (!resource->soak) {
+			VL_MEM_ERR((" Fail in alloc soak"));
+			return FAIL;
+		}
+		memset(resource->soak, 0, sizeof(struct soak_t));
+	}
+
+	if (config.xrc_procs && config.is_daemon) {
+		resource->xrc_procs = VL_MALLOC(sizeof(struct xrc_procs_t), struct xrc_procs_t);
+		if (!resource->xrc_procs) {
+			VL_MEM_ERR((" Fail in alloc xrc_procs"));
+			return FAIL;
+		}
+		memset(resource->xrc_procs, 0, sizeof(struct xrc_procs_t));
+	}
+
+	if (config.mr_bench && !config.is_daemon) {
+		resource->mr_bench = VL_MALLOC(sizeof(struct mr_bench_t), struct mr_bench_t);
+		if (!resource->mr_bench) {
+			VL_MEM_ERR((" Fail in alloc mr_bench"));
+			return FAIL;
+		}
+		memset(resource->mr_bench, 0, sizeof(struct mr_bench_t));
+	}
+
+	if (config.size_sweep) {
+		size = WL_MAX_SIZES * sizeof(struct recv_step_t);
+		resource->recv_steps = VL_MALLOC(size, struct recv_step_t);
+		if (!resource->recv_steps) {
+			VL_MEM_ERR((" Fail in alloc recv_steps"));
+			return FAIL;
+		}
+		memset(resource->recv_steps, 0, size);
+	}
+
+	if (config.producers) {
+		size = MAX_PROD_STEPS * sizeof(struct prod_step_t);
+		resource->prod_steps = VL_MALLOC(size, struct prod_step_t);
+		if (!resource->prod_steps) {
+			VL_MEM_ERR((" Fail in alloc prod_steps"));
+			return FAIL;
+		}
+		memset(resource->prod_steps, 0, size);
+	}
+
+	/* ODP separates the first touch from the steady state by latency */
+	if (!config.is_daemon &&
+	    (config.comp_cpu >= 0 || config.producers ||
+	     (config.mr_mode != MR_PINNED && !config.rate))) {
+		/* The warm-up step fills it as well */
+		size = (config.warmup > config.num_of_iter ? config.warmup : config.num_of_iter) *
+		       sizeof(cycles_t);
+		resource->lat = VL_MALLOC(size, cycles_t);
+		if (!resource->lat) {
+			VL_MEM_ERR((" Fail in alloc completion latencies"));
+			return FAIL;
+		}
+
+		size = config.ring_depth * sizeof(cycles_t);
+		resource->post_ts = VL_MALLOC(size, cycles_t);
+		if (!resource->post_ts) {
+			VL_MEM_ERR((" Fail in alloc post_ts"));
+			return FAIL;
+		}
+	}
+
+	if (config.trace.recs) {
+		/* Replay posts straight from the mapping */
+		resource->wl_sched = config.trace.recs;
+		resource->wl_mask = ~0;
+		resource->wl_sig = config.trace.sig;
+		resource->wl_recv_cnt = config.trace.recv_cnt;
+
+		size = TRACE_MAX_PHASES * sizeof(struct trace_phase_t);
+		resource->phases = VL_MALLOC(size, struct trace_phase_t);
+		if (!resource->phases) {
+			VL_MEM_ERR((" Fail in alloc trace phases"));
+			return FAIL;
+		}
+		memset(resource->phases, 0, size);
+	} else if (config.workload) {
+		struct wl_entry_t *sched;
+
+		size = WL_SCHED_LEN * sizeof(struct wl_entry_t);
+		sched = VL_MALLOC(size, struct wl_entry_t);
+		if (!sched) {
+			VL_MEM_ERR((" Fail in alloc wl_sched"));
+			return FAIL;
+		}
+
+		resource->wl_sig = wl_build_schedule(&config.wl, sched);
+		resource->wl_sched = sched;
+		resource->wl_mask = WL_SCHED_LEN - 1;
+		resource->wl_recv_cnt = wl_count_ops(resource->wl_sched, config.num_of_iter,
+						     WL_RECV_OPS_MASK);
+	}
+
+	if (config.workload) {
+		size = WL_MAX_OPCODE * sizeof(struct wl_op_stats_t);
+		resource->wl_stats = VL_MALLOC(size, struct wl_op_stats_t);
+		if (!resource->wl_stats) {
+			VL_MEM_ERR((" Fail in alloc wl_stats"));
+			return FAIL;
+		}
+		memset(resource->wl_stats, 0, size);
+
+		size = config.ring_depth * sizeof(cycles_t);
+		resource->wl_post_ts = VL_MALLOC(size, cycles_t);
+		if (!resource->wl_post_ts) {
+			VL_MEM_ERR((" Fail in alloc wl_post_ts"));
+			return FAIL;
+		}
+
+		VL_MEM_TRACE1(("Workload schedule signature 0x%x, %lu receives",
+				resource->wl_sig, resource->wl_recv_cnt));
+	}
+
+	if (config.trace_out) {
+		size = config.num_of_iter * sizeof(struct wl_entry_t);
+		resource->capture_buf = VL_MALLOC(size, struct wl_entry_t);
+		if (!resource->capture_buf) {
+			VL_MEM_ERR((" Fail in alloc capture_buf"));
+			return FAIL;
+		}
+		memset(resource->capture_buf, 0, size);
+	}
+
+	resource->atomic_arg_sz = config.msg_sz;
+	resource->window = config.ring_depth;
 	if (config.ext_atomic) {
 		if (config.opcode == IBV_WR_ATOMIC_FETCH_AND_ADD) {
 			resource->atomic_args = calloc(2, config.msg_sz);
@@ -124,6 +362,48 @@ static int init_socket(struct resources_t *resource)
 	return SUCCESS;
 }
 
+/*
+ * Ethernet ports (RoCE, rxe) need GRH addressing, by default on the first
+ * RoCE v2 GID. IB keeps LID addressing unless a GID index is given.
+ */
+static int init_gid(struct hca_data_t *hca)
+{
+	struct ibv_gid_entry entry;
+	int i;
+
+	hca->gid_idx = config.gid_idx;
+	memset(&hca->gid, 0, sizeof(hca->gid));
+
+	if (hca->gid_idx < 0 && hca->port_attr.link_layer == IBV_LINK_LAYER_ETHERNET) {
+		for (i = 0; i < hca->port_attr.gid_tbl_len; i++) {
+			if (ibv_query_gid_ex(hca->context, IB_PORT, i, &entry, 0))
+				continue;
+
+			if (entry.gid_type == IBV_GID_TYPE_ROCE_V2) {
+				hca->gid_idx = i;
+				break;
+			}
+		}
+
+		if (hca->gid_idx < 0) {
+			VL_HCA_ERR(("No RoCE v2 GID on the port, set --gid_index"));
+			return FAIL;
+		}
+	}
+
+	if (hca->gid_idx < 0)
+		return SUCCESS;
+
+	if (ibv_query_gid(hca->context, IB_PORT, hca->gid_idx, &hca->gid)) {
+		VL_HCA_ERR(("Fail to query GID index %d", hca->gid_idx));
+		return FAIL;
+	}
+
+	VL_HCA_TRACE1(("Use GID index %d", hca->gid_idx));
+
+	return SUCCESS;
+}
+
 static int init_hca(struct resources_t *resource)
 {
 	struct ibv_device *ib_dev = NULL;
@@ -157,16 +437,41 @@ static int init_hca(struct resources_t *resource)
 		return FAIL;
 	}
 
-	memset(&ctx_attr, 0, sizeof(ctx_attr));
-	ctx_attr.flags = MLX5DV_CONTEXT_FLAGS_DEVX;
-	resource->hca_p->context = mlx5dv_open_device(ib_dev, &ctx_attr);
+	/* XRC workers fork after the MRs are registered */
+	if (config.xrc_procs && ibv_fork_init()) {
+		VL_HCA_ERR(("ibv_fork_init failed"));
+		ibv_free_device_list(dev_list);
+		return FAIL;
+	}
+
+	/* Other providers (e.g. rxe) run the verbs paths */
+	resource->hca_p->dv = mlx5dv_is_supported(ib_dev);
+	if (resource->hca_p->dv) {
+		/* The provider reads it on context init, a QP may still opt out */
+		if (config.s2c == S2C_ON)
+			setenv("MLX5_SCATTER_TO_CQE", "1", 1);
+
+		memset(&ctx_attr, 0, sizeof(ctx_attr));
+		ctx_attr.flags = MLX5DV_CONTEXT_FLAGS_DEVX;
+		resource->hca_p->context = mlx5dv_open_device(ib_dev, &ctx_attr);
+	} else {
+		resource->hca_p->context = ibv_open_device(ib_dev);
+	}
 	if (!resource->hca_p->context) {
-		VL_HCA_ERR(("mlx5dv_open_device with HCA ID %s failed",
+		VL_HCA_ERR(("%s with HCA ID %s failed",
+				resource->hca_p->dv ? "mlx5dv_open_device" : "ibv_open_device",
 				config.hca_type));
 		ibv_free_device_list(dev_list);
 		return FAIL;
 	}
 
+	if (!resource->hca_p->dv && (config.qp_type == IBV_QPT_DRIVER || config.ext_atomic ||
+				     config.s2c || config.cqe_comp)) {
+		VL_HCA_ERR(("DC, extended atomics, scatter to CQE and CQE compression require an mlx5 device"));
+		ibv_free_device_list(dev_list);
+		return FAIL;
+	}
+
 	VL_HCA_TRACE1(("HCA %s was opened, context = %p",
 			config.hca_type, resource->hca_p->context));
 
@@ -179,6 +484,13 @@ static int init_hca(struct resources_t *resource)
 	}
 	VL_HCA_TRACE1(("HCA was queried"));
 
+	/* Rings past 64K WRs are fine as long as the device takes them */
+	if (config.ring_depth > (uint32_t)resource->hca_p->device_attr.max_qp_wr) {
+		VL_HCA_ERR(("Ring size %u exceeds the device max of %d WRs",
+			    config.ring_depth, resource->hca_p->device_attr.max_qp_wr));
+		return FAIL;
+	}
+
 	if (config.ext_atomic) {
 		struct mlx5dv_context dv_attr;
 
@@ -192,9 +504,25 @@ static int init_hca(struct resources_t *resource)
 		}
 		VL_HCA_TRACE1(("mlx5dv HCA was queried"));
 
-		if (dv_attr.comp_mask & MLX5DV_CONTEXT_MASK_ATOMICS)
+		if (dv_attr.comp_mask & MLX5DV_CONTEXT_MASK_ATOMICS) {
 			VL_HCA_TRACE1(("arg_size_mask=0x%x arg_size_mask_dc=0x%x", dv_attr.atomics_caps.arg_size_mask,
 					dv_attr.atomics_caps.arg_size_mask_dc));
+			resource->hca_p->atomic_arg_mask = dv_attr.atomics_caps.arg_size_mask;
+		}
+
+		/* The atomic benchmark sweeps the argument up to the largest the device takes */
+		resource->hca_p->max_atomic_arg = config.msg_sz;
+		if (config.atomic_targets && resource->hca_p->atomic_arg_mask) {
+			while (resource->hca_p->max_atomic_arg >= ATOMIC_MIN_ARG &&
+			       !(resource->hca_p->atomic_arg_mask & resource->hca_p->max_atomic_arg))
+				resource->hca_p->max_atomic_arg /= 2;
+
+			if (resource->hca_p->max_atomic_arg < ATOMIC_MIN_ARG) {
+				VL_HCA_ERR(("No extended atomic argument of %d..%d[B] is supported",
+					    ATOMIC_MIN_ARG, ATOMIC_MAX_ARG));
+				return FAIL;
+			}
+		}
 	}
 
 	rc = ibv_query_port(resource->hca_p->context, IB_PORT, &resource->hca_p->port_attr);
@@ -209,6 +537,9 @@ static int init_hca(struct resources_t *resource)
 		return FAIL;
 	}
 
+	if (init_gid(resource->hca_p))
+		return FAIL;
+
 	return SUCCESS;
 }
 
@@ -227,15 +558,213 @@ static int init_pd(struct resources_t *resource)
 	return SUCCESS;
 }
 
+/*
+ * A thread domain tells the provider that a single thread uses the objects
+ * created on it, so it can drop the locks (and with mlx5 use a dedicated
+ * UAR) on the data path. The allocators place the rings the provider
+ * would otherwise allocate itself.
+ */
+static int init_parent_domain(struct resources_t *resource)
+{
+	struct ibv_parent_domain_init_attr pd_attr;
+	struct ibv_td_init_attr td_attr;
+
+	if (!config.thread_domain && !config.ring_alloc)
+		return SUCCESS;
+
+	memset(&pd_attr, 0, sizeof(pd_attr));
+	pd_attr.pd = resource->pd;
+
+	if (config.thread_domain) {
+		memset(&td_attr, 0, sizeof(td_attr));
+		resource->td = ibv_alloc_td(resource->hca_p->context, &td_attr);
+		if (!resource->td) {
+			VL_HCA_ERR(("Fail to allocate TD (errno %d)", errno));
+			return FAIL;
+		}
+		pd_attr.td = resource->td;
+	}
+
+	if (config.ring_alloc) {
+		ring_alloc_init(&resource->ring_alloc, config.ring_alloc, config.hca_type);
+		ring_alloc_attach(&resource->ring_alloc, &pd_attr);
+	}
+
+	resource->parent_pd = ibv_alloc_parent_domain(resource->hca_p->context, &pd_attr);
+	if (!resource->parent_pd) {
+		VL_HCA_ERR(("Fail to allocate parent domain (errno %d)", errno));
+		return FAIL;
+	}
+
+	VL_HCA_TRACE1(("Finish init parent domain"));
+	return SUCCESS;
+}
+
+/* The receive CQ options apply where messages are received */
+static int rx_cq_opts(void)
+{
+	return config.is_daemon && (config.cqe_comp || config.cq_moder_cnt);
+}
+
+static int check_cqe_comp(struct resources_t *resource, uint32_t format)
+{
+	struct mlx5dv_context dv_attr;
+
+	memset(&dv_attr, 0, sizeof(dv_attr));
+	dv_attr.comp_mask = MLX5DV_CONTEXT_MASK_CQE_COMPRESION;
+	if (mlx5dv_query_device(resource->hca_p->context, &dv_attr) ||
+	    !(dv_attr.comp_mask & MLX5DV_CONTEXT_MASK_CQE_COMPRESION) ||
+	    !(dv_attr.cqe_comp_caps.supported_format & format)) {
+		VL_HCA_ERR(("HCA doesn't support CQE compression in that format"));
+		return FAIL;
+	}
+
+	VL_HCA_TRACE1(("CQE compression, up to %u mini CQEs", dv_attr.cqe_comp_caps.max_num));
+
+	return SUCCESS;
+}
+
+static struct ibv_cq *create_cq(struct resources_t *resource, int depth, int rx)
+{
+	struct ibv_cq *cq;
+
+	if (depth > resource->hca_p->device_attr.max_cqe) {
+		VL_DATA_ERR(("CQ depth %d exceeds the device max of %d CQEs",
+			     depth, resource->hca_p->device_attr.max_cqe));
+		return NULL;
+	}
+
+	if (resource->parent_pd || (rx && rx_cq_opts())) {
+		struct mlx5dv_cq_init_attr dv_attr;
+		struct ibv_cq_init_attr_ex cq_attr;
+		struct ibv_cq_ex *cq_ex;
+
+		memset(&dv_attr, 0, sizeof(dv_attr));
+		memset(&cq_attr, 0, sizeof(cq_attr));
+		cq_attr.cqe = depth;
+
+		/* --ring_alloc alone makes a parent domain too, the CQ keeps its lock then */
+		if (resource->parent_pd) {
+			cq_attr.comp_mask = IBV_CQ_INIT_ATTR_MASK_PD;
+			cq_attr.parent_domain = resource->parent_pd;
+			if (config.thread_domain) {
+				cq_attr.comp_mask |= IBV_CQ_INIT_ATTR_MASK_FLAGS;
+				cq_attr.flags = IBV_CREATE_CQ_ATTR_SINGLE_THREADED;
+			}
+		}
+
+		if (rx)
+			cq_attr.channel = resource->rx_channel;
+
+		if (rx && config.is_daemon && config.cqe_comp) {
+			dv_attr.comp_mask = MLX5DV_CQ_INIT_ATTR_MASK_COMPRESSED_CQE;
+			dv_attr.cqe_comp_res_format = config.cqe_comp == CQE_COMP_HASH ?
+						      MLX5DV_CQE_RES_FORMAT_HASH :
+						      MLX5DV_CQE_RES_FORMAT_CSUM;
+			if (check_cqe_comp(resource, dv_attr.cqe_comp_res_format))
+				return NULL;
+
+			cq_ex = mlx5dv_create_cq(resource->hca_p->context, &cq_attr, &dv_attr);
+		} else {
+			cq_ex = ibv_create_cq_ex(resource->hca_p->context, &cq_attr);
+		}
+		cq = cq_ex ? ibv_cq_ex_to_cq(cq_ex) : NULL;
+	} else {
+		cq = ibv_create_cq(resource->hca_p->context, depth, NULL, NULL, 0);
+	}
+
+	if (!cq) {
+		VL_DATA_ERR(("Fail in ibv_create_cq (depth %d)", depth));
+		return NULL;
+	}
+
+	if (rx && config.is_daemon && config.cq_moder_cnt) {
+		struct ibv_modify_cq_attr moder = {
+			.attr_mask = IBV_CQ_ATTR_MODERATE,
+			.moderate = {
+				.cq_count = config.cq_moder_cnt,
+				.cq_period = config.cq_moder_usec,
+			},
+		};
+
+		if (ibv_modify_cq(cq, &moder)) {
+			VL_DATA_ERR(("Fail to moderate the receive CQ"));
+			ibv_destroy_cq(cq);
+			return NULL;
+		}
+	}
+
+	return cq;
+}
+
+/* The CQ takes the rings of every QP that completes on it */
+int cq_sharers(void)
+{
+	if (config.is_daemon)
+		return 1; /* several QPs receive on one SRQ */
+
+	switch (config.cq_share) {
+	case CQ_SHARE_GLOBAL:
+		return config.num_qps;
+	case CQ_SHARE_THREAD:
+		return (config.num_qps + config.threads - 1) / config.threads;
+	default:
+		return 1;
+	}
+}
+
 static int init_cq(struct resources_t *resource)
 {
-	resource->cq = 	ibv_create_cq(resource->hca_p->context, config.ring_depth, NULL, NULL, 0);
-	if (!resource->cq) {
-		VL_DATA_ERR(("Fail in ibv_create_cq"));
+	int depth = config.cq_depth ? config.cq_depth : config.ring_depth * cq_sharers();
+
+	if (config.is_daemon && config.cq_moder_cnt) {
+		resource->rx_channel = ibv_create_comp_channel(resource->hca_p->context);
+		if (!resource->rx_channel) {
+			VL_DATA_ERR(("Fail in ibv_create_comp_channel"));
+			return FAIL;
+		}
+	}
+
+	resource->cq = create_cq(resource, depth, !config.split_cq);
+	if (!resource->cq)
 		return FAIL;
+	resource->own_cq = 1;
+
+	resource->rcq = resource->cq;
+	if (config.split_cq) {
+		resource->rcq = create_cq(resource, config.cq_depth ? config.cq_depth : config.ring_depth, 1);
+		if (!resource->rcq)
+			return FAIL;
 	}
 
-	VL_DATA_TRACE1(("Finish init CQ"));
+	VL_DATA_TRACE1(("Finish init CQ, depth %d%s", depth, config.split_cq ? ", split recv CQ" : ""));
+
+	return SUCCESS;
+}
+
+/*
+ * Client QP contexts complete on their own CQ, on the CQ of their thread's
+ * first QP or on the global one. A split recv CQ is never polled on the
+ * client, one is enough for all.
+ */
+static int init_ctx_cq(struct resources_t *resource, struct resources_t *ctx, int i)
+{
+	int depth = config.cq_depth ? config.cq_depth : config.ring_depth * cq_sharers();
+
+	ctx->own_cq = 0;
+
+	if (config.cq_share == CQ_SHARE_GLOBAL) {
+		ctx->cq = resource->cq;
+	} else if (config.cq_share == CQ_SHARE_THREAD && i >= config.threads) {
+		ctx->cq = resource->qpc[i % config.threads]->cq;
+	} else {
+		ctx->cq = create_cq(ctx, depth, 0);
+		if (!ctx->cq)
+			return FAIL;
+		ctx->own_cq = 1;
+	}
+
+	ctx->rcq = config.split_cq ? resource->rcq : ctx->cq;
 
 	return SUCCESS;
 }
@@ -244,25 +773,29 @@ static int init_xrcd(struct resources_t *resource)
 {
 
 	struct ibv_xrcd_init_attr xrcd_attr;
-	int fd;
 
 	if (config.qp_type != IBV_QPT_XRC_SEND && config.qp_type != IBV_QPT_XRC_RECV)
 		return SUCCESS;
 
 	VL_HCA_TRACE1(("Going to create XRCD"));
 
-	fd = open("/dev/null", O_WRONLY);
-	if (fd < 0) {
-		VL_DATA_ERR(("Fail to open a file"));
+	/* The inode names the domain, other processes opening the file share it */
+	resource->fd = open(config.xrcd_path, O_RDONLY | O_CREAT, 0644);
+	if (resource->fd < 0) {
+		VL_DATA_ERR(("Fail to open the XRCD file %s (errno %d)", config.xrcd_path, errno));
 		return FAIL;
 	}
 
 	memset(&xrcd_attr, 0, sizeof(xrcd_attr));
 	xrcd_attr.comp_mask = IBV_XRCD_INIT_ATTR_FD | IBV_XRCD_INIT_ATTR_OFLAGS;
-        xrcd_attr.fd = fd;
-        xrcd_attr.oflags = O_CREAT;
+	xrcd_attr.fd = resource->fd;
+	xrcd_attr.oflags = O_CREAT;
 
 	resource->xrcd = ibv_open_xrcd(resource->hca_p->context, &xrcd_attr);
+	if (!resource->xrcd) {
+		VL_DATA_ERR(("Fail in ibv_open_xrcd of %s", config.xrcd_path));
+		return FAIL;
+	}
 
 	VL_DATA_TRACE1(("Finish init XRCD"));
 
@@ -295,23 +828,44 @@ static int destroy_xrcd(struct resources_t *resource)
 	return SUCCESS;
 }
 
+/*
+ * Every client QP may have a ring in flight to the SRQ. A UD fan-out sends
+ * from one QP, a DC one from at most DC_MAX_DCIS, whatever the targets.
+ */
+static uint32_t srq_depth(const struct resources_t *resource)
+{
+	uint64_t senders = config.ud_dests ? 1 :
+			   config.dc_targets && config.num_qps > DC_MAX_DCIS ? DC_MAX_DCIS :
+			   config.num_qps;
+	uint64_t depth = config.ring_depth * senders;
+	uint32_t max = resource->hca_p->device_attr.max_srq_wr;
+
+	return depth < max ? depth : max;
+}
+
 static int init_srq(struct resources_t *resource)
 {
 	struct ibv_srq_init_attr_ex attr;
 	uint32_t srqn;
 
-	if ((config.qp_type != IBV_QPT_DRIVER && config.qp_type != IBV_QPT_XRC_RECV) || !config.is_daemon)
+	resource->rx_depth = config.ring_depth;
+
+	/* Several QPs feed one receive ring, whatever the client spreads on them */
+	if ((config.qp_type != IBV_QPT_DRIVER && config.qp_type != IBV_QPT_XRC_RECV &&
+	     config.num_qps == 1) || !config.is_daemon)
 		return SUCCESS;
 
 	VL_HCA_TRACE1(("Going to create SRQ"));
 
+	resource->rx_depth = srq_depth(resource);
+
 	memset(&attr, 0, sizeof(attr));
         attr.comp_mask = IBV_SRQ_INIT_ATTR_TYPE | IBV_SRQ_INIT_ATTR_PD;
-	attr.attr.max_wr = config.ring_depth;
+	attr.attr.max_wr = resource->rx_depth;
 	attr.attr.max_sge = config.num_sge;
 	attr.pd = resource->pd;
 
-	if (config.qp_type == IBV_QPT_DRIVER) {
+	if (config.qp_type != IBV_QPT_XRC_RECV) {
 		attr.srq_type = IBV_SRQT_BASIC;
 	} else {
 		attr.comp_mask |= IBV_SRQ_INIT_ATTR_XRCD | IBV_SRQ_INIT_ATTR_CQ;
@@ -333,6 +887,40 @@ static int init_srq(struct resources_t *resource)
 	return SUCCESS;
 }
 
+static uint64_t opcode_to_send_ops(enum ibv_wr_opcode opcode)
+{
+	switch (opcode) {
+	case IBV_WR_SEND:
+		return IBV_QP_EX_WITH_SEND;
+	case IBV_WR_SEND_WITH_IMM:
+		return IBV_QP_EX_WITH_SEND_WITH_IMM;
+	case IBV_WR_RDMA_WRITE:
+		return IBV_QP_EX_WITH_RDMA_WRITE;
+	case IBV_WR_RDMA_WRITE_WITH_IMM:
+		return IBV_QP_EX_WITH_RDMA_WRITE_WITH_IMM;
+	case IBV_WR_RDMA_READ:
+		return IBV_QP_EX_WITH_RDMA_READ;
+	case IBV_WR_ATOMIC_FETCH_AND_ADD:
+		return config.ext_atomic ? 0 : IBV_QP_EX_WITH_ATOMIC_FETCH_AND_ADD;
+	case IBV_WR_ATOMIC_CMP_AND_SWP:
+		return config.ext_atomic ? 0 : IBV_QP_EX_WITH_ATOMIC_CMP_AND_SWP;
+	case IBV_WR_BIND_MW:
+		return IBV_QP_EX_WITH_BIND_MW;
+	case IBV_WR_LOCAL_INV:
+		return IBV_QP_EX_WITH_LOCAL_INV;
+	case IBV_WR_SEND_WITH_INV:
+		return IBV_QP_EX_WITH_SEND_WITH_INV;
+	default:
+		return 0;
+	}
+}
+
+/* QP create flags or DC attributes only mlx5dv_create_qp takes */
+static int dv_qp_needed(void)
+{
+	return config.qp_type == IBV_QPT_DRIVER || config.ext_atomic || config.s2c == S2C_OFF;
+}
+
 static int init_qp(struct resources_t *resource)
 {
 	struct ibv_qp_init_attr *attr;
@@ -347,7 +935,7 @@ static int init_qp(struct resources_t *resource)
 	VL_DATA_TRACE1(("Going to create QP type %s:", VL_ibv_qp_type_str(config.qp_type)));
 
 	if (config.qp_type != IBV_QPT_XRC_RECV || config.qp_type != IBV_QPT_XRC_SEND)
-		attr->recv_cq = resource->cq;
+		attr->recv_cq = resource->rcq;
 	if (config.qp_type != IBV_QPT_XRC_RECV)
 		attr->send_cq = resource->cq; /* Relevant also for DCT */
 
@@ -378,29 +966,16 @@ static int init_qp(struct resources_t *resource)
 	if (!config.is_daemon) {
 		attr_ex.comp_mask |= IBV_QP_INIT_ATTR_SEND_OPS_FLAGS | IBV_QP_INIT_ATTR_PD;
 
-		if(0);
-		else if (config.opcode == IBV_WR_SEND)
-			attr_ex.send_ops_flags |= IBV_QP_EX_WITH_SEND;
-		else if (config.opcode == IBV_WR_SEND_WITH_IMM)
-			attr_ex.send_ops_flags |= IBV_QP_EX_WITH_SEND_WITH_IMM;
-		else if (config.opcode == IBV_WR_RDMA_WRITE)
-			attr_ex.send_ops_flags |= IBV_QP_EX_WITH_RDMA_WRITE;
-		else if (config.opcode == IBV_WR_RDMA_WRITE_WITH_IMM)
-			attr_ex.send_ops_flags |= IBV_QP_EX_WITH_RDMA_WRITE_WITH_IMM;
-		else if (config.opcode == IBV_WR_RDMA_READ)
-			attr_ex.send_ops_flags |= IBV_QP_EX_WITH_RDMA_READ;
-		else if (config.opcode == IBV_WR_ATOMIC_FETCH_AND_ADD && !config.ext_atomic)
-			attr_ex.send_ops_flags |= IBV_QP_EX_WITH_ATOMIC_FETCH_AND_ADD;
-		else if (config.opcode == IBV_WR_ATOMIC_CMP_AND_SWP && !config.ext_atomic)
-			attr_ex.send_ops_flags |= IBV_QP_EX_WITH_ATOMIC_CMP_AND_SWP;
-		else if (config.opcode == IBV_WR_BIND_MW)
-			attr_ex.send_ops_flags |= IBV_QP_EX_WITH_BIND_MW;
-		else if (config.opcode == IBV_WR_LOCAL_INV)
-			attr_ex.send_ops_flags |= IBV_QP_EX_WITH_LOCAL_INV;
-		else if (config.opcode == IBV_WR_SEND_WITH_INV)
-			attr_ex.send_ops_flags |= IBV_QP_EX_WITH_SEND_WITH_INV;
-
-		attr_ex.pd = resource->pd;
+		if (config.workload) {
+			int i;
+
+			for (i = 0; i < config.wl.num_ops; i++)
+				attr_ex.send_ops_flags |= opcode_to_send_ops(config.wl.ops[i]);
+		} else {
+			attr_ex.send_ops_flags |= opcode_to_send_ops(config.opcode);
+		}
+
+		attr_ex.pd = resource->parent_pd ? resource->parent_pd : resource->pd;
 
 		if (config.qp_type == IBV_QPT_DRIVER) {
 			attr_dv.comp_mask |= MLX5DV_QP_INIT_ATTR_MASK_DC |
@@ -415,21 +990,26 @@ static int init_qp(struct resources_t *resource)
 			attr_dv.create_flags |= MLX5DV_QP_CREATE_DISABLE_SCATTER_TO_CQE; /*driver doesnt support scatter2cqe data-path for ext atomic yet*/
 			attr_dv.send_ops_flags |= MLX5DV_QP_EX_WITH_ATOMIC;
 			attr_dv.comp_mask |= MLX5DV_QP_INIT_ATTR_MASK_ATOMIC_ARG;
-			attr_dv.max_atomic_arg = config.msg_sz;
+			attr_dv.max_atomic_arg = resource->hca_p->max_atomic_arg;
+		}
+
+		if (config.s2c == S2C_OFF) {
+			attr_dv.comp_mask |= MLX5DV_QP_INIT_ATTR_MASK_QP_CREATE_FLAGS;
+			attr_dv.create_flags |= MLX5DV_QP_CREATE_DISABLE_SCATTER_TO_CQE;
 		}
 
-		if (config.qp_type == IBV_QPT_DRIVER || config.ext_atomic) {
+		if (dv_qp_needed()) {
 			resource->qp = mlx5dv_create_qp(resource->hca_p->context, &attr_ex, &attr_dv);
 		} else {
 			resource->qp = ibv_create_qp_ex(resource->hca_p->context, &attr_ex);
 		}
 	} else {
 		attr_ex.comp_mask |= IBV_QP_INIT_ATTR_PD;
-		attr_ex.pd = resource->pd;
+		attr_ex.pd = resource->parent_pd ? resource->parent_pd : resource->pd;
 
 		if (config.ext_atomic) {
 			attr_dv.comp_mask |= MLX5DV_QP_INIT_ATTR_MASK_ATOMIC_ARG;
-			attr_dv.max_atomic_arg = config.msg_sz;
+			attr_dv.max_atomic_arg = resource->hca_p->max_atomic_arg;
 		}
 
 		if (config.qp_type == IBV_QPT_XRC_RECV) {
@@ -437,14 +1017,24 @@ static int init_qp(struct resources_t *resource)
 			attr_ex.xrcd = resource->xrcd;
 		}
 
-		if (config.qp_type == IBV_QPT_DRIVER) {
+		if (config.qp_type != IBV_QPT_XRC_RECV)
 			attr_ex.srq = resource->srq;
+
+		if (config.qp_type == IBV_QPT_DRIVER) {
 			attr_dv.comp_mask |= MLX5DV_QP_INIT_ATTR_MASK_DC;
 			attr_dv.dc_init_attr.dc_type = MLX5DV_DCTYPE_DCT;
 			attr_dv.dc_init_attr.dct_access_key = DC_KEY;
 		}
 
-		resource->qp = mlx5dv_create_qp(resource->hca_p->context, &attr_ex, &attr_dv);
+		if (config.s2c == S2C_OFF) {
+			attr_dv.comp_mask |= MLX5DV_QP_INIT_ATTR_MASK_QP_CREATE_FLAGS;
+			attr_dv.create_flags |= MLX5DV_QP_CREATE_DISABLE_SCATTER_TO_CQE;
+		}
+
+		if (dv_qp_needed())
+			resource->qp = mlx5dv_create_qp(resource->hca_p->context, &attr_ex, &attr_dv);
+		else
+			resource->qp = ibv_create_qp_ex(resource->hca_p->context, &attr_ex);
 	}
 
 	if (!resource->qp) {
@@ -471,21 +1061,136 @@ static int init_qp(struct resources_t *resource)
 	return SUCCESS;
 }
 
+/* The ODP transport caps the buffer is used with on this side */
+static uint32_t odp_required_caps(void)
+{
+	uint32_t caps = 0;
+
+	switch (config.opcode) {
+	case IBV_WR_SEND:
+	case IBV_WR_SEND_WITH_IMM:
+		caps = config.is_daemon ? IBV_ODP_SUPPORT_RECV : IBV_ODP_SUPPORT_SEND;
+		break;
+	case IBV_WR_RDMA_WRITE:
+	case IBV_WR_RDMA_WRITE_WITH_IMM:
+		caps = config.is_daemon ? IBV_ODP_SUPPORT_WRITE : IBV_ODP_SUPPORT_SEND;
+		break;
+	case IBV_WR_RDMA_READ:
+		caps = IBV_ODP_SUPPORT_READ;
+		break;
+	case IBV_WR_ATOMIC_FETCH_AND_ADD:
+	case IBV_WR_ATOMIC_CMP_AND_SWP:
+		caps = IBV_ODP_SUPPORT_ATOMIC;
+		break;
+	default:
+		break;
+	}
+
+	return caps;
+}
+
+/* Whether the device can page the buffer on demand, otherwise it is pinned */
+static enum mr_mode odp_check(struct resources_t *resource)
+{
+	struct ibv_device_attr_ex attr;
+	uint32_t caps;
+
+	if (config.mr_mode == MR_PINNED)
+		return MR_PINNED;
+
+	memset(&attr, 0, sizeof(attr));
+	if (ibv_query_device_ex(resource->hca_p->context, NULL, &attr)) {
+		VL_HCA_ERR(("WARN: ibv_query_device_ex failed, the MR is pinned"));
+		return MR_PINNED;
+	}
+
+	if (!(attr.odp_caps.general_caps & IBV_ODP_SUPPORT) ||
+	    (config.mr_mode == MR_IMPLICIT_ODP &&
+	     !(attr.odp_caps.general_caps & IBV_ODP_SUPPORT_IMPLICIT))) {
+		VL_HCA_ERR(("WARN: HCA doesn't support %s, the MR is pinned",
+			    mr_mode_str(config.mr_mode)));
+		return MR_PINNED;
+	}
+
+	switch (config.qp_type) {
+	case IBV_QPT_RC:
+		caps = attr.odp_caps.per_transport_caps.rc_odp_caps;
+		break;
+	case IBV_QPT_UC:
+		caps = attr.odp_caps.per_transport_caps.uc_odp_caps;
+		break;
+	case IBV_QPT_UD:
+		caps = attr.odp_caps.per_transport_caps.ud_odp_caps;
+		break;
+	case IBV_QPT_XRC_SEND:
+	case IBV_QPT_XRC_RECV:
+		caps = attr.xrc_odp_caps;
+		break;
+	default:
+		/* DC caps are mlx5 specific, let the registration tell */
+		caps = ~0;
+		break;
+	}
+
+	if ((caps & odp_required_caps()) != odp_required_caps()) {
+		VL_HCA_ERR(("WARN: HCA doesn't support ODP for this transport and opcode, the MR is pinned"));
+		return MR_PINNED;
+	}
+
+	return config.mr_mode;
+}
+
+/* Fault the buffer in ahead of traffic, FLUSH waits for it */
+static int prefetch_mr(struct resources_t *resource)
+{
+	struct ibv_sge sge = {
+		.addr = (uintptr_t)resource->mr->addr,
+		.length = buf_size(),
+		.lkey = resource->mr->ibv_mr->lkey,
+	};
+	cycles_t t1 = get_cycles();
+	int rc;
+
+	rc = ibv_advise_mr(resource->pd, IBV_ADVISE_MR_ADVICE_PREFETCH_WRITE,
+			   IBV_ADVISE_MR_FLAG_FLUSH, &sge, 1);
+	if (rc) {
+		VL_MEM_ERR(("Fail in ibv_advise_mr (%s)", strerror(rc)));
+		return FAIL;
+	}
+
+	resource->prefetch_cycles = get_cycles() - t1;
+
+	return SUCCESS;
+}
+
 static int init_mr(struct resources_t *resource)
 {
-	resource->mr->ibv_mr =
-		ibv_reg_mr(resource->pd, resource->mr->addr,
-			   config.msg_sz,
-			   IBV_ACCESS_MW_BIND |
-			   IBV_ACCESS_LOCAL_WRITE |
-			   IBV_ACCESS_REMOTE_WRITE |
-			   IBV_ACCESS_REMOTE_READ |
-			   IBV_ACCESS_REMOTE_ATOMIC);
+	int access = IBV_ACCESS_LOCAL_WRITE |
+		     IBV_ACCESS_REMOTE_WRITE |
+		     IBV_ACCESS_REMOTE_READ |
+		     IBV_ACCESS_REMOTE_ATOMIC;
+
+	resource->mr_mode = odp_check(resource);
+
+	if (resource->mr_mode == MR_PINNED)
+		resource->mr->ibv_mr =
+			ibv_reg_mr(resource->pd, resource->mr->addr,
+				   buf_size(), access | IBV_ACCESS_MW_BIND);
+	else if (resource->mr_mode == MR_ODP)
+		resource->mr->ibv_mr =
+			ibv_reg_mr(resource->pd, resource->mr->addr,
+				   buf_size(), access | IBV_ACCESS_ON_DEMAND);
+	else
+		resource->mr->ibv_mr =
+			ibv_reg_mr(resource->pd, NULL, SIZE_MAX, access | IBV_ACCESS_ON_DEMAND);
 	if (!resource->mr->ibv_mr) {
-		VL_MEM_ERR(("Fail in ibv_reg_mr"));
+		VL_MEM_ERR(("Fail in ibv_reg_mr (%s)", mr_mode_str(resource->mr_mode)));
 		return FAIL;
 	}
 
+	if (resource->mr_mode != MR_PINNED && config.prefetch && prefetch_mr(resource))
+		return FAIL;
+
 	VL_MEM_TRACE1(("MR created, addr = %p, size = %d, lkey = 0x%x",
 			resource->mr->ibv_mr->addr,
 			resource->mr->ibv_mr->length,
@@ -515,18 +1220,104 @@ static int init_mw(struct resources_t *resource)
 	return SUCCESS;
 }
 
+static int init_perf_counters(struct resources_t *resource)
+{
+	if (!config.perf_counters)
+		return SUCCESS;
+
+	resource->perf = VL_MALLOC(sizeof(struct perf_counters_t), struct perf_counters_t);
+	if (!resource->perf) {
+		VL_MEM_ERR(("Fail to alloc perf_counters_t"));
+		return FAIL;
+	}
+
+	if (perf_counters_open(resource->perf) != SUCCESS) {
+		VL_MISC_ERR(("Fail to open perf counters"));
+		VL_FREE(resource->perf);
+		resource->perf = NULL;
+		return FAIL;
+	}
+
+	VL_MISC_TRACE1(("Finish init perf counters"));
+
+	return SUCCESS;
+}
+
+/*
+ * QP contexts beyond the first are clones of the resource: they share the
+ * HCA, PD, MR and socket, and own the QP and the per-poster arrays, so the
+ * post/poll helpers run on any of them unchanged. Client QPs get their own
+ * CQ, server QPs share the CQ and the SRQ.
+ */
+static int init_qp_ctxs(struct resources_t *resource)
+{
+	int i;
+
+	if (config.num_qps == 1)
+		return SUCCESS;
+
+	resource->qpc = VL_MALLOC(config.num_qps * sizeof(*resource->qpc), struct resources_t *);
+	if (!resource->qpc) {
+		VL_MEM_ERR((" Fail in alloc QP contexts"));
+		return FAIL;
+	}
+	memset(resource->qpc, 0, config.num_qps * sizeof(*resource->qpc));
+	resource->qpc[0] = resource;
+
+	for (i = 1; i < config.num_qps; i++) {
+		struct resources_t *ctx;
+
+		/* comp_ctx_t is cache line aligned */
+		if (posix_memalign((void **)&ctx, CACHE_LINE_SIZE, sizeof(*ctx))) {
+			VL_MEM_ERR((" Fail in alloc QP context %d", i));
+			return FAIL;
+		}
+
+		*ctx = *resource;
+		ctx->qpc = NULL;
+		ctx->ah = NULL;
+		ctx->flow = NULL;
+		ctx->method_state = 0;
+		ctx->wl_seq = 0;
+		resource->qpc[i] = ctx;
+
+		ctx->wc_arr = NULL;
+		ctx->sge_arr = NULL;
+		ctx->data_buf_arr = NULL;
+		ctx->send_wr_arr = NULL;
+		ctx->recv_wr_arr = NULL;
+		ctx->qp = NULL;
+		ctx->own_cq = 0;
+		ctx->rx_channel = NULL;
+
+		if (alloc_wr_arrays(ctx) ||
+		    (!config.is_daemon && init_ctx_cq(resource, ctx, i) != SUCCESS) ||
+		    init_qp(ctx) != SUCCESS) {
+			VL_MISC_ERR(("Fail to init QP context %d", i));
+			return FAIL;
+		}
+	}
+
+	VL_DATA_TRACE1(("Finish init %d QP contexts", config.num_qps));
+
+	return SUCCESS;
+}
+
 int resource_init(struct resources_t *resource)
 {
 
-	if (init_socket(resource) != SUCCESS ||
+	if ((!config.loopback && init_socket(resource) != SUCCESS) ||
 	    init_hca(resource) != SUCCESS ||
 	    init_pd(resource) != SUCCESS ||
+	    init_parent_domain(resource) != SUCCESS ||
 	    init_xrcd(resource) != SUCCESS ||
 	    init_cq(resource) != SUCCESS ||
 	    init_srq(resource) != SUCCESS ||
 	    init_qp(resource) != SUCCESS ||
 	    init_mr(resource) != SUCCESS ||
-	    init_mw(resource)) {
+	    init_qp_ctxs(resource) != SUCCESS ||
+	    init_mw(resource) ||
+	    init_perf_counters(resource)) {
 			VL_MISC_ERR(("Fail to init resource"));
 			return FAIL;
 	}
@@ -534,6 +1325,16 @@ int resource_init(struct resources_t *resource)
 	return SUCCESS;
 }
 
+static void destroy_perf_counters(struct resources_t *resource)
+{
+	if (!resource->perf)
+		return;
+
+	perf_counters_close(resource->perf);
+	VL_FREE(resource->perf);
+	VL_MISC_TRACE1(("Finish destroy perf counters"));
+}
+
 static int destroy_mw(struct resources_t *resource)
 {
 	int rc;
@@ -637,18 +1438,50 @@ static int destroy_cq(struct resources_t *resource)
 {
 	int rc;
 
-	if (!resource->cq)
-		return SUCCESS;
-
 	VL_DATA_TRACE1(("Going to destroy CQ."));
-	rc = ibv_destroy_cq(resource->cq);
-	CHECK_VALUE("ibv_destroy_cq", rc, 0, return FAIL);
+	if (resource->rcq && resource->rcq != resource->cq) {
+		rc = ibv_destroy_cq(resource->rcq);
+		CHECK_VALUE("ibv_destroy_cq(recv)", rc, 0, return FAIL);
+	}
+
+	if (resource->cq) {
+		rc = ibv_destroy_cq(resource->cq);
+		CHECK_VALUE("ibv_destroy_cq", rc, 0, return FAIL);
+	}
+
+	/* Every event was acked as it was read */
+	if (resource->rx_channel) {
+		rc = ibv_destroy_comp_channel(resource->rx_channel);
+		CHECK_VALUE("ibv_destroy_comp_channel", rc, 0, return FAIL);
+	}
 
 	VL_DATA_TRACE1(("Finish destroy CQ."));
 
 	return SUCCESS;
 }
 
+static int destroy_parent_domain(struct resources_t *resource)
+{
+	int rc;
+
+	if (resource->parent_pd) {
+		rc = ibv_dealloc_pd(resource->parent_pd);
+		CHECK_VALUE("ibv_dealloc_pd(parent domain)", rc, 0, return FAIL);
+	}
+
+	if (resource->td) {
+		rc = ibv_dealloc_td(resource->td);
+		CHECK_VALUE("ibv_dealloc_td", rc, 0, return FAIL);
+	}
+
+	/* After every object the provider placed in it is gone */
+	ring_alloc_destroy(&resource->ring_alloc);
+
+	VL_HCA_TRACE1(("Finish destroy parent domain"));
+
+	return SUCCESS;
+}
+
 static int destroy_pd(struct resources_t *resource)
 {
 	int rc;
@@ -691,6 +1524,38 @@ static int destroy_hca(struct resources_t *resource)
 	return result1;
 }
 
+static int destroy_qp_ctxs(struct resources_t *resource)
+{
+	int result1 = SUCCESS;
+	int i;
+
+	if (!resource->qpc)
+		return SUCCESS;
+
+	for (i = 1; i < config.num_qps; i++) {
+		struct resources_t *ctx = resource->qpc[i];
+
+		if (!ctx)
+			continue;
+
+		/* A split recv CQ belongs to the resource */
+		ctx->rcq = ctx->cq;
+
+		if (destroy_ah(ctx) != SUCCESS ||
+		    destroy_qp(ctx) != SUCCESS ||
+		    (ctx->own_cq && destroy_cq(ctx) != SUCCESS))
+			result1 = FAIL;
+
+		free_wr_arrays(ctx);
+		free(ctx);
+	}
+
+	VL_FREE(resource->qpc);
+	resource->qpc = NULL;
+
+	return result1;
+}
+
 int resource_destroy(struct resources_t *resource)
 {
 	int result1 = SUCCESS;
@@ -699,8 +1564,19 @@ int resource_destroy(struct resources_t *resource)
 		VL_sock_close(&resource->sock);
 		VL_SOCK_TRACE((" Close the Socket."));
 	}
+	if (resource->loop_fd >= 0)
+		close(resource->loop_fd);
 	//destroy_recv_wr(resource);
 
+	destroy_perf_counters(resource);
+
+	/* The cached AHs hold the PD */
+	if (resource->ud)
+		ah_cache_destroy(&resource->ud->cache);
+
+	if (destroy_qp_ctxs(resource) != SUCCESS)
+		result1 = FAIL;
+
 	if (destroy_mw(resource) != SUCCESS ||
 	    destroy_all_mr(resource) != SUCCESS	||
 	    destroy_flow(resource) != SUCCESS ||
@@ -709,26 +1585,63 @@ int resource_destroy(struct resources_t *resource)
 	    destroy_srq(resource) != SUCCESS ||
 	    destroy_cq(resource) != SUCCESS ||
 	    destroy_xrcd(resource) != SUCCESS ||
+	    destroy_parent_domain(resource) != SUCCESS ||
 	    destroy_pd(resource) != SUCCESS ||
 	    destroy_hca(resource) != SUCCESS)
 		result1 = FAIL;
 
-	if (resource->wc_arr)
-		VL_FREE(resource->wc_arr);
-	if (resource->send_wr_arr)
-		VL_FREE(resource->send_wr_arr);
-	if (resource->recv_wr_arr)
-		VL_FREE(resource->recv_wr_arr);
-	if (resource->sge_arr)
-		VL_FREE(resource->sge_arr);
+	free_wr_arrays(resource);
 	if (resource->atomic_args) {
 		if (config.ext_atomic && config.opcode == IBV_WR_ATOMIC_CMP_AND_SWP)
 			VL_FREE(((struct mlx5dv_comp_swap *)resource->atomic_args)->swap_val);
 
 		VL_FREE(resource->atomic_args);
 	}
-	if (resource->data_buf_arr)
-		VL_FREE(resource->data_buf_arr);
+	if (resource->sched)
+		VL_FREE(resource->sched);
+	if (resource->lat)
+		VL_FREE(resource->lat);
+	if (resource->rate_steps)
+		VL_FREE(resource->rate_steps);
+	if (resource->recv_steps)
+		VL_FREE(resource->recv_steps);
+	if (resource->mr_bench)
+		VL_FREE(resource->mr_bench);
+
+	if (resource->atomic_steps)
+		VL_FREE(resource->atomic_steps);
+
+	if (resource->sweep_steps)
+		VL_FREE(resource->sweep_steps);
+	if (resource->xrc_procs)
+		VL_FREE(resource->xrc_procs);
+	if (resource->soak)
+		VL_FREE(resource->soak);
+	if (resource->runs)
+		VL_FREE(resource->runs);
+	if (resource->ud)
+		VL_FREE(resource->ud);
+	if (resource->dc) {
+		if (resource->dc->post_ts)
+			VL_FREE(resource->dc->post_ts);
+		VL_FREE(resource->dc);
+	}
+	if (resource->post_ts)
+		VL_FREE(resource->post_ts);
+	if (resource->prod_steps)
+		VL_FREE(resource->prod_steps);
+	if (resource->wl_sched && !config.trace.recs)
+		VL_FREE((void *)resource->wl_sched);
+	if (resource->phases)
+		VL_FREE(resource->phases);
+	if (resource->capture_buf)
+		VL_FREE(resource->capture_buf);
+	if (config.trace.recs)
+		trace_close(&config.trace);
+	if (resource->wl_stats)
+		VL_FREE(resource->wl_stats);
+	if (resource->wl_post_ts)
+		VL_FREE(resource->wl_post_ts);
 
 	VL_MISC_TRACE(("*********** Destroy all resource. *************"));
 	return result1;
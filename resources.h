@@ -6,5 +6,6 @@
 int resource_alloc(struct resources_t *resource);
 int resource_init(struct resources_t *resource);
 int resource_destroy(struct resources_t *resource);
+int cq_sharers(void);
 
 #endif /* TEST_FUNCTION_H */
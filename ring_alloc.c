@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <infiniband/mlx5dv.h>
+#include <vl.h>
+#include "types.h"
+#include "ring_alloc.h"
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+
+#define MPOL_BIND 2
+
+static const char *ring_type_str[] = { "QP", "CQ", "SRQ", "DBR", "OTHER" };
+
+int ring_alloc_parse(const char *str, uint32_t *flags)
+{
+	const char *p = str;
+
+	*flags = 0;
+
+	while (*p) {
+		const char *end = strchr(p, ',');
+		size_t len;
+
+		if (!end)
+			end = p + strlen(p);
+		len = end - p;
+
+		if (len == 4 && !strncmp(p, "HUGE", len))
+			*flags |= RING_ALLOC_HUGE;
+		else if (len == 4 && !strncmp(p, "NUMA", len))
+			*flags |= RING_ALLOC_NUMA;
+		else if (len == 5 && !strncmp(p, "COLOR", len))
+			*flags |= RING_ALLOC_COLOR;
+		else if (!(len == 7 && !strncmp(p, "DEFAULT", len)))
+			return FAIL;
+
+		p = *end ? end + 1 : end;
+	}
+
+	return SUCCESS;
+}
+
+const char *ring_alloc_str(uint32_t flags)
+{
+	static char str[32];
+
+	if (!flags)
+		return "DEFAULT";
+
+	snprintf(str, sizeof(str), "%s%s%s",
+		 flags & RING_ALLOC_HUGE ? "HUGE " : "",
+		 flags & RING_ALLOC_NUMA ? "NUMA " : "",
+		 flags & RING_ALLOC_COLOR ? "COLOR " : "");
+	str[strlen(str) - 1] = '\0';
+
+	return str;
+}
+
+static int hca_numa_node(const char *dev_name)
+{
+	char path[128];
+	int node = -1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/class/infiniband/%s/device/numa_node", dev_name);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	if (fscanf(f, "%d", &node) != 1)
+		node = -1;
+	fclose(f);
+
+	return node;
+}
+
+void ring_alloc_init(struct ring_alloc_t *ra, uint32_t flags, const char *dev_name)
+{
+	memset(ra, 0, sizeof(*ra));
+	ra->flags = flags;
+	ra->numa_node = -1;
+
+	if (flags & RING_ALLOC_NUMA) {
+		ra->numa_node = hca_numa_node(dev_name);
+		if (ra->numa_node < 0)
+			VL_MISC_ERR(("%s has no NUMA node, rings are not bound", dev_name));
+	}
+}
+
+static struct ring_chunk_t *ring_chunk_new(struct ring_alloc_t *ra, size_t size)
+{
+	size_t len = (size + sizeof(struct ring_chunk_t) + RING_ALLOC_CHUNK - 1) &
+		     ~(RING_ALLOC_CHUNK - 1);
+	int mflags = MAP_PRIVATE | MAP_ANONYMOUS;
+	struct ring_chunk_t *chunk = MAP_FAILED;
+
+	if (ra->flags & RING_ALLOC_HUGE) {
+		chunk = mmap(NULL, len, PROT_READ | PROT_WRITE, mflags | MAP_HUGETLB, -1, 0);
+		if (chunk == MAP_FAILED)
+			ra->huge_fallbacks++;
+	}
+
+	if (chunk == MAP_FAILED)
+		chunk = mmap(NULL, len, PROT_READ | PROT_WRITE, mflags, -1, 0);
+	if (chunk == MAP_FAILED)
+		return NULL;
+
+	/* Bind before the first touch so the pages come from the HCA node */
+	if (ra->numa_node >= 0) {
+		unsigned long mask[4] = { 0 };
+
+		if (ra->numa_node < (int)(sizeof(mask) * 8)) {
+			mask[ra->numa_node / (sizeof(mask[0]) * 8)] =
+				1UL << (ra->numa_node % (sizeof(mask[0]) * 8));
+			if (syscall(SYS_mbind, chunk, len, MPOL_BIND, mask, sizeof(mask) * 8, 0))
+				VL_MISC_ERR(("mbind to node %d failed (errno %d)", ra->numa_node, errno));
+		}
+	}
+
+	chunk->len = len;
+	chunk->used = sizeof(*chunk);
+	chunk->next = ra->chunks;
+	ra->chunks = chunk;
+
+	return chunk;
+}
+
+static enum ring_alloc_type ring_type(uint64_t resource_type)
+{
+	if (resource_type == MLX5DV_RES_TYPE_QP)
+		return RING_TYPE_QP;
+	if (resource_type == MLX5DV_RES_TYPE_CQ)
+		return RING_TYPE_CQ;
+	if (resource_type == MLX5DV_RES_TYPE_SRQ)
+		return RING_TYPE_SRQ;
+	if (resource_type == MLX5DV_RES_TYPE_DBR)
+		return RING_TYPE_DBR;
+
+	return RING_TYPE_OTHER;
+}
+
+static void *ring_alloc_cb(struct ibv_pd *pd, void *pd_context, size_t size,
+			   size_t alignment, uint64_t resource_type)
+{
+	struct ring_alloc_t *ra = pd_context;
+	enum ring_alloc_type type = ring_type(resource_type);
+	size_t page = sysconf(_SC_PAGESIZE);
+	struct ring_chunk_t *chunk;
+	size_t color = 0;
+	size_t off;
+
+	(void)pd;
+
+	if (!alignment)
+		alignment = 1;
+
+	/*
+	 * Rings start on a rotating page offset, so the heads of many rings
+	 * don't all land on the same cache sets. Doorbell records are tiny
+	 * and packed together by the provider, leave them alone.
+	 */
+	if ((ra->flags & RING_ALLOC_COLOR) && type != RING_TYPE_DBR)
+		color = (ra->color++ % RING_ALLOC_COLORS) * page;
+
+	for (chunk = ra->chunks; chunk; chunk = chunk->next) {
+		off = ((chunk->used + alignment - 1) & ~(alignment - 1)) + color;
+		if (off + size <= chunk->len)
+			break;
+	}
+
+	if (!chunk) {
+		chunk = ring_chunk_new(ra, size + color + alignment);
+		if (!chunk)
+			return IBV_ALLOCATOR_USE_DEFAULT;
+		off = ((chunk->used + alignment - 1) & ~(alignment - 1)) + color;
+	}
+
+	chunk->used = off + size;
+	ra->num_allocs[type]++;
+	ra->bytes[type] += size;
+
+	return (char *)chunk + off;
+}
+
+static void ring_free_cb(struct ibv_pd *pd, void *pd_context, void *ptr,
+			 uint64_t resource_type)
+{
+	/* The chunks are unmapped as a whole on teardown */
+	(void)pd;
+	(void)pd_context;
+	(void)ptr;
+	(void)resource_type;
+}
+
+void ring_alloc_attach(struct ring_alloc_t *ra, struct ibv_parent_domain_init_attr *attr)
+{
+	attr->comp_mask |= IBV_PARENT_DOMAIN_INIT_ATTR_ALLOCATORS |
+			   IBV_PARENT_DOMAIN_INIT_ATTR_PD_CONTEXT;
+	attr->alloc = ring_alloc_cb;
+	attr->free = ring_free_cb;
+	attr->pd_context = ra;
+}
+
+void ring_alloc_destroy(struct ring_alloc_t *ra)
+{
+	while (ra->chunks) {
+		struct ring_chunk_t *next = ra->chunks->next;
+
+		munmap(ra->chunks, ra->chunks->len);
+		ra->chunks = next;
+	}
+}
+
+void ring_alloc_print(const struct ring_alloc_t *ra)
+{
+	const struct ring_chunk_t *chunk;
+	uint64_t mapped = 0;
+	int i;
+
+	for (chunk = ra->chunks; chunk; chunk = chunk->next)
+		mapped += chunk->len;
+
+	VL_MISC_TRACE((" Ring allocator %s: %lu bytes mapped, NUMA node %d, %lu hugepage fallbacks",
+		       ring_alloc_str(ra->flags), mapped, ra->numa_node, ra->huge_fallbacks));
+
+	for (i = 0; i < RING_TYPE_NUM; i++)
+		if (ra->num_allocs[i])
+			VL_MISC_TRACE(("   %-6s %8lu buffers %12lu bytes", ring_type_str[i],
+				       ra->num_allocs[i], ra->bytes[i]));
+}
@@ -0,0 +1,53 @@
+#ifndef RING_ALLOC_H
+#define RING_ALLOC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <infiniband/verbs.h>
+
+enum ring_alloc_flags {
+	RING_ALLOC_HUGE		= 1 << 0,	/* 2MB hugepages */
+	RING_ALLOC_NUMA		= 1 << 1,	/* bound to the HCA NUMA node */
+	RING_ALLOC_COLOR	= 1 << 2,	/* page offset rotated per ring */
+};
+
+#define RING_ALLOC_CHUNK (2UL << 20)
+#define RING_ALLOC_COLORS 16
+
+enum ring_alloc_type {
+	RING_TYPE_QP = 0,
+	RING_TYPE_CQ,
+	RING_TYPE_SRQ,
+	RING_TYPE_DBR,
+	RING_TYPE_OTHER,
+	RING_TYPE_NUM,
+};
+
+struct ring_chunk_t {
+	struct ring_chunk_t	*next;
+	size_t			len;
+	size_t			used;
+};
+
+/*
+ * Provider buffers (SQ/RQ, CQ, SRQ, doorbell records) are carved from
+ * benchmark-owned chunks. Freeing is deferred to ring_alloc_destroy().
+ */
+struct ring_alloc_t {
+	uint32_t		flags;
+	int			numa_node;	/* -1 - unknown */
+	uint32_t		color;		/* next color to hand out */
+	struct ring_chunk_t	*chunks;
+	uint64_t		num_allocs[RING_TYPE_NUM];
+	uint64_t		bytes[RING_TYPE_NUM];
+	uint64_t		huge_fallbacks;
+};
+
+int ring_alloc_parse(const char *str, uint32_t *flags);
+void ring_alloc_init(struct ring_alloc_t *ra, uint32_t flags, const char *dev_name);
+void ring_alloc_destroy(struct ring_alloc_t *ra);
+void ring_alloc_attach(struct ring_alloc_t *ra, struct ibv_parent_domain_init_attr *attr);
+const char *ring_alloc_str(uint32_t flags);
+void ring_alloc_print(const struct ring_alloc_t *ra);
+
+#endif /* RING_ALLOC_H */
@@ -0,0 +1,108 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "stats.h"
+
+/* Two-sided 95% Student t by degrees of freedom, the normal value past them */
+static const double t95[] = {
+	0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+	2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+	2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+};
+
+static int cycles_cmp(const void *a, const void *b)
+{
+	cycles_t x = *(const cycles_t *)a;
+	cycles_t y = *(const cycles_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+void stats_sort_cycles(cycles_t *samples, uint64_t num)
+{
+	qsort(samples, num, sizeof(*samples), cycles_cmp);
+}
+
+/* Nearest-rank percentile */
+cycles_t stats_percentile_cycles(const cycles_t *samples, uint64_t num, double pct)
+{
+	uint64_t rank;
+
+	if (!num)
+		return 0;
+
+	rank = (uint64_t)(pct / 100 * num + 0.5);
+	if (rank)
+		rank--;
+	if (rank >= num)
+		rank = num - 1;
+
+	return samples[rank];
+}
+
+static int double_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile_double(const double *samples, uint32_t num, double pct)
+{
+	uint32_t rank = (uint32_t)(pct / 100 * num + 0.5);
+
+	if (rank)
+		rank--;
+	if (rank >= num)
+		rank = num - 1;
+
+	return samples[rank];
+}
+
+/*
+ * Mean with its confidence interval, and the median of what is left once
+ * the samples past the Tukey fences (1.5 IQR out of the quartiles) go.
+ */
+void stats_summarize(double *samples, uint32_t num, struct stats_summary_t *sum)
+{
+	double q1, q3, lo, hi, var = 0;
+	uint32_t i, first, last, kept;
+
+	memset(sum, 0, sizeof(*sum));
+	if (!num)
+		return;
+
+	sum->num = num;
+	for (i = 0; i < num; i++)
+		sum->mean += samples[i];
+	sum->mean /= num;
+
+	if (num > 1) {
+		for (i = 0; i < num; i++)
+			var += (samples[i] - sum->mean) * (samples[i] - sum->mean);
+		sum->stddev = sqrt(var / (num - 1));
+		sum->ci95 = (num - 1 < sizeof(t95) / sizeof(t95[0]) ? t95[num - 1] : 1.960) *
+			    sum->stddev / sqrt(num);
+	}
+
+	if (sum->mean)
+		sum->cv = sum->stddev / sum->mean;
+
+	qsort(samples, num, sizeof(*samples), double_cmp);
+	q1 = percentile_double(samples, num, 25);
+	q3 = percentile_double(samples, num, 75);
+	lo = q1 - 1.5 * (q3 - q1);
+	hi = q3 + 1.5 * (q3 - q1);
+
+	/* The quartiles are samples themselves, so some are always kept */
+	for (first = 0; samples[first] < lo; first++)
+		;
+	for (last = num; samples[last - 1] > hi; last--)
+		;
+
+	kept = last - first;
+	sum->outliers = num - kept;
+	i = first + kept / 2;
+	sum->median = kept % 2 ? samples[i] : (samples[i - 1] + samples[i]) / 2;
+}
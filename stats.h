@@ -0,0 +1,25 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include "get_clock.h"
+
+/* Spread of repeated runs, a sample per run */
+struct stats_summary_t {
+	uint32_t	num;
+	double		mean;
+	double		stddev;		/* sample, n - 1 */
+	double		ci95;		/* half-width of the 95% confidence interval of the mean */
+	double		cv;		/* stddev / mean */
+	double		median;		/* of the samples inside the 1.5 IQR fences */
+	uint32_t	outliers;	/* outside the fences */
+};
+
+/* Sorts the samples in place */
+void stats_sort_cycles(cycles_t *samples, uint64_t num);
+/* pct in [0, 100], samples must be sorted */
+cycles_t stats_percentile_cycles(const cycles_t *samples, uint64_t num, double pct);
+/* Sorts the samples in place */
+void stats_summarize(double *samples, uint32_t num, struct stats_summary_t *sum);
+
+#endif /* STATS_H */
@@ -1,14 +1,273 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <vl.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/socket.h>
 #include "types.h"
+#include "resources.h"
 #include "get_clock.h"
 #include <assert.h>
+#include <math.h>
 #include <infiniband/mlx5dv.h>
+#include "stats.h"
+#include "mpsc.h"
+#include "mr_cache.h"
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <poll.h>
 
 extern struct config_t config;
 
 int force_configurations_dependencies()
 {
+	if (config.depth_sweep) {
+		if (config.opcode != IBV_WR_RDMA_READ || config.qp_type != IBV_QPT_RC) {
+			VL_MISC_ERR(("Depth sweep runs RDMA READ over RC\n"));
+			return FAIL;
+		}
+
+		/* The sizes ride on the size sweep, a single one without it */
+		if (!config.size_sweep)
+			config.size_sweep = config.msg_sz;
+	}
+
+	if (config.mtu_sweep) {
+		if (config.qp_type != IBV_QPT_RC || config.depth_sweep) {
+			VL_MISC_ERR(("MTU sweep runs over RC, without a depth sweep\n"));
+			return FAIL;
+		}
+
+		if (!config.size_sweep)
+			config.size_sweep = config.msg_sz;
+	}
+
+	if (config.size_sweep) {
+		uint64_t size;
+
+		if (config.workload || config.trace_path) {
+			VL_MISC_ERR(("Size sweep can't be combined with a workload or trace replay\n"));
+			return FAIL;
+		}
+
+		if (config.rate || config.comp_cpu >= 0 || config.producers) {
+			VL_MISC_ERR(("Size sweep can't be combined with open-loop, a completion thread"
+				     " or producers\n"));
+			return FAIL;
+		}
+
+		/* A single opcode workload, each step posts its schedule at one size */
+		config.wl.num_ops = 1;
+		config.wl.ops[0] = config.opcode;
+		config.wl.op_weight[0] = 1;
+		for (size = config.msg_sz; size <= config.size_sweep; size *= 2) {
+			if (config.wl.num_sizes == WL_MAX_SIZES) {
+				VL_MISC_ERR(("Size sweep takes up to %d sizes\n", WL_MAX_SIZES));
+				return FAIL;
+			}
+
+			config.wl.sizes[config.wl.num_sizes] = size;
+			config.wl.size_weight[config.wl.num_sizes++] = 1;
+		}
+
+		if (!config.wl.num_sizes) {
+			VL_MISC_ERR(("Size sweep max is below the message size\n"));
+			return FAIL;
+		}
+
+		config.workload = 1;
+		config.stepped = 1;
+	}
+
+	if (config.mr_bench) {
+		uint32_t size;
+		int num = 0;
+
+		if (config.opcode != IBV_WR_SEND ||
+		    (config.qp_type != IBV_QPT_RC && config.qp_type != IBV_QPT_UC &&
+		     config.qp_type != IBV_QPT_UD)) {
+			VL_MISC_ERR(("Registration benchmark sends over RC, UC or UD\n"));
+			return FAIL;
+		}
+
+		if (config.workload || config.trace_path || config.size_sweep || config.rate ||
+		    config.comp_cpu >= 0 || config.producers || config.num_qps > 1 ||
+		    config.mr_mode != MR_PINNED) {
+			VL_MISC_ERR(("Registration benchmark runs alone\n"));
+			return FAIL;
+		}
+
+		for (size = config.msg_sz; size <= config.mr_bench; size *= 2)
+			num++;
+		if (!num || num > MR_BENCH_SIZES) {
+			VL_MISC_ERR(("Registration benchmark takes 1..%d sizes\n", MR_BENCH_SIZES));
+			return FAIL;
+		}
+
+		/* The receive buffer takes the largest message */
+		config.mr_bench_min = config.msg_sz;
+		config.msg_sz = config.mr_bench;
+		config.stepped = 1;
+	}
+
+	if (config.atomic_targets) {
+		if ((config.opcode != IBV_WR_ATOMIC_FETCH_AND_ADD &&
+		     config.opcode != IBV_WR_ATOMIC_CMP_AND_SWP) ||
+		    config.qp_type != IBV_QPT_RC) {
+			VL_MISC_ERR(("Atomic benchmark runs atomic operations over RC\n"));
+			return FAIL;
+		}
+
+		if (config.workload || config.trace_path || config.size_sweep || config.rate ||
+		    config.comp_cpu >= 0 || config.producers || config.mr_bench ||
+		    config.perf_counters) {
+			VL_MISC_ERR(("Atomic benchmark runs alone\n"));
+			return FAIL;
+		}
+
+		/*
+		 * Extended atomics sweep the argument up to what the device takes,
+		 * known after the buffer is sized, so it is sized for the largest.
+		 */
+		if (config.ext_atomic)
+			config.msg_sz = ATOMIC_MAX_ARG;
+
+		/* The targets of a QP are every num_qps-th one, wrapped by the target mask */
+		if (config.num_qps & (config.num_qps - 1)) {
+			VL_MISC_ERR(("Atomic benchmark splits the targets over a power of 2 of QPs\n"));
+			return FAIL;
+		}
+
+		/* A cache line per target, so disjoint targets don't share one */
+		config.atomic_stride = config.msg_sz > CACHE_LINE_SIZE ? config.msg_sz : CACHE_LINE_SIZE;
+		config.stepped = 1;
+	}
+
+	if (config.dc_targets) {
+		if (config.qp_type != IBV_QPT_DRIVER || config.opcode != IBV_WR_SEND) {
+			VL_MISC_ERR(("DC fan-out sends over DC\n"));
+			return FAIL;
+		}
+
+		if (config.workload || config.trace_path || config.size_sweep || config.rate ||
+		    config.comp_cpu >= 0 || config.producers || config.mr_bench ||
+		    config.atomic_targets || config.threads > 1) {
+			VL_MISC_ERR(("DC fan-out runs alone, from a single sender thread\n"));
+			return FAIL;
+		}
+
+		if (config.is_daemon) {
+			/* A DCT per target, they all receive on the SRQ */
+			config.num_qps = config.dc_targets;
+		} else {
+			if (config.send_method != METHOD_NEW || config.num_qps > DC_MAX_DCIS) {
+				VL_MISC_ERR(("DC fan-out posts with the NEW method from up to %d DCIs\n",
+					     DC_MAX_DCIS));
+				return FAIL;
+			}
+
+			/* The sender polls the DCIs on one CQ */
+			config.cq_share = CQ_SHARE_GLOBAL;
+		}
+
+		config.stepped = 1;
+	}
+
+	if (config.ud_dests) {
+		if (config.qp_type != IBV_QPT_UD || config.opcode != IBV_WR_SEND) {
+			VL_MISC_ERR(("UD fan-out sends over UD\n"));
+			return FAIL;
+		}
+
+		if (config.workload || config.trace_path || config.size_sweep || config.rate ||
+		    config.comp_cpu >= 0 || config.producers || config.mr_bench ||
+		    config.threads > 1) {
+			VL_MISC_ERR(("UD fan-out runs alone, from a single sender thread\n"));
+			return FAIL;
+		}
+
+		if (config.is_daemon) {
+			/* A QP per destination, they all receive on the SRQ */
+			config.num_qps = config.ud_dests;
+		} else {
+			if (config.send_method != METHOD_NEW || config.num_qps > 1) {
+				VL_MISC_ERR(("UD fan-out posts with the NEW method from one QP\n"));
+				return FAIL;
+			}
+
+			if (!config.ah_cache)
+				config.ah_cache = config.ud_dests;
+		}
+
+		config.stepped = 1;
+	}
+
+	if (config.trace_path) {
+		int op;
+
+		if (config.workload || config.rate) {
+			VL_MISC_ERR(("Trace replay can't be combined with a workload or open-loop rate\n"));
+			return FAIL;
+		}
+
+		if (trace_open(&config.trace, config.trace_path))
+			return FAIL;
+
+		if (!config.trace.num_recs || config.trace.num_recs > UINT32_MAX) {
+			VL_MISC_ERR(("Trace must hold 1..%u records\n", UINT32_MAX));
+			return FAIL;
+		}
+
+		/* The trace is a workload whose schedule is the mapping itself */
+		for (op = 0; op < WL_MAX_OPCODE; op++)
+			if (config.trace.op_mask & (1 << op))
+				config.wl.ops[config.wl.num_ops++] = op;
+		config.wl.num_sizes = 1;
+		config.wl.sizes[0] = config.trace.max_size;
+		config.wl.size_weight[0] = 1;
+		config.num_of_iter = config.trace.num_recs;
+		config.workload = 1;
+	}
+
+	if (config.wl.num_sizes && !config.workload) {
+		VL_MISC_ERR(("Message sizes distribution requires a workload\n"));
+		return FAIL;
+	}
+
+	if (config.workload) {
+		uint32_t op_mask;
+
+		if (!config.wl.num_sizes) {
+			config.wl.num_sizes = 1;
+			config.wl.sizes[0] = config.msg_sz;
+			config.wl.size_weight[0] = 1;
+		}
+
+		if (!config.is_daemon && config.send_method != METHOD_NEW) {
+			VL_MISC_ERR(("Workload is supported just by the NEW post send method\n"));
+			return FAIL;
+		}
+
+		if (config.use_inl || config.num_sge > 1 || config.ext_atomic) {
+			VL_MISC_ERR(("Workload supports a single SGE w/o inline nor extended atomics\n"));
+			return FAIL;
+		}
+
+		op_mask = wl_op_mask(&config.wl);
+		if (config.qp_type == IBV_QPT_RAW_PACKET ||
+		    (config.qp_type == IBV_QPT_UD &&
+		     (op_mask & ~((1 << IBV_WR_SEND) | (1 << IBV_WR_SEND_WITH_IMM))))) {
+			VL_MISC_ERR(("The workload is unsupported on that transport\n"));
+			return FAIL;
+		}
+
+		/* A single buffer serves every size of the mix */
+		config.msg_sz = wl_max_size(&config.wl);
+	}
+
 	if(config.ring_depth < config.batch_size)
 		config.ring_depth = config.batch_size;
 
@@ -121,135 +380,446 @@ int force_configurations_dependencies()
 		return FAIL;
 	}
 
-	/* For performance benchmark need to optimize operations */
-	if (config.opcode != IBV_WR_SEND)
-		VL_MISC_ERR(("WARN: opcode isn't optimized by test!\n"));
+	if (config.num_qps > 1 && !config.dc_targets &&
+	    config.qp_type != IBV_QPT_RC && config.qp_type != IBV_QPT_UC &&
+	    config.qp_type != IBV_QPT_UD) {
+		VL_MISC_ERR(("Multiple QPs are supported on RC, UC and UD, DC with --dc_targets\n"));
+		return FAIL;
+	}
 
-	return 0;
-}
+	if (!config.is_daemon && (config.num_qps > 1 || config.threads > 1)) {
+		if (config.threads > config.num_qps) {
+			VL_MISC_ERR(("Every sender thread needs a QP (threads <= num_qps)\n"));
+			return FAIL;
+		}
 
-int send_info(struct resources_t *resource, const void *buf, size_t size)
-{
-	void *tmp_buf;
-	int rc = SUCCESS;
-	int i;
+		if (config.rate || config.workload || config.comp_cpu >= 0 || config.perf_counters) {
+			VL_MISC_ERR(("Multiple QPs can't be combined with open-loop, workload, perf counters"
+				     " or a completion thread\n"));
+			return FAIL;
+		}
 
-	VL_SOCK_TRACE1(("Going to send info."));
+		if (config.opcode == IBV_WR_SEND_WITH_INV ||
+		    config.opcode == IBV_WR_LOCAL_INV ||
+		    config.opcode == IBV_WR_BIND_MW) {
+			VL_MISC_ERR(("Multiple QPs don't support MW operations\n"));
+			return FAIL;
+		}
 
-	if (size % 4) {
-		VL_MISC_ERR(("sync_info must get buffer size of multiples of 4B"));
-		return FAIL;
+		if ((uint32_t)config.num_qps > config.num_of_iter) {
+			VL_MISC_ERR(("Every QP needs an iteration (num_qps <= iterations)\n"));
+			return FAIL;
+		}
+
+		/* Single threaded CQs can't be polled from several threads */
+		if (config.cq_share == CQ_SHARE_GLOBAL && config.threads > 1 && config.thread_domain) {
+			VL_MISC_ERR(("A global CQ of several threads can't live on a thread domain\n"));
+			return FAIL;
+		}
 	}
 
-	tmp_buf = calloc(1, size);
-	if (!tmp_buf) {
-		VL_MEM_ERR((" Fail in alloc tmp_buf"));
+	if (config.producers && config.cq_share != CQ_SHARE_QP) {
+		VL_MISC_ERR(("Producers run with a CQ per QP\n"));
 		return FAIL;
 	}
 
-	for (i = 0; i < (int) (size / sizeof(uint32_t)); i++)
-		((uint32_t*) tmp_buf)[i] = htonl((uint32_t) (((uint32_t*) buf)[i]));
+	/* A larger count never fills a ring, the CQE would only come on the timer */
+	if (config.cq_moder_cnt > config.ring_depth) {
+		VL_MISC_ERR(("CQ moderation count must be within the ring size (%u)\n",
+			     config.ring_depth));
+		return FAIL;
+	}
 
-	if (VL_sock_send(&resource->sock, size, tmp_buf)) {
-		VL_SOCK_ERR(("Fail to send info"));
-		rc =  FAIL;
-		goto cleanup;
+	if (config.cq_depth && config.cq_depth < config.ring_depth * cq_sharers()) {
+		VL_MISC_ERR(("CQ depth must hold the rings of the %d QPs sharing it (%u)\n",
+			     cq_sharers(), config.ring_depth * cq_sharers()));
+		return FAIL;
 	}
 
-	VL_SOCK_TRACE1((" Info was sent"));
+	if (config.producers && !config.is_daemon) {
+		if (config.rate || config.workload || config.perf_counters || config.comp_cpu >= 0) {
+			VL_MISC_ERR(("Producers can't be combined with open-loop, workload, perf counters"
+				     " or a completion thread\n"));
+			return FAIL;
+		}
 
-cleanup:
-	free(tmp_buf);
+		if (config.send_method != METHOD_NEW) {
+			VL_MISC_ERR(("Producers post with the NEW method\n"));
+			return FAIL;
+		}
 
-	return rc;
-}
+		if (config.opcode == IBV_WR_SEND_WITH_INV ||
+		    config.opcode == IBV_WR_LOCAL_INV ||
+		    config.opcode == IBV_WR_BIND_MW) {
+			VL_MISC_ERR(("Producers don't support MW operations\n"));
+			return FAIL;
+		}
 
-int recv_info(struct resources_t *resource, void *buf, size_t size)
-{
-	int i;
+		if ((uint32_t)config.producers > config.num_of_iter) {
+			VL_MISC_ERR(("Producers must be less than iterations\n"));
+			return FAIL;
+		}
 
-	VL_SOCK_TRACE1(("Going to recv info."));
+		/* A step per producer count and mode */
+		config.stepped = 1;
+	}
 
-	if (size % 4) {
-		VL_MISC_ERR(("sync_info must get buffer size of multiples of 4"));
-		return FAIL;
+	if (config.comp_cpu >= 0 && !config.is_daemon) {
+		if (config.rate || config.workload || config.perf_counters) {
+			VL_MISC_ERR(("Completion thread can't be combined with open-loop, workload or perf counters\n"));
+			return FAIL;
+		}
+
+		if (config.opcode == IBV_WR_SEND_WITH_INV ||
+		    config.opcode == IBV_WR_LOCAL_INV ||
+		    config.opcode == IBV_WR_BIND_MW) {
+			VL_MISC_ERR(("Completion thread doesn't support MW operations\n"));
+			return FAIL;
+		}
+
+		/* Inline polling baseline first, then the completion thread */
+		config.stepped = 1;
 	}
 
-	if (VL_sock_recv(&resource->sock, size, buf)) {
-		VL_SOCK_ERR(("Fail to receive info"));
+	if (config.rate_step && !config.rate) {
+		VL_MISC_ERR(("Rate sweep requires a start rate (--rate)\n"));
 		return FAIL;
 	}
 
-	for (i = 0; i < (int) (size / sizeof(uint32_t)); i++)
-		((uint32_t*) buf)[i] = ntohl((uint32_t) (((uint32_t*) buf)[i]));
-
-	VL_SOCK_TRACE1((" Info was received"));
+	if (config.coalesce_n && !config.rate) {
+		VL_MISC_ERR(("Coalescing needs an arrival process (--rate)\n"));
+		return FAIL;
+	}
 
-	return SUCCESS;
-}
+	if (config.coalesce_n > config.batch_size) {
+		VL_MISC_ERR(("Coalescing N must be up to the batch size\n"));
+		return FAIL;
+	}
 
-//TODO: This need to be optimized for singlr SGE test (save ~15[ns])
-static inline void set_sge(struct resources_t *resource, struct ibv_sge *arr)
-{
-	size_t chunk = config.msg_sz / config.num_sge;
-	void *addr = resource->mr->addr;
-	int i;
+	if (config.rate && !config.is_daemon) {
+		if (config.opcode == IBV_WR_SEND_WITH_INV ||
+		    config.opcode == IBV_WR_LOCAL_INV ||
+		    config.opcode == IBV_WR_BIND_MW) {
+			VL_MISC_ERR(("Open-loop sender doesn't support MW operations\n"));
+			return FAIL;
+		}
 
-	for (i = 0; i < config.num_sge; i++) {
-		arr[i].addr = (uintptr_t)addr;
-		arr[i].length = chunk;
-		arr[i].lkey = resource->mr->ibv_mr->lkey;
+		config.stepped = 1;
+	}
 
-		addr += chunk;
+	if (config.mr_mode != MR_PINNED &&
+	    (config.opcode == IBV_WR_SEND_WITH_INV ||
+	     config.opcode == IBV_WR_LOCAL_INV ||
+	     config.opcode == IBV_WR_BIND_MW)) {
+		VL_MISC_ERR(("Memory windows need a pinned MR\n"));
+		return FAIL;
 	}
-}
 
-static inline void set_data_buf(struct resources_t *resource, struct ibv_data_buf *arr)
-{
-	size_t chunk = config.msg_sz / config.num_sge;
-	void *addr = resource->mr->addr;
-	int i;
+	if (config.prefetch && config.mr_mode == MR_PINNED) {
+		VL_MISC_ERR(("Prefetch applies to an ODP MR (--mr_mode)\n"));
+		return FAIL;
+	}
 
-	for (i = 0; i < config.num_sge; i++) {
-		arr[i].addr = addr;
-		arr[i].length = chunk;
+	if (config.loopback) {
+		if (config.is_daemon) {
+			VL_MISC_ERR(("Loopback runs both sides, it can't be a daemon\n"));
+			return FAIL;
+		}
 
-		addr += chunk;
-	}
-}
+		/* The UD server pads its buffer with the GRH, the sides share msg_sz */
+		if (config.qp_type != IBV_QPT_RC && config.qp_type != IBV_QPT_UC &&
+		    config.qp_type != IBV_QPT_DRIVER) {
+			VL_MISC_ERR(("Loopback supports RC, UC and DC\n"));
+			return FAIL;
+		}
 
-static inline void set_send_wr(struct resources_t *resource,
-			       struct ibv_send_wr *wr, uint16_t size)
-{
-	int i;
+		/* Both sides would own the one trace mapping */
+		if (config.trace_path) {
+			VL_MISC_ERR(("Loopback can't replay a trace\n"));
+			return FAIL;
+		}
 
-	for (i = 0; i < size; i++) {
-		int offset = i  * config.num_sge;
+		/* A step reconnect would bring the receiver QPs up as a client */
+		if (config.mtu_sweep) {
+			VL_MISC_ERR(("Loopback can't sweep the MTU\n"));
+			return FAIL;
+		}
 
-		wr[i].wr_id = WR_ID;
-		wr[i].send_flags =
-			IBV_SEND_SIGNALED |
-			(config.use_inl ? IBV_SEND_INLINE : 0); //TODO: move it to pre-processing
-		wr[i].opcode = IBV_WR_SEND;
-		wr[i].next = &wr[i + 1];
-		wr[i].sg_list = &resource->sge_arr[offset];
-		wr[i].num_sge = config.num_sge;
+		/* The DCT set and the DCT numbers come from the connection sync */
+		if (config.dc_targets) {
+			VL_MISC_ERR(("Loopback can't fan out over DC targets\n"));
+			return FAIL;
+		}
 
-		set_sge(resource, &resource->sge_arr[offset]); //TODO: optimize when IBV_SEND_INLINE
+		/* The refill options are validated on the server only */
+		if (config.srq_refill) {
+			VL_MISC_ERR(("Loopback can't refill the SRQ on its limit event\n"));
+			return FAIL;
+		}
 	}
 
-	wr[size - 1].next = NULL;
-}
+	if (config.srq_refill && config.is_daemon) {
+		if (config.num_qps == 1 ||
+		    (config.qp_type != IBV_QPT_RC && config.qp_type != IBV_QPT_UC &&
+		     config.qp_type != IBV_QPT_UD)) {
+			VL_MISC_ERR(("SRQ refill takes a multi-QP server over RC, UC or UD\n"));
+			return FAIL;
+		}
 
-static inline void set_recv_wr(struct resources_t *resource,
-			       struct ibv_recv_wr *wr, uint16_t size)
-{
-	int i;
+		if (config.cq_moder_cnt || config.size_sweep) {
+			VL_MISC_ERR(("SRQ refill can't be combined with CQ moderation or a size sweep\n"));
+			return FAIL;
+		}
 
-	for (i = 0; i < size; i++) {
-		int offset = i * config.num_sge;
+		if (!config.srq_watermark)
+			config.srq_watermark = config.ring_depth / 4 ? config.ring_depth / 4 : 1;
 
-		wr[i].wr_id = WR_ID;
+		if (config.srq_watermark >= config.ring_depth) {
+			VL_MISC_ERR(("SRQ watermark must be below the ring depth\n"));
+			return FAIL;
+		}
+	}
+
+	if (config.xrc_procs) {
+		if (config.qp_type != IBV_QPT_XRC_RECV) {
+			VL_MISC_ERR(("XRC workers are an XRC server option\n"));
+			return FAIL;
+		}
+
+		/* A worker counts its share of the messages on its own SRQ */
+		if ((config.opcode != IBV_WR_SEND && config.opcode != IBV_WR_SEND_WITH_IMM) ||
+		    config.workload || config.size_sweep || config.srq_refill) {
+			VL_MISC_ERR(("XRC workers receive SEND traffic, without a workload, size sweep"
+				     " or SRQ refill\n"));
+			return FAIL;
+		}
+	}
+
+	/* A duration run is the plain single QP sender, the clock ends it */
+	if (config.duration &&
+	    (config.stepped || config.rate || config.workload || config.trace_out ||
+	     config.comp_cpu >= 0 || config.producers || config.num_qps > 1 ||
+	     config.threads > 1 || config.perf_counters || config.srq_refill ||
+	     config.opcode == IBV_WR_LOCAL_INV || config.opcode == IBV_WR_SEND_WITH_INV ||
+	     config.opcode == IBV_WR_BIND_MW)) {
+		VL_MISC_ERR(("Duration runs a single QP sender, without steps, a schedule,"
+			     " perf counters or memory windows\n"));
+		return FAIL;
+	}
+
+	/* Warm-up and repeats are steps of the plain single QP sender */
+	if (config.warmup || config.repeat > 1) {
+		if (config.stepped || config.duration || config.rate || config.workload ||
+		    config.trace_out || config.comp_cpu >= 0 || config.producers ||
+		    config.num_qps > 1 || config.threads > 1 ||
+		    config.opcode == IBV_WR_LOCAL_INV || config.opcode == IBV_WR_SEND_WITH_INV ||
+		    config.opcode == IBV_WR_BIND_MW) {
+			VL_MISC_ERR(("Warm-up and repeats run a single QP sender, without other steps,"
+				     " a schedule or memory windows\n"));
+			return FAIL;
+		}
+
+		if (config.warmup && config.warmup < config.ring_depth) {
+			VL_MISC_ERR(("Warm-up requires messages >= ring size\n"));
+			return FAIL;
+		}
+
+		config.stepped = 1;
+	}
+
+	/* Each step re-posts a full RX ring, so a step must drain it */
+	if (config.stepped && config.num_of_iter < config.ring_depth) {
+		VL_MISC_ERR(("Stepped traffic requires iterations >= ring size\n"));
+		return FAIL;
+	}
+
+	/* For performance benchmark need to optimize operations */
+	if (config.opcode != IBV_WR_SEND)
+		VL_MISC_ERR(("WARN: opcode isn't optimized by test!\n"));
+
+	return 0;
+}
+
+/* Loopback sides share a socketpair instead of the TCP socket */
+static int loop_xfer(int fd, void *buf, size_t size, int is_send)
+{
+	char *p = buf;
+
+	while (size) {
+		ssize_t n = is_send ? write(fd, p, size) : read(fd, p, size);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return FAIL;
+
+		p += n;
+		size -= n;
+	}
+
+	return SUCCESS;
+}
+
+static int sock_send(struct resources_t *resource, size_t size, void *buf)
+{
+	if (resource->loop_fd >= 0)
+		return loop_xfer(resource->loop_fd, buf, size, 1);
+
+	return VL_sock_send(&resource->sock, size, buf);
+}
+
+static int sock_recv(struct resources_t *resource, size_t size, void *buf)
+{
+	if (resource->loop_fd >= 0)
+		return loop_xfer(resource->loop_fd, buf, size, 0);
+
+	return VL_sock_recv(&resource->sock, size, buf);
+}
+
+static int sock_sync_ready(struct resources_t *resource)
+{
+	uint32_t token = 0;
+
+	if (resource->loop_fd >= 0)
+		return sock_send(resource, sizeof(token), &token) ||
+		       sock_recv(resource, sizeof(token), &token);
+
+	return VL_sock_sync_ready(&resource->sock);
+}
+
+/* Whether the peer sent something, without blocking */
+static int sock_readable(struct resources_t *resource)
+{
+	struct pollfd pfd = {
+		.fd = resource->loop_fd >= 0 ? resource->loop_fd : resource->sock.sock_fd,
+		.events = POLLIN,
+	};
+
+	return poll(&pfd, 1, 0) > 0;
+}
+
+int send_info(struct resources_t *resource, const void *buf, size_t size)
+{
+	void *tmp_buf;
+	int rc = SUCCESS;
+	int i;
+
+	VL_SOCK_TRACE1(("Going to send info."));
+
+	if (size % 4) {
+		VL_MISC_ERR(("sync_info must get buffer size of multiples of 4B"));
+		return FAIL;
+	}
+
+	tmp_buf = calloc(1, size);
+	if (!tmp_buf) {
+		VL_MEM_ERR((" Fail in alloc tmp_buf"));
+		return FAIL;
+	}
+
+	for (i = 0; i < (int) (size / sizeof(uint32_t)); i++)
+		((uint32_t*) tmp_buf)[i] = htonl((uint32_t) (((uint32_t*) buf)[i]));
+
+	if (sock_send(resource, size, tmp_buf)) {
+		VL_SOCK_ERR(("Fail to send info"));
+		rc =  FAIL;
+		goto cleanup;
+	}
+
+	VL_SOCK_TRACE1((" Info was sent"));
+
+cleanup:
+	free(tmp_buf);
+
+	return rc;
+}
+
+int recv_info(struct resources_t *resource, void *buf, size_t size)
+{
+	int i;
+
+	VL_SOCK_TRACE1(("Going to recv info."));
+
+	if (size % 4) {
+		VL_MISC_ERR(("sync_info must get buffer size of multiples of 4"));
+		return FAIL;
+	}
+
+	if (sock_recv(resource, size, buf)) {
+		VL_SOCK_ERR(("Fail to receive info"));
+		return FAIL;
+	}
+
+	for (i = 0; i < (int) (size / sizeof(uint32_t)); i++)
+		((uint32_t*) buf)[i] = ntohl((uint32_t) (((uint32_t*) buf)[i]));
+
+	VL_SOCK_TRACE1((" Info was received"));
+
+	return SUCCESS;
+}
+
+//TODO: This need to be optimized for singlr SGE test (save ~15[ns])
+static inline void set_sge(struct resources_t *resource, struct ibv_sge *arr)
+{
+	size_t chunk = config.msg_sz / config.num_sge;
+	void *addr = resource->mr->addr;
+	int i;
+
+	for (i = 0; i < config.num_sge; i++) {
+		arr[i].addr = (uintptr_t)addr;
+		arr[i].length = chunk;
+		arr[i].lkey = resource->mr->ibv_mr->lkey;
+
+		addr += chunk;
+	}
+}
+
+static inline void set_data_buf(struct resources_t *resource, struct ibv_data_buf *arr)
+{
+	size_t chunk = config.msg_sz / config.num_sge;
+	void *addr = resource->mr->addr;
+	int i;
+
+	for (i = 0; i < config.num_sge; i++) {
+		arr[i].addr = addr;
+		arr[i].length = chunk;
+
+		addr += chunk;
+	}
+}
+
+static inline void set_send_wr(struct resources_t *resource,
+			       struct ibv_send_wr *wr, uint16_t size)
+{
+	int i;
+
+	for (i = 0; i < size; i++) {
+		int offset = i  * config.num_sge;
+
+		wr[i].wr_id = WR_ID;
+		wr[i].send_flags =
+			IBV_SEND_SIGNALED |
+			(config.use_inl ? IBV_SEND_INLINE : 0); //TODO: move it to pre-processing
+		wr[i].opcode = IBV_WR_SEND;
+		wr[i].next = &wr[i + 1];
+		wr[i].sg_list = &resource->sge_arr[offset];
+		wr[i].num_sge = config.num_sge;
+
+		set_sge(resource, &resource->sge_arr[offset]); //TODO: optimize when IBV_SEND_INLINE
+	}
+
+	wr[size - 1].next = NULL;
+}
+
+static inline void set_recv_wr(struct resources_t *resource,
+			       struct ibv_recv_wr *wr, uint16_t size)
+{
+	int i;
+
+	for (i = 0; i < size; i++) {
+		int offset = i * config.num_sge;
+
+		wr[i].wr_id = WR_ID;
 		wr[i].next = &wr[i + 1];
 		wr[i].sg_list = &resource->sge_arr[offset];
 		wr[i].num_sge = config.num_sge;
@@ -270,17 +840,64 @@ static inline void fast_set_recv_wr(struct ibv_recv_wr *wr, uint16_t size)
 		wr[i].next = &wr[i + 1];
 }
 
+/* The target SRQ, round-robin over the SRQs of the server XRC workers */
+static inline uint32_t xrc_srqn(struct resources_t *resource)
+{
+	uint32_t srqn;
+
+	if (!resource->num_xrc_srqn)
+		return resource->r_dctn;
+
+	srqn = resource->xrc_srqn[resource->xrc_seq];
+	if (++resource->xrc_seq == resource->num_xrc_srqn)
+		resource->xrc_seq = 0;
+
+	return srqn;
+}
+
+/* The UD fan-out sends to its destinations in turn, by the AH of the step mode */
+static inline void ud_set_addr(struct resources_t *resource)
+{
+	struct ud_fanout_t *ud = resource->ud;
+	struct ibv_ah *ah = resource->ah;
+	uint32_t qpn;
+
+	if (!ud) {
+		ibv_wr_set_ud_addr(resource->eqp, resource->ah, resource->r_dctn, QKEY);
+		return;
+	}
+
+	qpn = ud->qpn[ud->seq];
+	if (++ud->seq == config.ud_dests)
+		ud->seq = 0;
+
+	if (ud->mode == UD_AH_CACHE) {
+		ah = ah_cache_get(&ud->cache, qpn, &ud->attr);
+		if (!ah) {
+			ud->error = 1;
+			ah = resource->ah;
+		}
+	}
+
+	ibv_wr_set_ud_addr(resource->eqp, ah, qpn, QKEY);
+}
+
+static inline struct resources_t *qp_ctx(struct resources_t *resource, int i)
+{
+	return resource->qpc ? resource->qpc[i] : resource;
+}
+
 static int prepare_receiver(struct resources_t *resource)
 {
 	int i;
 
 	set_recv_wr(resource, resource->recv_wr_arr, 1);
 
-	for (i = 0; i < (int) config.ring_depth; i++) {
+	for (i = 0; i < (int) resource->rx_depth; i++) {
 		struct ibv_recv_wr *bad_wr = NULL;
 		int rc;
 
-		if (config.qp_type != IBV_QPT_DRIVER && config.qp_type != IBV_QPT_XRC_RECV)
+		if (!resource->srq)
 			rc = ibv_post_recv(resource->qp, resource->recv_wr_arr, &bad_wr);
 		else
 			rc = ibv_post_srq_recv(resource->srq, resource->recv_wr_arr, &bad_wr);
@@ -311,13 +928,22 @@ static inline int old_post_send(struct resources_t *resource, uint16_t batch_siz
 	return rc;
 }
 
+/* Next atomic target of the QP, raddr itself unless the atomic benchmark spreads them */
+static inline uint64_t atomic_raddr(struct resources_t *resource)
+{
+	uint32_t slot = (resource->at_base + resource->at_seq++ * resource->at_step) &
+			resource->at_mask;
+
+	return resource->raddr + slot * config.atomic_stride;
+}
+
 static inline int _new_post_send(struct resources_t *resource, uint16_t batch_size,
 				cycles_t *t1, cycles_t *t2, int inl, int list,
-				enum ibv_qp_type qpt, enum ibv_wr_opcode op)
+				enum ibv_qp_type qpt, enum ibv_wr_opcode op, int wl)
 				ALWAYS_INLINE;
 static inline int _new_post_send(struct resources_t *resource, uint16_t batch_size,
 				cycles_t *t1, cycles_t *t2, int inl, int list,
-				enum ibv_qp_type qpt, enum ibv_wr_opcode op)
+				enum ibv_qp_type qpt, enum ibv_wr_opcode op, int wl)
 {
 	struct ibv_mw_bind_info bind_info = {
 		.mr = resource->mr->ibv_mr,
@@ -327,6 +953,7 @@ static inline int _new_post_send(struct resources_t *resource, uint16_t batch_si
 			IBV_ACCESS_REMOTE_READ |
 			IBV_ACCESS_REMOTE_WRITE
 	};
+	uint32_t msg_sz = config.msg_sz;
 	uint32_t new_rkey;
 	int rc;
 	int i;
@@ -337,6 +964,15 @@ static inline int _new_post_send(struct resources_t *resource, uint16_t batch_si
 		resource->eqp->wr_id = WR_ID;
 		resource->eqp->wr_flags = IBV_SEND_SIGNALED;
 
+		/* Mixed workload takes opcode and size from the precomputed schedule */
+		if (wl) {
+			const struct wl_entry_t *e =
+				&resource->wl_sched[(resource->wl_seq + i) & resource->wl_mask];
+
+			op = e->opcode;
+			msg_sz = e->size;
+		}
+
 		switch (op) {
 		case IBV_WR_SEND:
 			ibv_wr_send(resource->eqp);
@@ -354,20 +990,25 @@ static inline int _new_post_send(struct resources_t *resource, uint16_t batch_si
 			ibv_wr_rdma_read(resource->eqp, resource->rkey, resource->raddr);
 			break;
 		case IBV_WR_ATOMIC_FETCH_AND_ADD:
-			if (config.ext_atomic)
+			if (config.ext_atomic) {
+				msg_sz = resource->atomic_arg_sz;
 				mlx5dv_wr_atomic_fetch_add(resource->dv_qp, resource->rkey,
-							   resource->raddr, (uint16_t)config.msg_sz,
+							   atomic_raddr(resource), msg_sz,
 							   resource->atomic_args, resource->atomic_args + config.msg_sz);
-			else
-				ibv_wr_atomic_fetch_add(resource->eqp, resource->rkey, resource->raddr, 0xFAFAFAFA);
+			} else {
+				ibv_wr_atomic_fetch_add(resource->eqp, resource->rkey, atomic_raddr(resource), 0xFAFAFAFA);
+			}
 			break;
 		case IBV_WR_ATOMIC_CMP_AND_SWP:
-			if (config.ext_atomic)
+			if (config.ext_atomic) {
+				msg_sz = resource->atomic_arg_sz;
 				mlx5dv_wr_atomic_comp_swap(resource->dv_qp, resource->rkey,
-							   resource->raddr, (uint16_t)config.msg_sz,
+							   atomic_raddr(resource), msg_sz,
 							   (struct mlx5dv_comp_swap *) resource->atomic_args);
-			else
-				ibv_wr_atomic_cmp_swp(resource->eqp, resource->rkey, resource->raddr, 0xEEEEEEEE, 0xCCCCCCCC);
+			} else {
+				ibv_wr_atomic_cmp_swp(resource->eqp, resource->rkey, atomic_raddr(resource),
+						      0xEEEEEEEE, 0xCCCCCCCC);
+			}
 			break;
 		case IBV_WR_BIND_MW:
 		case IBV_WR_LOCAL_INV:
@@ -405,19 +1046,19 @@ static inline int _new_post_send(struct resources_t *resource, uint16_t batch_si
 		if (qpt == IBV_QPT_DRIVER)
 			mlx5dv_wr_set_dc_addr(resource->dv_qp, resource->ah, resource->r_dctn ,DC_KEY);
 		else if (qpt == IBV_QPT_UD)
-			ibv_wr_set_ud_addr(resource->eqp, resource->ah, resource->r_dctn, QKEY);
+			ud_set_addr(resource);
 		else if (qpt == IBV_QPT_XRC_SEND)
-			ibv_wr_set_xrc_srqn(resource->eqp, resource->r_dctn);
+			ibv_wr_set_xrc_srqn(resource->eqp, xrc_srqn(resource));
 
 		if (!inl && !list) {
 			ibv_wr_set_sge(resource->eqp,
 				       resource->mr->ibv_mr->lkey,
 				       (uintptr_t) resource->mr->addr,
-				       (uint32_t) config.msg_sz);
+				       msg_sz);
 		} else if (inl && !list) {
 			ibv_wr_set_inline_data(resource->eqp,
 					       resource->mr->addr,
-					       config.msg_sz);
+					       msg_sz);
 		} else if (!inl && list){
 			int offset = i * config.num_sge;
 
@@ -445,26 +1086,26 @@ static inline int _new_post_send(struct resources_t *resource, uint16_t batch_si
 static int new_post_send_sge_rc(struct resources_t *resource, uint16_t batch_size,
 				cycles_t *t1, cycles_t *t2)
 {
-	return _new_post_send(resource, batch_size, t1, t2, 0, 0, IBV_QPT_RC, IBV_WR_SEND);
+	return _new_post_send(resource, batch_size, t1, t2, 0, 0, IBV_QPT_RC, IBV_WR_SEND, 0);
 }
 
 static int new_post_send_sge_list_rc(struct resources_t *resource, uint16_t batch_size,
 				     cycles_t *t1, cycles_t *t2)
 {
-	return _new_post_send(resource, batch_size, t1, t2, 0, 1, IBV_QPT_RC, IBV_WR_SEND);
+	return _new_post_send(resource, batch_size, t1, t2, 0, 1, IBV_QPT_RC, IBV_WR_SEND, 0);
 }
 
 static int new_post_send_inl_rc(struct resources_t *resource, uint16_t batch_size,
 				cycles_t *t1, cycles_t *t2)
 {
-	return _new_post_send(resource, batch_size, t1, t2, 1, 0, IBV_QPT_RC, IBV_WR_SEND);
+	return _new_post_send(resource, batch_size, t1, t2, 1, 0, IBV_QPT_RC, IBV_WR_SEND, 0);
 }
 
 static int new_post_send_inl_list_rc(struct resources_t *resource,
 					     uint16_t batch_size,
 					     cycles_t *t1, cycles_t *t2)
 {
-	return _new_post_send(resource, batch_size, t1, t2, 1, 1, IBV_QPT_RC, IBV_WR_SEND);
+	return _new_post_send(resource, batch_size, t1, t2, 1, 1, IBV_QPT_RC, IBV_WR_SEND, 0);
 }
 
 /* Post DC SEND WR optimized functions */
@@ -472,39 +1113,43 @@ static int new_post_send_inl_list_rc(struct resources_t *resource,
 static int new_post_send_sge_dc(struct resources_t *resource, uint16_t batch_size,
 				cycles_t *t1, cycles_t *t2)
 {
-	return _new_post_send(resource, batch_size, t1, t2, 0, 0, IBV_QPT_DRIVER, IBV_WR_SEND);
+	return _new_post_send(resource, batch_size, t1, t2, 0, 0, IBV_QPT_DRIVER, IBV_WR_SEND, 0);
 }
 
 static int new_post_send_sge_list_dc(struct resources_t *resource, uint16_t batch_size,
 				     cycles_t *t1, cycles_t *t2)
 {
-	return _new_post_send(resource, batch_size, t1, t2, 0, 1, IBV_QPT_DRIVER, IBV_WR_SEND);
+	return _new_post_send(resource, batch_size, t1, t2, 0, 1, IBV_QPT_DRIVER, IBV_WR_SEND, 0);
 }
 
 static int new_post_send_inl_dc(struct resources_t *resource, uint16_t batch_size,
 				cycles_t *t1, cycles_t *t2)
 {
-	return _new_post_send(resource, batch_size, t1, t2, 1, 0, IBV_QPT_DRIVER, IBV_WR_SEND);
+	return _new_post_send(resource, batch_size, t1, t2, 1, 0, IBV_QPT_DRIVER, IBV_WR_SEND, 0);
 }
 
 static int new_post_send_inl_list_dc(struct resources_t *resource,
 					     uint16_t batch_size,
 					     cycles_t *t1, cycles_t *t2)
 {
-	return _new_post_send(resource, batch_size, t1, t2, 1, 1, IBV_QPT_DRIVER, IBV_WR_SEND);
+	return _new_post_send(resource, batch_size, t1, t2, 1, 1, IBV_QPT_DRIVER, IBV_WR_SEND, 0);
 }
 
 
 static int post_send_method_new(struct resources_t *resource, uint16_t batch,
 				cycles_t *t1, cycles_t *t2)
 {
+	if (config.workload)
+		return _new_post_send(resource, batch, t1, t2, 0, 0,
+				      config.qp_type, IBV_WR_SEND, 1);
+
 	switch (config.qp_type) {
 	case IBV_QPT_RC:
 		if (0);
 		else if (config.opcode != IBV_WR_SEND)
 			return _new_post_send(resource, batch, t1, t2, config.use_inl,
 					      config.num_sge == 1 ? 0 : 1,
-					      config.qp_type, config.opcode);
+					      config.qp_type, config.opcode, 0);
 		else if (config.use_inl && config.num_sge == 1)
 			return new_post_send_inl_rc(resource, batch, t1, t2);
 		else if (config.use_inl && config.num_sge > 1)
@@ -522,7 +1167,7 @@ static int post_send_method_new(struct resources_t *resource, uint16_t batch,
 		else if (config.opcode != IBV_WR_SEND)
 			return _new_post_send(resource, batch, t1, t2, config.use_inl,
 					      config.num_sge == 1 ? 0 : 1,
-					      config.qp_type, config.opcode);
+					      config.qp_type, config.opcode, 0);
 		else if (config.use_inl && config.num_sge == 1)
 			return new_post_send_inl_dc(resource, batch, t1, t2);
 		else if (config.use_inl && config.num_sge > 1)
@@ -540,7 +1185,7 @@ static int post_send_method_new(struct resources_t *resource, uint16_t batch,
 	case IBV_QPT_XRC_SEND:
 			return _new_post_send(resource, batch, t1, t2, config.use_inl,
 					      config.num_sge == 1 ? 0 : 1,
-					      config.qp_type, config.opcode);
+					      config.qp_type, config.opcode, 0);
 	default:
 			VL_MISC_ERR(("Unsupported transport"));
 			return FAIL;
@@ -586,61 +1231,219 @@ static int post_send_method(struct resources_t *resource, enum send_method metho
 	}
 }
 
-static int do_sender(struct resources_t *resource)
+static inline void update_measure(struct resources_t *resource, cycles_t delta,
+				  uint16_t batch)
 {
-	uint32_t tot_ccnt = 0;
-	uint32_t tot_scnt = 0;
-	int result = SUCCESS;
+	if (batch == config.batch_size) {
+		if (resource->measure.min > delta)
+			resource->measure.min = delta;
 
-	while (tot_ccnt < config.num_of_iter) {
-		uint16_t outstanding = tot_scnt - tot_ccnt;
-		static bool got_bind_wc = 0;
-		int rc = 0;
+		if (resource->measure.max < delta)
+			resource->measure.max = delta;
 
-		if ((tot_scnt < config.num_of_iter) && (outstanding < config.ring_depth)) {
-			uint32_t left = config.num_of_iter - tot_scnt;
-			uint16_t batch;
-			cycles_t delta, t1, t2 = 0;
+		resource->measure.batch_samples++;
+	}
 
-			batch = (config.ring_depth - outstanding) >= config.batch_size ?
-				(left >= config.batch_size ? config.batch_size : 1) : 1 ;
+	resource->measure.tot += delta;
+}
 
-			rc = post_send_method(resource, config.send_method, batch, &t1, &t2);
-			if (rc) {
-				VL_MISC_ERR(("in post send (error: %s)", strerror(rc)));
-				result = FAIL;
-				goto out;
-			}
+static inline void wl_account_post(struct resources_t *resource, uint16_t batch,
+				   cycles_t t1, cycles_t t2)
+{
+	cycles_t share = (t2 - t1) / batch;
+	int i;
 
-			delta = t2 - t1;
+	for (i = 0; i < batch; i++) {
+		uint64_t seq = resource->wl_seq + i;
+		const struct wl_entry_t *e = &resource->wl_sched[seq & resource->wl_mask];
+		struct wl_op_stats_t *st = &resource->wl_stats[e->opcode];
 
-			if (batch == config.batch_size) {
-				if (resource->measure.min > delta)
-					resource->measure.min = delta;
+		st->posted++;
+		st->bytes += e->size;
+		st->post_cycles += share;
+		resource->wl_post_ts[seq % config.ring_depth] = t2;
+	}
 
-				if (resource->measure.max < delta)
-					resource->measure.max = delta;
+	resource->wl_seq += batch;
+}
 
-				resource->measure.batch_samples++;
-			}
+/* Single QP, so the completions arrive in schedule order starting at first */
+static inline void wl_account_completions(struct resources_t *resource, uint64_t first,
+					  int num, cycles_t now)
+{
+	int i;
 
-			resource->measure.tot += delta;
+	for (i = 0; i < num; i++) {
+		uint64_t seq = first + i;
+		const struct wl_entry_t *e = &resource->wl_sched[seq & resource->wl_mask];
+		struct wl_op_stats_t *st = &resource->wl_stats[e->opcode];
 
-			tot_scnt += batch;
-		}
+		st->completed++;
+		st->lat_cycles += now - resource->wl_post_ts[seq % config.ring_depth];
+	}
+}
 
-		rc = ibv_poll_cq(resource->cq, config.batch_size, resource->wc_arr);
+/* Keep what was posted, the timestamp stays in cycles until the flush */
+static inline void capture_post(struct resources_t *resource, uint64_t first,
+				uint16_t batch, cycles_t t1)
+{
+	int i;
 
-		if (rc > 0) {
-			int i;
+	for (i = 0; i < batch; i++) {
+		struct wl_entry_t *rec = &resource->capture_buf[first + i];
 
-			for (i = 0; i < rc; i++) {
-				if (resource->wc_arr[i].status != IBV_WC_SUCCESS) {
-					VL_MISC_ERR(("got WC with error (%d)", resource->wc_arr[i].status));
-					result = FAIL;
-					goto out;
-				}
-			}
+		if (config.workload) {
+			*rec = resource->wl_sched[(first + i) & resource->wl_mask];
+		} else {
+			rec->opcode = config.opcode;
+			rec->size = config.msg_sz;
+		}
+
+		rec->ts = t1 - resource->capture_start;
+		rec->phase = resource->capture_phase;
+	}
+}
+
+static int capture_flush(struct resources_t *resource, uint64_t num)
+{
+	uint64_t i;
+
+	for (i = 0; i < num; i++)
+		resource->capture_buf[i].ts =
+			(uint64_t)(resource->capture_buf[i].ts * 1000 / resource->cpu_mhz);
+
+	resource->capture_phase++;
+
+	return trace_writer_append(&resource->capture, resource->capture_buf, num);
+}
+
+/* Before the doorbell, a completion thread may reap the CQE right after it */
+static inline void comp_stamp_post(struct resources_t *resource, uint64_t first,
+				   uint16_t batch, cycles_t now)
+{
+	int i;
+
+	for (i = 0; i < batch; i++)
+		resource->post_ts[(first + i) % config.ring_depth] = now;
+}
+
+static inline void comp_account_post(struct resources_t *resource, uint16_t batch,
+				     cycles_t t1, cycles_t t2)
+{
+	struct comp_step_t *st = &resource->comp_steps[resource->comp_mode];
+
+	if (!st->msgs)
+		st->first_post = t1;
+	st->last_post = t2;
+	st->post_cycles += t2 - t1;
+	st->msgs += batch;
+}
+
+static inline void comp_account_completions(struct resources_t *resource, uint64_t first,
+					    int num, cycles_t now)
+{
+	int i;
+
+	for (i = 0; i < num; i++)
+		resource->lat[first + i] = now - resource->post_ts[(first + i) % config.ring_depth];
+
+	resource->comp_steps[resource->comp_mode].last_comp = now;
+}
+
+/* Messages of the current step, the warm-up has its own count */
+static inline uint64_t step_iterations(const struct resources_t *resource)
+{
+	return resource->warmup_step ? config.warmup : config.num_of_iter;
+}
+
+static int do_sender(struct resources_t *resource)
+{
+	uint64_t iters = step_iterations(resource);
+	uint64_t tot_ccnt = 0;
+	uint64_t tot_scnt = 0;
+	struct perf_sample_t pc_start, pc_end;
+	enum send_method method = config.send_method;
+	int result = SUCCESS;
+
+	while (tot_ccnt < iters) {
+		uint64_t outstanding = tot_scnt - tot_ccnt;
+		static bool got_bind_wc = 0;
+		int rc = 0;
+
+		if ((tot_scnt < iters) && (outstanding < resource->window)) {
+			uint64_t left = iters - tot_scnt;
+			uint16_t batch;
+			cycles_t delta, t1, t2 = 0;
+
+			batch = (resource->window - outstanding) >= config.batch_size ?
+				(left >= config.batch_size ? config.batch_size : 1) : 1 ;
+
+			/* MIX alternates, so account the method which is about to post */
+			method = config.send_method != METHOD_MIX ? config.send_method :
+				 (resource->method_state ? METHOD_OLD : METHOD_NEW);
+
+			if (config.perf_counters)
+				perf_counters_read(resource->perf, &pc_start);
+
+			rc = post_send_method(resource, config.send_method, batch, &t1, &t2);
+
+			if (config.perf_counters) {
+				perf_counters_read(resource->perf, &pc_end);
+				perf_measure_add(&resource->perf_post[method], &pc_start, &pc_end, batch);
+			}
+
+			if (rc) {
+				VL_MISC_ERR(("in post send (error: %s)", strerror(rc)));
+				result = FAIL;
+				goto out;
+			}
+
+			delta = t2 - t1;
+			update_measure(resource, delta, batch);
+			resource->method_measure[method].msgs += batch;
+			resource->method_measure[method].tot += delta;
+
+			if (resource->post_ts) {
+				comp_stamp_post(resource, tot_scnt, batch, t1);
+				comp_account_post(resource, batch, t1, t2);
+			}
+
+			if (config.trace_out)
+				capture_post(resource, tot_scnt, batch, t1);
+
+			if (config.workload)
+				wl_account_post(resource, batch, t1, t2);
+
+			tot_scnt += batch;
+		}
+
+		if (config.perf_counters)
+			perf_counters_read(resource->perf, &pc_start);
+
+		rc = ibv_poll_cq(resource->cq, config.batch_size, resource->wc_arr);
+
+		if (rc > 0) {
+			int i;
+
+			for (i = 0; i < rc; i++) {
+				if (resource->wc_arr[i].status != IBV_WC_SUCCESS) {
+					VL_MISC_ERR(("got WC with error (%d)", resource->wc_arr[i].status));
+					result = FAIL;
+					goto out;
+				}
+			}
+
+			/* Empty polls are not accounted, they would just dilute the per-CQE cost */
+			if (config.perf_counters) {
+				perf_counters_read(resource->perf, &pc_end);
+				perf_measure_add(&resource->perf_poll, &pc_start, &pc_end, rc);
+			}
+
+			if (config.workload)
+				wl_account_completions(resource, tot_ccnt, rc, get_cycles());
+
+			if (resource->post_ts)
+				comp_account_completions(resource, tot_ccnt, rc, get_cycles());
 
 			tot_ccnt += rc;
 
@@ -658,226 +1461,2089 @@ static int do_sender(struct resources_t *resource)
 	}
 
 out:
-	VL_DATA_TRACE(("Sender exit with tot_scnt=%u tot_ccnt=%u", tot_scnt, tot_ccnt));
+	VL_DATA_TRACE(("Sender exit with tot_scnt=%lu tot_ccnt=%lu", tot_scnt, tot_ccnt));
 
 	return result;
 }
 
-static int do_receiver(struct resources_t *resource)
+static inline void soak_account_post(struct soak_t *soak, uint16_t batch, cycles_t delta)
 {
-	uint32_t tot_ccnt = 0;
-	uint32_t tot_rcnt = config.ring_depth; //Due to pre-preparation of the RX
-	int result = SUCCESS;
+	cycles_t per_wr = delta / batch;
 
-	while (tot_ccnt < config.num_of_iter) {
-		uint16_t outstanding;
-		int rc = 0;
+	soak->samples[soak->ivl_posts++ & (SOAK_MAX_SAMPLES - 1)] = per_wr;
+	if (soak->ivl_max < per_wr)
+		soak->ivl_max = per_wr;
+	soak->ivl_posted += batch;
+}
 
-		rc = ibv_poll_cq(resource->cq, config.batch_size, resource->wc_arr);
+/* Sorting the samples stalls the post loop, the ring drains meanwhile */
+static void soak_report(struct resources_t *resource, cycles_t now)
+{
+	struct soak_t *soak = resource->soak;
+	uint64_t num = soak->ivl_posts < SOAK_MAX_SAMPLES ? soak->ivl_posts : SOAK_MAX_SAMPLES;
+	double cycles_per_sec = resource->cpu_mhz * 1000000;
+	double freq = resource->cpu_mhz / 1000; //Ghz
+
+	stats_sort_cycles(soak->samples, num);
+
+	VL_MISC_TRACE((" %9.3lf %12.0lf %14lu %14lu %9.1lf %9.1lf %9.1lf",
+		       (now - soak->start) / cycles_per_sec,
+		       soak->ivl_completed / ((now - soak->ivl_start) / cycles_per_sec),
+		       soak->ivl_posted, soak->ivl_completed,
+		       stats_percentile_cycles(soak->samples, num, 50) / freq,
+		       stats_percentile_cycles(soak->samples, num, 99) / freq,
+		       soak->ivl_max / freq));
+
+	if (soak->post_max < soak->ivl_max)
+		soak->post_max = soak->ivl_max;
+
+	soak->ivl_start = now;
+	soak->ivl_posted = 0;
+	soak->ivl_completed = 0;
+	soak->ivl_posts = 0;
+	soak->ivl_max = 0;
+}
+
+/*
+ * Duration run: post until --duration elapses, then drain the ring. The
+ * receiver can't count on num_of_iter, it is sent the completed messages.
+ */
+static int do_sender_duration(struct resources_t *resource)
+{
+	struct soak_t *soak = resource->soak;
+	cycles_t ivl = (cycles_t)(resource->cpu_mhz * 1000 * config.interval_ms);
+	enum send_method method;
+	uint64_t tot_ccnt = 0;
+	uint64_t tot_scnt = 0;
+	cycles_t now, next;
+	int stop = 0;
+
+	VL_MISC_TRACE((" %9s %12s %14s %14s %9s %9s %9s", "time[s]", "msg/s", "posted",
+		       "completed", "p50[ns]", "p99[ns]", "max[ns]"));
+
+	soak->start = get_cycles();
+	soak->end = soak->start + (cycles_t)(resource->cpu_mhz * 1000000) * config.duration;
+	soak->ivl_start = soak->start;
+	next = soak->start + ivl;
+
+	while (!stop || tot_ccnt < tot_scnt) {
+		uint64_t outstanding = tot_scnt - tot_ccnt;
+		int rc;
+
+		if (!stop && outstanding < resource->window) {
+			uint16_t batch;
+			cycles_t delta, t1, t2 = 0;
+
+			batch = (resource->window - outstanding) >= config.batch_size ?
+				config.batch_size : 1;
+
+			method = config.send_method != METHOD_MIX ? config.send_method :
+				 (resource->method_state ? METHOD_OLD : METHOD_NEW);
+
+			rc = post_send_method(resource, config.send_method, batch, &t1, &t2);
+			if (rc) {
+				VL_MISC_ERR(("in post send (error: %s)", strerror(rc)));
+				return FAIL;
+			}
+
+			delta = t2 - t1;
+			update_measure(resource, delta, batch);
+			resource->method_measure[method].msgs += batch;
+			resource->method_measure[method].tot += delta;
+			soak_account_post(soak, batch, delta);
+
+			tot_scnt += batch;
+		}
 
+		rc = ibv_poll_cq(resource->cq, config.batch_size, resource->wc_arr);
 		if (rc > 0) {
 			int i;
 
-			for (i = 0; i < rc; i++)
+			for (i = 0; i < rc; i++) {
 				if (resource->wc_arr[i].status != IBV_WC_SUCCESS) {
 					VL_MISC_ERR(("got WC with error (%d)", resource->wc_arr[i].status));
-					result = FAIL;
-					goto out;
+					return FAIL;
 				}
+			}
 
 			tot_ccnt += rc;
+			soak->ivl_completed += rc;
 		} else if (rc < 0) {
 			VL_MISC_ERR(("in ibv_poll_cq (%s)", strerror(rc)));
-			result = FAIL;
-			goto out;
+			return FAIL;
 		}
 
-		outstanding = tot_rcnt - tot_ccnt;
-
-		if ((tot_rcnt < config.num_of_iter) && (outstanding < config.ring_depth)) {
-			struct ibv_recv_wr *bad_wr = NULL;
-			uint32_t left = config.num_of_iter - tot_rcnt;
-			uint16_t batch;
-
-			batch = (config.ring_depth - outstanding) >= config.batch_size ?
-				(left >= config.batch_size ? config.batch_size : 1) : 1 ;
+		now = get_cycles();
+		if (now >= next) {
+			soak_report(resource, now);
+			next = now + ivl;
+		}
 
-			fast_set_recv_wr(resource->recv_wr_arr, batch);
+		if (now >= soak->end)
+			stop = 1;
+	}
 
-			if (config.qp_type != IBV_QPT_DRIVER && config.qp_type != IBV_QPT_XRC_RECV)
-				rc = ibv_post_recv(resource->qp, resource->recv_wr_arr, &bad_wr);
-			else
-				rc = ibv_post_srq_recv(resource->srq, resource->recv_wr_arr, &bad_wr);
-			if (rc) {
-				VL_MISC_ERR(("in ibv_post_receive", strerror(rc)));
-				result = FAIL;
-				goto out;
-			}
+	/* The drain after the clock ran out */
+	if (soak->ivl_completed)
+		soak_report(resource, get_cycles());
 
-			tot_rcnt += batch;
-		}
-	}
+	soak->posted = tot_scnt;
+	soak->completed = tot_ccnt;
 
-out:
-	VL_DATA_TRACE(("Receiver exit with tot_rcnt=%u tot_ccnt=%u", tot_rcnt, tot_ccnt));
+	VL_DATA_TRACE(("Duration sender exit with tot_scnt=%lu tot_ccnt=%lu", tot_scnt, tot_ccnt));
 
-	return result;
+	return SUCCESS;
 }
 
-int sync_configurations(struct resources_t *resource)
+static int pin_thread(pthread_t thread, int cpu)
 {
-	struct sync_conf_info_t remote_info = {0};
-	struct sync_conf_info_t local_info = {0};
+	cpu_set_t set;
 	int rc;
 
-	local_info.iter = config.num_of_iter;
-	local_info.opcode = config.opcode;
-	local_info.qp_type = config.qp_type == IBV_QPT_XRC_RECV ?
-			     IBV_QPT_XRC_SEND : /* Hack the XRC QPTs sync*/
-			     config.qp_type;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
 
-	if (!config.is_daemon) {
-		rc = send_info(resource, &local_info, sizeof(local_info));
-		if (rc)
-			return FAIL;
+	rc = pthread_setaffinity_np(thread, sizeof(set), &set);
+	if (rc)
+		VL_MISC_ERR(("Fail to pin thread to CPU %d (%s)", cpu, strerror(rc)));
 
-		rc = recv_info(resource, &remote_info, sizeof(remote_info));
-		if (rc)
-			return FAIL;
-	} else {
-		rc = recv_info(resource, &remote_info, sizeof(remote_info));
-		if (rc)
-			return FAIL;
+	return rc ? FAIL : SUCCESS;
+}
 
-		rc = send_info(resource, &local_info, sizeof(local_info));
-		if (rc)
-			return FAIL;
-	}
+#define XCORE_ROUNDS 100000
 
-	if (config.num_of_iter != remote_info.iter ||
-	    config.opcode != remote_info.opcode ||
-	    local_info.qp_type != remote_info.qp_type) {
-		VL_SOCK_ERR(("Server-client configurations are not synced"));
-		return FAIL;
+/*
+ * Bounce a cache line between the poster and the completion thread; half
+ * the round trip is what a credit update costs to become visible.
+ */
+static void xcore_pong(struct comp_ctx_t *comp)
+{
+	uint64_t i;
+
+	for (i = 1; i <= XCORE_ROUNDS; i++) {
+		while (__atomic_load_n(&comp->ping, __ATOMIC_ACQUIRE) != i)
+			;
+		__atomic_store_n(&comp->pong, i, __ATOMIC_RELEASE);
 	}
+}
 
-	VL_DATA_TRACE(("Server-client configurations are synced"));
+static cycles_t xcore_ping(struct comp_ctx_t *comp)
+{
+	cycles_t start = get_cycles();
+	uint64_t i;
 
-	return  SUCCESS;
+	for (i = 1; i <= XCORE_ROUNDS; i++) {
+		__atomic_store_n(&comp->ping, i, __ATOMIC_RELEASE);
+		while (__atomic_load_n(&comp->pong, __ATOMIC_ACQUIRE) != i)
+			;
+	}
+
+	return get_cycles() - start;
 }
 
-int sync_post_connection(struct resources_t *resource)
+static void *comp_thread_main(void *arg)
 {
-	int rc;
+	struct resources_t *resource = arg;
+	struct comp_ctx_t *comp = &resource->comp;
+	struct ibv_wc wc_arr[config.batch_size];
+	uint64_t tot_ccnt = 0;
 
-	if (!config.is_daemon) {
-		struct sync_post_connection_t remote_info = {0};
+	xcore_pong(comp);
 
-		rc = recv_info(resource, &remote_info, sizeof(remote_info));
-		if (rc)
-			return FAIL;
+	while (tot_ccnt < config.num_of_iter) {
+		int rc = ibv_poll_cq(resource->cq, config.batch_size, wc_arr);
+		int i;
 
-		if (config.qp_type == IBV_QPT_DRIVER || config.qp_type == IBV_QPT_XRC_SEND)
-			resource->r_dctn = remote_info.dctn;
+		if (rc > 0) {
+			cycles_t now = get_cycles();
 
-		if (config.opcode == IBV_WR_RDMA_WRITE ||
-		    config.opcode == IBV_WR_RDMA_WRITE_WITH_IMM ||
-		    config.opcode == IBV_WR_RDMA_READ ||
-		    config.opcode == IBV_WR_ATOMIC_FETCH_AND_ADD ||
-		    config.opcode == IBV_WR_ATOMIC_CMP_AND_SWP) {
-			resource->rkey = remote_info.rkey;
-			resource->raddr = remote_info.raddr;
-		}
-	} else {
-		struct sync_post_connection_t local_info = {0};
+			for (i = 0; i < rc; i++) {
+				if (wc_arr[i].status != IBV_WC_SUCCESS) {
+					VL_MISC_ERR(("got WC with error (%d)", wc_arr[i].status));
+					comp->error = 1;
+					return NULL;
+				}
+			}
 
-		if (config.qp_type == IBV_QPT_DRIVER)
-			local_info.dctn = resource->qp->qp_num;
-		else if (config.qp_type == IBV_QPT_XRC_RECV)
-			ibv_get_srq_num(resource->srq, &local_info.dctn);
+			comp_account_completions(resource, tot_ccnt, rc, now);
+			tot_ccnt += rc;
 
-		if (config.opcode == IBV_WR_RDMA_WRITE ||
-		    config.opcode == IBV_WR_RDMA_WRITE_WITH_IMM ||
-		    config.opcode == IBV_WR_RDMA_READ ||
-		    config.opcode == IBV_WR_ATOMIC_FETCH_AND_ADD ||
-		    config.opcode == IBV_WR_ATOMIC_CMP_AND_SWP) {
-			local_info.rkey = resource->mr->ibv_mr->rkey;
-			local_info.raddr = (uintptr_t)resource->mr->addr;
+			/* Return the credits, the post_ts slots are free again */
+			__atomic_store_n(&comp->completed, tot_ccnt, __ATOMIC_RELEASE);
+		} else if (rc < 0) {
+			VL_MISC_ERR(("in ibv_poll_cq (%s)", strerror(rc)));
+			comp->error = 1;
+			return NULL;
 		}
 
-		rc = send_info(resource, &local_info, sizeof(local_info));
-		if (rc)
-			return FAIL;
+		if (comp->error)
+			return NULL;
 	}
 
-	return  SUCCESS;
+	return NULL;
 }
 
-static int init_ah(struct resources_t *resource, uint16_t dlid)
+/* The sender loop without polling, credits come back from the completion thread */
+static int do_sender_comp_thread(struct resources_t *resource)
 {
-	struct ibv_ah_attr ah_attr;
+	struct comp_ctx_t *comp = &resource->comp;
+	struct comp_step_t *st = &resource->comp_steps[COMP_THREAD];
+	uint64_t tot_scnt = 0;
+	pthread_t thread;
+	int result = SUCCESS;
+	int rc;
 
-	memset(&ah_attr, 0, sizeof(ah_attr));
-	ah_attr.dlid = dlid;
-	ah_attr.port_num = IB_PORT;
+	comp->completed = 0;
+	comp->error = 0;
+	comp->ping = 0;
+	comp->pong = 0;
 
-	VL_HCA_TRACE1(("Going to create AH"));
+	if (pin_thread(pthread_self(), sched_getcpu()))
+		return FAIL;
 
-	resource->ah = ibv_create_ah(resource->pd, &ah_attr);
-	if (!resource->ah) {
-		VL_DATA_ERR(("Fail in ibv_create_ah"));
+	rc = pthread_create(&thread, NULL, comp_thread_main, resource);
+	if (rc) {
+		VL_MISC_ERR(("Fail to create completion thread (%s)", strerror(rc)));
 		return FAIL;
 	}
 
-	VL_DATA_TRACE1(("Finish init AH"));
+	if (pin_thread(thread, config.comp_cpu)) {
+		comp->error = 1;
+		result = FAIL;
+		goto out;
+	}
 
-	return SUCCESS;
-}
+	resource->xcore_cycles = (double)xcore_ping(comp) / XCORE_ROUNDS;
 
-//convert mac string xx:xx:xx:xx:xx:xx to byte array
-#define MAC_SEP ':'
-static char *mac_string_to_byte(const char *mac_string, uint8_t *mac_bytes)
-{
-	int counter;
-	for (counter = 0; counter < 6; ++counter) {
-		unsigned int number = 0;
-		char ch;
+	while (tot_scnt < config.num_of_iter) {
+		uint64_t credits = config.ring_depth -
+				   (tot_scnt - __atomic_load_n(&comp->completed, __ATOMIC_ACQUIRE));
+		uint64_t left = config.num_of_iter - tot_scnt;
+		uint16_t batch;
+		cycles_t t1, t2 = 0;
 
-		//Convert letter into lower case.
-		ch = tolower(*mac_string++);
+		if (comp->error) {
+			result = FAIL;
+			goto out;
+		}
 
-		if ((ch < '0' || ch > '9') && (ch < 'a' || ch > 'f')) {
-			return NULL;
+		if (!credits) {
+			st->credit_stalls++;
+			continue;
 		}
 
-		number = isdigit (ch) ? (ch - '0') : (ch - 'a' + 10);
-		ch = tolower(*mac_string);
+		batch = credits >= config.batch_size ?
+			(left >= config.batch_size ? config.batch_size : 1) : 1;
 
-		if ((counter < 5 && ch != MAC_SEP) || (counter == 5 && ch != '\0'
-				&& !isspace (ch))) {
-			++mac_string;
+		comp_stamp_post(resource, tot_scnt, batch, get_cycles());
 
-			if ((ch < '0' || ch > '9') && (ch < 'a' || ch > 'f')) {
-				return NULL;
-			}
+		rc = post_send_method(resource, config.send_method, batch, &t1, &t2);
+		if (rc) {
+			VL_MISC_ERR(("in post send (error: %s)", strerror(rc)));
+			comp->error = 1;
+			result = FAIL;
+			goto out;
+		}
 
-			number <<= 4;
-			number += isdigit (ch) ? (ch - '0') : (ch - 'a' + 10);
-			ch = *mac_string;
+		update_measure(resource, t2 - t1, batch);
+		comp_account_post(resource, batch, t1, t2);
 
-			if (counter < 5 && ch != MAC_SEP) {
-				return NULL;
-			}
-		}
-		mac_bytes[counter] = (unsigned char) number;
-		++mac_string;
+		tot_scnt += batch;
 	}
-	return (char *) mac_bytes;
+
+out:
+	pthread_join(thread, NULL);
+	if (comp->error)
+		result = FAIL;
+
+	VL_DATA_TRACE(("Completion thread sender exit with tot_scnt=%lu tot_ccnt=%lu",
+		       tot_scnt, comp->completed));
+
+	return result;
 }
 
-static int init_mcast_mac_flow(struct resources_t *resource, uint8_t *mmac)
+struct prod_shared_t {
+	struct resources_t	*resource;
+	struct mpsc_ring_t	ring;
+	pthread_mutex_t		lock;
+	uint64_t		posted;		/* MUTEX mode, under lock */
+	uint64_t		completed;	/* MUTEX mode, under lock */
+	volatile int		start;
+	volatile int		abort;
+};
+
+struct prod_thread_t {
+	struct prod_shared_t	*shared;
+	pthread_t		thread;
+	int			id;
+	uint64_t		first;		/* first message, also its lat[] slot */
+	uint64_t		count;
+	uint64_t		full_retries;
+	uint64_t		batches;
+	int			error;
+};
+
+/* Reap what the CQ holds, lat[] is indexed by completion order */
+static int prod_reap(struct resources_t *resource, struct ibv_cq *cq, struct ibv_wc *wc_arr,
+		     const cycles_t *post_ts, uint64_t lat_base, uint64_t *completed)
 {
-	struct raw_eth_flow_attr flow_attr = {
+	int rc = ibv_poll_cq(cq, config.batch_size, wc_arr);
+	cycles_t now;
+	int i;
+
+	if (rc <= 0) {
+		if (rc < 0)
+			VL_MISC_ERR(("in ibv_poll_cq (%s)", strerror(rc)));
+		return rc;
+	}
+
+	now = get_cycles();
+
+	for (i = 0; i < rc; i++) {
+		uint64_t seq = *completed + i;
+
+		if (wc_arr[i].status != IBV_WC_SUCCESS) {
+			VL_MISC_ERR(("got WC with error (%d)", wc_arr[i].status));
+			return -1;
+		}
+
+		resource->lat[lat_base + seq] = now - post_ts[seq % config.ring_depth];
+	}
+
+	*completed += rc;
+
+	return rc;
+}
+
+static void prod_wait_start(struct prod_shared_t *shared)
+{
+	while (!__atomic_load_n(&shared->start, __ATOMIC_ACQUIRE))
+		;
+}
+
+static void *prod_mpsc_main(void *arg)
+{
+	struct prod_thread_t *pt = arg;
+	struct prod_shared_t *shared = pt->shared;
+	struct mpsc_desc_t desc = {
+		.size = config.msg_sz,
+		.producer = pt->id,
+	};
+	uint64_t i;
+
+	prod_wait_start(shared);
+
+	for (i = 0; i < pt->count; i++) {
+		desc.enq_ts = get_cycles();
+
+		while (mpsc_enqueue(&shared->ring, &desc)) {
+			if (shared->abort)
+				return NULL;
+			pt->full_retries++;
+		}
+	}
+
+	return NULL;
+}
+
+static void *prod_mutex_main(void *arg)
+{
+	struct prod_thread_t *pt = arg;
+	struct prod_shared_t *shared = pt->shared;
+	struct resources_t *resource = shared->resource;
+	uint64_t i;
+
+	prod_wait_start(shared);
+
+	for (i = 0; i < pt->count && !shared->abort; i++) {
+		cycles_t enq_ts = get_cycles();
+		cycles_t t1, t2;
+		int rc;
+
+		pthread_mutex_lock(&shared->lock);
+
+		while (shared->posted - shared->completed == config.ring_depth) {
+			pt->full_retries++;
+			if (prod_reap(resource, resource->cq, resource->wc_arr, resource->post_ts,
+				      0, &shared->completed) < 0)
+				goto err;
+		}
+
+		resource->post_ts[shared->posted % config.ring_depth] = enq_ts;
+
+		rc = post_send_method(resource, METHOD_NEW, 1, &t1, &t2);
+		if (rc) {
+			VL_MISC_ERR(("in post send (error: %s)", strerror(rc)));
+			goto err;
+		}
+
+		shared->posted++;
+		pt->batches++;
+
+		if (prod_reap(resource, resource->cq, resource->wc_arr, resource->post_ts,
+			      0, &shared->completed) < 0)
+			goto err;
+
+		pthread_mutex_unlock(&shared->lock);
+	}
+
+	return NULL;
+
+err:
+	pt->error = 1;
+	shared->abort = 1;
+	pthread_mutex_unlock(&shared->lock);
+
+	return NULL;
+}
+
+/* The do_sender() loop on a private QP and CQ */
+static void *prod_qp_main(void *arg)
+{
+	struct prod_thread_t *pt = arg;
+	struct prod_shared_t *shared = pt->shared;
+	struct resources_t *ctx = qp_ctx(shared->resource, pt->id);
+	uint64_t tot_scnt = 0, tot_ccnt = 0;
+	cycles_t *post_ts;
+
+	post_ts = VL_MALLOC(config.ring_depth * sizeof(cycles_t), cycles_t);
+	if (!post_ts) {
+		pt->error = 1;
+		shared->abort = 1;
+		return NULL;
+	}
+
+	prod_wait_start(shared);
+
+	while (tot_ccnt < pt->count && !shared->abort) {
+		uint64_t outstanding = tot_scnt - tot_ccnt;
+
+		if (tot_scnt < pt->count && outstanding < config.ring_depth) {
+			uint64_t left = pt->count - tot_scnt;
+			uint16_t batch;
+			cycles_t t1, t2;
+			int i, rc;
+
+			batch = (config.ring_depth - outstanding) >= config.batch_size ?
+				(left >= config.batch_size ? config.batch_size : 1) : 1;
+
+			t1 = get_cycles();
+			for (i = 0; i < batch; i++)
+				post_ts[(tot_scnt + i) % config.ring_depth] = t1;
+
+			rc = post_send_method(ctx, METHOD_NEW, batch, &t1, &t2);
+			if (rc) {
+				VL_MISC_ERR(("in post send (error: %s)", strerror(rc)));
+				goto err;
+			}
+
+			tot_scnt += batch;
+			pt->batches++;
+		} else {
+			pt->full_retries++;
+		}
+
+		if (prod_reap(shared->resource, ctx->cq, ctx->wc_arr, post_ts, pt->first,
+			      &tot_ccnt) < 0)
+			goto err;
+	}
+
+	VL_FREE(post_ts);
+
+	return NULL;
+
+err:
+	VL_FREE(post_ts);
+	pt->error = 1;
+	shared->abort = 1;
+
+	return NULL;
+}
+
+/* Single poster: drain the ring up to the free credits and post the lot as one batch */
+static int prod_mpsc_poster(struct prod_shared_t *shared, struct prod_step_t *st)
+{
+	struct resources_t *resource = shared->resource;
+	uint64_t tot_scnt = 0, tot_ccnt = 0;
+
+	while (tot_ccnt < config.num_of_iter) {
+		uint64_t credits = config.ring_depth - (tot_scnt - tot_ccnt);
+		struct mpsc_desc_t desc;
+		uint16_t batch = 0;
+
+		if (shared->abort)
+			return FAIL;
+
+		while (batch < config.batch_size && batch < credits &&
+		       !mpsc_dequeue(&shared->ring, &desc)) {
+			resource->post_ts[(tot_scnt + batch) % config.ring_depth] = desc.enq_ts;
+			batch++;
+		}
+
+		if (batch) {
+			cycles_t t1, t2;
+			int rc;
+
+			rc = post_send_method(resource, METHOD_NEW, batch, &t1, &t2);
+			if (rc) {
+				VL_MISC_ERR(("in post send (error: %s)", strerror(rc)));
+				return FAIL;
+			}
+
+			tot_scnt += batch;
+			st->batches++;
+		}
+
+		if (prod_reap(resource, resource->cq, resource->wc_arr, resource->post_ts,
+			      0, &tot_ccnt) < 0)
+			return FAIL;
+	}
+
+	return SUCCESS;
+}
+
+static int do_sender_producers(struct resources_t *resource)
+{
+	struct prod_step_t *st = resource->cur_prod_step;
+	struct prod_thread_t pt[MAX_PRODUCERS];
+	struct prod_shared_t shared;
+	struct mpsc_slot_t *slots = NULL;
+	void *(*thread_main)(void *);
+	uint64_t first = 0;
+	cycles_t start;
+	int result = SUCCESS;
+	int created = 0;
+	int i, rc;
+
+	memset(&shared, 0, sizeof(shared));
+	memset(pt, 0, sizeof(pt));
+	shared.resource = resource;
+	pthread_mutex_init(&shared.lock, NULL);
+
+	switch (st->mode) {
+	case PROD_MPSC:
+		/* Twice the send ring, so producers run ahead of the credits */
+		slots = VL_MALLOC(2 * config.ring_depth * sizeof(*slots), struct mpsc_slot_t);
+		if (!slots) {
+			VL_MEM_ERR((" Fail in alloc MPSC ring"));
+			return FAIL;
+		}
+		mpsc_init(&shared.ring, slots, 2 * config.ring_depth);
+		thread_main = prod_mpsc_main;
+		break;
+	case PROD_MUTEX:
+		thread_main = prod_mutex_main;
+		break;
+	default:
+		thread_main = prod_qp_main;
+		break;
+	}
+
+	for (i = 0; i < st->producers; i++) {
+		pt[i].shared = &shared;
+		pt[i].id = i;
+		pt[i].first = first;
+		pt[i].count = config.num_of_iter / st->producers +
+			      ((uint64_t)i < config.num_of_iter % st->producers);
+		first += pt[i].count;
+
+		rc = pthread_create(&pt[i].thread, NULL, thread_main, &pt[i]);
+		if (rc) {
+			VL_MISC_ERR(("Fail to create producer %d (%s)", i, strerror(rc)));
+			shared.abort = 1;
+			result = FAIL;
+			break;
+		}
+		created++;
+	}
+
+	start = get_cycles();
+	__atomic_store_n(&shared.start, 1, __ATOMIC_RELEASE);
+
+	if (result == SUCCESS && st->mode == PROD_MPSC)
+		result = prod_mpsc_poster(&shared, st);
+	if (result)
+		shared.abort = 1;
+
+	for (i = 0; i < created; i++) {
+		pthread_join(pt[i].thread, NULL);
+		if (pt[i].error)
+			result = FAIL;
+		st->full_retries += pt[i].full_retries;
+		st->batches += pt[i].batches;
+	}
+
+	/* The last producers leave completions behind */
+	while (result == SUCCESS && st->mode == PROD_MUTEX &&
+	       shared.completed < config.num_of_iter)
+		if (prod_reap(resource, resource->cq, resource->wc_arr, resource->post_ts,
+			      0, &shared.completed) < 0)
+			result = FAIL;
+
+	st->duration = get_cycles() - start;
+	st->msgs = config.num_of_iter;
+
+	pthread_mutex_destroy(&shared.lock);
+	if (slots)
+		VL_FREE(slots);
+
+	return result;
+}
+
+/* Per-QP send state, each on its own line since other threads may return its credits */
+struct mq_qp_t {
+	struct resources_t	*ctx;
+	uint64_t		share;
+	uint64_t		posted;
+	volatile uint64_t	completed;
+	cycles_t		*post_ts;	/* per ring slot, atomic benchmark latency */
+} __attribute__ ((aligned(CACHE_LINE_SIZE)));
+
+struct mq_shared_t {
+	struct resources_t	*resource;
+	struct mq_qp_t		*qps;
+	uint32_t		*qpn_hash;	/* open addressing, qpn -> QP index + 1 */
+	uint32_t		hash_mask;
+	pthread_mutex_t		cq_lock;	/* the global CQ, when threads share it */
+	int			locked;
+	volatile int		start;
+	volatile int		abort;
+};
+
+struct mq_thread_t {
+	struct mq_shared_t	*shared;
+	pthread_t		thread;
+	int			id;
+	struct cq_poll_stats_t	st;
+	cycles_t		lat_cycles;
+	cycles_t		max_lat;
+	int			error;
+};
+
+static inline uint32_t mq_hash(uint32_t qpn, uint32_t mask)
+{
+	return (qpn * 2654435761u) & mask;
+}
+
+static inline int mq_qp_index(struct mq_shared_t *shared, uint32_t qpn)
+{
+	uint32_t h = mq_hash(qpn, shared->hash_mask);
+
+	while (shared->qpn_hash[h] &&
+	       shared->qps[shared->qpn_hash[h] - 1].ctx->qp->qp_num != qpn)
+		h = (h + 1) & shared->hash_mask;
+
+	return (int)shared->qpn_hash[h] - 1;
+}
+
+/*
+ * Credit the QPs of the reaped CQEs: per-QP CQs credit their QP directly,
+ * shared ones look the QP up by number. A locked CQ is still held, so the
+ * QP has a single poller. Its post time is read before the credit lets the
+ * owner thread reuse the slot. Returns -1 on an error CQE.
+ */
+static inline int mq_account(struct mq_thread_t *mt, struct ibv_wc *wc_arr, int num,
+			     int qp_idx, cycles_t now)
+{
+	struct mq_shared_t *shared = mt->shared;
+	int i;
+
+	for (i = 0; i < num; i++) {
+		struct mq_qp_t *q;
+		int idx = qp_idx;
+		uint64_t seq;
+
+		if (wc_arr[i].status != IBV_WC_SUCCESS) {
+			VL_MISC_ERR(("got WC with error (%d)", wc_arr[i].status));
+			return -1;
+		}
+
+		if (idx < 0) {
+			idx = mq_qp_index(shared, wc_arr[i].qp_num);
+			if (idx < 0) {
+				VL_MISC_ERR(("CQE of unknown QP 0x%x", wc_arr[i].qp_num));
+				return -1;
+			}
+		}
+
+		q = &shared->qps[idx];
+		seq = q->completed;
+
+		/* RC completes a QP in order, its CQEs follow the posted ones */
+		if (q->post_ts) {
+			cycles_t lat = now - q->post_ts[seq % config.ring_depth];
+
+			mt->lat_cycles += lat;
+			if (lat > mt->max_lat)
+				mt->max_lat = lat;
+		}
+
+		__atomic_store_n(&q->completed, seq + 1, __ATOMIC_RELEASE);
+	}
+
+	return num;
+}
+
+/* One poll of a CQ. Returns the CQEs reaped or -1 */
+static int mq_poll(struct mq_thread_t *mt, struct ibv_cq *cq, struct ibv_wc *wc_arr,
+		   int qp_idx)
+{
+	struct mq_shared_t *shared = mt->shared;
+	struct cq_poll_stats_t *st = &mt->st;
+	cycles_t t1, t2;
+	int rc, num;
+
+	if (shared->locked) {
+		st->lock_acquires++;
+		if (pthread_mutex_trylock(&shared->cq_lock)) {
+			st->lock_contended++;
+			t1 = get_cycles();
+			pthread_mutex_lock(&shared->cq_lock);
+			st->lock_wait_cycles += get_cycles() - t1;
+		}
+	}
+
+	t1 = get_cycles();
+	rc = ibv_poll_cq(cq, config.batch_size, wc_arr);
+	t2 = get_cycles();
+
+	num = rc > 0 ? mq_account(mt, wc_arr, rc, qp_idx, t2) : rc;
+
+	if (shared->locked)
+		pthread_mutex_unlock(&shared->cq_lock);
+
+	st->polls++;
+	st->poll_cycles += t2 - t1;
+
+	if (rc <= 0) {
+		if (rc < 0) {
+			VL_MISC_ERR(("in ibv_poll_cq (%s)", strerror(rc)));
+			return -1;
+		}
+		st->empty_polls++;
+		return 0;
+	}
+
+	if (num < 0)
+		return -1;
+
+	st->hit_cycles += t2 - t1;
+	st->cqes += rc;
+	st->batch_hist[batch_bucket(rc)]++;
+
+	return rc;
+}
+
+/* Closed loop over the thread's QPs (i % threads == id), then a poll per CQ it owns */
+static void *mq_thread_main(void *arg)
+{
+	struct mq_thread_t *mt = arg;
+	struct mq_shared_t *shared = mt->shared;
+	struct resources_t *first = shared->qps[mt->id].ctx;
+	int done = 0;
+	int i;
+
+	while (!__atomic_load_n(&shared->start, __ATOMIC_ACQUIRE))
+		;
+
+	while (!done && !shared->abort) {
+		done = 1;
+
+		for (i = mt->id; i < config.num_qps; i += config.threads) {
+			struct mq_qp_t *q = &shared->qps[i];
+			uint64_t completed = __atomic_load_n(&q->completed, __ATOMIC_ACQUIRE);
+			uint64_t outstanding = q->posted - completed;
+
+			if (completed < q->share)
+				done = 0;
+
+			if (q->posted < q->share && outstanding < config.ring_depth) {
+				uint64_t left = q->share - q->posted;
+				uint16_t batch;
+				cycles_t t1, t2;
+				int rc;
+
+				batch = (config.ring_depth - outstanding) >= config.batch_size ?
+					(left >= config.batch_size ? config.batch_size : 1) : 1;
+
+				/* Stamped ahead, another thread may reap the CQE on a shared CQ */
+				if (q->post_ts) {
+					cycles_t now = get_cycles();
+					int b;
+
+					for (b = 0; b < batch; b++)
+						q->post_ts[(q->posted + b) % config.ring_depth] = now;
+				}
+
+				rc = post_send_method(q->ctx, config.send_method, batch, &t1, &t2);
+				if (rc) {
+					VL_MISC_ERR(("in post send (error: %s)", strerror(rc)));
+					goto err;
+				}
+
+				update_measure(q->ctx, t2 - t1, batch);
+				q->posted += batch;
+			}
+		}
+
+		switch (config.cq_share) {
+		case CQ_SHARE_QP:
+			for (i = mt->id; i < config.num_qps; i += config.threads)
+				if (mq_poll(mt, shared->qps[i].ctx->cq, first->wc_arr, i) < 0)
+					goto err;
+			break;
+		case CQ_SHARE_THREAD:
+			if (mq_poll(mt, first->cq, first->wc_arr, -1) < 0)
+				goto err;
+			break;
+		default:
+			if (mq_poll(mt, shared->resource->cq, first->wc_arr, -1) < 0)
+				goto err;
+			break;
+		}
+	}
+
+	return NULL;
+
+err:
+	mt->error = 1;
+	shared->abort = 1;
+
+	return NULL;
+}
+
+static int do_sender_multi_qp(struct resources_t *resource)
+{
+	struct atomic_step_t *at = resource->cur_atomic_step;
+	struct mq_thread_t mt[MAX_PRODUCERS];
+	struct mq_shared_t shared;
+	cycles_t *post_ts = NULL;
+	cycles_t start;
+	int result = SUCCESS;
+	int created = 1;
+	int i, j;
+
+	memset(&shared, 0, sizeof(shared));
+	memset(mt, 0, sizeof(mt));
+	shared.resource = resource;
+	pthread_mutex_init(&shared.cq_lock, NULL);
+	shared.locked = config.cq_share == CQ_SHARE_GLOBAL && config.threads > 1;
+
+	if (posix_memalign((void **)&shared.qps, CACHE_LINE_SIZE,
+			   config.num_qps * sizeof(*shared.qps))) {
+		VL_MEM_ERR((" Fail in alloc multi-QP state"));
+		return FAIL;
+	}
+	memset(shared.qps, 0, config.num_qps * sizeof(*shared.qps));
+
+	for (shared.hash_mask = 1; shared.hash_mask < 2 * (uint32_t)config.num_qps; shared.hash_mask <<= 1)
+		;
+	shared.qpn_hash = calloc(shared.hash_mask, sizeof(*shared.qpn_hash));
+	if (!shared.qpn_hash) {
+		VL_MEM_ERR((" Fail in alloc QP hash"));
+		free(shared.qps);
+		return FAIL;
+	}
+	shared.hash_mask--;
+
+	if (at) {
+		post_ts = calloc(config.num_qps * config.ring_depth, sizeof(*post_ts));
+		if (!post_ts) {
+			VL_MEM_ERR((" Fail in alloc post timestamps"));
+			free(shared.qpn_hash);
+			free(shared.qps);
+			return FAIL;
+		}
+	}
+
+	for (i = 0; i < config.num_qps; i++) {
+		struct mq_qp_t *q = &shared.qps[i];
+
+		q->ctx = qp_ctx(resource, i);
+		if (post_ts)
+			q->post_ts = post_ts + i * config.ring_depth;
+
+		/* The other QPs measure this step only, it is folded into [0] below */
+		if (i) {
+			memset(&q->ctx->measure, 0, sizeof(q->ctx->measure));
+			q->ctx->measure.min = ~0;
+		}
+		q->share = config.num_of_iter / config.num_qps +
+			   ((uint64_t)i < config.num_of_iter % config.num_qps);
+
+		for (j = mq_hash(q->ctx->qp->qp_num, shared.hash_mask); shared.qpn_hash[j];
+		     j = (j + 1) & shared.hash_mask)
+			;
+		shared.qpn_hash[j] = i + 1;
+	}
+
+	/* The calling thread runs thread 0 */
+	for (i = 0; i < config.threads; i++) {
+		mt[i].shared = &shared;
+		mt[i].id = i;
+
+		if (!i)
+			continue;
+
+		if (pthread_create(&mt[i].thread, NULL, mq_thread_main, &mt[i])) {
+			VL_MISC_ERR(("Fail to create sender thread %d", i));
+			shared.abort = 1;
+			result = FAIL;
+			break;
+		}
+		created++;
+	}
+
+	start = get_cycles();
+	__atomic_store_n(&shared.start, 1, __ATOMIC_RELEASE);
+
+	mq_thread_main(&mt[0]);
+
+	for (i = 0; i < created; i++) {
+		struct cq_poll_stats_t *st = &resource->cq_stats;
+
+		if (i)
+			pthread_join(mt[i].thread, NULL);
+		if (mt[i].error)
+			result = FAIL;
+
+		st->polls += mt[i].st.polls;
+		st->empty_polls += mt[i].st.empty_polls;
+		st->cqes += mt[i].st.cqes;
+		st->poll_cycles += mt[i].st.poll_cycles;
+		st->hit_cycles += mt[i].st.hit_cycles;
+		st->lock_acquires += mt[i].st.lock_acquires;
+		st->lock_contended += mt[i].st.lock_contended;
+		st->lock_wait_cycles += mt[i].st.lock_wait_cycles;
+		for (j = 0; j < BATCH_BUCKETS; j++)
+			st->batch_hist[j] += mt[i].st.batch_hist[j];
+
+		if (at) {
+			at->lat_cycles += mt[i].lat_cycles;
+			if (mt[i].max_lat > at->max_lat)
+				at->max_lat = mt[i].max_lat;
+		}
+	}
+
+	resource->mq_duration = get_cycles() - start;
+	if (at) {
+		at->duration = resource->mq_duration;
+		at->ops = config.num_of_iter;
+	}
+
+	/* Post times of the other QPs go into the main report */
+	for (i = 1; i < config.num_qps; i++) {
+		struct measure_t *m = &shared.qps[i].ctx->measure;
+
+		if (m->min < resource->measure.min)
+			resource->measure.min = m->min;
+		if (m->max > resource->measure.max)
+			resource->measure.max = m->max;
+		resource->measure.tot += m->tot;
+		resource->measure.batch_samples += m->batch_samples;
+	}
+
+	pthread_mutex_destroy(&shared.cq_lock);
+	free(post_ts);
+	free(shared.qpn_hash);
+	free(shared.qps);
+
+	return result;
+}
+
+/* Intended send times, relative to the step start. Drawn before traffic
+ * so the post loop does no math beyond a compare.
+ */
+static void build_arrival_schedule(struct resources_t *resource, double rate)
+{
+	double cycles_per_msg = resource->cpu_mhz * 1e6 / rate;
+	double t = 0;
+	uint64_t i;
+
+	for (i = 0; i < config.num_of_iter; i++) {
+		resource->sched[i] = (cycles_t)t;
+
+		if (config.arrival == ARRIVAL_POISSON)
+			t += -log(1.0 - drand48()) * cycles_per_msg;
+		else
+			t += cycles_per_msg;
+	}
+}
+
+/*
+ * Coalescing stage: what arrived stays pending until N messages are due or
+ * the first of them waited the time budget. Returns how many to flush now.
+ */
+static inline uint16_t coalesce_ready(struct resources_t *resource, uint64_t tot_scnt,
+				      uint16_t pending, cycles_t start, cycles_t now,
+				      cycles_t budget, struct coalesce_stats_t *cs)
+{
+	if (pending >= config.coalesce_n) {
+		cs->by_size++;
+		return config.coalesce_n;
+	}
+
+	/* The last messages of the run can't fill N */
+	if (now - start - resource->sched[tot_scnt] >= budget ||
+	    tot_scnt + pending == config.num_of_iter) {
+		cs->by_time++;
+		return pending;
+	}
+
+	return 0;
+}
+
+static inline void coalesce_account(struct resources_t *resource, uint64_t first,
+				    uint16_t batch, cycles_t start, cycles_t t1,
+				    struct coalesce_stats_t *cs)
+{
+	int i;
+
+	cs->doorbells++;
+	cs->batch_hist[batch_bucket(batch)]++;
+
+	for (i = 0; i < batch; i++) {
+		cycles_t delay = t1 - start - resource->sched[first + i];
+
+		cs->delay_tot += delay;
+		if (delay > cs->delay_max)
+			cs->delay_max = delay;
+	}
+}
+
+/* Open loop: posts follow the schedule regardless of completions, and the
+ * latency is taken from the intended send time so queueing behind a full
+ * ring is not omitted.
+ */
+static int do_sender_open_loop(struct resources_t *resource, struct rate_step_t *step)
+{
+	cycles_t budget = (cycles_t)(config.coalesce_ns * resource->cpu_mhz / 1000);
+	struct coalesce_stats_t *cs = &step->coalesce;
+	uint64_t tot_ccnt = 0;
+	uint64_t tot_scnt = 0;
+	cycles_t start, last_comp;
+	double duration;
+	int result = SUCCESS;
+
+	start = get_cycles();
+	last_comp = start;
+
+	while (tot_ccnt < config.num_of_iter) {
+		uint64_t outstanding = tot_scnt - tot_ccnt;
+		cycles_t now = get_cycles();
+		int rc = 0;
+
+		if ((tot_scnt < config.num_of_iter) && (outstanding < config.ring_depth) &&
+		    (start + resource->sched[tot_scnt] <= now)) {
+			uint16_t batch = 1;
+			cycles_t t1, t2 = 0;
+
+			/* Everything which is already due goes in one doorbell */
+			while (batch < config.batch_size &&
+			       batch < config.ring_depth - outstanding &&
+			       tot_scnt + batch < config.num_of_iter &&
+			       start + resource->sched[tot_scnt + batch] <= now)
+				batch++;
+
+			if (config.coalesce_n) {
+				batch = coalesce_ready(resource, tot_scnt, batch, start, now, budget, cs);
+				if (!batch)
+					goto poll;
+			}
+
+			rc = post_send_method(resource, config.send_method, batch, &t1, &t2);
+			if (rc) {
+				VL_MISC_ERR(("in post send (error: %s)", strerror(rc)));
+				result = FAIL;
+				goto out;
+			}
+
+			update_measure(resource, t2 - t1, batch);
+
+			if (config.coalesce_n)
+				coalesce_account(resource, tot_scnt, batch, start, t1, cs);
+
+			if (config.trace_out)
+				capture_post(resource, tot_scnt, batch, t1);
+
+			if (config.workload)
+				wl_account_post(resource, batch, t1, t2);
+
+			tot_scnt += batch;
+		}
+
+poll:
+		rc = ibv_poll_cq(resource->cq, config.batch_size, resource->wc_arr);
+
+		if (rc > 0) {
+			int i;
+
+			now = get_cycles();
+
+			for (i = 0; i < rc; i++) {
+				if (resource->wc_arr[i].status != IBV_WC_SUCCESS) {
+					VL_MISC_ERR(("got WC with error (%d)", resource->wc_arr[i].status));
+					result = FAIL;
+					goto out;
+				}
+
+				/* Single QP, completions arrive in post order */
+				resource->lat[tot_ccnt + i] = now - start - resource->sched[tot_ccnt + i];
+			}
+
+			if (config.workload)
+				wl_account_completions(resource, tot_ccnt, rc, now);
+
+			tot_ccnt += rc;
+			last_comp = now;
+		} else if (rc < 0) {
+			VL_MISC_ERR(("in ibv_poll_cq (%s)", strerror(rc)));
+			result = FAIL;
+			goto out;
+		}
+	}
+
+	duration = (last_comp - start) / (resource->cpu_mhz * 1e6); //sec
+	step->achieved = duration > 0 ? tot_ccnt / duration : 0;
+
+	stats_sort_cycles(resource->lat, tot_ccnt);
+	step->p50 = stats_percentile_cycles(resource->lat, tot_ccnt, 50);
+	step->p99 = stats_percentile_cycles(resource->lat, tot_ccnt, 99);
+	step->p999 = stats_percentile_cycles(resource->lat, tot_ccnt, 99.9);
+	step->max = resource->lat[tot_ccnt - 1];
+
+out:
+	VL_DATA_TRACE(("Open-loop sender exit with tot_scnt=%lu tot_ccnt=%lu", tot_scnt, tot_ccnt));
+
+	return result;
+}
+
+static inline void trace_account_post(struct resources_t *resource, uint64_t first,
+				      uint16_t batch, cycles_t t1, cycles_t t2)
+{
+	const struct wl_entry_t *rec = &resource->wl_sched[first];
+	struct trace_phase_t *phase = &resource->phases[rec->phase];
+	int i;
+
+	/* A batch never crosses a phase */
+	if (!phase->msgs)
+		phase->first_post = t1;
+
+	for (i = 0; i < batch; i++)
+		phase->bytes += rec[i].size;
+
+	phase->msgs += batch;
+	phase->post_cycles += t2 - t1;
+}
+
+static inline void trace_account_completions(struct resources_t *resource, uint64_t first,
+					     int num, cycles_t now, cycles_t start,
+					     double cycles_per_ns)
+{
+	int i;
+
+	for (i = 0; i < num; i++) {
+		uint64_t seq = first + i;
+		const struct wl_entry_t *rec = &resource->wl_sched[seq];
+		struct trace_phase_t *phase = &resource->phases[rec->phase];
+		cycles_t lat;
+
+		/* Timed replay measures from the trace time, like the open loop */
+		if (config.replay == REPLAY_TIMED)
+			lat = now - start - (cycles_t)(rec->ts * cycles_per_ns);
+		else
+			lat = now - resource->wl_post_ts[seq % config.ring_depth];
+
+		phase->completed++;
+		phase->lat_cycles += lat;
+		if (lat > phase->max_lat)
+			phase->max_lat = lat;
+		phase->last_comp = now;
+	}
+}
+
+/*
+ * Replay the mapped trace: FAST posts whenever the ring has room, TIMED
+ * holds every record until its trace time. Batches don't cross phases.
+ */
+static int do_sender_replay(struct resources_t *resource)
+{
+	const struct wl_entry_t *recs = resource->wl_sched;
+	double cycles_per_ns = resource->cpu_mhz / 1000;
+	int timed = config.replay == REPLAY_TIMED;
+	uint64_t tot_ccnt = 0;
+	uint64_t tot_scnt = 0;
+	cycles_t start;
+	int result = SUCCESS;
+
+	start = get_cycles();
+
+	while (tot_ccnt < config.num_of_iter) {
+		uint64_t outstanding = tot_scnt - tot_ccnt;
+		cycles_t now = get_cycles();
+		int rc = 0;
+
+		if ((tot_scnt < config.num_of_iter) && (outstanding < config.ring_depth) &&
+		    (!timed || now - start >= (cycles_t)(recs[tot_scnt].ts * cycles_per_ns))) {
+			uint16_t batch = 1;
+			cycles_t t1, t2 = 0;
+
+			while (batch < config.batch_size &&
+			       batch < config.ring_depth - outstanding &&
+			       tot_scnt + batch < config.num_of_iter &&
+			       recs[tot_scnt + batch].phase == recs[tot_scnt].phase &&
+			       (!timed || now - start >= (cycles_t)(recs[tot_scnt + batch].ts * cycles_per_ns)))
+				batch++;
+
+			rc = post_send_method(resource, config.send_method, batch, &t1, &t2);
+			if (rc) {
+				VL_MISC_ERR(("in post send (error: %s)", strerror(rc)));
+				result = FAIL;
+				goto out;
+			}
+
+			update_measure(resource, t2 - t1, batch);
+
+			if (config.trace_out)
+				capture_post(resource, tot_scnt, batch, t1);
+
+			trace_account_post(resource, tot_scnt, batch, t1, t2);
+			wl_account_post(resource, batch, t1, t2);
+
+			tot_scnt += batch;
+		}
+
+		rc = ibv_poll_cq(resource->cq, config.batch_size, resource->wc_arr);
+
+		if (rc > 0) {
+			int i;
+
+			now = get_cycles();
+
+			for (i = 0; i < rc; i++) {
+				if (resource->wc_arr[i].status != IBV_WC_SUCCESS) {
+					VL_MISC_ERR(("got WC with error (%d)", resource->wc_arr[i].status));
+					result = FAIL;
+					goto out;
+				}
+			}
+
+			trace_account_completions(resource, tot_ccnt, rc, now, start, cycles_per_ns);
+			wl_account_completions(resource, tot_ccnt, rc, now);
+
+			tot_ccnt += rc;
+		} else if (rc < 0) {
+			VL_MISC_ERR(("in ibv_poll_cq (%s)", strerror(rc)));
+			result = FAIL;
+			goto out;
+		}
+	}
+
+out:
+	VL_DATA_TRACE(("Replay sender exit with tot_scnt=%lu tot_ccnt=%lu", tot_scnt, tot_ccnt));
+
+	return result;
+}
+
+/* Receive WRs the responder consumes in a single run */
+static inline uint64_t recv_iterations(const struct resources_t *resource)
+{
+	return config.workload ? resource->wl_recv_cnt : step_iterations(resource);
+}
+
+/*
+ * Arm the receive CQ and sleep on its channel, the moderation decides when
+ * the event comes. A CQE which landed before arming is reaped right away.
+ */
+static int rx_wait_event(struct resources_t *resource, struct rx_cq_stats_t *rx)
+{
+	struct ibv_cq *ev_cq;
+	void *ev_ctx;
+	cycles_t t1;
+	int rc;
+
+	if (ibv_req_notify_cq(resource->rcq, 0)) {
+		VL_MISC_ERR(("Fail to arm the receive CQ"));
+		return -1;
+	}
+
+	rc = ibv_poll_cq(resource->rcq, config.batch_size, resource->wc_arr);
+	if (rc)
+		return rc;
+
+	t1 = get_cycles();
+	if (ibv_get_cq_event(resource->rx_channel, &ev_cq, &ev_ctx)) {
+		VL_MISC_ERR(("Fail to get a receive CQ event"));
+		return -1;
+	}
+	ibv_ack_cq_events(ev_cq, 1);
+
+	rx->wait_cycles += get_cycles() - t1;
+	rx->events++;
+
+	return 0;
+}
+
+static int do_receiver(struct resources_t *resource)
+{
+	uint64_t iters = recv_iterations(resource);
+	uint64_t tot_ccnt = 0;
+	uint64_t tot_rcnt = resource->rx_depth; //Due to pre-preparation of the RX
+	struct recv_step_t *st = resource->cur_recv_step;
+	struct rx_cq_stats_t *rx = config.cqe_comp || config.cq_moder_cnt ?
+				   &resource->rx_stats : NULL;
+	struct perf_sample_t pc_start, pc_end;
+	int result = SUCCESS;
+	cycles_t t1 = 0, t2;
+
+	while (tot_ccnt < iters) {
+		uint64_t outstanding;
+		int polled = 0;
+		int rc = 0;
+
+		if (config.perf_counters)
+			perf_counters_read(resource->perf, &pc_start);
+
+		if (st || rx)
+			t1 = get_cycles();
+
+		rc = ibv_poll_cq(resource->rcq, config.batch_size, resource->wc_arr);
+		if (!rc && resource->rx_channel)
+			rc = rx_wait_event(resource, rx);
+
+		/* With scatter to CQE the poll also copies the data out */
+		if (st && rc > 0) {
+			t2 = get_cycles();
+			st->poll_cycles += t2 - t1;
+			if (!st->msgs)
+				st->first = t2;
+			st->last = t2;
+			st->msgs += rc;
+		}
+
+		if (rx) {
+			t2 = get_cycles();
+			rx->poll.polls++;
+			if (rc > 0) {
+				rx->poll.hit_cycles += t2 - t1;
+				rx->poll.cqes += rc;
+				rx->poll.batch_hist[batch_bucket(rc)]++;
+				if (!rx->first)
+					rx->first = t2;
+				rx->last = t2;
+			} else {
+				rx->poll.empty_polls++;
+			}
+		}
+
+		if (rc > 0) {
+			int i;
+
+			for (i = 0; i < rc; i++)
+				if (resource->wc_arr[i].status != IBV_WC_SUCCESS) {
+					VL_MISC_ERR(("got WC with error (%d)", resource->wc_arr[i].status));
+					result = FAIL;
+					goto out;
+				}
+
+			tot_ccnt += rc;
+			polled = rc;
+		} else if (rc < 0) {
+			VL_MISC_ERR(("in ibv_poll_cq (%s)", strerror(rc)));
+			result = FAIL;
+			goto out;
+		}
+
+		outstanding = tot_rcnt - tot_ccnt;
+
+		if ((tot_rcnt < iters) && (outstanding < resource->rx_depth)) {
+			struct ibv_recv_wr *bad_wr = NULL;
+			uint64_t left = iters - tot_rcnt;
+			uint16_t batch;
+
+			batch = (resource->rx_depth - outstanding) >= config.batch_size ?
+				(left >= config.batch_size ? config.batch_size : 1) : 1 ;
+
+			fast_set_recv_wr(resource->recv_wr_arr, batch);
+
+			if (st)
+				t1 = get_cycles();
+
+			if (!resource->srq)
+				rc = ibv_post_recv(resource->qp, resource->recv_wr_arr, &bad_wr);
+			else
+				rc = ibv_post_srq_recv(resource->srq, resource->recv_wr_arr, &bad_wr);
+			if (rc) {
+				VL_MISC_ERR(("in ibv_post_receive", strerror(rc)));
+				result = FAIL;
+				goto out;
+			}
+
+			if (st)
+				st->post_cycles += get_cycles() - t1;
+
+			tot_rcnt += batch;
+		}
+
+		/* Poll and RX refill are sampled together, per reaped CQE */
+		if (config.perf_counters && polled) {
+			perf_counters_read(resource->perf, &pc_end);
+			perf_measure_add(&resource->perf_poll, &pc_start, &pc_end, polled);
+		}
+	}
+
+out:
+	VL_DATA_TRACE(("Receiver exit with tot_rcnt=%lu tot_ccnt=%lu", tot_rcnt, tot_ccnt));
+
+	return result;
+}
+
+/*
+ * Receiver of a duration run, the ring is refilled until the client sends
+ * the number of messages it completed. The socket is only looked at after
+ * a run of empty polls, not a syscall per poll.
+ */
+static int do_receiver_duration(struct resources_t *resource)
+{
+	uint64_t iters = UINT64_MAX;
+	uint64_t tot_ccnt = 0;
+	uint64_t tot_rcnt = resource->rx_depth; //Due to pre-preparation of the RX
+	uint32_t idle = 0;
+
+	while (tot_ccnt < iters) {
+		uint64_t outstanding;
+		int rc;
+
+		rc = ibv_poll_cq(resource->rcq, config.batch_size, resource->wc_arr);
+		if (rc > 0) {
+			int i;
+
+			for (i = 0; i < rc; i++)
+				if (resource->wc_arr[i].status != IBV_WC_SUCCESS) {
+					VL_MISC_ERR(("got WC with error (%d)", resource->wc_arr[i].status));
+					return FAIL;
+				}
+
+			tot_ccnt += rc;
+			idle = 0;
+		} else if (rc < 0) {
+			VL_MISC_ERR(("in ibv_poll_cq (%s)", strerror(rc)));
+			return FAIL;
+		} else if (iters == UINT64_MAX && ++idle == SOAK_IDLE_POLLS) {
+			idle = 0;
+			if (sock_readable(resource) && recv_info(resource, &iters, sizeof(iters)))
+				return FAIL;
+		}
+
+		outstanding = tot_rcnt - tot_ccnt;
+
+		if (outstanding < resource->rx_depth) {
+			struct ibv_recv_wr *bad_wr = NULL;
+			uint16_t batch;
+
+			batch = (resource->rx_depth - outstanding) >= config.batch_size ?
+				config.batch_size : 1;
+
+			fast_set_recv_wr(resource->recv_wr_arr, batch);
+
+			if (!resource->srq)
+				rc = ibv_post_recv(resource->qp, resource->recv_wr_arr, &bad_wr);
+			else
+				rc = ibv_post_srq_recv(resource->srq, resource->recv_wr_arr, &bad_wr);
+			if (rc) {
+				VL_MISC_ERR(("in ibv_post_receive (error: %s)", strerror(rc)));
+				return FAIL;
+			}
+
+			tot_rcnt += batch;
+		}
+	}
+
+	VL_DATA_TRACE(("Duration receiver exit with tot_rcnt=%lu tot_ccnt=%lu", tot_rcnt, tot_ccnt));
+
+	return SUCCESS;
+}
+
+struct srq_refill_t {
+	struct resources_t	*resource;
+	uint64_t		iters;
+	uint64_t		posted;		/* written by the refiller only */
+	volatile uint64_t	completed;	/* written by the poller only */
+	volatile int		stop;
+	int			error;
+};
+
+/* mlx5 counts the receives which found no WQE, RNR NAKs on RC and drops otherwise */
+static int read_out_of_buffer(const struct resources_t *resource, uint64_t *val)
+{
+	char path[256];
+	FILE *f;
+	int rc;
+
+	snprintf(path, sizeof(path), "/sys/class/infiniband/%s/ports/%d/hw_counters/out_of_buffer",
+		 ibv_get_device_name(resource->hca_p->context->device), IB_PORT);
+
+	f = fopen(path, "r");
+	if (!f)
+		return FAIL;
+
+	rc = fscanf(f, "%lu", val) == 1 ? SUCCESS : FAIL;
+	fclose(f);
+
+	return rc;
+}
+
+static int srq_arm(struct resources_t *resource)
+{
+	struct ibv_srq_attr attr = {
+		.srq_limit = config.srq_watermark,
+	};
+
+	if (ibv_modify_srq(resource->srq, &attr, IBV_SRQ_LIMIT)) {
+		VL_DATA_ERR(("Fail to arm the SRQ limit"));
+		return FAIL;
+	}
+
+	return SUCCESS;
+}
+
+/*
+ * Top the SRQ up to its depth, or to the receives still expected, and
+ * arm the limit again. The level counts reaped CQEs, so it may be above
+ * what the HCA still holds but never below.
+ */
+static int srq_refill(struct srq_refill_t *rf)
+{
+	struct resources_t *resource = rf->resource;
+	struct srq_stats_t *st = &resource->srq_stats;
+	uint32_t level = rf->posted - __atomic_load_n(&rf->completed, __ATOMIC_ACQUIRE);
+	cycles_t t1 = get_cycles();
+
+	if (level < st->min_level)
+		st->min_level = level;
+
+	while (level < resource->rx_depth && rf->posted < rf->iters) {
+		struct ibv_recv_wr *bad_wr = NULL;
+		uint32_t batch = resource->rx_depth - level;
+		int rc;
+
+		if (batch > config.batch_size)
+			batch = config.batch_size;
+		if (batch > rf->iters - rf->posted)
+			batch = rf->iters - rf->posted;
+
+		fast_set_recv_wr(resource->recv_wr_arr, batch);
+		rc = ibv_post_srq_recv(resource->srq, resource->recv_wr_arr, &bad_wr);
+		if (rc) {
+			VL_MISC_ERR(("in ibv_post_srq_recv (error: %s)", strerror(rc)));
+			return FAIL;
+		}
+
+		rf->posted += batch;
+		level += batch;
+		st->wrs += batch;
+	}
+
+	st->refills++;
+	st->refill_cycles += get_cycles() - t1;
+
+	return srq_arm(resource);
+}
+
+/* Take one async event off the non-blocking fd. Returns 1 on the SRQ limit event */
+static int srq_limit_event(struct srq_refill_t *rf)
+{
+	struct ibv_context *context = rf->resource->hca_p->context;
+	struct ibv_async_event event;
+	int limit;
+
+	if (ibv_get_async_event(context, &event))
+		return 0;
+
+	limit = event.event_type == IBV_EVENT_SRQ_LIMIT_REACHED;
+	ibv_ack_async_event(&event);
+
+	if (limit)
+		rf->resource->srq_stats.events++;
+
+	return limit;
+}
+
+/* The limit event is the trigger, a low SRQ found on a timeout is a missed one */
+static int srq_low(struct srq_refill_t *rf)
+{
+	uint64_t completed = __atomic_load_n(&rf->completed, __ATOMIC_ACQUIRE);
+
+	return rf->posted < rf->iters && rf->posted - completed < config.srq_watermark;
+}
+
+static void *srq_refill_main(void *arg)
+{
+	struct srq_refill_t *rf = arg;
+	struct pollfd pfd = {
+		.fd = rf->resource->hca_p->context->async_fd,
+		.events = POLLIN,
+	};
+
+	while (!rf->stop) {
+		int rc = poll(&pfd, 1, SRQ_POLL_MS);
+
+		if (rc < 0 && errno != EINTR) {
+			VL_MISC_ERR(("Fail to poll the async fd (errno %d)", errno));
+			goto err;
+		}
+
+		if (rc > 0 && srq_limit_event(rf)) {
+			if (srq_refill(rf))
+				goto err;
+		} else if (!rc && srq_low(rf)) {
+			rf->resource->srq_stats.missed++;
+			if (srq_refill(rf))
+				goto err;
+		}
+	}
+
+	return NULL;
+
+err:
+	rf->error = 1;
+
+	return NULL;
+}
+
+/*
+ * Receive on the SRQ of all the QPs without topping it up after each
+ * poll. The SRQ limit event asks for a refill, the receive loop takes it
+ * once its own count says the SRQ is low, or a refill thread sleeps on it.
+ */
+static int do_receiver_srq(struct resources_t *resource)
+{
+	struct ibv_context *context = resource->hca_p->context;
+	struct srq_stats_t *st = &resource->srq_stats;
+	struct srq_refill_t rf = {
+		.resource = resource,
+		.iters = recv_iterations(resource),
+		.posted = resource->rx_depth,	/* prepare_receiver filled it */
+	};
+	uint64_t oob_start = 0;
+	pthread_t thread;
+	int result = SUCCESS;
+	int flags;
+
+	if (!resource->srq) {
+		VL_MISC_ERR(("SRQ refill needs the multi-QP server SRQ"));
+		return FAIL;
+	}
+
+	if (!st->refills && !st->events)
+		st->min_level = resource->rx_depth;
+
+	flags = fcntl(context->async_fd, F_GETFL);
+	if (flags < 0 || fcntl(context->async_fd, F_SETFL, flags | O_NONBLOCK)) {
+		VL_MISC_ERR(("Fail to make the async fd non-blocking"));
+		return FAIL;
+	}
+
+	st->oob_valid = read_out_of_buffer(resource, &oob_start) == SUCCESS;
+
+	if (srq_arm(resource))
+		return FAIL;
+
+	if (config.srq_refill == SRQ_REFILL_THREAD &&
+	    pthread_create(&thread, NULL, srq_refill_main, &rf)) {
+		VL_MISC_ERR(("Fail to create the SRQ refill thread"));
+		return FAIL;
+	}
+
+	while (rf.completed < rf.iters && !rf.error) {
+		int rc, i;
+
+		rc = ibv_poll_cq(resource->rcq, config.batch_size, resource->wc_arr);
+		if (rc < 0) {
+			VL_MISC_ERR(("in ibv_poll_cq (%s)", strerror(rc)));
+			result = FAIL;
+			break;
+		}
+
+		for (i = 0; i < rc; i++)
+			if (resource->wc_arr[i].status != IBV_WC_SUCCESS) {
+				VL_MISC_ERR(("got WC with error (%d)", resource->wc_arr[i].status));
+				result = FAIL;
+				goto out;
+			}
+
+		__atomic_store_n(&rf.completed, rf.completed + rc, __ATOMIC_RELEASE);
+
+		if (config.srq_refill != SRQ_REFILL_EVENT || !srq_low(&rf))
+			continue;
+
+		if (srq_limit_event(&rf)) {
+			if (srq_refill(&rf))
+				result = FAIL;
+		} else if (!rc) {
+			st->missed++;
+			if (srq_refill(&rf))
+				result = FAIL;
+		}
+	}
+
+out:
+	if (config.srq_refill == SRQ_REFILL_THREAD) {
+		rf.stop = 1;
+		pthread_join(thread, NULL);
+	}
+
+	if (rf.error)
+		result = FAIL;
+
+	st->msgs += rf.completed;
+	if (st->oob_valid) {
+		uint64_t oob_end;
+
+		st->oob_valid = read_out_of_buffer(resource, &oob_end) == SUCCESS;
+		st->oob += oob_end - oob_start;
+	}
+
+	VL_DATA_TRACE(("SRQ receiver exit with posted=%lu completed=%lu", rf.posted, rf.completed));
+
+	return result;
+}
+
+/* What this HCA takes of --rd_atomic, as the initiator and as the responder, and of --mtu */
+static void local_qp_caps(const struct resources_t *resource, struct sync_conf_info_t *info)
+{
+	const struct ibv_device_attr *attr = &resource->hca_p->device_attr;
+	enum ibv_mtu active = resource->hca_p->port_attr.active_mtu;
+
+	info->init_rd_atom = config.rd_atomic < attr->max_qp_init_rd_atom ?
+			     config.rd_atomic : attr->max_qp_init_rd_atom;
+	info->dest_rd_atom = config.rd_atomic < attr->max_qp_rd_atom ?
+			     config.rd_atomic : attr->max_qp_rd_atom;
+
+	info->mtu = active;
+	if (config.mtu > active)
+		VL_MISC_ERR(("WARN: MTU %d is above the active MTU %d of the port",
+			     128 << config.mtu, 128 << active));
+	else if (config.mtu)
+		info->mtu = config.mtu;
+}
+
+/*
+ * READs and atomics in flight are bounded by the responder resources of
+ * the peer, the path MTU by the smaller of both sides.
+ */
+static void apply_qp_caps(struct resources_t *resource, const struct sync_conf_info_t *local,
+			    const struct sync_conf_info_t *remote)
+{
+	uint8_t init = local->init_rd_atom < remote->dest_rd_atom ?
+		       local->init_rd_atom : remote->dest_rd_atom;
+	enum ibv_mtu mtu = local->mtu < remote->mtu ? local->mtu : remote->mtu;
+	int i;
+
+	if (!config.is_daemon && init < config.rd_atomic)
+		VL_MISC_ERR(("WARN: %u READ/atomic in flight were asked, the HCAs take %u",
+			     config.rd_atomic, init));
+
+	for (i = 0; i < config.num_qps; i++) {
+		qp_ctx(resource, i)->max_rd_atomic = init;
+		qp_ctx(resource, i)->max_dest_rd_atomic = local->dest_rd_atom;
+		qp_ctx(resource, i)->path_mtu = mtu;
+	}
+
+	VL_DATA_TRACE(("READ/atomic in flight %u, responder resources %u, path MTU %d",
+		       init, local->dest_rd_atom, 128 << mtu));
+}
+
+int sync_configurations(struct resources_t *resource)
+{
+	struct sync_conf_info_t remote_info = {0};
+	struct sync_conf_info_t local_info = {0};
+	int rc;
+
+	local_info.iter = config.num_of_iter;
+	local_info.opcode = config.opcode;
+	local_info.flags = (config.stepped ? SYNC_CONF_STEPPED : 0) |
+			   (config.duration ? SYNC_CONF_DURATION : 0);
+	local_info.wl_sig = resource->wl_sig;
+	local_info.num_qps = config.num_qps;
+	local_info.atomic_targets = config.atomic_targets;
+	local_info.dc_targets = config.dc_targets;
+	local_info.ud_dests = config.ud_dests;
+	local_info.warmup = config.warmup;
+	local_qp_caps(resource, &local_info);
+	local_info.qp_type = config.qp_type == IBV_QPT_XRC_RECV ?
+			     IBV_QPT_XRC_SEND : /* Hack the XRC QPTs sync*/
+			     config.qp_type;
+
+	if (!config.is_daemon) {
+		rc = send_info(resource, &local_info, sizeof(local_info));
+		if (rc)
+			return FAIL;
+
+		rc = recv_info(resource, &remote_info, sizeof(remote_info));
+		if (rc)
+			return FAIL;
+	} else {
+		rc = recv_info(resource, &remote_info, sizeof(remote_info));
+		if (rc)
+			return FAIL;
+
+		rc = send_info(resource, &local_info, sizeof(local_info));
+		if (rc)
+			return FAIL;
+	}
+
+	/* A fan-out pairs the senders of one side with the many targets of the other */
+	if (config.num_of_iter != remote_info.iter ||
+	    (!config.dc_targets && !config.ud_dests &&
+	     (uint32_t)config.num_qps != remote_info.num_qps) ||
+	    config.dc_targets != remote_info.dc_targets ||
+	    config.ud_dests != remote_info.ud_dests ||
+	    config.atomic_targets != remote_info.atomic_targets ||
+	    config.opcode != remote_info.opcode ||
+	    local_info.qp_type != remote_info.qp_type) {
+		VL_SOCK_ERR(("Server-client configurations are not synced"));
+		return FAIL;
+	}
+
+	if (local_info.wl_sig != remote_info.wl_sig) {
+		VL_SOCK_ERR(("Server-client workloads are not synced"));
+		return FAIL;
+	}
+
+	apply_qp_caps(resource, &local_info, &remote_info);
+
+	/*
+	 * Traffic pattern is driven by the client. A workload without receives,
+	 * as the READ sweeps, never reaps the ring.
+	 */
+	if (config.is_daemon && (remote_info.flags & SYNC_CONF_STEPPED)) {
+		if ((!config.workload || resource->wl_recv_cnt) &&
+		    (recv_iterations(resource) < resource->rx_depth ||
+		     (remote_info.warmup && remote_info.warmup < resource->rx_depth))) {
+			VL_SOCK_ERR(("Stepped traffic requires iterations >= ring size"));
+			return FAIL;
+		}
+
+		config.stepped = 1;
+		config.warmup = remote_info.warmup;
+	}
+
+	/* The server receives until the client tells how many it completed */
+	if (config.is_daemon && (remote_info.flags & SYNC_CONF_DURATION)) {
+		if (config.stepped || config.srq_refill || config.xrc_procs) {
+			VL_SOCK_ERR(("Duration runs receive on a single ring"));
+			return FAIL;
+		}
+
+		config.duration = 1;
+	}
+
+	VL_DATA_TRACE(("Server-client configurations are synced"));
+
+	return  SUCCESS;
+}
+
+/* Whether any opcode in use targets the remote MR */
+static int needs_remote_addr(void)
+{
+	int i;
+
+	if (!config.workload)
+		return wl_op_needs_raddr(config.opcode);
+
+	for (i = 0; i < config.wl.num_ops; i++)
+		if (wl_op_needs_raddr(config.wl.ops[i]))
+			return 1;
+
+	return 0;
+}
+
+/* What the server exposes once connected: the DC/XRC target and its MR */
+static void post_connection_info(struct resources_t *resource,
+				 struct sync_post_connection_t *info)
+{
+	if (config.qp_type == IBV_QPT_DRIVER)
+		info->dctn = resource->qp->qp_num;
+	else if (config.qp_type == IBV_QPT_XRC_RECV)
+		ibv_get_srq_num(resource->srq, &info->dctn);
+
+	if (config.xrc_procs)
+		info->num_srqn = resource->xrc_procs->num;
+
+	if (needs_remote_addr()) {
+		info->rkey = resource->mr->ibv_mr->rkey;
+		info->raddr = (uintptr_t)resource->mr->addr;
+
+		/* Atomic targets start on a stride boundary, buf_size() leaves the room */
+		if (config.atomic_targets)
+			info->raddr = (info->raddr + config.atomic_stride - 1) &
+				      ~(uint64_t)(config.atomic_stride - 1);
+	}
+}
+
+static void apply_post_connection(struct resources_t *resource,
+				  const struct sync_post_connection_t *info)
+{
+	if (config.qp_type == IBV_QPT_DRIVER || config.qp_type == IBV_QPT_XRC_SEND)
+		resource->r_dctn = info->dctn;
+
+	if (needs_remote_addr()) {
+		int i;
+
+		for (i = 0; i < config.num_qps; i++) {
+			qp_ctx(resource, i)->rkey = info->rkey;
+			qp_ctx(resource, i)->raddr = info->raddr;
+		}
+	}
+}
+
+int sync_post_connection(struct resources_t *resource)
+{
+	int rc;
+
+	if (!config.is_daemon) {
+		struct sync_post_connection_t remote_info = {0};
+
+		rc = recv_info(resource, &remote_info, sizeof(remote_info));
+		if (rc)
+			return FAIL;
+
+		apply_post_connection(resource, &remote_info);
+
+		if (remote_info.num_srqn) {
+			/* Only the NEW method addresses an XRC SRQ per WR */
+			if (remote_info.num_srqn > XRC_MAX_PROCS || config.send_method != METHOD_NEW ||
+			    config.stepped) {
+				VL_SOCK_ERR(("XRC workers take a single run of the NEW method"));
+				return FAIL;
+			}
+
+			rc = recv_info(resource, resource->xrc_srqn,
+				       remote_info.num_srqn * sizeof(uint32_t));
+			if (rc)
+				return FAIL;
+
+			resource->num_xrc_srqn = remote_info.num_srqn;
+			resource->xrc_seq = 0;
+		}
+	} else {
+		struct sync_post_connection_t local_info = {0};
+		uint32_t srqn[XRC_MAX_PROCS];
+		int i;
+
+		if (config.xrc_procs) {
+			if (config.stepped) {
+				VL_SOCK_ERR(("XRC workers take a single run"));
+				return FAIL;
+			}
+
+			if (xrc_procs_start(resource->xrc_procs, config.xrc_procs,
+					    recv_iterations(resource)))
+				return FAIL;
+		}
+
+		post_connection_info(resource, &local_info);
+
+		rc = send_info(resource, &local_info, sizeof(local_info));
+		if (rc)
+			return FAIL;
+
+		if (local_info.num_srqn) {
+			for (i = 0; i < (int)local_info.num_srqn; i++)
+				srqn[i] = resource->xrc_procs->proc[i].srqn;
+
+			rc = send_info(resource, srqn, local_info.num_srqn * sizeof(uint32_t));
+			if (rc)
+				return FAIL;
+		}
+	}
+
+	return  SUCCESS;
+}
+
+/* Address the remote port, with a GRH when the HCA uses a GID. remote_qp may be NULL (DCT) */
+static void set_ah_attr(const struct resources_t *resource, struct ibv_ah_attr *ah_attr,
+			const struct sync_qp_info_t *remote_qp)
+{
+	ah_attr->port_num = IB_PORT;
+	if (remote_qp)
+		ah_attr->dlid = remote_qp->lid;
+
+	if (resource->hca_p->gid_idx < 0)
+		return;
+
+	ah_attr->is_global = 1;
+	ah_attr->grh.sgid_index = resource->hca_p->gid_idx;
+	ah_attr->grh.hop_limit = 64;
+	if (remote_qp)
+		memcpy(ah_attr->grh.dgid.raw, remote_qp->gid, sizeof(ah_attr->grh.dgid.raw));
+}
+
+static int init_ah(struct resources_t *resource, const struct sync_qp_info_t *remote_qp)
+{
+	struct ibv_ah_attr ah_attr;
+
+	memset(&ah_attr, 0, sizeof(ah_attr));
+	set_ah_attr(resource, &ah_attr, remote_qp);
+
+	VL_HCA_TRACE1(("Going to create AH"));
+
+	resource->ah = ibv_create_ah(resource->pd, &ah_attr);
+	if (!resource->ah) {
+		VL_DATA_ERR(("Fail in ibv_create_ah"));
+		return FAIL;
+	}
+
+	VL_DATA_TRACE1(("Finish init AH"));
+
+	return SUCCESS;
+}
+
+//convert mac string xx:xx:xx:xx:xx:xx to byte array
+#define MAC_SEP ':'
+static char *mac_string_to_byte(const char *mac_string, uint8_t *mac_bytes)
+{
+	int counter;
+	for (counter = 0; counter < 6; ++counter) {
+		unsigned int number = 0;
+		char ch;
+
+		//Convert letter into lower case.
+		ch = tolower(*mac_string++);
+
+		if ((ch < '0' || ch > '9') && (ch < 'a' || ch > 'f')) {
+			return NULL;
+		}
+
+		number = isdigit (ch) ? (ch - '0') : (ch - 'a' + 10);
+		ch = tolower(*mac_string);
+
+		if ((counter < 5 && ch != MAC_SEP) || (counter == 5 && ch != '\0'
+				&& !isspace (ch))) {
+			++mac_string;
+
+			if ((ch < '0' || ch > '9') && (ch < 'a' || ch > 'f')) {
+				return NULL;
+			}
+
+			number <<= 4;
+			number += isdigit (ch) ? (ch - '0') : (ch - 'a' + 10);
+			ch = *mac_string;
+
+			if (counter < 5 && ch != MAC_SEP) {
+				return NULL;
+			}
+		}
+		mac_bytes[counter] = (unsigned char) number;
+		++mac_string;
+	}
+	return (char *) mac_bytes;
+}
+
+static int init_mcast_mac_flow(struct resources_t *resource, uint8_t *mmac)
+{
+	struct raw_eth_flow_attr flow_attr = {
 		.attr = {
 			.comp_mask      = 0,
 			.type           = IBV_FLOW_ATTR_NORMAL,
@@ -903,288 +3569,2254 @@ static int init_mcast_mac_flow(struct resources_t *resource, uint8_t *mmac)
 				.vlan_tag = 0,
 			}
 		}
-	};
+	};
+
+	VL_DATA_TRACE1(("Going to create flow rule"));
+
+	resource->flow = ibv_create_flow(resource->qp , &flow_attr.attr);
+	if (!resource->flow) {
+		VL_DATA_ERR(("Fail to create flow rule (errno %d)", errno));
+		return FAIL;
+	}
+
+	VL_DATA_TRACE1(("Finish to create flow rule"));
+
+	return SUCCESS;
+}
+
+static void init_eth_header(struct resources_t *resource, uint8_t *smac, uint8_t *dmac)
+{
+	struct ETH_header *eth_header = resource->mr->addr;
+	size_t frame_size = config.msg_sz;
+
+	memcpy(eth_header->src_mac, smac, MAC_LEN);
+	memcpy(eth_header->dst_mac, dmac, MAC_LEN);
+	eth_header->eth_type = htons(frame_size - ETH_HDR_SIZE); /* Payload and CRC */
+}
+
+static int qp_to_init(const struct resources_t *resource)
+{
+	struct ibv_qp_attr attr = {
+		.qp_state        = IBV_QPS_INIT,
+		.pkey_index      = 0,
+		.port_num        = IB_PORT,
+	};
+	int attr_mask = IBV_QP_STATE | IBV_QP_PORT;
+
+	if (config.qp_type == IBV_QPT_RC) { //RC
+		attr_mask |= IBV_QP_ACCESS_FLAGS | IBV_QP_PKEY_INDEX;
+		attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE |
+				       IBV_ACCESS_REMOTE_WRITE |
+				       IBV_ACCESS_REMOTE_READ |
+				       IBV_ACCESS_REMOTE_ATOMIC;
+	} else if ((config.qp_type == IBV_QPT_DRIVER && config.is_daemon) ||
+		   config.qp_type == IBV_QPT_XRC_RECV) { //DCT and XRC_RECV
+		attr_mask |= IBV_QP_ACCESS_FLAGS | IBV_QP_PKEY_INDEX;
+		attr.qp_access_flags = IBV_ACCESS_REMOTE_WRITE |
+				       IBV_ACCESS_REMOTE_READ |
+				       IBV_ACCESS_REMOTE_ATOMIC;
+	} else if (config.qp_type == IBV_QPT_DRIVER && !config.is_daemon) { //DCI
+		attr_mask |= IBV_QP_PKEY_INDEX;
+	} else if (config.qp_type == IBV_QPT_XRC_SEND) { //XRC_SEND
+		attr_mask |= IBV_QP_PKEY_INDEX | IBV_QP_ACCESS_FLAGS;
+	} else if (config.qp_type == IBV_QPT_UD) { //UD
+		attr_mask |= IBV_QP_QKEY | IBV_QP_PKEY_INDEX;
+		attr.qkey = QKEY;
+	}
+	/* else Raw-Packet */
+
+	if (ibv_modify_qp(resource->qp, &attr, attr_mask)) {
+		VL_DATA_ERR(("Fail to modify QP to IBV_QPS_INIT"));
+		return FAIL;
+	}
+
+	return SUCCESS;
+}
+
+static int qp_to_rtr(const struct resources_t *resource, const struct sync_qp_info_t *remote_qp)
+{
+	struct ibv_qp_attr attr = {
+		.qp_state		= IBV_QPS_RTR,
+		.ah_attr		= {
+			.is_global	= 0,
+			.sl		= 0,
+			.src_path_bits	= 0,
+			}
+		};
+	int attr_mask = IBV_QP_STATE;
+
+	if (config.qp_type == IBV_QPT_RC || config.qp_type == IBV_QPT_XRC_RECV) {
+		attr.dest_qp_num = remote_qp->qp_num;
+		attr.max_dest_rd_atomic = resource->max_dest_rd_atomic;
+		attr.min_rnr_timer = 0x10;
+		attr.rq_psn = 0;
+		attr.path_mtu = resource->path_mtu;
+		set_ah_attr(resource, &attr.ah_attr, remote_qp);
+
+		attr_mask |= IBV_QP_AV |
+			     IBV_QP_DEST_QPN |
+			     IBV_QP_RQ_PSN |
+			     IBV_QP_PATH_MTU |
+			     IBV_QP_MAX_DEST_RD_ATOMIC |
+			     IBV_QP_MIN_RNR_TIMER;
+	} else if (config.qp_type == IBV_QPT_XRC_SEND) {
+		attr.dest_qp_num = remote_qp->qp_num;
+		attr.rq_psn = 0;
+		attr.path_mtu = resource->path_mtu;
+		set_ah_attr(resource, &attr.ah_attr, remote_qp);
+
+		attr_mask |= IBV_QP_AV |
+			     IBV_QP_DEST_QPN |
+			     IBV_QP_RQ_PSN |
+			     IBV_QP_PATH_MTU;
+	} else if (config.qp_type == IBV_QPT_DRIVER && config.is_daemon) { //DCT
+		attr.min_rnr_timer = 0x10;
+		attr.path_mtu = resource->path_mtu;
+		set_ah_attr(resource, &attr.ah_attr, NULL);
+
+		attr_mask |= IBV_QP_AV |
+			     IBV_QP_PATH_MTU |
+			     IBV_QP_MIN_RNR_TIMER;
+	} else if (config.qp_type == IBV_QPT_DRIVER && !config.is_daemon) { //DCI
+		/* On DCI we dont need recieve attrs */
+		attr.path_mtu = resource->path_mtu;
+
+		attr_mask |= IBV_QP_PATH_MTU;
+	}
+	/* else Raw-Packet or UD*/
+
+	if (ibv_modify_qp(resource->qp, &attr, attr_mask)) {
+		VL_DATA_ERR(("Fail to modify QP, to IBV_QPS_RTR"));
+		return FAIL;
+	}
+
+	return SUCCESS;
+}
+
+static int qp_to_rts(const struct resources_t *resource)
+{
+	struct ibv_qp_attr attr = {
+		.qp_state = IBV_QPS_RTS,
+		};
+	int attr_mask = IBV_QP_STATE;
+
+	if (config.qp_type == IBV_QPT_RC || config.qp_type == IBV_QPT_DRIVER ||
+	    config.qp_type == IBV_QPT_XRC_SEND) {
+		attr_mask |= IBV_QP_TIMEOUT |
+			     IBV_QP_RETRY_CNT |
+			     IBV_QP_RNR_RETRY |
+			     IBV_QP_SQ_PSN |
+			     IBV_QP_MAX_QP_RD_ATOMIC;
+
+		attr.sq_psn = 0,
+		attr.timeout = 0x10;
+		attr.retry_cnt = 7;
+		attr.rnr_retry = 7;
+		attr.max_rd_atomic = resource->max_rd_atomic;
+	} else if (config.qp_type != IBV_QPT_RAW_PACKET) {
+		attr_mask |= IBV_QP_SQ_PSN;
+
+		attr.sq_psn = 0;
+	}
+
+	if (ibv_modify_qp(resource->qp, &attr, attr_mask)) {
+		VL_DATA_ERR(("Fail to modify QP to IBV_QPS_RTS."));
+		return FAIL;
+		}
+
+	return SUCCESS;
+}
+
+static void fill_local_qp_info(const struct resources_t *resource, struct sync_qp_info_t *info)
+{
+	info->qp_num = resource->qp->qp_num;
+
+	info->lid = resource->hca_p->port_attr.lid;
+	mac_string_to_byte(config.mac, info->mac);
+	memcpy(info->gid, resource->hca_p->gid.raw, sizeof(info->gid));
+}
+
+/* Bring the QP to its ready state towards remote_qp_info, the side is config.is_daemon */
+static int connect_qp(struct resources_t *resource, struct sync_qp_info_t *local_qp_info,
+		      const struct sync_qp_info_t *remote_qp_info)
+{
+	int rc;
+
+	resource->r_dctn = remote_qp_info->qp_num;
+	resource->remote_qp = *remote_qp_info;
+
+	VL_DATA_TRACE1(("Going to connect QP to lid 0x%x qp_num 0x%x",
+			remote_qp_info->lid,
+			remote_qp_info->qp_num));
+
+	if (qp_to_init(resource))
+		return FAIL;
+
+	if (qp_to_rtr(resource, remote_qp_info))
+		return FAIL;
+
+	if(!config.is_daemon) {
+		if (qp_to_rts(resource))
+			return FAIL;
+	}
+
+	VL_DATA_TRACE1(("QP qp_num 0x%x is in ready state", resource->qp->qp_num));
+
+	if ((config.qp_type == IBV_QPT_DRIVER || config.qp_type == IBV_QPT_UD) &&
+	    !config.is_daemon) {
+		rc = init_ah(resource, remote_qp_info);
+		if (rc)
+			return FAIL;
+	}
+
+	if (config.qp_type == IBV_QPT_RAW_PACKET) {
+		if (config.is_daemon) {
+			rc = init_mcast_mac_flow(resource, local_qp_info->mac);
+			if (rc)
+				return FAIL;
+		} else {
+			init_eth_header(resource, local_qp_info->mac,
+					(uint8_t *)remote_qp_info->mac);
+		}
+
+	}
+
+	return  SUCCESS;
+}
+
+static int connect_qp_ctx(struct resources_t *resource)
+{
+	struct sync_qp_info_t remote_qp_info = {0};
+	struct sync_qp_info_t local_qp_info = {0};
+	int rc;
+
+	fill_local_qp_info(resource, &local_qp_info);
+
+	if (!config.is_daemon) {
+		rc = send_info(resource, &local_qp_info, sizeof(local_qp_info));
+		if (rc)
+			return FAIL;
+
+		rc = recv_info(resource, &remote_qp_info, sizeof(remote_qp_info));
+		if (rc)
+			return FAIL;
+	} else {
+		rc = recv_info(resource, &remote_qp_info, sizeof(remote_qp_info));
+		if (rc)
+			return FAIL;
+
+		rc = send_info(resource, &local_qp_info, sizeof(local_qp_info));
+		if (rc)
+			return FAIL;
+	}
+
+	return connect_qp(resource, &local_qp_info, &remote_qp_info);
+}
+
+/*
+ * DC and UD fan-out: the QPs get ready without a peer. The server sends its
+ * address once and then the numbers of all its DCTs or UD QPs, one AH
+ * reaches them all.
+ */
+static int connect_fanout(struct resources_t *resource)
+{
+	uint32_t num = config.dc_targets ? config.dc_targets : config.ud_dests;
+	struct sync_qp_info_t qp_info = {0};
+	uint32_t *qpn;
+	int i, rc;
+
+	for (i = 0; i < config.num_qps; i++) {
+		struct resources_t *ctx = qp_ctx(resource, i);
+
+		if (qp_to_init(ctx) || qp_to_rtr(ctx, &qp_info) ||
+		    (!config.is_daemon && qp_to_rts(ctx)))
+			return FAIL;
+	}
+
+	if (!config.is_daemon) {
+		qpn = resource->dc ? resource->dc->dctn : resource->ud->qpn;
+		if (recv_info(resource, &qp_info, sizeof(qp_info)) ||
+		    recv_info(resource, qpn, num * sizeof(uint32_t)))
+			return FAIL;
+
+		/* The AH cache creates its AHs alike */
+		if (resource->ud)
+			set_ah_attr(resource, &resource->ud->attr, &qp_info);
+
+		return init_ah(resource, &qp_info);
+	}
+
+	fill_local_qp_info(resource, &qp_info);
+	if (send_info(resource, &qp_info, sizeof(qp_info)))
+		return FAIL;
+
+	qpn = VL_MALLOC(num * sizeof(uint32_t), uint32_t);
+	if (!qpn) {
+		VL_MEM_ERR(("Fail to alloc the fan-out QP numbers"));
+		return FAIL;
+	}
+
+	for (i = 0; i < config.num_qps; i++)
+		qpn[i] = qp_ctx(resource, i)->qp->qp_num;
+
+	rc = send_info(resource, qpn, num * sizeof(uint32_t));
+	VL_FREE(qpn);
+
+	return rc;
+}
+
+int init_connection(struct resources_t *resource)
+{
+	int i;
+
+	if (config.dc_targets || config.ud_dests) {
+		if (connect_fanout(resource))
+			return FAIL;
+
+		VL_DATA_TRACE(("init_connection is done, fan-out to %d QPs",
+			       config.dc_targets ? config.dc_targets : config.ud_dests));
+
+		return SUCCESS;
+	}
+
+	/* QP contexts are connected pairwise, in order */
+	for (i = 0; i < config.num_qps; i++)
+		if (connect_qp_ctx(qp_ctx(resource, i)))
+			return FAIL;
+
+	VL_DATA_TRACE(("init_connection is done"));
+
+	return  SUCCESS;
+}
+
+/* Back to RESET and up again towards the same peer QPs, at another path MTU */
+static int reconnect_qps(struct resources_t *resource, enum ibv_mtu mtu)
+{
+	struct ibv_qp_attr attr = {
+		.qp_state = IBV_QPS_RESET,
+	};
+	int i;
+
+	if (resource->path_mtu == mtu)
+		return SUCCESS;
+
+	for (i = 0; i < config.num_qps; i++) {
+		struct resources_t *ctx = qp_ctx(resource, i);
+
+		ctx->path_mtu = mtu;
+
+		if (ibv_modify_qp(ctx->qp, &attr, IBV_QP_STATE)) {
+			VL_DATA_ERR(("Fail to modify QP to IBV_QPS_RESET"));
+			return FAIL;
+		}
+
+		if (qp_to_init(ctx) || qp_to_rtr(ctx, &ctx->remote_qp) ||
+		    (!config.is_daemon && qp_to_rts(ctx)))
+			return FAIL;
+	}
+
+	VL_DATA_TRACE(("QPs reconnected at MTU %d", 128 << mtu));
+
+	return SUCCESS;
+}
+
+/* Time registration of touched buffers, over page sizes and access flags */
+static void mr_bench_registration(struct resources_t *resource)
+{
+	struct mr_bench_t *mb = resource->mr_bench;
+	uint32_t size;
+
+	for (size = config.mr_bench_min; size <= config.mr_bench; size *= 2) {
+		int huge, remote;
+
+		for (huge = 0; huge < 2; huge++) {
+			size_t len = huge ? (size + RING_ALLOC_CHUNK - 1) & ~(RING_ALLOC_CHUNK - 1) :
+					    (size + 4095) & ~4095UL;
+			void *buf;
+
+			if (huge) {
+				buf = mmap(NULL, len, PROT_READ | PROT_WRITE,
+					   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+				if (buf == MAP_FAILED)
+					buf = NULL;
+			} else if (posix_memalign(&buf, 4096, len)) {
+				buf = NULL;
+			}
+
+			if (buf)
+				memset(buf, 0, len);
+
+			for (remote = 0; remote < 2; remote++) {
+				struct mr_reg_cost_t *c = &mb->costs[mb->num_costs++];
+				int access = IBV_ACCESS_LOCAL_WRITE |
+					     (remote ? IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ : 0);
+				int i;
+
+				c->size = size;
+				c->huge = huge;
+				c->remote = remote;
+
+				for (i = 0; buf && i < MR_BENCH_ROUNDS; i++) {
+					cycles_t t1, t2;
+					struct ibv_mr *mr;
+
+					t1 = get_cycles();
+					mr = ibv_reg_mr(resource->pd, buf, size, access);
+					t2 = get_cycles();
+					if (!mr) {
+						VL_MEM_ERR(("Fail in ibv_reg_mr of %u[B]", size));
+						break;
+					}
+					ibv_dereg_mr(mr);
+
+					c->reg += t2 - t1;
+					c->dereg += get_cycles() - t2;
+					c->rounds++;
+				}
+			}
+
+			if (!buf && huge)
+				VL_MEM_ERR(("WARN: no 2MB pages buffer of %u[B], is vm.nr_hugepages set?",
+					    size));
+			else if (!buf)
+				VL_MEM_ERR(("WARN: no 4KB pages buffer of %u[B]", size));
+			else if (huge)
+				munmap(buf, len);
+			else
+				free(buf);
+		}
+	}
+}
+
+static int do_sender_mr_strategy(struct resources_t *resource)
+{
+	struct mr_bench_t *mb = resource->mr_bench;
+	struct mr_step_t *st = mb->cur;
+	uint64_t hits = mb->cache.hits, misses = mb->cache.misses;
+	struct ibv_send_wr wr, *bad_wr = NULL;
+	uint64_t tot_scnt = 0, tot_ccnt = 0;
+	struct ibv_sge sge;
+	int rc, i;
+
+	memset(&wr, 0, sizeof(wr));
+	wr.wr_id = WR_ID;
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	wr.opcode = IBV_WR_SEND;
+	wr.send_flags = IBV_SEND_SIGNALED;
+	if (config.qp_type == IBV_QPT_UD) {
+		wr.wr.ud.ah = resource->ah;
+		wr.wr.ud.remote_qpn = resource->r_dctn;
+		wr.wr.ud.remote_qkey = QKEY;
+	}
+	sge.length = st->size;
+
+	while (tot_ccnt < config.num_of_iter) {
+		if (tot_scnt < config.num_of_iter && tot_scnt - tot_ccnt < config.ring_depth) {
+			char *buf = mb->pool + (tot_scnt % MR_POOL_BUFS) * mb->stride;
+			uint32_t slot = tot_scnt % config.ring_depth;
+			struct ibv_mr *mr;
+			cycles_t t1 = get_cycles();
+
+			switch (st->strategy) {
+			case MR_STRAT_REG:
+				mr = ibv_reg_mr(resource->pd, buf, st->size, IBV_ACCESS_LOCAL_WRITE);
+				mb->slot_mr[slot] = mr;
+				sge.addr = (uintptr_t)buf;
+				break;
+			case MR_STRAT_CACHE:
+				mr = mr_cache_get(&mb->cache, buf, st->size);
+				sge.addr = (uintptr_t)buf;
+				break;
+			default:
+				mr = mb->bounce_mr;
+				sge.addr = (uintptr_t)(mb->bounce + slot * mb->stride);
+				memcpy((void *)(uintptr_t)sge.addr, buf, st->size);
+				break;
+			}
+
+			if (!mr) {
+				VL_MEM_ERR(("No MR for the message"));
+				return FAIL;
+			}
+			sge.lkey = mr->lkey;
+
+			rc = ibv_post_send(resource->qp, &wr, &bad_wr);
+			st->cycles += get_cycles() - t1;
+			if (rc) {
+				VL_MISC_ERR(("in post send (error: %s)", strerror(rc)));
+				return FAIL;
+			}
+
+			tot_scnt++;
+		}
+
+		rc = ibv_poll_cq(resource->cq, config.batch_size, resource->wc_arr);
+		if (rc < 0) {
+			VL_MISC_ERR(("in ibv_poll_cq (%s)", strerror(rc)));
+			return FAIL;
+		}
+
+		for (i = 0; i < rc; i++) {
+			if (resource->wc_arr[i].status != IBV_WC_SUCCESS) {
+				VL_MISC_ERR(("got WC with error (%d)", resource->wc_arr[i].status));
+				return FAIL;
+			}
+
+			if (st->strategy == MR_STRAT_REG) {
+				struct ibv_mr **mr = &mb->slot_mr[(tot_ccnt + i) % config.ring_depth];
+				cycles_t t1 = get_cycles();
+
+				if (ibv_dereg_mr(*mr)) {
+					VL_MEM_ERR(("Fail in ibv_dereg_mr"));
+					return FAIL;
+				}
+				*mr = NULL;
+				st->cycles += get_cycles() - t1;
+			}
+		}
+
+		tot_ccnt += rc;
+	}
+
+	st->msgs = tot_ccnt;
+	st->hits = mb->cache.hits - hits;
+	st->misses = mb->cache.misses - misses;
+
+	return SUCCESS;
+}
+
+static inline uint32_t dc_next_target(struct dc_fanout_t *dc, uint32_t targets, uint64_t seq)
+{
+	if (config.dc_pattern == DC_PATTERN_RR)
+		return seq % targets;
+
+	/* xorshift32 */
+	dc->rand ^= dc->rand << 13;
+	dc->rand ^= dc->rand >> 17;
+	dc->rand ^= dc->rand << 5;
+
+	return dc->rand % targets;
+}
+
+static inline int dc_pick_dci(struct dc_fanout_t *dc, uint32_t target, uint64_t seq)
+{
+	int d, i;
+
+	switch (config.dci_policy) {
+	case DCI_POLICY_HASH:
+		return target % config.num_qps;
+	case DCI_POLICY_RR:
+		return seq % config.num_qps;
+	default:
+		d = dc->owner[target];
+		if (d >= 0 && dc->dci[d].target == target)
+			return d;
+
+		d = 0;
+		for (i = 1; i < config.num_qps; i++)
+			if (dc->dci[i].last_use < dc->dci[d].last_use)
+				d = i;
+
+		return d;
+	}
+}
+
+/*
+ * Spread the messages of a fan-out step over its targets, through the DCI
+ * the policy picks. A post which moves a DCI to another DCT is a reconnect,
+ * its completion latency is kept apart. Every DCI completes on one CQ.
+ */
+static int do_sender_dc(struct resources_t *resource)
+{
+	struct dc_fanout_t *dc = resource->dc;
+	struct dc_step_t *st = dc->cur;
+	uint64_t scnt = 0, ccnt = 0;
+	uint32_t target = 0;
+	cycles_t start;
+	int d = -1;
+	int i, rc;
+
+	for (i = 0; i < config.num_qps; i++) {
+		dc->dci[i].target = DC_NO_TARGET;
+		dc->dci[i].outstanding = 0;
+		dc->dci[i].last_use = 0;
+		dc->dci[i].posted = 0;
+		dc->dci[i].completed = 0;
+	}
+	for (i = 0; i < (int)config.dc_targets; i++)
+		dc->owner[i] = -1;
+	dc->clock = 0;
+	dc->rand = 0x9e3779b9;
+
+	start = get_cycles();
+
+	while (ccnt < config.num_of_iter) {
+		if (scnt < config.num_of_iter) {
+			/* A message waits on a full DCI, its target and DCI stay picked */
+			if (d < 0) {
+				target = dc_next_target(dc, st->targets, scnt);
+				d = dc_pick_dci(dc, target, scnt);
+			}
+
+			if (dc->dci[d].outstanding < config.ring_depth) {
+				struct resources_t *ctx = qp_ctx(resource, d);
+				uint64_t reconnect = dc->dci[d].target != target;
+				cycles_t t1, t2;
+
+				t1 = get_cycles();
+				ibv_wr_start(ctx->eqp);
+				ctx->eqp->wr_id = scnt | (uint64_t)d << DC_WR_DCI_SHIFT | reconnect << 63;
+				ctx->eqp->wr_flags = IBV_SEND_SIGNALED;
+				ibv_wr_send(ctx->eqp);
+				mlx5dv_wr_set_dc_addr(ctx->dv_qp, resource->ah, dc->dctn[target], DC_KEY);
+				ibv_wr_set_sge(ctx->eqp, resource->mr->ibv_mr->lkey,
+					       (uintptr_t)resource->mr->addr, config.msg_sz);
+				rc = ibv_wr_complete(ctx->eqp);
+				t2 = get_cycles();
+				if (rc) {
+					VL_MISC_ERR(("Fail to post on DCI %d (%s)", d, strerror(rc)));
+					return FAIL;
+				}
+
+				dc->post_ts[d * config.ring_depth + dc->dci[d].posted++ % config.ring_depth] = t2;
+				st->post_cycles += t2 - t1;
+				st->reconnects += reconnect;
+
+				dc->dci[d].target = target;
+				dc->dci[d].outstanding++;
+				dc->dci[d].last_use = ++dc->clock;
+				dc->owner[target] = d;
+
+				scnt++;
+				d = -1;
+			}
+		}
+
+		rc = ibv_poll_cq(resource->cq, config.batch_size, resource->wc_arr);
+		if (rc < 0) {
+			VL_MISC_ERR(("in ibv_poll_cq (%s)", strerror(rc)));
+			return FAIL;
+		}
+
+		if (rc) {
+			cycles_t now = get_cycles();
+
+			for (i = 0; i < rc; i++) {
+				uint64_t wr_id = resource->wc_arr[i].wr_id;
+				uint32_t n = (wr_id >> DC_WR_DCI_SHIFT) & (DC_MAX_DCIS - 1);
+				struct dci_state_t *dci = &dc->dci[n];
+				cycles_t lat;
+
+				if (resource->wc_arr[i].status != IBV_WC_SUCCESS) {
+					VL_MISC_ERR(("got WC with error (%d)", resource->wc_arr[i].status));
+					return FAIL;
+				}
+
+				/* DCIs overtake each other, a slot is only reused by its own DCI */
+				lat = now - dc->post_ts[n * config.ring_depth +
+						       dci->completed++ % config.ring_depth];
+				dci->outstanding--;
+				if (wr_id >> 63)
+					st->reconnect_lat += lat;
+				else
+					st->hit_lat += lat;
+			}
+
+			ccnt += rc;
+		}
+	}
+
+	st->duration = get_cycles() - start;
+	st->msgs = ccnt;
+
+	VL_DATA_TRACE(("DC sender exit with %lu messages, %lu reconnects", ccnt, st->reconnects));
+
+	return SUCCESS;
+}
+
+static int run_sender_step(struct resources_t *resource, struct rate_step_t *step)
+{
+	/* Every run replays the workload schedule from its start */
+	resource->wl_seq = 0;
+
+	if (sock_sync_ready(resource)) {
+		VL_SOCK_ERR(("Sync before traffic"));
+		return FAIL;
+	}
+
+	resource->capture_start = get_cycles();
+
+	if (step) {
+		if (do_sender_open_loop(resource, step))
+			return FAIL;
+	} else if (config.trace.recs) {
+		if (do_sender_replay(resource))
+			return FAIL;
+	} else if (resource->cur_prod_step) {
+		if (do_sender_producers(resource))
+			return FAIL;
+	} else if (resource->mr_bench && resource->mr_bench->cur) {
+		if (do_sender_mr_strategy(resource))
+			return FAIL;
+	} else if (resource->comp_mode == COMP_THREAD) {
+		if (do_sender_comp_thread(resource))
+			return FAIL;
+	} else if (resource->dc) {
+		if (do_sender_dc(resource))
+			return FAIL;
+	} else if (config.num_qps > 1 || config.threads > 1 || resource->cur_atomic_step) {
+		if (do_sender_multi_qp(resource))
+			return FAIL;
+	} else if (resource->soak) {
+		if (do_sender_duration(resource))
+			return FAIL;
+	} else {
+		if (do_sender(resource))
+			return FAIL;
+	}
+
+	resource->step_duration = get_cycles() - resource->capture_start;
+
+	if (resource->soak &&
+	    send_info(resource, &resource->soak->completed, sizeof(resource->soak->completed)))
+		return FAIL;
+
+	if (config.trace_out && capture_flush(resource, config.num_of_iter))
+		return FAIL;
+
+	VL_DATA_TRACE(("Wait for Receiver"));
+	if (sock_sync_ready(resource)) {
+		VL_SOCK_ERR(("Sync after traffic"));
+		return FAIL;
+	}
+
+	return SUCCESS;
+}
+
+static int run_receiver_step(struct resources_t *resource)
+{
+	int rc;
+
+	rc = prepare_receiver(resource);
+	if (rc)
+		return FAIL;
+
+	VL_DATA_TRACE(("Run receiver"));
+
+	if (sock_sync_ready(resource)) {
+		VL_SOCK_ERR(("Sync before traffic"));
+		return FAIL;
+	}
+
+	if (config.workload ? resource->wl_recv_cnt :
+	    (config.opcode != IBV_WR_RDMA_WRITE &&
+	     config.opcode != IBV_WR_RDMA_READ &&
+	     config.opcode != IBV_WR_ATOMIC_FETCH_AND_ADD &&
+	     config.opcode != IBV_WR_ATOMIC_CMP_AND_SWP &&
+	     config.opcode != IBV_WR_LOCAL_INV &&
+	     config.opcode != IBV_WR_BIND_MW)) {
+		if (config.duration ? do_receiver_duration(resource) :
+		    config.srq_refill ? do_receiver_srq(resource) : do_receiver(resource))
+			return FAIL;
+	} else if (config.duration) {
+		uint64_t msgs;
+
+		/* Nothing to reap, the count is only taken off the socket */
+		if (recv_info(resource, &msgs, sizeof(msgs)))
+			return FAIL;
+	}
+
+	VL_DATA_TRACE(("Wait for Sender"));
+	if (sock_sync_ready(resource)) {
+		VL_SOCK_ERR(("Sync after traffic"));
+		return FAIL;
+	}
+
+	return SUCCESS;
+}
+
+/*
+ * Producer counts double up to --producers, every count runs each mode.
+ * A QP per thread needs as many QPs as producers.
+ */
+static int run_producers(struct resources_t *resource)
+{
+	struct sync_step_t step_ctl = {0};
+	int producers = 1;
+	uint64_t j;
+
+	while (1) {
+		int mode;
+
+		for (mode = 0; mode < PROD_NUM_MODES; mode++) {
+			struct prod_step_t *st;
+
+			if (mode == PROD_QP_PER_THREAD && producers > config.num_qps)
+				continue;
+
+			if (resource->num_prod_steps == MAX_PROD_STEPS)
+				goto out;
+
+			st = &resource->prod_steps[resource->num_prod_steps];
+			st->mode = mode;
+			st->producers = producers;
+			resource->cur_prod_step = st;
+
+			step_ctl.step = resource->num_prod_steps;
+			if (send_info(resource, &step_ctl, sizeof(step_ctl)))
+				return FAIL;
+
+			if (run_sender_step(resource, NULL))
+				return FAIL;
+
+			stats_sort_cycles(resource->lat, config.num_of_iter);
+			st->p50 = stats_percentile_cycles(resource->lat, config.num_of_iter, 50);
+			st->p99 = stats_percentile_cycles(resource->lat, config.num_of_iter, 99);
+			st->max = resource->lat[config.num_of_iter - 1];
+			st->lat_avg = 0;
+			for (j = 0; j < config.num_of_iter; j++)
+				st->lat_avg += resource->lat[j];
+			st->lat_avg /= config.num_of_iter;
+
+			resource->num_prod_steps++;
+		}
+
+		if (producers == config.producers)
+			break;
+
+		producers *= 2;
+		if (producers > config.producers)
+			producers = config.producers;
+	}
+
+out:
+	resource->cur_prod_step = NULL;
+	step_ctl.stop = 1;
+
+	return send_info(resource, &step_ctl, sizeof(step_ctl));
+}
+
+/* Run the inline polling baseline and then the completion thread on the same QP */
+static int run_comp_compare(struct resources_t *resource)
+{
+	struct sync_step_t step_ctl = {0};
+	uint64_t j;
+	int i;
+
+	for (i = 0; i < COMP_NUM_MODES; i++) {
+		struct comp_step_t *st = &resource->comp_steps[i];
+
+		resource->comp_mode = i;
+
+		/* Post-time stats describe the last step */
+		memset(&resource->measure, 0, sizeof(resource->measure));
+		resource->measure.min = ~0;
+
+		step_ctl.step = i;
+		if (send_info(resource, &step_ctl, sizeof(step_ctl)))
+			return FAIL;
+
+		if (run_sender_step(resource, NULL))
+			return FAIL;
+
+		stats_sort_cycles(resource->lat, config.num_of_iter);
+		st->p50 = stats_percentile_cycles(resource->lat, config.num_of_iter, 50);
+		st->p99 = stats_percentile_cycles(resource->lat, config.num_of_iter, 99);
+		st->max = resource->lat[config.num_of_iter - 1];
+		st->lat_avg = 0;
+		for (j = 0; j < config.num_of_iter; j++)
+			st->lat_avg += resource->lat[j];
+		st->lat_avg /= config.num_of_iter;
+	}
+
+	step_ctl.stop = 1;
+
+	return send_info(resource, &step_ctl, sizeof(step_ctl));
+}
+
+/* Step every size through the three strategies, the receiver just receives */
+static int run_mr_bench(struct resources_t *resource)
+{
+	struct mr_bench_t *mb = resource->mr_bench;
+	struct sync_step_t step_ctl = {0};
+	uint32_t size, i;
+	int rc = FAIL;
+
+	mr_bench_registration(resource);
+
+	mb->stride = (config.mr_bench + 4095) & ~4095UL;
+	if (posix_memalign((void **)&mb->pool, 4096, MR_POOL_BUFS * mb->stride) ||
+	    posix_memalign((void **)&mb->bounce, 4096, config.ring_depth * mb->stride)) {
+		VL_MEM_ERR((" Fail in alloc registration benchmark buffers"));
+		goto out;
+	}
+	memset(mb->pool, 0xE, MR_POOL_BUFS * mb->stride);
+
+	mb->slot_mr = calloc(config.ring_depth, sizeof(*mb->slot_mr));
+	mb->bounce_mr = ibv_reg_mr(resource->pd, mb->bounce, config.ring_depth * mb->stride,
+				   IBV_ACCESS_LOCAL_WRITE);
+	if (!mb->slot_mr || !mb->bounce_mr) {
+		VL_MEM_ERR((" Fail to set up the registration benchmark"));
+		goto out;
+	}
+
+	mr_cache_init(&mb->cache, resource->pd, IBV_ACCESS_LOCAL_WRITE);
+
+	for (size = config.mr_bench_min; size <= config.mr_bench; size *= 2) {
+		int strategy;
+
+		for (strategy = 0; strategy < MR_STRAT_NUM; strategy++) {
+			struct mr_step_t *st = &mb->steps[mb->num_steps];
+
+			st->size = size;
+			st->strategy = strategy;
+			mb->cur = st;
+
+			step_ctl.step = mb->num_steps;
+			if (send_info(resource, &step_ctl, sizeof(step_ctl)))
+				goto out;
+
+			if (run_sender_step(resource, NULL))
+				goto out;
+
+			mb->num_steps++;
+
+			/* Each size starts cold, the cache sees its buffers anew */
+			if (mr_cache_flush(&mb->cache))
+				goto out;
+		}
+	}
+
+	rc = SUCCESS;
+
+out:
+	mb->cur = NULL;
+
+	mr_cache_flush(&mb->cache);
+	if (mb->slot_mr) {
+		for (i = 0; i < config.ring_depth; i++)
+			if (mb->slot_mr[i])
+				ibv_dereg_mr(mb->slot_mr[i]);
+		free(mb->slot_mr);
+	}
+	if (mb->bounce_mr)
+		ibv_dereg_mr(mb->bounce_mr);
+	free(mb->bounce);
+	free(mb->pool);
+
+	if (rc)
+		return FAIL;
+
+	step_ctl.stop = 1;
+
+	return send_info(resource, &step_ctl, sizeof(step_ctl));
+}
+
+/*
+ * Targets double from one address all QPs contend on, a QP's atomics go
+ * round robin over its share: at num_qps targets every QP owns one, past
+ * that each owns several. Extended atomics repeat it per argument size.
+ */
+static int run_atomic_bench(struct resources_t *resource)
+{
+	uint32_t arg_mask = resource->hca_p->atomic_arg_mask;
+	uint32_t max_arg = config.ext_atomic ? resource->hca_p->max_atomic_arg : config.msg_sz;
+	struct sync_step_t step_ctl = {0};
+	uint32_t arg_sz, targets;
+	int i;
+
+	for (i = 0; i < config.num_qps; i++) {
+		qp_ctx(resource, i)->at_base = i;
+		qp_ctx(resource, i)->at_step = config.num_qps;
+	}
+
+	for (arg_sz = config.ext_atomic ? ATOMIC_MIN_ARG : config.msg_sz;
+	     arg_sz <= max_arg; arg_sz *= 2) {
+		if (config.ext_atomic && arg_mask && !(arg_mask & arg_sz)) {
+			VL_MISC_TRACE1(("Extended atomic of %u[B] is unsupported, skipped", arg_sz));
+			continue;
+		}
+
+		for (targets = 1; targets <= config.atomic_targets; targets *= 2) {
+			struct atomic_step_t *st = &resource->atomic_steps[resource->num_atomic_steps];
+
+			VL_DATA_TRACE(("Run atomic step, %u[B] over %u targets", arg_sz, targets));
+
+			st->arg_sz = arg_sz;
+			st->targets = targets;
+			for (i = 0; i < config.num_qps; i++) {
+				struct resources_t *ctx = qp_ctx(resource, i);
+
+				ctx->at_seq = 0;
+				ctx->at_mask = targets - 1;
+				ctx->atomic_arg_sz = arg_sz;
+			}
+			resource->cur_atomic_step = st;
+
+			step_ctl.step = resource->num_atomic_steps;
+			if (send_info(resource, &step_ctl, sizeof(step_ctl)))
+				return FAIL;
+
+			if (run_sender_step(resource, NULL))
+				return FAIL;
+
+			resource->num_atomic_steps++;
+		}
+	}
+
+	resource->cur_atomic_step = NULL;
+	step_ctl.stop = 1;
+
+	return send_info(resource, &step_ctl, sizeof(step_ctl));
+}
+
+/* Targets double up to --dc_targets, so the rate shows where they outgrow the DCIs */
+static int run_dc_fanout(struct resources_t *resource)
+{
+	struct dc_fanout_t *dc = resource->dc;
+	struct sync_step_t step_ctl = {0};
+	uint32_t targets = 1;
+
+	while (dc->num_steps < DC_MAX_STEPS) {
+		struct dc_step_t *st = &dc->steps[dc->num_steps];
+
+		VL_DATA_TRACE(("Run DC fan-out step, %u targets from %d DCIs", targets, config.num_qps));
+
+		st->targets = targets;
+		dc->cur = st;
+
+		step_ctl.step = dc->num_steps;
+		if (send_info(resource, &step_ctl, sizeof(step_ctl)))
+			return FAIL;
+
+		if (run_sender_step(resource, NULL))
+			return FAIL;
+
+		dc->num_steps++;
+
+		if (targets == config.dc_targets)
+			break;
+
+		targets = targets * 2 < config.dc_targets ? targets * 2 : config.dc_targets;
+	}
+
+	dc->cur = NULL;
+	step_ctl.stop = 1;
+
+	return send_info(resource, &step_ctl, sizeof(step_ctl));
+}
+
+/* ibv_create_ah and ibv_destroy_ah of an AH per destination, none kept */
+static int ud_ah_bench(struct resources_t *resource)
+{
+	struct ud_fanout_t *ud = resource->ud;
+	struct ibv_ah **ahs;
+	cycles_t t1;
+	uint32_t i, num;
+
+	ahs = VL_MALLOC(config.ud_dests * sizeof(*ahs), struct ibv_ah *);
+	if (!ahs) {
+		VL_MEM_ERR(("Fail to alloc the AH benchmark"));
+		return FAIL;
+	}
+
+	for (num = 0; num < config.ud_dests; num++) {
+		t1 = get_cycles();
+		ahs[num] = ibv_create_ah(resource->pd, &ud->attr);
+		ud->create_lat[num] = get_cycles() - t1;
+		if (!ahs[num]) {
+			VL_DATA_ERR(("Fail in ibv_create_ah of destination %u", num));
+			break;
+		}
+	}
+
+	t1 = get_cycles();
+	for (i = 0; i < num; i++)
+		ibv_destroy_ah(ahs[i]);
+	ud->destroy_cycles = get_cycles() - t1;
+
+	VL_FREE(ahs);
+
+	if (num < config.ud_dests)
+		return FAIL;
+
+	stats_sort_cycles(ud->create_lat, config.ud_dests);
+
+	return SUCCESS;
+}
+
+/*
+ * Time AH creation for every destination, then send to them all once with
+ * the one AH of the server port and once with an AH per destination out
+ * of the cache. The difference of the post cost is the lookup.
+ */
+static int run_ud_fanout(struct resources_t *resource)
+{
+	struct ud_fanout_t *ud = resource->ud;
+	struct sync_step_t step_ctl = {0};
+	int mode;
+
+	if (ud_ah_bench(resource) ||
+	    ah_cache_init(&ud->cache, resource->pd, config.ah_cache))
+		return FAIL;
+
+	for (mode = 0; mode < UD_AH_NUM_MODES; mode++) {
+		struct ud_step_t *st = &ud->steps[mode];
+		struct ah_cache_t start;
+		uint32_t i;
+
+		VL_DATA_TRACE(("Run UD fan-out step, %s AH", mode == UD_AH_CACHE ? "cached" : "shared"));
+
+		/*
+		 * An untimed pass in send order, so a cache which holds all the
+		 * destinations only looks up. A smaller one keeps missing anyway.
+		 */
+		for (i = 0; mode == UD_AH_CACHE && i < config.ud_dests; i++)
+			if (!ah_cache_get(&ud->cache, ud->qpn[i], &ud->attr)) {
+				VL_DATA_ERR(("The AH cache failed to create an AH"));
+				return FAIL;
+			}
+		start = ud->cache;
+
+		ud->mode = mode;
+		ud->seq = 0;
+		memset(&resource->measure, 0, sizeof(resource->measure));
+		resource->measure.min = ~0;
+
+		step_ctl.step = mode;
+		if (send_info(resource, &step_ctl, sizeof(step_ctl)))
+			return FAIL;
+
+		if (run_sender_step(resource, NULL))
+			return FAIL;
+
+		if (ud->error) {
+			VL_DATA_ERR(("The AH cache failed to create an AH"));
+			return FAIL;
+		}
 
-	VL_DATA_TRACE1(("Going to create flow rule"));
+		st->msgs = config.num_of_iter;
+		st->post_cycles = resource->measure.tot;
+		st->duration = resource->step_duration;
+		st->hits = ud->cache.hits - start.hits;
+		st->misses = ud->cache.misses - start.misses;
+		st->evictions = ud->cache.evictions - start.evictions;
+		st->create_cycles = ud->cache.create_cycles - start.create_cycles;
+	}
 
-	resource->flow = ibv_create_flow(resource->qp , &flow_attr.attr);
-	if (!resource->flow) {
-		VL_DATA_ERR(("Fail to create flow rule (errno %d)", errno));
+	step_ctl.stop = 1;
+
+	return send_info(resource, &step_ctl, sizeof(step_ctl));
+}
+
+/* A depth or MTU sweep step, its post and latency come off the workload stats */
+static int run_sweep_step(struct resources_t *resource, uint32_t size)
+{
+	struct wl_op_stats_t *op = &resource->wl_stats[config.opcode];
+	struct sweep_step_t *st = &resource->sweep_steps[resource->num_sweep_steps];
+	uint64_t completed = op->completed;
+	cycles_t post_cycles = op->post_cycles;
+	cycles_t lat_cycles = op->lat_cycles;
+
+	VL_DATA_TRACE(("Run sweep step, %u[B] with %u in flight at MTU %d",
+		       size, resource->window, 128 << resource->path_mtu));
+
+	if (run_sender_step(resource, NULL))
 		return FAIL;
+
+	st->size = size;
+	st->window = resource->window;
+	st->mtu = resource->path_mtu;
+	st->msgs = op->completed - completed;
+	st->post_cycles = op->post_cycles - post_cycles;
+	st->lat_cycles = op->lat_cycles - lat_cycles;
+	st->duration = resource->step_duration;
+	resource->num_sweep_steps++;
+
+	return SUCCESS;
+}
+
+/*
+ * Every step posts the whole schedule at the next size of the sweep.
+ * A depth sweep runs each size with windows doubling up to the ring, an
+ * MTU sweep at every MTU up to the negotiated one. The receiver only sees
+ * the size index, and the MTU to reconnect at.
+ */
+static int run_size_sweep(struct resources_t *resource)
+{
+	struct wl_entry_t *sched = (struct wl_entry_t *)resource->wl_sched;
+	struct sync_step_t step_ctl = {0};
+	enum ibv_mtu max_mtu = resource->path_mtu;
+	uint32_t window;
+	int i, j, mtu;
+
+	for (i = 0; i < config.wl.num_sizes; i++) {
+		VL_DATA_TRACE(("Run size sweep step, %u[B]", config.wl.sizes[i]));
+
+		for (j = 0; j < WL_SCHED_LEN; j++)
+			sched[j].size = config.wl.sizes[i];
+
+		step_ctl.step = i;
+
+		if (config.mtu_sweep) {
+			for (mtu = IBV_MTU_256; mtu <= (int)max_mtu; mtu++) {
+				step_ctl.mtu = mtu;
+				if (reconnect_qps(resource, mtu))
+					return FAIL;
+
+				if (send_info(resource, &step_ctl, sizeof(step_ctl)))
+					return FAIL;
+
+				if (run_sweep_step(resource, config.wl.sizes[i]))
+					return FAIL;
+			}
+
+			continue;
+		}
+
+		if (!config.depth_sweep) {
+			if (send_info(resource, &step_ctl, sizeof(step_ctl)))
+				return FAIL;
+
+			if (run_sender_step(resource, NULL))
+				return FAIL;
+
+			continue;
+		}
+
+		for (window = 1; ; window *= 2) {
+			if (window > config.ring_depth)
+				window = config.ring_depth;
+
+			if (send_info(resource, &step_ctl, sizeof(step_ctl)))
+				return FAIL;
+
+			resource->window = window;
+			if (run_sweep_step(resource, config.wl.sizes[i]))
+				return FAIL;
+
+			if (window == config.ring_depth)
+				break;
+		}
 	}
 
-	VL_DATA_TRACE1(("Finish to create flow rule"));
+	resource->window = config.ring_depth;
+	step_ctl.stop = 1;
+
+	return send_info(resource, &step_ctl, sizeof(step_ctl));
+}
+
+/*
+ * The warm-up step takes the cold I-cache, TLB and CQ state and is thrown
+ * away. The measured runs follow over the same QP, each one is a sample.
+ */
+static int run_repeats(struct resources_t *resource)
+{
+	struct sync_step_t step_ctl = {0};
+	uint32_t k;
+
+	if (config.warmup) {
+		VL_DATA_TRACE(("Run warm-up, %u messages", config.warmup));
+
+		step_ctl.step = SYNC_STEP_WARMUP;
+		if (send_info(resource, &step_ctl, sizeof(step_ctl)))
+			return FAIL;
+
+		resource->warmup_step = 1;
+		if (run_sender_step(resource, NULL))
+			return FAIL;
+		resource->warmup_step = 0;
+
+		memset(&resource->measure, 0, sizeof(resource->measure));
+		resource->measure.min = ~0;
+		memset(resource->method_measure, 0, sizeof(resource->method_measure));
+		memset(resource->perf_post, 0, sizeof(resource->perf_post));
+		memset(&resource->perf_poll, 0, sizeof(resource->perf_poll));
+		memset(resource->comp_steps, 0, sizeof(resource->comp_steps));
+	}
+
+	for (k = 0; k < config.repeat; k++) {
+		cycles_t post_cycles = resource->measure.tot;
+
+		VL_DATA_TRACE(("Run measured run %u", k));
+
+		step_ctl.step = k;
+		if (send_info(resource, &step_ctl, sizeof(step_ctl)))
+			return FAIL;
+
+		if (run_sender_step(resource, NULL))
+			return FAIL;
+
+		if (resource->runs) {
+			resource->runs[k].post_cycles = resource->measure.tot - post_cycles;
+			resource->runs[k].duration = resource->step_duration;
+			resource->num_runs++;
+		}
+	}
+
+	step_ctl.stop = 1;
+
+	return send_info(resource, &step_ctl, sizeof(step_ctl));
+}
+
+/* Steps the open-loop rate until the achieved rate falls behind the offered one */
+static int run_open_loop(struct resources_t *resource)
+{
+	struct sync_step_t step_ctl = {0};
+	double rate = config.rate;
+	int i;
+
+	for (i = 0; i < MAX_RATE_STEPS; i++) {
+		struct rate_step_t *step = &resource->rate_steps[i];
+
+		VL_DATA_TRACE(("Run open-loop sender at %.0lf[msg/s]", rate));
+
+		step->offered = rate;
+		build_arrival_schedule(resource, rate);
+
+		/* Post-time stats describe the last step */
+		memset(&resource->measure, 0, sizeof(resource->measure));
+		resource->measure.min = ~0;
+
+		step_ctl.step = i;
+		if (send_info(resource, &step_ctl, sizeof(step_ctl)))
+			return FAIL;
+
+		if (run_sender_step(resource, step))
+			return FAIL;
+
+		resource->num_rate_steps++;
+
+		if (!config.rate_step || step->achieved < RATE_SATURATION * step->offered)
+			break;
+
+		rate *= config.rate_step;
+	}
+
+	step_ctl.stop = 1;
+
+	return send_info(resource, &step_ctl, sizeof(step_ctl));
+}
+
+static int do_test_sender(struct resources_t *resource)
+{
+	int rc;
+
+	VL_DATA_TRACE(("Run sender"));
+
+	resource->measure.min = ~0; //initialize to max value of unsigned type
+
+	if (config.rate || config.trace_path || config.trace_out || config.duration) {
+		resource->cpu_mhz = get_cpu_mhz(1);
+		if (!resource->cpu_mhz) {
+			VL_MISC_ERR(("Can't calibrate TSC"));
+			return FAIL;
+		}
+	}
+
+	if (config.trace_out &&
+	    trace_writer_open(&resource->capture, config.trace_out))
+		return FAIL;
+
+	if (config.rate)
+		rc = run_open_loop(resource);
+	else if (config.comp_cpu >= 0)
+		rc = run_comp_compare(resource);
+	else if (config.producers)
+		rc = run_producers(resource);
+	else if (config.mr_bench)
+		rc = run_mr_bench(resource);
+	else if (config.atomic_targets)
+		rc = run_atomic_bench(resource);
+	else if (config.dc_targets)
+		rc = run_dc_fanout(resource);
+	else if (config.ud_dests)
+		rc = run_ud_fanout(resource);
+	else if (config.size_sweep)
+		rc = run_size_sweep(resource);
+	else if (config.warmup || config.repeat > 1)
+		rc = run_repeats(resource);
+	else
+		rc = run_sender_step(resource, NULL);
+
+	if (trace_writer_close(&resource->capture))
+		return FAIL;
+
+	return rc;
+}
+
+/* The workers receive, the server only syncs with the client around them */
+static int run_xrc_procs(struct resources_t *resource)
+{
+	VL_DATA_TRACE(("Run %d XRC workers", resource->xrc_procs->num));
+
+	if (sock_sync_ready(resource)) {
+		VL_SOCK_ERR(("Sync before traffic"));
+		return FAIL;
+	}
+
+	if (xrc_procs_wait(resource->xrc_procs))
+		return FAIL;
+
+	if (sock_sync_ready(resource)) {
+		VL_SOCK_ERR(("Sync after traffic"));
+		return FAIL;
+	}
 
 	return SUCCESS;
 }
 
-static void init_eth_header(struct resources_t *resource, uint8_t *smac, uint8_t *dmac)
+static int do_test_receiver(struct resources_t *resource)
 {
-	struct ETH_header *eth_header = resource->mr->addr;
-	size_t frame_size = config.msg_sz;
+	struct sync_step_t step_ctl;
 
-	memcpy(eth_header->src_mac, smac, MAC_LEN);
-	memcpy(eth_header->dst_mac, dmac, MAC_LEN);
-	eth_header->eth_type = htons(frame_size - ETH_HDR_SIZE); /* Payload and CRC */
+	if (config.xrc_procs)
+		return run_xrc_procs(resource);
+
+	if (!config.stepped)
+		return run_receiver_step(resource);
+
+	while (1) {
+		if (recv_info(resource, &step_ctl, sizeof(step_ctl)))
+			return FAIL;
+
+		if (step_ctl.stop)
+			break;
+
+		VL_DATA_TRACE(("Receiver step %u", step_ctl.step));
+
+		resource->warmup_step = step_ctl.step == SYNC_STEP_WARMUP;
+
+		if (step_ctl.mtu && reconnect_qps(resource, step_ctl.mtu))
+			return FAIL;
+
+		if (resource->recv_steps && step_ctl.step < (uint32_t)config.wl.num_sizes) {
+			resource->cur_recv_step = &resource->recv_steps[step_ctl.step];
+			resource->cur_recv_step->size = config.wl.sizes[step_ctl.step];
+		}
+
+		if (run_receiver_step(resource))
+			return FAIL;
+	}
+
+	return SUCCESS;
 }
 
-static int qp_to_init(const struct resources_t *resource)
+int do_test(struct resources_t *resource)
 {
-	struct ibv_qp_attr attr = {
-		.qp_state        = IBV_QPS_INIT,
-		.pkey_index      = 0,
-		.port_num        = IB_PORT,
+	if (!config.is_daemon)
+		return do_test_sender(resource);
+
+	return do_test_receiver(resource);
+}
+
+/*
+ * Loopback: the server side is a second resource set on the same device,
+ * created with the server role. QPs are connected directly and the step
+ * syncs run over a socketpair, so nothing goes through TCP. The role is
+ * config.is_daemon, set just around the server setup, so the receiver
+ * thread runs as a client; modes that need the server role after setup
+ * are rejected by force_configurations_dependencies().
+ */
+int loopback_init(struct resources_t *client, struct resources_t *server)
+{
+	int perf_counters = config.perf_counters;
+	int sv[2];
+	int rc;
+
+	/* Counters count the opening thread, just the sender is measured */
+	config.perf_counters = 0;
+	config.is_daemon = 1;
+
+	rc = resource_alloc(server);
+	if (rc == SUCCESS)
+		rc = resource_init(server);
+
+	config.is_daemon = 0;
+	config.perf_counters = perf_counters;
+
+	if (rc)
+		return FAIL;
+
+	if (config.stepped && (!config.workload || server->wl_recv_cnt) &&
+	    (recv_iterations(server) < server->rx_depth ||
+	     (config.warmup && config.warmup < server->rx_depth))) {
+		VL_MISC_ERR(("Stepped traffic requires iterations >= ring size"));
+		return FAIL;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+		VL_SOCK_ERR(("Fail to create the loopback socketpair (errno %d)", errno));
+		return FAIL;
+	}
+
+	client->loop_fd = sv[0];
+	server->loop_fd = sv[1];
+
+	return SUCCESS;
+}
+
+int loopback_connect(struct resources_t *client, struct resources_t *server)
+{
+	struct sync_post_connection_t post_info = {0};
+	struct sync_conf_info_t caps = {0};
+	int rc, i;
+
+	/* Both sides live on the one HCA */
+	local_qp_caps(client, &caps);
+	apply_qp_caps(client, &caps, &caps);
+	apply_qp_caps(server, &caps, &caps);
+
+	for (i = 0; i < config.num_qps; i++) {
+		struct sync_qp_info_t client_info = {0};
+		struct sync_qp_info_t server_info = {0};
+
+		fill_local_qp_info(qp_ctx(client, i), &client_info);
+		fill_local_qp_info(qp_ctx(server, i), &server_info);
+
+		config.is_daemon = 1;
+		rc = connect_qp(qp_ctx(server, i), &server_info, &client_info);
+		config.is_daemon = 0;
+		if (rc)
+			return FAIL;
+
+		if (connect_qp(qp_ctx(client, i), &client_info, &server_info))
+			return FAIL;
+	}
+
+	config.is_daemon = 1;
+	post_connection_info(server, &post_info);
+	config.is_daemon = 0;
+
+	apply_post_connection(client, &post_info);
+
+	VL_DATA_TRACE(("Loopback connection is done"));
+
+	return SUCCESS;
+}
+
+struct loopback_side_t {
+	struct resources_t	*resource;
+	int			cpu;
+	int			rc;
+};
+
+static void *loopback_receiver_main(void *arg)
+{
+	struct loopback_side_t *side = arg;
+
+	if (side->cpu >= 0 && pin_thread(pthread_self(), side->cpu)) {
+		side->rc = FAIL;
+		/* Unblocks the sender's next sync */
+		shutdown(side->resource->loop_fd, SHUT_RDWR);
+		return NULL;
+	}
+
+	side->rc = do_test_receiver(side->resource);
+
+	return NULL;
+}
+
+/* The receiver runs on its own thread, the sender on the calling one */
+int loopback_test(struct resources_t *client, struct resources_t *server)
+{
+	struct loopback_side_t side = {
+		.resource = server,
+		.cpu = config.lb_cpu[1],
 	};
-	int attr_mask = IBV_QP_STATE | IBV_QP_PORT;
+	pthread_t thread;
+	int rc;
 
-	if (config.qp_type == IBV_QPT_RC) { //RC
-		attr_mask |= IBV_QP_ACCESS_FLAGS | IBV_QP_PKEY_INDEX;
-		attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE |
-				       IBV_ACCESS_REMOTE_WRITE |
-				       IBV_ACCESS_REMOTE_READ |
-				       IBV_ACCESS_REMOTE_ATOMIC;
-	} else if ((config.qp_type == IBV_QPT_DRIVER && config.is_daemon) ||
-		   config.qp_type == IBV_QPT_XRC_RECV) { //DCT and XRC_RECV
-		attr_mask |= IBV_QP_ACCESS_FLAGS | IBV_QP_PKEY_INDEX;
-		attr.qp_access_flags = IBV_ACCESS_REMOTE_WRITE |
-				       IBV_ACCESS_REMOTE_READ |
-				       IBV_ACCESS_REMOTE_ATOMIC;
-	} else if (config.qp_type == IBV_QPT_DRIVER && !config.is_daemon) { //DCI
-		attr_mask |= IBV_QP_PKEY_INDEX;
-	} else if (config.qp_type == IBV_QPT_XRC_SEND) { //XRC_SEND
-		attr_mask |= IBV_QP_PKEY_INDEX | IBV_QP_ACCESS_FLAGS;
-	} else if (config.qp_type == IBV_QPT_UD) { //UD
-		attr_mask |= IBV_QP_QKEY | IBV_QP_PKEY_INDEX;
-		attr.qkey = QKEY;
+	rc = pthread_create(&thread, NULL, loopback_receiver_main, &side);
+	if (rc) {
+		VL_MISC_ERR(("Fail to create the loopback receiver thread (%s)", strerror(rc)));
+		return FAIL;
+	}
+
+	rc = SUCCESS;
+	if (config.lb_cpu[0] >= 0)
+		rc = pin_thread(pthread_self(), config.lb_cpu[0]);
+
+	if (rc == SUCCESS)
+		rc = do_test_sender(client);
+
+	/* Unblocks a receiver waiting on a step sync */
+	if (rc)
+		shutdown(client->loop_fd, SHUT_RDWR);
+
+	pthread_join(thread, NULL);
+
+	return rc || side.rc ? FAIL : SUCCESS;
+}
+
+static void print_perf_measure(const struct perf_counters_t *pc, const char *title,
+			       const struct perf_measure_t *m)
+{
+	int i;
+
+	if (!m->batches)
+		return;
+
+	VL_MISC_TRACE((" %s: %lu batches, %lu messages", title, m->batches, m->msgs));
+	VL_MISC_TRACE(("   %-16s %16s %16s", "counter", "per batch", "per message"));
+
+	for (i = 0; i < PC_NUM_COUNTERS; i++) {
+		if (pc->cnt[i].fd < 0) {
+			VL_MISC_TRACE(("   %-16s %16s %16s", perf_counter_name(i), "n/a", "n/a"));
+			continue;
+		}
+
+		VL_MISC_TRACE(("   %-16s %16.2lf %16.2lf", perf_counter_name(i),
+			       (double)m->tot[i] / m->batches,
+			       (double)m->tot[i] / m->msgs));
+	}
+}
+
+static int print_perf_results(struct resources_t *resource)
+{
+	static const char *method_str[] = { "OLD post", "NEW post" };
+	int i;
+
+	VL_MISC_TRACE((" ---------------------- HW Counters  ----------------"));
+
+	for (i = 0; i < METHOD_MIX; i++)
+		print_perf_measure(resource->perf, method_str[i], &resource->perf_post[i]);
+
+	print_perf_measure(resource->perf, config.is_daemon ? "Poll CQ and post recv" : "Poll CQ",
+			   &resource->perf_poll);
+
+	VL_MISC_TRACE((" ----------------------------------------------------"));
+
+	return SUCCESS;
+}
+
+static void print_producer_results(struct resources_t *resource, double freq)
+{
+	static const char *mode_str[] = { "MPSC ring", "QP mutex", "QP per thread" };
+	int i;
+
+	VL_MISC_TRACE((" ---------------------- Producer Scaling Results  ---"));
+	VL_MISC_TRACE((" Latency is enqueue (or post attempt) to completion"));
+	VL_MISC_TRACE((" %-14s %9s %14s %12s %12s %12s %12s %12s %12s",
+		       "mode", "producers", "rate[Mmsg/s]", "msgs/post", "avg lat[ns]",
+		       "p50[ns]", "p99[ns]", "max[ns]", "waits"));
+
+	for (i = 0; i < resource->num_prod_steps; i++) {
+		struct prod_step_t *st = &resource->prod_steps[i];
+		double duration = st->duration / freq; /* [ns] */
+
+		VL_MISC_TRACE((" %-14s %9d %14.3lf %12.2lf %12.1lf %12.1lf %12.1lf %12.1lf %12lu",
+			       mode_str[st->mode], st->producers,
+			       duration ? st->msgs / duration * 1000 : 0,
+			       st->batches ? (double)st->msgs / st->batches : 0,
+			       st->lat_avg / freq, st->p50 / freq, st->p99 / freq,
+			       st->max / freq, st->full_retries));
 	}
-	/* else Raw-Packet */
+}
 
-	if (ibv_modify_qp(resource->qp, &attr, attr_mask)) {
-		VL_DATA_ERR(("Fail to modify QP to IBV_QPS_INIT"));
-		return FAIL;
+static const char *batch_bucket_str[BATCH_BUCKETS] = { "1", "2", "3-4", "5-8", "9-16", "17+" };
+
+static void print_cq_results(struct resources_t *resource, double freq)
+{
+	struct cq_poll_stats_t *st = &resource->cq_stats;
+	double duration = resource->mq_duration / freq; /* [ns] */
+	int i;
+
+	VL_MISC_TRACE((" ---------------------- CQ Topology Results  -------"));
+	VL_MISC_TRACE((" %d QPs, %d threads, CQ per %s, CQ depth %u%s", config.num_qps,
+		       config.threads, cq_share_str(config.cq_share),
+		       config.cq_depth ? config.cq_depth : config.ring_depth * cq_sharers(),
+		       config.split_cq ? ", split send/recv CQs" : ""));
+	VL_MISC_TRACE((" Message rate:                  %lf[Mmsg/s]",
+		       duration ? config.num_of_iter / duration * 1000 : 0));
+
+	if (!st->polls)
+		return;
+
+	VL_MISC_TRACE((" Polls: %lu, empty %.1lf%%", st->polls, 100.0 * st->empty_polls / st->polls));
+	VL_MISC_TRACE((" Average poll:                  %lf[ns]", st->poll_cycles / freq / st->polls));
+	if (st->cqes) {
+		VL_MISC_TRACE((" Average non-empty poll:        %lf[ns]",
+			       st->hit_cycles / freq / (st->polls - st->empty_polls)));
+		VL_MISC_TRACE((" Poll time per CQE:             %lf[ns]", st->poll_cycles / freq / st->cqes));
+		VL_MISC_TRACE((" CQEs per non-empty poll:       %lf",
+			       (double)st->cqes / (st->polls - st->empty_polls)));
 	}
 
-	return SUCCESS;
+	for (i = 0; i < BATCH_BUCKETS; i++)
+		VL_MISC_TRACE(("   %-5s CQEs: %12lu polls", batch_bucket_str[i], st->batch_hist[i]));
+
+	if (st->lock_acquires)
+		VL_MISC_TRACE((" CQ lock contended %.2lf%% of %lu acquires, average wait %lf[ns]",
+			       100.0 * st->lock_contended / st->lock_acquires, st->lock_acquires,
+			       st->lock_contended ? st->lock_wait_cycles / freq / st->lock_contended : 0));
 }
 
-static int qp_to_rtr(const struct resources_t *resource, const struct sync_qp_info_t *remote_qp)
+static void print_comp_results(struct resources_t *resource, double freq)
 {
-	struct ibv_qp_attr attr = {
-		.qp_state		= IBV_QPS_RTR,
-		.ah_attr		= {
-			.is_global	= 0,
-			.sl		= 0,
-			.src_path_bits	= 0,
-			}
-		};
-	int attr_mask = IBV_QP_STATE;
+	static const char *mode_str[] = { "inline poll", "comp thread" };
+	int i;
 
-	if (config.qp_type == IBV_QPT_RC || config.qp_type == IBV_QPT_XRC_RECV) {
-		attr.dest_qp_num = remote_qp->qp_num;
-		attr.ah_attr.dlid = remote_qp->lid;
-		attr.max_dest_rd_atomic = 8,
-		attr.min_rnr_timer = 0x10;
-		attr.rq_psn = 0;
-		attr.path_mtu = IBV_MTU_1024;
-		attr.ah_attr.port_num = IB_PORT;
+	VL_MISC_TRACE((" ---------------------- Completion Thread Results  --"));
+	VL_MISC_TRACE((" Poster CPU %d, completion thread CPU %d, cache line round trip %.1lf[ns]"
+		       " (credit update ~%.1lf[ns])", sched_getcpu(), config.comp_cpu,
+		       resource->xcore_cycles / freq, resource->xcore_cycles / freq / 2));
+	VL_MISC_TRACE((" %-12s %14s %14s %12s %12s %12s %12s %14s",
+		       "mode", "post[Mmsg/s]", "compl[Mmsg/s]", "avg post[ns]", "avg lat[ns]",
+		       "p50[ns]", "p99[ns]", "credit stalls"));
+
+	for (i = 0; i < COMP_NUM_MODES; i++) {
+		struct comp_step_t *st = &resource->comp_steps[i];
+		double post_time = (st->last_post - st->first_post) / freq; /* [ns] */
+		double comp_time = (st->last_comp - st->first_post) / freq;
+
+		if (!st->msgs)
+			continue;
+
+		VL_MISC_TRACE((" %-12s %14.3lf %14.3lf %12.1lf %12.1lf %12.1lf %12.1lf %14lu",
+			       mode_str[i],
+			       post_time ? st->msgs / post_time * 1000 : 0,
+			       comp_time ? st->msgs / comp_time * 1000 : 0,
+			       st->post_cycles / freq / st->msgs,
+			       st->lat_avg / freq, st->p50 / freq, st->p99 / freq,
+			       st->credit_stalls));
+	}
+}
 
-		attr_mask |= IBV_QP_AV |
-			     IBV_QP_DEST_QPN |
-			     IBV_QP_RQ_PSN |
-			     IBV_QP_PATH_MTU |
-			     IBV_QP_MAX_DEST_RD_ATOMIC |
-			     IBV_QP_MIN_RNR_TIMER;
-	} else if (config.qp_type == IBV_QPT_XRC_SEND) {
-		attr.dest_qp_num = remote_qp->qp_num;
-		attr.ah_attr.dlid = remote_qp->lid;
-		attr.rq_psn = 0;
-		attr.path_mtu = IBV_MTU_1024;
-		attr.ah_attr.port_num = IB_PORT;
+static void print_workload_results(struct resources_t *resource, double freq)
+{
+	int op;
 
-		attr_mask |= IBV_QP_AV |
-			     IBV_QP_DEST_QPN |
-			     IBV_QP_RQ_PSN |
-			     IBV_QP_PATH_MTU;
-	} else if (config.qp_type == IBV_QPT_DRIVER && config.is_daemon) { //DCT
-		//attr.ah_attr.is_global = 1; //TODO: not sure if required
-		attr.min_rnr_timer = 0x10;
-		attr.path_mtu = IBV_MTU_1024;
-		attr.ah_attr.port_num = IB_PORT;
+	VL_MISC_TRACE((" ---------------------- Workload Results  -----------"));
+	VL_MISC_TRACE((" %-10s %12s %12s %14s %14s %16s",
+		       "opcode", "posted", "completed", "bytes", "avg post[ns]", "avg latency[ns]"));
 
-		attr_mask |= IBV_QP_AV |
-			     IBV_QP_PATH_MTU |
-			     IBV_QP_MIN_RNR_TIMER;
-	} else if (config.qp_type == IBV_QPT_DRIVER && !config.is_daemon) { //DCI
-		/* On DCI we dont need recieve attrs */
-		attr.path_mtu = IBV_MTU_1024;
+	for (op = 0; op < WL_MAX_OPCODE; op++) {
+		struct wl_op_stats_t *st = &resource->wl_stats[op];
 
-		attr_mask |= IBV_QP_PATH_MTU;
-	}
-	/* else Raw-Packet or UD*/
+		if (!st->posted)
+			continue;
 
-	if (ibv_modify_qp(resource->qp, &attr, attr_mask)) {
-		VL_DATA_ERR(("Fail to modify QP, to IBV_QPS_RTR"));
-		return FAIL;
+		VL_MISC_TRACE((" %-10s %12lu %12lu %14lu %14.1lf %16.1lf",
+			       wl_opcode_str(op), st->posted, st->completed, st->bytes,
+			       st->post_cycles / freq / st->posted,
+			       st->completed ? st->lat_cycles / freq / st->completed : 0));
 	}
+}
 
-	return SUCCESS;
+static void print_trace_results(struct resources_t *resource, double freq)
+{
+	int i;
+
+	VL_MISC_TRACE((" ---------------------- Trace Replay Results  -------"));
+	VL_MISC_TRACE((" Replay %s, latency measured from the %s",
+		       config.replay == REPLAY_TIMED ? "TIMED" : "FAST",
+		       config.replay == REPLAY_TIMED ? "trace time" : "post time"));
+	VL_MISC_TRACE((" %6s %12s %14s %14s %12s %14s %14s %14s",
+		       "phase", "msgs", "msg rate[M/s]", "BW[MB/s]", "avg post[ns]",
+		       "avg lat[ns]", "max lat[ns]", "duration[us]"));
+
+	for (i = 0; i < config.trace.num_phases; i++) {
+		struct trace_phase_t *phase = &resource->phases[i];
+		double duration; /* [ns] */
+
+		if (!phase->msgs)
+			continue;
+
+		duration = (phase->last_comp - phase->first_post) / freq;
+
+		VL_MISC_TRACE((" %6d %12lu %14.3lf %14.1lf %12.1lf %14.1lf %14.1lf %14.1lf",
+			       i, phase->msgs,
+			       duration ? phase->completed / duration * 1000 : 0,
+			       duration ? phase->bytes / duration * 1000 : 0,
+			       phase->post_cycles / freq / phase->msgs,
+			       phase->completed ? phase->lat_cycles / freq / phase->completed : 0,
+			       phase->max_lat / freq, duration / 1000));
+	}
 }
 
-static int qp_to_rts(const struct resources_t *resource)
+/* The knee is the step with the best Kleinrock power (throughput / latency) */
+static void print_open_loop_results(struct resources_t *resource, double freq)
 {
-	struct ibv_qp_attr attr = {
-		.qp_state = IBV_QPS_RTS,
-		};
-	int attr_mask = IBV_QP_STATE;
+	double best_power = 0;
+	int knee = -1;
+	int i;
 
-	if (config.qp_type == IBV_QPT_RC || config.qp_type == IBV_QPT_DRIVER ||
-	    config.qp_type == IBV_QPT_XRC_SEND) {
-		attr_mask |= IBV_QP_TIMEOUT |
-			     IBV_QP_RETRY_CNT |
-			     IBV_QP_RNR_RETRY |
-			     IBV_QP_SQ_PSN |
-			     IBV_QP_MAX_QP_RD_ATOMIC;
+	for (i = 0; i < resource->num_rate_steps; i++) {
+		struct rate_step_t *step = &resource->rate_steps[i];
+		double power = step->p50 ? step->achieved / step->p50 : 0;
 
-		attr.sq_psn = 0,
-		attr.timeout = 0x10;
-		attr.retry_cnt = 7;
-		attr.rnr_retry = 7;
-		attr.max_rd_atomic = 8;
-	} else if (config.qp_type != IBV_QPT_RAW_PACKET) {
-		attr_mask |= IBV_QP_SQ_PSN;
+		if (power > best_power) {
+			best_power = power;
+			knee = i;
+		}
+	}
 
-		attr.sq_psn = 0;
+	VL_MISC_TRACE((" ---------------------- Open-loop Results  ----------"));
+	VL_MISC_TRACE((" Latency is measured from the intended send time (%s arrivals)",
+		       config.arrival == ARRIVAL_POISSON ? "POISSON" : "CONST"));
+	VL_MISC_TRACE((" %16s %16s %12s %12s %12s %12s",
+		       "offered[msg/s]", "achieved[msg/s]", "p50[ns]", "p99[ns]", "p99.9[ns]", "max[ns]"));
+
+	for (i = 0; i < resource->num_rate_steps; i++) {
+		struct rate_step_t *step = &resource->rate_steps[i];
+
+		VL_MISC_TRACE((" %16.0lf %16.0lf %12.1lf %12.1lf %12.1lf %12.1lf%s%s",
+			       step->offered, step->achieved,
+			       step->p50 / freq, step->p99 / freq,
+			       step->p999 / freq, step->max / freq,
+			       i == knee ? "  <-- knee" : "",
+			       step->achieved < RATE_SATURATION * step->offered ? "  (saturated)" : ""));
 	}
 
-	if (ibv_modify_qp(resource->qp, &attr, attr_mask)) {
-		VL_DATA_ERR(("Fail to modify QP to IBV_QPS_RTS."));
-		return FAIL;
+	if (!config.coalesce_n)
+		return;
+
+	VL_MISC_TRACE((" Doorbell coalescing (%u messages or %u[ns]), delay is arrival to post",
+		       config.coalesce_n, config.coalesce_ns));
+	VL_MISC_TRACE((" %16s %10s %10s %10s %10s %12s %12s   %s",
+		       "offered[msg/s]", "doorbells", "by size", "by time", "msgs/db",
+		       "avg delay", "max delay", "batch 1/2/3-4/5-8/9-16/17+"));
+
+	for (i = 0; i < resource->num_rate_steps; i++) {
+		struct coalesce_stats_t *cs = &resource->rate_steps[i].coalesce;
+
+		if (!cs->doorbells)
+			continue;
+
+		VL_MISC_TRACE((" %16.0lf %10lu %10lu %10lu %10.2lf %12.1lf %12.1lf   %lu/%lu/%lu/%lu/%lu/%lu",
+			       resource->rate_steps[i].offered, cs->doorbells, cs->by_size, cs->by_time,
+			       (double)config.num_of_iter / cs->doorbells,
+			       cs->delay_tot / freq / config.num_of_iter, cs->delay_max / freq,
+			       cs->batch_hist[0], cs->batch_hist[1], cs->batch_hist[2],
+			       cs->batch_hist[3], cs->batch_hist[4], cs->batch_hist[5]));
+	}
+}
+
+static void print_mr_bench_results(struct resources_t *resource, double freq)
+{
+	struct mr_bench_t *mb = resource->mr_bench;
+	int i;
+
+	VL_MISC_TRACE((" ---------------------- Registration Cost  ----------"));
+	VL_MISC_TRACE((" %10s %6s %8s %14s %14s", "size[B]", "pages", "access", "reg[ns]", "dereg[ns]"));
+	for (i = 0; i < mb->num_costs; i++) {
+		const struct mr_reg_cost_t *c = &mb->costs[i];
+
+		if (!c->rounds) {
+			VL_MISC_TRACE((" %10u %6s %8s %14s %14s", c->size, c->huge ? "2MB" : "4KB",
+				       c->remote ? "REMOTE" : "LOCAL", "n/a", "n/a"));
+			continue;
 		}
 
-	return SUCCESS;
+		VL_MISC_TRACE((" %10u %6s %8s %14.1lf %14.1lf", c->size, c->huge ? "2MB" : "4KB",
+			       c->remote ? "REMOTE" : "LOCAL",
+			       c->reg / freq / c->rounds, c->dereg / freq / c->rounds));
+	}
+
+	/* Per message: buffer preparation, post and, registering each time, the deregistration */
+	VL_MISC_TRACE((" ---------------------- Registration Strategies  ----"));
+	VL_MISC_TRACE((" %10s %16s %16s %8s %16s", "size[B]", "reg each[ns]", "cache[ns]",
+		       "hits[%]", "bounce[ns]"));
+	for (i = 0; i + MR_STRAT_NUM <= mb->num_steps; i += MR_STRAT_NUM) {
+		const struct mr_step_t *st = &mb->steps[i];
+		const struct mr_step_t *cache = &st[MR_STRAT_CACHE];
+
+		VL_MISC_TRACE((" %10u %16.1lf %16.1lf %8.1lf %16.1lf", st->size,
+			       st[MR_STRAT_REG].cycles / freq / st[MR_STRAT_REG].msgs,
+			       cache->cycles / freq / cache->msgs,
+			       100.0 * cache->hits / (cache->hits + cache->misses),
+			       st[MR_STRAT_BOUNCE].cycles / freq / st[MR_STRAT_BOUNCE].msgs));
+	}
+	VL_MISC_TRACE((" ----------------------------------------------------"));
 }
 
-int init_connection(struct resources_t *resource)
+/* Past the negotiated depth the HCA queues the READs, the window stops paying */
+static void print_depth_results(struct resources_t *resource, double freq)
 {
-	struct sync_qp_info_t remote_qp_info = {0};
-	struct sync_qp_info_t local_qp_info = {0};
-	int rc;
+	uint8_t depth = resource->max_rd_atomic;
+	int i;
 
-	local_qp_info.qp_num = resource->qp->qp_num;
+	VL_MISC_TRACE((" ---------------------- READ Depth Sweep  -----------"));
+	VL_MISC_TRACE((" READ in flight: %u (asked %u)", depth, config.rd_atomic));
+	VL_MISC_TRACE((" %10s %8s %8s %12s %12s %14s", "size[B]", "window", "in HCA",
+		       "Mmsg/s", "MB/s", "avg lat[usec]"));
+	for (i = 0; i < resource->num_sweep_steps; i++) {
+		const struct sweep_step_t *st = &resource->sweep_steps[i];
+		double usec = st->duration / freq / 1000;
+
+		if (!st->msgs)
+			continue;
+
+		VL_MISC_TRACE((" %10u %8u %8u %12.3lf %12.1lf %14.3lf", st->size, st->window,
+			       st->window < depth ? st->window : depth,
+			       st->msgs / usec, (double)st->msgs * st->size / usec,
+			       st->lat_cycles / freq / 1000 / st->msgs));
+	}
+	VL_MISC_TRACE((" ----------------------------------------------------"));
+}
 
-	local_qp_info.lid = resource->hca_p->port_attr.lid;
-	mac_string_to_byte(config.mac, local_qp_info.mac);
+/*
+ * Receive buffers the one SRQ holds against a ring per QP, and how often
+ * the refill at that watermark let a message find it empty.
+ */
+static void print_srq_results(struct resources_t *resource, double freq)
+{
+	struct srq_stats_t *st = &resource->srq_stats;
+	double srq_kb = (double)config.ring_depth * config.msg_sz / 1024;
+
+	VL_MISC_TRACE((" ---------------------- SRQ Refill  -----------------"));
+	VL_MISC_TRACE((" Refill:                        %s below %u of %u WRs",
+		       config.srq_refill == SRQ_REFILL_EVENT ? "EVENT" : "THREAD",
+		       config.srq_watermark, config.ring_depth));
+	VL_MISC_TRACE((" Receive buffers:               %.1lf[KB] on the SRQ, %.1lf[KB] with a RQ per QP"
+		       " (%d QPs), %.1lf%% saved", srq_kb, srq_kb * config.num_qps, config.num_qps,
+		       100.0 * (config.num_qps - 1) / config.num_qps));
+	VL_MISC_TRACE((" Limit events:                  %lu, missed %lu", st->events, st->missed));
+	if (st->refills)
+		VL_MISC_TRACE((" Refills:                       %lu, %.1lf WRs and %.1lf[ns] each",
+			       st->refills, (double)st->wrs / st->refills,
+			       st->refill_cycles / freq / st->refills));
+	VL_MISC_TRACE((" Lowest SRQ level at a refill:  %u", st->min_level));
+	if (st->oob_valid)
+		VL_MISC_TRACE((" Found the SRQ empty:           %lu of %lu messages (%.4lf%%)",
+			       st->oob, st->msgs, st->msgs ? 100.0 * st->oob / st->msgs : 0));
+	else
+		VL_MISC_TRACE((" Found the SRQ empty:           n/a, no out_of_buffer counter"));
+	VL_MISC_TRACE((" ----------------------------------------------------"));
+}
 
-	if (!config.is_daemon) {
-		rc = send_info(resource, &local_qp_info, sizeof(local_qp_info));
-		if (rc)
-			return FAIL;
+/*
+ * Message rate of every worker and of them all, and the receive side a
+ * worker grew by on its XRC SRQ against an RC QP with an RQ per worker.
+ * The footprint is resident memory, the HCA context memory isn't in it.
+ */
+static void print_xrc_results(struct resources_t *resource, double freq)
+{
+	struct xrc_procs_t *procs = resource->xrc_procs;
+	cycles_t first = ~0, last = 0;
+	long xrc_kb = 0, rc_kb = 0;
+	uint64_t msgs = 0;
+	double usec;
+	int i;
 
-		rc = recv_info(resource, &remote_qp_info, sizeof(remote_qp_info));
-		if (rc)
-			return FAIL;
-	} else {
-		rc = recv_info(resource, &remote_qp_info, sizeof(remote_qp_info));
-		if (rc)
-			return FAIL;
+	VL_MISC_TRACE((" ---------------------- XRC Workers  ----------------"));
+	VL_MISC_TRACE((" %6s %12s %12s %14s %14s", "worker", "msgs", "Mmsg/s", "XRC RSS[KB]",
+		       "RC RSS[KB]"));
+	for (i = 0; i < procs->num; i++) {
+		const struct xrc_proc_result_t *res = &procs->proc[i].res;
+
+		usec = (res->last - res->first) / freq / 1000;
+		VL_MISC_TRACE((" %6d %12lu %12.3lf %14ld %14ld", i, res->msgs,
+			       usec ? res->msgs / usec : 0, res->xrc_kb, res->rc_kb));
+
+		msgs += res->msgs;
+		xrc_kb += res->xrc_kb;
+		rc_kb += res->rc_kb;
+		if (res->msgs && res->first < first)
+			first = res->first;
+		if (res->last > last)
+			last = res->last;
+	}
 
-		rc = send_info(resource, &local_qp_info, sizeof(local_qp_info));
-		if (rc)
-			return FAIL;
+	usec = msgs ? (last - first) / freq / 1000 : 0;
+	VL_MISC_TRACE((" Aggregate rate:                %.3lf[Mmsg/s] on %d processes",
+		       usec ? msgs / usec : 0, procs->num));
+	VL_MISC_TRACE((" Receive footprint:             %ld[KB] on XRC SRQs, %ld[KB] with %d RC QPs"
+		       " per process", xrc_kb, rc_kb, procs->num));
+	VL_MISC_TRACE((" ----------------------------------------------------"));
+}
+
+/* Bandwidth and per message cost of every MTU, the post is the CPU side */
+static void print_mtu_results(struct resources_t *resource, double freq)
+{
+	int i;
+
+	VL_MISC_TRACE((" ---------------------- MTU Sweep  ------------------"));
+	VL_MISC_TRACE((" %10s %6s %12s %12s %18s", "size[B]", "MTU", "MB/s", "post[ns]",
+		       "completion[usec]"));
+	for (i = 0; i < resource->num_sweep_steps; i++) {
+		const struct sweep_step_t *st = &resource->sweep_steps[i];
+		double usec = st->duration / freq / 1000;
+
+		if (!st->msgs)
+			continue;
+
+		VL_MISC_TRACE((" %10u %6d %12.1lf %12.1lf %18.3lf", st->size, 128 << st->mtu,
+			       (double)st->msgs * st->size / usec,
+			       st->post_cycles / freq / st->msgs,
+			       st->lat_cycles / freq / 1000 / st->msgs));
 	}
+	VL_MISC_TRACE((" ----------------------------------------------------"));
+}
 
-	resource->r_dctn = remote_qp_info.qp_num;
+/* A line of the repeat table, one metric summarized over the runs */
+static void print_run_stat(const char *name, double *samples, uint32_t num)
+{
+	struct stats_summary_t sum;
 
-	VL_DATA_TRACE1(("Going to connect QP to lid 0x%x qp_num 0x%x",
-			remote_qp_info.lid,
-			remote_qp_info.qp_num));
+	stats_summarize(samples, num, &sum);
+	VL_MISC_TRACE((" %-16s %12.3lf %10.3lf %8.2lf %12.3lf %9u", name, sum.mean, sum.ci95,
+		       sum.cv * 100, sum.median, sum.outliers));
+}
 
-	if (qp_to_init(resource))
+/* Per run spread, every run posted num_of_iter messages */
+static int print_repeat_results(struct resources_t *resource, double freq)
+{
+	uint32_t num = resource->num_runs;
+	double *post_ns, *rate;
+	uint32_t k;
+
+	post_ns = calloc(num, sizeof(*post_ns));
+	rate = calloc(num, sizeof(*rate));
+	if (!post_ns || !rate) {
+		VL_MEM_ERR((" Fail in alloc run samples"));
+		free(post_ns);
+		free(rate);
 		return FAIL;
+	}
 
-	if (qp_to_rtr(resource, &remote_qp_info))
-		return FAIL;
+	for (k = 0; k < num; k++) {
+		const struct run_sample_t *run = &resource->runs[k];
 
-	if(!config.is_daemon) {
-		if (qp_to_rts(resource))
-			return FAIL;
+		post_ns[k] = run->post_cycles / freq / config.num_of_iter;
+		rate[k] = config.num_of_iter * freq * 1000 / run->duration; // Mmsg/s
+		VL_MISC_TRACE1((" Run %u: %.3lf[ns] per message, %.3lf[Mmsg/s]", k, post_ns[k], rate[k]));
 	}
 
-	VL_DATA_TRACE1(("QP qp_num 0x%x is in ready state", resource->qp->qp_num));
+	VL_MISC_TRACE((" ---------------------- Repeated Runs  -------------"));
+	VL_MISC_TRACE((" %u runs of %lu messages, %u warm-up messages dropped",
+		       num, config.num_of_iter, config.warmup));
+	VL_MISC_TRACE((" %-16s %12s %10s %8s %12s %9s", "", "mean", "+-95% CI", "CV[%]",
+		       "median", "outliers"));
+	print_run_stat("post[ns]", post_ns, num);
+	print_run_stat("rate[Mmsg/s]", rate, num);
+	VL_MISC_TRACE((" ----------------------------------------------------"));
 
-	if ((config.qp_type == IBV_QPT_DRIVER || config.qp_type == IBV_QPT_UD) &&
-	    !config.is_daemon) {
-		rc = init_ah(resource, (uint16_t)remote_qp_info.lid);
-		if (rc)
-			return FAIL;
+	free(post_ns);
+	free(rate);
+
+	return SUCCESS;
+}
+
+/* Totals of a duration run, its interval lines went out while it ran */
+static void print_soak_results(struct resources_t *resource, double freq)
+{
+	struct soak_t *soak = resource->soak;
+	double secs = resource->step_duration / freq / 1000000000;
+
+	VL_MISC_TRACE((" ---------------------- Duration Run  ---------------"));
+	VL_MISC_TRACE((" Run time (with the drain):     %lf[s]", secs));
+	VL_MISC_TRACE((" Messages completed:            %lu", soak->completed));
+	VL_MISC_TRACE((" Message rate:                  %lf[msg/s]", soak->completed / secs));
+	VL_MISC_TRACE((" Max time per message:          %lf[ns]", soak->post_max / freq));
+	VL_MISC_TRACE((" ----------------------------------------------------"));
+}
+
+/* AH creation cost, and the post cost of a shared AH against a cached AH per destination */
+static void print_ud_results(struct resources_t *resource, double freq)
+{
+	struct ud_fanout_t *ud = resource->ud;
+	uint32_t num = config.ud_dests;
+	cycles_t create_tot = 0;
+	uint32_t i;
+	int mode;
+
+	for (i = 0; i < num; i++)
+		create_tot += ud->create_lat[i];
+
+	VL_MISC_TRACE((" ---------------------- UD Fan-out  -----------------"));
+	VL_MISC_TRACE((" Destinations: %u, AH cache %u entries (%d ways)", num,
+		       (ud->cache.set_mask + 1) * AH_CACHE_WAYS, AH_CACHE_WAYS));
+	VL_MISC_TRACE((" ibv_create_ah:                 avg %.3lf, p50 %.3lf, p99 %.3lf, max %.3lf [usec]",
+		       create_tot / freq / 1000 / num,
+		       stats_percentile_cycles(ud->create_lat, num, 50) / freq / 1000,
+		       stats_percentile_cycles(ud->create_lat, num, 99) / freq / 1000,
+		       ud->create_lat[num - 1] / freq / 1000));
+	VL_MISC_TRACE((" ibv_destroy_ah:                avg %.3lf[usec]",
+		       ud->destroy_cycles / freq / 1000 / num));
+	VL_MISC_TRACE((" %8s %10s %10s %12s %12s %10s %14s", "AH", "Mmsg/s", "post[ns]", "hits",
+		       "misses", "evicted", "create[usec]"));
+	for (mode = 0; mode < UD_AH_NUM_MODES; mode++) {
+		const struct ud_step_t *st = &ud->steps[mode];
+
+		if (!st->msgs)
+			continue;
+
+		VL_MISC_TRACE((" %8s %10.3lf %10.1lf %12lu %12lu %10lu %14.3lf",
+			       mode == UD_AH_CACHE ? "CACHE" : "SHARED",
+			       st->msgs * freq * 1000 / st->duration,
+			       st->post_cycles / freq / st->msgs,
+			       st->hits, st->misses, st->evictions,
+			       st->misses ? st->create_cycles / freq / 1000 / st->misses : 0));
 	}
+	if (ud->steps[UD_AH_SHARED].msgs && ud->steps[UD_AH_CACHE].msgs)
+		VL_MISC_TRACE((" AH lookup per post:            %.1lf[ns]",
+			       (double)ud->steps[UD_AH_CACHE].post_cycles / freq / ud->steps[UD_AH_CACHE].msgs -
+			       (double)ud->steps[UD_AH_SHARED].post_cycles / freq / ud->steps[UD_AH_SHARED].msgs));
+	VL_MISC_TRACE((" ----------------------------------------------------"));
+}
 
-	if (config.qp_type == IBV_QPT_RAW_PACKET) {
-		if (config.is_daemon) {
-			rc = init_mcast_mac_flow(resource, local_qp_info.mac);
-			if (rc)
-				return FAIL;
-		} else {
-			init_eth_header(resource, local_qp_info.mac, remote_qp_info.mac);
-		}
+/* QPs per target below 1 means every QP goes round robin over several targets */
+static void print_atomic_results(struct resources_t *resource, double freq)
+{
+	int i;
 
+	VL_MISC_TRACE((" ---------------------- Atomic Contention  ----------"));
+	VL_MISC_TRACE((" %8s %8s %11s %10s %14s %14s", "arg[B]", "targets", "QPs/target",
+		       "Mops/s", "avg lat[usec]", "max lat[usec]"));
+	for (i = 0; i < resource->num_atomic_steps; i++) {
+		const struct atomic_step_t *st = &resource->atomic_steps[i];
+
+		VL_MISC_TRACE((" %8u %8u %11.2lf %10.3lf %14.3lf %14.3lf", st->arg_sz, st->targets,
+			       (double)config.num_qps / st->targets,
+			       st->ops * freq * 1000 / st->duration,
+			       st->lat_cycles / freq / 1000 / st->ops,
+			       st->max_lat / freq / 1000));
 	}
+	VL_MISC_TRACE((" ----------------------------------------------------"));
+}
 
-	VL_DATA_TRACE(("init_connection is done"));
+/*
+ * Rate of every fan-out step and how often a DCI had to move to another
+ * DCT. The overhead is the extra completion latency of those messages.
+ */
+static void print_dc_results(struct resources_t *resource, double freq)
+{
+	struct dc_fanout_t *dc = resource->dc;
+	int i;
 
-	return  SUCCESS;
+	VL_MISC_TRACE((" ---------------------- DC Fan-out  -----------------"));
+	VL_MISC_TRACE((" DCIs: %d, targets %s, DCI policy %s", config.num_qps,
+		       config.dc_pattern == DC_PATTERN_RANDOM ? "RANDOM" : "RR",
+		       dci_policy_str(config.dci_policy)));
+	VL_MISC_TRACE((" %8s %10s %10s %12s %12s %16s", "targets", "Mmsg/s", "post[ns]",
+		       "reconnect%", "hit[usec]", "reconnect[usec]"));
+	for (i = 0; i < dc->num_steps; i++) {
+		const struct dc_step_t *st = &dc->steps[i];
+		uint64_t hits = st->msgs - st->reconnects;
+
+		if (!st->msgs)
+			continue;
+
+		VL_MISC_TRACE((" %8u %10.3lf %10.1lf %12.2lf %12.3lf %16.3lf", st->targets,
+			       st->msgs * freq * 1000 / st->duration,
+			       st->post_cycles / freq / st->msgs,
+			       100.0 * st->reconnects / st->msgs,
+			       hits ? st->hit_lat / freq / 1000 / hits : 0,
+			       st->reconnects ? st->reconnect_lat / freq / 1000 / st->reconnects : 0));
+	}
+	VL_MISC_TRACE((" ----------------------------------------------------"));
 }
 
-int do_test(struct resources_t *resource)
+/*
+ * The first messages take the page faults of an ODP MR, on the local buffer
+ * and for RDMA on the remote one. The rest is the steady state.
+ */
+static void print_odp_results(struct resources_t *resource, double freq)
 {
-	int rc;
+	uint64_t first = config.batch_size < config.num_of_iter ? config.batch_size : 1;
+	uint64_t rest = config.num_of_iter - first;
+	cycles_t first_tot = 0, steady_tot = 0;
+	uint64_t i;
+
+	VL_MISC_TRACE((" ---------------------- MR Results  ----------------"));
+	VL_MISC_TRACE((" MR mode: %s", mr_mode_str(resource->mr_mode)));
+	if (resource->prefetch_cycles)
+		VL_MISC_TRACE((" Prefetch:                      %lf[ns]", resource->prefetch_cycles / freq));
+
+	/* Just the single poster flow of the client times every message */
+	if (!resource->post_ts || !rest || config.comp_cpu >= 0 || config.producers ||
+	    config.num_qps > 1 || config.threads > 1)
+		return;
+
+	for (i = 0; i < first; i++)
+		first_tot += resource->lat[i];
+	for (i = first; i < config.num_of_iter; i++)
+		steady_tot += resource->lat[i];
+
+	VL_MISC_TRACE((" First message latency:         %lf[ns]", resource->lat[0] / freq));
+	VL_MISC_TRACE((" First batch average latency:   %lf[ns]", first_tot / freq / first));
+	VL_MISC_TRACE((" Steady state average latency:  %lf[ns]", steady_tot / freq / rest));
+
+	stats_sort_cycles(resource->lat + first, rest);
+	VL_MISC_TRACE((" Steady state p50/p99 latency:  %lf/%lf[ns]",
+		       stats_percentile_cycles(resource->lat + first, rest, 50) / freq,
+		       stats_percentile_cycles(resource->lat + first, rest, 99) / freq));
+}
 
-	if (!config.is_daemon) {
-		VL_DATA_TRACE(("Run sender"));
+static int print_rx_cq_results(struct resources_t *resource)
+{
+	struct rx_cq_stats_t *rx = &resource->rx_stats;
+	double freq = get_cpu_mhz(1) / 1000; //Ghz
+	double span;
+	int i;
 
-		resource->measure.min = ~0; //initialize to max value of unsigned type
+	if (freq == 0) {
+		VL_MISC_ERR(("Can't produce a report"));
+		return FAIL;
+	}
 
-		if (VL_sock_sync_ready(&resource->sock)) {
-			VL_SOCK_ERR(("Sync before traffic"));
-			return FAIL;
-		}
+	span = (rx->last - rx->first) / freq;
+
+	VL_MISC_TRACE((" ---------------------- Receive CQ Results  --------"));
+	VL_MISC_TRACE((" CQE compression: %s, moderation: %u CQEs or %u[usec]",
+		       config.cqe_comp == CQE_COMP_HASH ? "HASH" :
+		       config.cqe_comp == CQE_COMP_CSUM ? "CSUM" : "NO",
+		       config.cq_moder_cnt, config.cq_moder_usec));
+	VL_MISC_TRACE((" Receive rate:                  %lf[Mmsg/s]",
+		       span ? (rx->poll.cqes - 1) * 1000 / span : 0));
+
+	if (rx->poll.cqes) {
+		VL_MISC_TRACE((" Average non-empty poll:        %lf[ns]",
+			       rx->poll.hit_cycles / freq / (rx->poll.polls - rx->poll.empty_polls)));
+		VL_MISC_TRACE((" CQEs per non-empty poll:       %lf",
+			       (double)rx->poll.cqes / (rx->poll.polls - rx->poll.empty_polls)));
+	}
 
-		if (do_sender(resource))
-			return FAIL;
+	for (i = 0; i < BATCH_BUCKETS; i++)
+		VL_MISC_TRACE(("   %-5s CQEs: %12lu polls", batch_bucket_str[i], rx->poll.batch_hist[i]));
 
-		VL_DATA_TRACE(("Wait for Receiver"));
-		if (VL_sock_sync_ready(&resource->sock)) {
-			VL_SOCK_ERR(("Sync after traffic"));
-			return FAIL;
-		}
-	} else {
-		rc = prepare_receiver(resource);
-		if (rc)
-			return FAIL;
+	/* Time asleep per event bounds what the moderation adds to a message */
+	if (rx->events)
+		VL_MISC_TRACE((" Events: %lu, %lf CQEs per event, average wait %lf[ns]",
+			       rx->events, (double)rx->poll.cqes / rx->events,
+			       rx->wait_cycles / freq / rx->events));
+	VL_MISC_TRACE((" ----------------------------------------------------"));
+
+	return SUCCESS;
+}
 
-		VL_DATA_TRACE(("Run receiver"));
+static int print_size_sweep_results(struct resources_t *resource)
+{
+	double freq = get_cpu_mhz(1) / 1000; //Ghz
+	int i;
 
-		if (VL_sock_sync_ready(&resource->sock)) {
-			VL_SOCK_ERR(("Sync before traffic"));
-			return FAIL;
-		}
+	if (freq == 0) {
+		VL_MISC_ERR(("Can't produce a report"));
+		return FAIL;
+	}
 
-		if (config.opcode != IBV_WR_RDMA_WRITE &&
-		    config.opcode != IBV_WR_RDMA_READ &&
-		    config.opcode != IBV_WR_ATOMIC_FETCH_AND_ADD &&
-		    config.opcode != IBV_WR_ATOMIC_CMP_AND_SWP &&
-		    config.opcode != IBV_WR_LOCAL_INV &&
-		    config.opcode != IBV_WR_BIND_MW) {
-			if (do_receiver(resource))
-				return FAIL;
-		}
+	VL_MISC_TRACE((" ---------------------- Receive Size Sweep  ---------"));
+	VL_MISC_TRACE((" Scatter to CQE: %s", config.s2c == S2C_ON ? "ON" :
+		       config.s2c == S2C_OFF ? "OFF" : "provider default"));
+	VL_MISC_TRACE((" %10s %12s %14s %14s %14s", "size[B]", "messages", "rate[Mmsg/s]",
+		       "CQE reap[ns]", "RX refill[ns]"));
 
-		VL_DATA_TRACE(("Wait for Sender"));
-		if (VL_sock_sync_ready(&resource->sock)) {
-			VL_SOCK_ERR(("Sync after traffic"));
-			return FAIL;
-		}
+	for (i = 0; i < config.wl.num_sizes; i++) {
+		const struct recv_step_t *st = &resource->recv_steps[i];
+		double span = (st->last - st->first) / freq;
+
+		if (!st->msgs)
+			continue;
+
+		VL_MISC_TRACE((" %10u %12lu %14.3lf %14.1lf %14.1lf", st->size, st->msgs,
+			       span ? (st->msgs - 1) * 1000 / span : 0,
+			       st->poll_cycles / freq / st->msgs,
+			       st->post_cycles / freq / st->msgs));
 	}
+	VL_MISC_TRACE((" ----------------------------------------------------"));
 
 	return SUCCESS;
 }
@@ -1195,6 +5827,39 @@ int print_results(struct resources_t *resource)
 	double min;
 	double average;
 	double freq;
+	int i;
+
+	if (config.ring_alloc)
+		ring_alloc_print(&resource->ring_alloc);
+
+	if (config.is_daemon) {
+		/* The MTU steps of a size share its receive step */
+		if (config.size_sweep && !config.mtu_sweep && print_size_sweep_results(resource))
+			return FAIL;
+
+		if ((config.cqe_comp || config.cq_moder_cnt) && print_rx_cq_results(resource))
+			return FAIL;
+
+		if (config.mr_mode != MR_PINNED || config.srq_refill || config.xrc_procs) {
+			freq = get_cpu_mhz(1) / 1000; //Ghz
+			if (freq == 0) {
+				VL_MISC_ERR(("Can't produce a report"));
+				return FAIL;
+			}
+
+			if (config.mr_mode != MR_PINNED)
+				print_odp_results(resource, freq);
+			if (config.srq_refill)
+				print_srq_results(resource, freq);
+			if (config.xrc_procs)
+				print_xrc_results(resource, freq);
+		}
+
+		if (config.perf_counters)
+			return print_perf_results(resource);
+
+		return SUCCESS;
+	}
 
 	freq = get_cpu_mhz(1) / 1000; //Ghz
 	if ((freq == 0)) {
@@ -1204,15 +5869,75 @@ int print_results(struct resources_t *resource)
 
 	max = resource->measure.max / freq; //ns
 	min = resource->measure.min / freq; //ns
-	average = resource->measure.tot / freq / config.num_of_iter; // time per message (not per batch) [ns].
+	average = resource->measure.tot / freq /
+		  (resource->soak ? resource->soak->posted : config.num_of_iter * config.repeat); // time per message (not per batch) [ns].
 
 	VL_MISC_TRACE((" ---------------------- Test Results  ---------------"));
-	VL_MISC_TRACE((" Batch (size: %u) was sampled %u times", config.batch_size, resource->measure.batch_samples));
-	VL_MISC_TRACE((" Max batch time:                %lf[ns]", max));
-	VL_MISC_TRACE((" Min batch time:                %lf[ns]", min));
-	VL_MISC_TRACE((" Average time per message:      %lf[ns]", average));
+	/* Producer steps post from several threads, their table stands instead */
+	if (!config.producers && !config.mr_bench && !config.atomic_targets && !config.dc_targets &&
+	    !config.ud_dests) {
+		VL_MISC_TRACE((" Batch (size: %u) was sampled %lu times", config.batch_size, resource->measure.batch_samples));
+		VL_MISC_TRACE((" Max batch time:                %lf[ns]", max));
+		VL_MISC_TRACE((" Min batch time:                %lf[ns]", min));
+		VL_MISC_TRACE((" Average time per message:      %lf[ns]", average));
+	}
+	VL_MISC_TRACE((" Thread domain:                 %s", config.thread_domain ? "YES" : "NO"));
+	for (i = 0; i < METHOD_MIX; i++) {
+		struct method_measure_t *mm = &resource->method_measure[i];
+
+		if (config.send_method == METHOD_MIX && mm->msgs)
+			VL_MISC_TRACE((" Average time per %s message:  %lf[ns]",
+				       i == METHOD_OLD ? "OLD" : "NEW", mm->tot / freq / mm->msgs));
+	}
 	VL_MISC_TRACE((" ----------------------------------------------------"));
 
+	if (config.rate)
+		print_open_loop_results(resource, freq);
+
+	if (config.workload)
+		print_workload_results(resource, freq);
+
+	if (config.trace.recs)
+		print_trace_results(resource, freq);
+
+	if (config.comp_cpu >= 0)
+		print_comp_results(resource, freq);
+
+	if (config.mr_mode != MR_PINNED)
+		print_odp_results(resource, freq);
+
+	if (config.mr_bench)
+		print_mr_bench_results(resource, freq);
+
+	if (config.atomic_targets)
+		print_atomic_results(resource, freq);
+
+	if (config.dc_targets)
+		print_dc_results(resource, freq);
+
+	if (config.ud_dests)
+		print_ud_results(resource, freq);
+
+	if (resource->soak)
+		print_soak_results(resource, freq);
+
+	if (resource->runs && print_repeat_results(resource, freq))
+		return FAIL;
+
+	if (config.depth_sweep)
+		print_depth_results(resource, freq);
+
+	if (config.mtu_sweep)
+		print_mtu_results(resource, freq);
+
+	if (config.producers)
+		print_producer_results(resource, freq);
+	else if ((config.num_qps > 1 || config.threads > 1) && !config.dc_targets)
+		print_cq_results(resource, freq);
+
+	if (config.perf_counters)
+		return print_perf_results(resource);
+
 	return SUCCESS;
 
 }
@@ -7,5 +7,8 @@ int init_connection(struct resources_t *resource);
 int print_results(struct resources_t *resource);
 int sync_configurations(struct resources_t *resource);
 int sync_post_connection(struct resources_t *resource);
+int loopback_init(struct resources_t *client, struct resources_t *server);
+int loopback_connect(struct resources_t *client, struct resources_t *server);
+int loopback_test(struct resources_t *client, struct resources_t *server);
 
 #endif
@@ -0,0 +1,159 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vl.h>
+#include "types.h"
+#include "trace.h"
+
+/*
+ * Map the trace read-only and scan it once for what the setup needs: the
+ * opcodes (QP send ops), the largest message (buffer size), the receives it
+ * consumes on the responder and a signature to match both sides.
+ */
+int trace_open(struct trace_t *trace, const char *path)
+{
+	const struct trace_hdr_t *hdr;
+	uint32_t sig = 2166136261u; /* FNV-1a */
+	struct stat st;
+	uint64_t i;
+
+	memset(trace, 0, sizeof(*trace));
+
+	trace->fd = open(path, O_RDONLY);
+	if (trace->fd < 0) {
+		VL_MISC_ERR(("Fail to open trace %s (errno %d)", path, errno));
+		return FAIL;
+	}
+
+	if (fstat(trace->fd, &st) || st.st_size < (off_t)sizeof(*hdr)) {
+		VL_MISC_ERR(("Trace %s is too short", path));
+		goto err;
+	}
+
+	trace->map_sz = st.st_size;
+	trace->map = mmap(NULL, trace->map_sz, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+			  trace->fd, 0);
+	if (trace->map == MAP_FAILED) {
+		VL_MISC_ERR(("Fail to mmap trace %s", path));
+		trace->map = NULL;
+		goto err;
+	}
+	madvise(trace->map, trace->map_sz, MADV_SEQUENTIAL);
+
+	hdr = trace->map;
+	if (hdr->magic != TRACE_MAGIC || hdr->version != TRACE_VERSION ||
+	    hdr->rec_size != sizeof(struct wl_entry_t) ||
+	    trace->map_sz < sizeof(*hdr) + hdr->num_recs * sizeof(struct wl_entry_t)) {
+		VL_MISC_ERR(("Trace %s has an unsupported format", path));
+		goto err;
+	}
+
+	trace->recs = (const struct wl_entry_t *)(hdr + 1);
+	trace->num_recs = hdr->num_recs;
+
+	for (i = 0; i < trace->num_recs; i++) {
+		const struct wl_entry_t *rec = &trace->recs[i];
+		const uint8_t *b = (const uint8_t *)rec;
+		unsigned int j;
+
+		if (rec->opcode >= WL_MAX_OPCODE || !strcmp(wl_opcode_str(rec->opcode), "UNKNOWN")) {
+			VL_MISC_ERR(("Trace record %lu has unsupported opcode %u", i, rec->opcode));
+			goto err;
+		}
+
+		trace->op_mask |= 1 << rec->opcode;
+		if (rec->size > trace->max_size)
+			trace->max_size = rec->size;
+		if (WL_RECV_OPS_MASK & (1 << rec->opcode))
+			trace->recv_cnt++;
+		if (rec->phase >= trace->num_phases)
+			trace->num_phases = rec->phase + 1;
+
+		for (j = 0; j < sizeof(*rec); j++)
+			sig = (sig ^ b[j]) * 16777619u;
+	}
+	trace->sig = sig;
+
+	VL_MISC_TRACE1(("Trace %s: %lu records, %d phases, max size %u",
+			path, trace->num_recs, trace->num_phases, trace->max_size));
+
+	return SUCCESS;
+
+err:
+	trace_close(trace);
+	return FAIL;
+}
+
+void trace_close(struct trace_t *trace)
+{
+	if (trace->map)
+		munmap(trace->map, trace->map_sz);
+	if (trace->fd > 0)
+		close(trace->fd);
+
+	trace->map = NULL;
+	trace->recs = NULL;
+	trace->fd = -1;
+}
+
+int trace_writer_open(struct trace_writer_t *w, const char *path)
+{
+	struct trace_hdr_t hdr = {
+		.magic = TRACE_MAGIC,
+		.version = TRACE_VERSION,
+		.rec_size = sizeof(struct wl_entry_t),
+	};
+
+	w->num_recs = 0;
+	w->f = fopen(path, "w");
+	if (!w->f) {
+		VL_MISC_ERR(("Fail to create trace %s (errno %d)", path, errno));
+		return FAIL;
+	}
+
+	/* Rewritten with the final count on close */
+	if (fwrite(&hdr, sizeof(hdr), 1, w->f) != 1) {
+		VL_MISC_ERR(("Fail to write trace header"));
+		return FAIL;
+	}
+
+	return SUCCESS;
+}
+
+int trace_writer_append(struct trace_writer_t *w, const struct wl_entry_t *recs, uint64_t num)
+{
+	if (fwrite(recs, sizeof(*recs), num, w->f) != num) {
+		VL_MISC_ERR(("Fail to write trace records"));
+		return FAIL;
+	}
+
+	w->num_recs += num;
+
+	return SUCCESS;
+}
+
+int trace_writer_close(struct trace_writer_t *w)
+{
+	struct trace_hdr_t hdr = {
+		.magic = TRACE_MAGIC,
+		.version = TRACE_VERSION,
+		.rec_size = sizeof(struct wl_entry_t),
+	};
+	int rc = SUCCESS;
+
+	if (!w->f)
+		return SUCCESS;
+
+	hdr.num_recs = w->num_recs;
+	if (fseek(w->f, 0, SEEK_SET) || fwrite(&hdr, sizeof(hdr), 1, w->f) != 1) {
+		VL_MISC_ERR(("Fail to finalize trace header"));
+		rc = FAIL;
+	}
+
+	if (fclose(w->f))
+		rc = FAIL;
+	w->f = NULL;
+
+	return rc;
+}
@@ -0,0 +1,61 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "workload.h"
+
+/*
+ * Binary trace file, host byte order:
+ *	struct trace_hdr_t
+ *	struct wl_entry_t[num_recs]
+ * Records are ordered by ts, phase groups consecutive records to report on.
+ */
+#define TRACE_MAGIC 0x43525450 /* "PTRC" */
+#define TRACE_VERSION 1
+#define TRACE_MAX_PHASES 256
+
+struct trace_hdr_t {
+	uint32_t	magic;
+	uint16_t	version;
+	uint16_t	rec_size;
+	uint64_t	num_recs;
+} __attribute__ ((packed));
+
+struct trace_t {
+	int			fd;
+	void			*map;
+	size_t			map_sz;
+	const struct wl_entry_t	*recs;	/* points into the mapping */
+	uint64_t		num_recs;
+	uint32_t		op_mask;
+	uint32_t		max_size;
+	uint64_t		recv_cnt;
+	uint32_t		sig;
+	int			num_phases;
+};
+
+struct trace_writer_t {
+	FILE		*f;
+	uint64_t	num_recs;
+};
+
+struct trace_phase_t {
+	uint64_t	msgs;
+	uint64_t	completed;
+	uint64_t	bytes;
+	cycles_t	first_post;
+	cycles_t	last_comp;
+	cycles_t	post_cycles;
+	cycles_t	lat_cycles;
+	cycles_t	max_lat;
+};
+
+int trace_open(struct trace_t *trace, const char *path);
+void trace_close(struct trace_t *trace);
+
+int trace_writer_open(struct trace_writer_t *w, const char *path);
+int trace_writer_append(struct trace_writer_t *w, const struct wl_entry_t *recs, uint64_t num);
+int trace_writer_close(struct trace_writer_t *w);
+
+#endif /* TRACE_H */
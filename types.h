@@ -2,6 +2,13 @@
 #define GEN2_SRQ__TEST_TYPE_H
 
 #include "get_clock.h"
+#include "perf_counters.h"
+#include "workload.h"
+#include "trace.h"
+#include "ring_alloc.h"
+#include "mr_cache.h"
+#include "xrc_procs.h"
+#include "ah_cache.h"
 #include "infiniband/verbs.h"
 
 #define IB_PORT 1
@@ -16,6 +23,8 @@
 #define MAC_LEN 6
 #define STR_MAC_LEN 18
 #define ETH_HDR_SIZE 14
+#define MAX_RATE_STEPS 32
+#define RATE_SATURATION 0.9 /* achieved/offered ratio below it is saturation */
 
 #define ALWAYS_INLINE __attribute__((always_inline))
 
@@ -44,6 +53,84 @@ enum send_method {
 	METHOD_MIX = 2,
 };
 
+enum cq_share_mode {
+	CQ_SHARE_QP = 0,	/* a send CQ per QP */
+	CQ_SHARE_THREAD,	/* the QPs of a sender thread share a CQ */
+	CQ_SHARE_GLOBAL,	/* every QP completes on one CQ */
+};
+
+enum s2c_mode {
+	S2C_DEFAULT = 0,	/* provider default, MLX5_SCATTER_TO_CQE */
+	S2C_ON,
+	S2C_OFF,
+};
+
+enum mr_mode {
+	MR_PINNED = 0,
+	MR_ODP,			/* pages fault in on first access */
+	MR_IMPLICIT_ODP,	/* one MR over the whole address space */
+};
+
+static inline const char *mr_mode_str(enum mr_mode mode)
+{
+	switch (mode) {
+	case MR_ODP:		return "ODP";
+	case MR_IMPLICIT_ODP:	return "IMPLICIT_ODP";
+	default:		return "PINNED";
+	}
+}
+
+enum cqe_comp_mode {
+	CQE_COMP_NONE = 0,
+	CQE_COMP_HASH,		/* mini CQEs carry the RSS hash */
+	CQE_COMP_CSUM,		/* ... or the checksum */
+};
+
+static inline const char *cq_share_str(enum cq_share_mode mode)
+{
+	switch (mode) {
+	case CQ_SHARE_THREAD:	return "THREAD";
+	case CQ_SHARE_GLOBAL:	return "GLOBAL";
+	default:		return "QP";
+	}
+}
+
+enum arrival_type {
+	ARRIVAL_CONST = 0,
+	ARRIVAL_POISSON = 1,
+};
+
+enum srq_refill_mode {
+	SRQ_REFILL_INLINE = 0,	/* the receive loop tops the SRQ up after polling */
+	SRQ_REFILL_EVENT,	/* the receive loop refills on the SRQ limit event */
+	SRQ_REFILL_THREAD,	/* a refill thread sleeps on the SRQ limit event */
+};
+
+enum dc_pattern {
+	DC_PATTERN_RR = 0,	/* targets in turn */
+	DC_PATTERN_RANDOM,	/* uniform over the targets */
+};
+
+enum dci_policy {
+	DCI_POLICY_HASH = 0,	/* a target always goes through the same DCI */
+	DCI_POLICY_RR,		/* DCIs in turn, whatever the target */
+	DCI_POLICY_LRU,		/* the DCI still at the target, else the least recently used */
+};
+
+static inline const char *dci_policy_str(enum dci_policy policy)
+{
+	switch (policy) {
+	case DCI_POLICY_RR:	return "RR";
+	case DCI_POLICY_LRU:	return "LRU";
+	default:		return "HASH";
+	}
+}
+
+enum replay_mode {
+	REPLAY_FAST = 0,
+	REPLAY_TIMED = 1,
+};
+
 struct config_t {
 	char		*hca_type;
 	char		ip[VL_IP_STR_LENGTH+1];
@@ -58,9 +145,62 @@ struct config_t {
 	int		use_inl;
 	size_t		msg_sz;
 	uint16_t	batch_size;
-	uint16_t	ring_depth;
+	uint32_t	ring_depth;	/* up to max_qp_wr of the device */
 	uint16_t	num_sge;
-	uint32_t	num_of_iter;
+	uint64_t	num_of_iter;
+	uint32_t	duration;	/* [s] post until it elapses, 0 - num_of_iter messages */
+	uint32_t	interval_ms;	/* report period of a duration run */
+	uint32_t	warmup;		/* messages posted and dropped before the measured runs */
+	uint32_t	repeat;		/* measured runs over the same connection */
+	int		perf_counters;
+	double		rate;		/* open-loop target [msg/s], 0 - closed loop */
+	double		rate_step;	/* rate multiplier per sweep step, 0 - no sweep */
+	enum arrival_type arrival;
+	int		stepped;	/* traffic runs in steps, server learns it on sync */
+	int		workload;	/* opcode/size mix replaces opcode and msg_sz */
+	struct wl_spec_t wl;
+	char		*trace_path;	/* replay, implies a workload */
+	char		*trace_out;	/* capture what the sender posts */
+	enum replay_mode replay;
+	struct trace_t	trace;
+	int		thread_domain;	/* QP and CQ on a parent domain with a TD */
+	uint32_t	ring_alloc;	/* enum ring_alloc_flags, 0 - provider allocates */
+	int		comp_cpu;	/* completion thread CPU, -1 - poll inline */
+	int		num_qps;
+	int		producers;	/* max producer threads, 0 - single poster */
+	enum cq_share_mode cq_share;
+	int		threads;	/* sender threads over the QPs */
+	uint32_t	cq_depth;	/* 0 - ring_depth times the QPs sharing a CQ */
+	int		split_cq;	/* separate recv CQ */
+	uint16_t	coalesce_n;	/* doorbell once N messages are pending, 0 - post as due */
+	uint32_t	coalesce_ns;	/* ... or once the first pending waited that long */
+	int		loopback;	/* both sides in this process, no TCP */
+	int		lb_cpu[2];	/* client and server thread CPUs, -1 - not pinned */
+	int		gid_idx;	/* -1 - RoCE v2 GID on Ethernet, LID on IB */
+	enum s2c_mode	s2c;
+	uint32_t	size_sweep;	/* max message size, doubling from msg_sz, 0 - no sweep */
+	enum cqe_comp_mode cqe_comp;	/* receive CQ */
+	uint16_t	cq_moder_cnt;	/* receive CQ event moderation, 0 - busy poll */
+	uint16_t	cq_moder_usec;
+	enum mr_mode	mr_mode;
+	int		prefetch;	/* ibv_advise_mr the buffer before traffic */
+	uint32_t	mr_bench;	/* max size of the registration benchmark, 0 - off */
+	uint32_t	mr_bench_min;
+	uint32_t	atomic_targets;	/* max remote addresses of the atomic benchmark, 0 - off */
+	size_t		atomic_stride;	/* between the remote addresses */
+	uint8_t		rd_atomic;	/* READ/atomic in flight, both directions */
+	int		depth_sweep;	/* step the outstanding READ window */
+	enum ibv_mtu	mtu;		/* 0 - the active MTU of the port */
+	int		mtu_sweep;	/* reconnect at every MTU up to the negotiated one */
+	enum srq_refill_mode srq_refill;	/* multi-QP server */
+	uint32_t	srq_watermark;	/* SRQ limit, refill below it */
+	char		*xrcd_path;	/* the file naming the XRC domain */
+	int		xrc_procs;	/* server workers sharing the XRCD, 0 - none */
+	uint32_t	dc_targets;	/* DCTs of the fan-out, the client DCIs are num_qps */
+	enum dc_pattern	dc_pattern;
+	enum dci_policy	dci_policy;
+	uint32_t	ud_dests;	/* UD QPs of the fan-out on the server, 0 - off */
+	uint32_t	ah_cache;	/* AH cache entries of the client, 0 - a destination each */
 };
 
 struct hca_data_t {
@@ -68,6 +208,11 @@ struct hca_data_t {
 	struct ibv_port_attr	port_attr;
 	struct ibv_device	*ib_dev;
 	struct ibv_context	*context;
+	int			dv;		/* opened through mlx5dv */
+	int			gid_idx;	/* -1 - LID only addressing */
+	union ibv_gid		gid;
+	uint32_t		atomic_arg_mask;	/* extended atomic sizes, bit n - 2^n bytes */
+	uint32_t		max_atomic_arg;	/* QP extended atomic argument */
 };
 
 struct mr_data_t {
@@ -79,33 +224,370 @@ struct sync_qp_info_t {
 	uint32_t	qp_num;
 	uint32_t	lid;
 	uint8_t		mac[8];
+	uint8_t		gid[16];
 } __attribute__ ((packed));
 
+enum sync_conf_flags {
+	SYNC_CONF_STEPPED = 1 << 0,
+	SYNC_CONF_DURATION = 1 << 1,
+};
+
 struct sync_conf_info_t {
-	uint32_t iter;
+	uint64_t iter;
 	enum ibv_qp_type qp_type;
 	enum ibv_wr_opcode opcode;
-	uint32_t reserved;
+	uint32_t flags;
+	uint32_t wl_sig;
+	uint32_t num_qps;
+	uint32_t atomic_targets;
+	uint16_t init_rd_atom;	/* as the initiator, capped by the HCA */
+	uint16_t dest_rd_atom;	/* responder resources, capped by the HCA */
+	uint32_t mtu;		/* enum ibv_mtu, capped by the active MTU */
+	uint32_t dc_targets;
+	uint32_t ud_dests;
+	uint32_t warmup;
+} __attribute__ ((packed));
+
+#define SYNC_STEP_WARMUP 0xffffffff	/* sync_step_t.step of the warm-up */
+
+/* Sent by the client before every traffic step of a stepped run */
+struct sync_step_t {
+	uint32_t stop;
+	uint32_t step;
+	uint32_t mtu;	/* enum ibv_mtu to reconnect at, 0 - keep */
 } __attribute__ ((packed));
 
 struct sync_post_connection_t {
 	uint32_t dctn;
 	uint32_t rkey;
 	uint64_t raddr;
+	uint32_t num_srqn;	/* XRC worker SRQ numbers following, 0 - dctn only */
 } __attribute__ ((packed));
 
 struct measure_t {
-	uint32_t batch_samples;
+	uint64_t batch_samples;
 	cycles_t min;
 	cycles_t max;
 	cycles_t tot;
 };
 
+/* Post time of the messages a single method posted, MIX alternates */
+struct method_measure_t {
+	uint64_t	msgs;
+	cycles_t	tot;
+};
+
+#define CACHE_LINE_SIZE 64
+
+enum comp_mode {
+	COMP_INLINE = 0,	/* the sender loop posts and polls */
+	COMP_THREAD,		/* a pinned thread polls and returns credits */
+	COMP_NUM_MODES,
+};
+
+/*
+ * Shared by the poster and the completion thread. Each side writes its own
+ * cache line only, the poster reads completed back as send credits.
+ */
+struct comp_ctx_t {
+	volatile uint64_t	completed __attribute__ ((aligned(CACHE_LINE_SIZE)));
+	volatile int		error __attribute__ ((aligned(CACHE_LINE_SIZE)));
+	volatile uint64_t	ping __attribute__ ((aligned(CACHE_LINE_SIZE)));
+	volatile uint64_t	pong __attribute__ ((aligned(CACHE_LINE_SIZE)));
+};
+
+struct comp_step_t {
+	uint64_t	msgs;
+	cycles_t	first_post;
+	cycles_t	last_post;
+	cycles_t	last_comp;
+	cycles_t	post_cycles;
+	uint64_t	credit_stalls;	/* post attempts that found no credit */
+	cycles_t	p50;
+	cycles_t	p99;
+	cycles_t	max;
+	double		lat_avg;	/* [cycles] */
+};
+
+#define MAX_PRODUCERS 64
+#define MAX_PROD_STEPS 64
+
+enum prod_mode {
+	PROD_MPSC = 0,		/* producers enqueue, one poster drains and posts */
+	PROD_MUTEX,		/* producers post and poll under a QP lock */
+	PROD_QP_PER_THREAD,	/* every producer owns a QP and its CQ */
+	PROD_NUM_MODES,
+};
+
+struct prod_step_t {
+	enum prod_mode	mode;
+	int		producers;
+	uint64_t	msgs;
+	uint64_t	batches;	/* posts, a batch drains what queued up */
+	uint64_t	full_retries;	/* enqueue or credit waits */
+	cycles_t	duration;
+	cycles_t	p50;
+	cycles_t	p99;
+	cycles_t	max;
+	double		lat_avg;	/* [cycles] enqueue to completion */
+};
+
+#define BATCH_BUCKETS 6	/* 1, 2, 3-4, 5-8, 9-16, 17+ */
+
+static inline int batch_bucket(int n)
+{
+	int b = 0;
+
+	n--;
+	while (n && b < BATCH_BUCKETS - 1) {
+		n >>= 1;
+		b++;
+	}
+
+	return b;
+}
+
+struct cq_poll_stats_t {
+	uint64_t	polls;
+	uint64_t	empty_polls;
+	uint64_t	cqes;
+	cycles_t	poll_cycles;	/* every poll */
+	cycles_t	hit_cycles;	/* polls which reaped CQEs */
+	uint64_t	batch_hist[BATCH_BUCKETS];	/* CQEs per poll */
+	uint64_t	lock_acquires;
+	uint64_t	lock_contended;
+	cycles_t	lock_wait_cycles;
+};
+
+enum mr_strategy {
+	MR_STRAT_REG = 0,	/* register each message, deregister on completion */
+	MR_STRAT_CACHE,		/* look the buffer up in the registration cache */
+	MR_STRAT_BOUNCE,	/* copy into a pre-registered bounce slot */
+	MR_STRAT_NUM,
+};
+
+#define MR_POOL_BUFS 16		/* user buffers the sender cycles through */
+#define MR_BENCH_ROUNDS 32
+#define MR_BENCH_MAX (1U << 20)
+#define MR_BENCH_SIZES 21	/* 1B doubling up to MR_BENCH_MAX */
+
+struct mr_step_t {
+	uint32_t		size;
+	enum mr_strategy	strategy;
+	uint64_t		msgs;
+	cycles_t		cycles;	/* buffer preparation, post and deregistration */
+	uint64_t		hits;
+	uint64_t		misses;
+};
+
+struct mr_reg_cost_t {
+	uint32_t	size;
+	int		huge;		/* 2MB pages */
+	int		remote;		/* remote read/write access */
+	int		rounds;		/* 0 - buffer couldn't be allocated */
+	cycles_t	reg;
+	cycles_t	dereg;
+};
+
+struct mr_bench_t {
+	char			*pool;		/* MR_POOL_BUFS unregistered user buffers */
+	size_t			stride;
+	char			*bounce;	/* a slot per ring entry */
+	struct ibv_mr		*bounce_mr;
+	struct ibv_mr		**slot_mr;	/* MR_STRAT_REG, per ring entry */
+	struct mr_cache_t	cache;
+	struct mr_step_t	steps[MR_BENCH_SIZES * MR_STRAT_NUM];
+	int			num_steps;
+	struct mr_step_t	*cur;
+	struct mr_reg_cost_t	costs[MR_BENCH_SIZES * 4];
+	int			num_costs;
+};
+
+#define ATOMIC_MAX_TARGETS 4096
+#define ATOMIC_MIN_ARG 8
+#define ATOMIC_MAX_ARG 256
+#define ATOMIC_MAX_STEPS (6 * 13)	/* 8..256B arguments by 1..4096 targets */
+
+/* An atomic benchmark step, every QP spreads its atomics over targets addresses */
+struct atomic_step_t {
+	uint32_t	arg_sz;
+	uint32_t	targets;
+	uint64_t	ops;
+	cycles_t	duration;
+	cycles_t	lat_cycles;	/* post to completion, summed */
+	cycles_t	max_lat;
+};
+
+#define SWEEP_MAX_STEPS (WL_MAX_SIZES * 17)	/* windows 1..64K per size */
+
+/* A depth or MTU sweep step, the sender keeps up to window WRs in flight */
+struct sweep_step_t {
+	uint32_t	size;
+	uint32_t	window;
+	enum ibv_mtu	mtu;
+	uint64_t	msgs;
+	cycles_t	duration;
+	cycles_t	post_cycles;	/* batch post time, split over its WRs */
+	cycles_t	lat_cycles;	/* post to completion, summed */
+};
+
+/* A measured run of --repeat */
+struct run_sample_t {
+	cycles_t	post_cycles;	/* batch post time, summed */
+	cycles_t	duration;
+};
+
+#define SOAK_MAX_SAMPLES 4096	/* power of 2, post costs an interval keeps */
+#define SOAK_IDLE_POLLS 1024	/* empty receive polls between looks for the final count */
+
+/*
+ * Sender of a duration run. The interval counters restart on every report,
+ * the post costs per WR wrap and keep the last SOAK_MAX_SAMPLES batches.
+ */
+struct soak_t {
+	uint64_t	posted;		/* the whole run */
+	uint64_t	completed;
+	cycles_t	post_max;	/* per WR */
+	cycles_t	start;
+	cycles_t	end;
+	cycles_t	ivl_start;
+	uint64_t	ivl_posted;
+	uint64_t	ivl_completed;
+	uint64_t	ivl_posts;	/* post calls */
+	cycles_t	ivl_max;
+	cycles_t	samples[SOAK_MAX_SAMPLES];
+};
+
+#define DC_MAX_TARGETS 4096
+#define DC_MAX_DCIS 256
+#define DC_MAX_STEPS 14		/* 1..4096 targets, doubling, and the last one */
+#define DC_NO_TARGET (~0U)
+#define DC_WR_DCI_SHIFT 40	/* wr_id: message seq, DCI above it, reconnect in bit 63 */
+
+/* A step of the fan-out, the messages spread over targets DCTs */
+struct dc_step_t {
+	uint32_t	targets;
+	uint64_t	msgs;
+	uint64_t	reconnects;	/* posts which moved a DCI to another target */
+	cycles_t	duration;
+	cycles_t	post_cycles;
+	cycles_t	hit_lat;	/* post to completion, DCI already at the target */
+	cycles_t	reconnect_lat;	/* ... DCI moved to the target */
+};
+
+struct dci_state_t {
+	uint32_t	target;		/* DC_NO_TARGET before its first post */
+	uint32_t	outstanding;
+	uint64_t	last_use;
+	uint64_t	posted;		/* a DCI completes in order, its post_ts slots follow */
+	uint64_t	completed;
+};
+
+struct dc_fanout_t {
+	uint32_t		dctn[DC_MAX_TARGETS];
+	int32_t			owner[DC_MAX_TARGETS];	/* DCI which last went to the target */
+	struct dci_state_t	dci[DC_MAX_DCIS];
+	cycles_t		*post_ts;	/* a ring of slots per DCI */
+	uint64_t		clock;
+	uint32_t		rand;		/* DC_PATTERN_RANDOM state */
+	struct dc_step_t	steps[DC_MAX_STEPS];
+	int			num_steps;
+	struct dc_step_t	*cur;
+};
+
+#define UD_MAX_DESTS 4096
+
+enum ud_ah_mode {
+	UD_AH_SHARED = 0,	/* the one AH of the server port, only the QPN changes */
+	UD_AH_CACHE,		/* an AH per destination, looked up on every post */
+	UD_AH_NUM_MODES,
+};
+
+struct ud_step_t {
+	uint64_t	msgs;
+	cycles_t	post_cycles;
+	cycles_t	duration;
+	uint64_t	hits;
+	uint64_t	misses;
+	uint64_t	evictions;
+	cycles_t	create_cycles;	/* ibv_create_ah of the misses */
+};
+
+struct ud_fanout_t {
+	uint32_t		qpn[UD_MAX_DESTS];
+	uint32_t		seq;		/* next destination, round-robin */
+	enum ud_ah_mode		mode;
+	struct ibv_ah_attr	attr;		/* of the server port */
+	struct ah_cache_t	cache;
+	cycles_t		create_lat[UD_MAX_DESTS];	/* ibv_create_ah, sorted */
+	cycles_t		destroy_cycles;
+	struct ud_step_t	steps[UD_AH_NUM_MODES];
+	int			error;		/* the post path failed to create an AH */
+};
+
+#define SRQ_POLL_MS 10	/* refill thread wake up, in case a limit event was missed */
+
+struct srq_stats_t {
+	uint64_t	msgs;
+	uint64_t	events;		/* SRQ limit reached */
+	uint64_t	missed;		/* refills of a low SRQ without a limit event */
+	uint64_t	refills;
+	uint64_t	wrs;		/* posted by the refills */
+	cycles_t	refill_cycles;
+	uint32_t	min_level;	/* fewest WRs left on the SRQ at a refill */
+	int		oob_valid;	/* the HCA exposes out_of_buffer */
+	uint64_t	oob;		/* receives which found the SRQ empty */
+};
+
+/* Receive CQ with compressed CQEs or moderated events */
+struct rx_cq_stats_t {
+	struct cq_poll_stats_t	poll;
+	uint64_t	events;
+	cycles_t	wait_cycles;	/* blocked on the completion channel */
+	cycles_t	first;		/* first and last reaped CQE */
+	cycles_t	last;
+};
+
+struct coalesce_stats_t {
+	uint64_t	doorbells;
+	uint64_t	by_size;	/* flushed on N pending */
+	uint64_t	by_time;	/* flushed on the time budget */
+	uint64_t	batch_hist[BATCH_BUCKETS];
+	cycles_t	delay_tot;	/* arrival to post, per message */
+	cycles_t	delay_max;
+};
+
+struct rate_step_t {
+	double		offered;	/* [msg/s] */
+	double		achieved;	/* [msg/s] */
+	cycles_t	p50;
+	cycles_t	p99;
+	cycles_t	p999;
+	cycles_t	max;
+	struct coalesce_stats_t	coalesce;
+};
+
+/* Receiver side of a size sweep step */
+struct recv_step_t {
+	uint32_t	size;
+	uint64_t	msgs;
+	cycles_t	poll_cycles;	/* polls which reaped CQEs */
+	cycles_t	post_cycles;	/* RX refills */
+	cycles_t	first;		/* first and last reaped CQE */
+	cycles_t	last;
+};
+
 struct resources_t {
 	struct VL_sock_t	sock;
 	struct hca_data_t	*hca_p;
 	struct ibv_pd		*pd;
-	struct ibv_cq		*cq;
+	struct ibv_td		*td;
+	struct ibv_pd		*parent_pd;	/* pd + td/allocators, the QP and CQ live on it */
+	struct ring_alloc_t	ring_alloc;
+	struct ibv_cq		*cq;		/* send CQ, also recv unless split */
+	struct ibv_cq		*rcq;
+	int			own_cq;		/* QP contexts may borrow the CQ */
+	uint32_t		rx_depth;	/* receives kept posted, a ring per client QP on an SRQ */
 	int			fd;
 	struct ibv_xrcd		*xrcd;
 	struct ibv_srq		*srq;
@@ -122,6 +604,73 @@ struct resources_t {
 	struct ibv_send_wr	*send_wr_arr;
 	struct ibv_wc		*wc_arr;
 	struct measure_t	measure;
+	struct method_measure_t	method_measure[METHOD_MIX];
+	struct perf_counters_t	*perf;
+	struct perf_measure_t	perf_post[METHOD_MIX]; /* per OLD/NEW method */
+	struct perf_measure_t	perf_poll;
+	double			cpu_mhz;
+	cycles_t		*sched;		/* open-loop intended send times */
+	cycles_t		*lat;		/* open-loop completion latencies */
+	struct rate_step_t	*rate_steps;
+	int			num_rate_steps;
+	const struct wl_entry_t	*wl_sched;	/* generated, or the mapped trace */
+	uint32_t		wl_mask;	/* schedule wrap, ~0 for a trace */
+	uint64_t		wl_seq;		/* next schedule entry to post */
+	uint32_t		wl_sig;
+	uint64_t		wl_recv_cnt;	/* receive WRs the mix consumes */
+	struct wl_op_stats_t	*wl_stats;	/* indexed by opcode */
+	cycles_t		*wl_post_ts;	/* per ring slot */
+	struct trace_phase_t	*phases;
+	struct trace_writer_t	capture;
+	struct wl_entry_t	*capture_buf;
+	cycles_t		capture_start;
+	uint8_t			capture_phase;
+	enum comp_mode		comp_mode;
+	cycles_t		*post_ts;	/* per ring slot, completion latency */
+	struct comp_ctx_t	comp;
+	struct comp_step_t	comp_steps[COMP_NUM_MODES];
+	double			xcore_cycles;	/* cache line round trip between the threads */
+	struct resources_t	**qpc;		/* QP contexts, [0] is the resource itself */
+	struct prod_step_t	*prod_steps;
+	int			num_prod_steps;
+	struct prod_step_t	*cur_prod_step;	/* the producer step being run */
+	struct cq_poll_stats_t	cq_stats;	/* multi-QP senders, summed over the threads */
+	cycles_t		mq_duration;
+	int			loop_fd;	/* loopback step control, replaces the socket */
+	struct recv_step_t	*recv_steps;
+	struct recv_step_t	*cur_recv_step;
+	struct ibv_comp_channel	*rx_channel;	/* moderated receive CQ events */
+	struct rx_cq_stats_t	rx_stats;
+	struct srq_stats_t	srq_stats;
+	enum mr_mode		mr_mode;	/* as registered, ODP may fall back to pinned */
+	struct mr_bench_t	*mr_bench;
+	cycles_t		prefetch_cycles;
+	struct atomic_step_t	*atomic_steps;
+	int			num_atomic_steps;
+	struct atomic_step_t	*cur_atomic_step;
+	uint32_t		at_seq;		/* atomics this QP posted in the step */
+	uint32_t		at_base;	/* first target of the QP */
+	uint32_t		at_step;	/* targets between its consecutive atomics */
+	uint32_t		at_mask;	/* targets - 1, 0 - always raddr */
+	uint16_t		atomic_arg_sz;
+	uint8_t			max_rd_atomic;	/* negotiated on sync */
+	uint8_t			max_dest_rd_atomic;
+	enum ibv_mtu		path_mtu;	/* negotiated on sync, the MTU sweep steps it */
+	struct sync_qp_info_t	remote_qp;	/* kept to reconnect */
+	uint32_t		window;		/* sender outstanding WRs, ring_depth unless swept */
+	cycles_t		step_duration;	/* the last traffic step, between its syncs */
+	struct sweep_step_t	*sweep_steps;
+	int			num_sweep_steps;
+	struct dc_fanout_t	*dc;		/* client of the DC fan-out */
+	struct ud_fanout_t	*ud;		/* client of the UD fan-out */
+	struct soak_t		*soak;		/* client of a duration run */
+	int			warmup_step;	/* the step is the warm-up, nothing of it is kept */
+	struct run_sample_t	*runs;		/* client, per --repeat run */
+	uint32_t		num_runs;
+	struct xrc_procs_t	*xrc_procs;	/* server workers */
+	uint32_t		xrc_srqn[XRC_MAX_PROCS];	/* client, the worker SRQs */
+	uint32_t		num_xrc_srqn;
+	uint32_t		xrc_seq;	/* next worker SRQ to send to */
 	uint32_t		r_dctn;
 	uint32_t		rkey;
 	uint64_t		raddr;
@@ -0,0 +1,216 @@
+#include <stdlib.h>
+#include <string.h>
+#include <vl.h>
+#include "types.h"
+#include "workload.h"
+
+#define WL_SEED 0x5eed
+
+static const struct {
+	const char		*name;
+	enum ibv_wr_opcode	opcode;
+} wl_opcodes[] = {
+	{ "SEND",	IBV_WR_SEND },
+	{ "SEND_IMM",	IBV_WR_SEND_WITH_IMM },
+	{ "WRITE",	IBV_WR_RDMA_WRITE },
+	{ "WRITE_IMM",	IBV_WR_RDMA_WRITE_WITH_IMM },
+	{ "READ",	IBV_WR_RDMA_READ },
+	{ "ATOMIC_FA",	IBV_WR_ATOMIC_FETCH_AND_ADD },
+	{ "ATOMIC_CS",	IBV_WR_ATOMIC_CMP_AND_SWP },
+};
+
+const char *wl_opcode_str(int opcode)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(wl_opcodes) / sizeof(wl_opcodes[0]); i++)
+		if (wl_opcodes[i].opcode == (enum ibv_wr_opcode)opcode)
+			return wl_opcodes[i].name;
+
+	return "UNKNOWN";
+}
+
+static int wl_opcode_from_str(const char *str, size_t len, enum ibv_wr_opcode *opcode)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(wl_opcodes) / sizeof(wl_opcodes[0]); i++) {
+		if (strlen(wl_opcodes[i].name) == len &&
+		    !strncmp(wl_opcodes[i].name, str, len)) {
+			*opcode = wl_opcodes[i].opcode;
+			return SUCCESS;
+		}
+	}
+
+	return FAIL;
+}
+
+/*
+ * Parse "TOKEN[:WEIGHT],TOKEN[:WEIGHT],..." - the weight defaults to 1.
+ * Returns the number of entries or FAIL.
+ */
+static int wl_parse_list(const char *str, int is_op, enum ibv_wr_opcode *ops,
+			 uint32_t *vals, uint32_t *weights)
+{
+	const char *p = str;
+	int num = 0;
+
+	while (*p) {
+		const char *end = strchr(p, ',');
+		const char *colon;
+		size_t len;
+
+		if (!end)
+			end = p + strlen(p);
+
+		if (num == WL_MAX_ENTRIES) {
+			VL_MISC_ERR(("Workload supports up to %d entries", WL_MAX_ENTRIES));
+			return FAIL;
+		}
+
+		colon = memchr(p, ':', end - p);
+		len = (colon ? colon : end) - p;
+
+		if (is_op) {
+			if (wl_opcode_from_str(p, len, &ops[num])) {
+				VL_MISC_ERR(("Unsupported workload opcode %.*s", (int)len, p));
+				return FAIL;
+			}
+		} else {
+			vals[num] = strtoul(p, NULL, 0);
+			if (!vals[num]) {
+				VL_MISC_ERR(("Workload message size cant be zero"));
+				return FAIL;
+			}
+		}
+
+		weights[num] = colon ? strtoul(colon + 1, NULL, 0) : 1;
+		if (!weights[num]) {
+			VL_MISC_ERR(("Workload weight cant be zero"));
+			return FAIL;
+		}
+
+		num++;
+		p = *end ? end + 1 : end;
+	}
+
+	return num;
+}
+
+int wl_parse_ops(struct wl_spec_t *spec, const char *str)
+{
+	int num = wl_parse_list(str, 1, spec->ops, NULL, spec->op_weight);
+
+	if (num <= 0)
+		return FAIL;
+
+	spec->num_ops = num;
+	return SUCCESS;
+}
+
+int wl_parse_sizes(struct wl_spec_t *spec, const char *str)
+{
+	int num = wl_parse_list(str, 0, NULL, spec->sizes, spec->size_weight);
+
+	if (num <= 0)
+		return FAIL;
+
+	spec->num_sizes = num;
+	return SUCCESS;
+}
+
+uint32_t wl_op_mask(const struct wl_spec_t *spec)
+{
+	uint32_t mask = 0;
+	int i;
+
+	for (i = 0; i < spec->num_ops; i++)
+		mask |= 1 << spec->ops[i];
+
+	return mask;
+}
+
+uint32_t wl_max_size(const struct wl_spec_t *spec)
+{
+	uint32_t max = 0;
+	int i;
+
+	for (i = 0; i < spec->num_sizes; i++)
+		if (spec->sizes[i] > max)
+			max = spec->sizes[i];
+
+	for (i = 0; i < spec->num_ops; i++)
+		if ((spec->ops[i] == IBV_WR_ATOMIC_FETCH_AND_ADD ||
+		     spec->ops[i] == IBV_WR_ATOMIC_CMP_AND_SWP) &&
+		    max < WL_ATOMIC_SIZE)
+			max = WL_ATOMIC_SIZE;
+
+	return max;
+}
+
+static int wl_pick(const uint32_t *weights, int num, uint32_t tot, unsigned short *rand_state)
+{
+	uint32_t r = (uint32_t)(erand48(rand_state) * tot);
+	int i;
+
+	for (i = 0; i < num - 1; i++) {
+		if (r < weights[i])
+			return i;
+		r -= weights[i];
+	}
+
+	return num - 1;
+}
+
+/*
+ * Fill WL_SCHED_LEN entries from the weighted opcode and size mixes.
+ * The seed is fixed so both sides build the very same schedule, the
+ * returned signature lets them verify it.
+ */
+uint32_t wl_build_schedule(const struct wl_spec_t *spec, struct wl_entry_t *sched)
+{
+	unsigned short rand_state[3] = { WL_SEED, WL_SEED >> 8, 0 };
+	uint32_t op_tot = 0, size_tot = 0;
+	uint32_t sig = 2166136261u; /* FNV-1a */
+	int i, j;
+
+	for (i = 0; i < spec->num_ops; i++)
+		op_tot += spec->op_weight[i];
+	for (i = 0; i < spec->num_sizes; i++)
+		size_tot += spec->size_weight[i];
+
+	for (i = 0; i < WL_SCHED_LEN; i++) {
+		const uint8_t *b = (const uint8_t *)&sched[i];
+
+		memset(&sched[i], 0, sizeof(sched[i]));
+		sched[i].opcode = spec->ops[wl_pick(spec->op_weight, spec->num_ops, op_tot, rand_state)];
+		sched[i].size = spec->sizes[wl_pick(spec->size_weight, spec->num_sizes, size_tot, rand_state)];
+
+		if (sched[i].opcode == IBV_WR_ATOMIC_FETCH_AND_ADD ||
+		    sched[i].opcode == IBV_WR_ATOMIC_CMP_AND_SWP)
+			sched[i].size = WL_ATOMIC_SIZE;
+
+		for (j = 0; j < (int)sizeof(sched[i]); j++)
+			sig = (sig ^ b[j]) * 16777619u;
+	}
+
+	return sig;
+}
+
+/* How many of the first iters WRs (the schedule wraps) use an opcode of op_mask */
+uint64_t wl_count_ops(const struct wl_entry_t *sched, uint64_t iters, uint32_t op_mask)
+{
+	uint64_t per_sched = 0;
+	uint64_t cnt = 0;
+	uint64_t i;
+
+	for (i = 0; i < WL_SCHED_LEN; i++) {
+		if (op_mask & (1 << sched[i].opcode)) {
+			per_sched++;
+			if (i < iters % WL_SCHED_LEN)
+				cnt++;
+		}
+	}
+
+	return cnt + per_sched * (iters / WL_SCHED_LEN);
+}
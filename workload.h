@@ -0,0 +1,66 @@
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include <stdint.h>
+#include "get_clock.h"
+#include "infiniband/verbs.h"
+
+#define WL_MAX_ENTRIES 8
+#define WL_MAX_SIZES 32 /* a size sweep doubles over the whole 32-bit range */
+#define WL_SCHED_LEN 4096 /* power of 2, the post loop wraps with a mask */
+#define WL_MAX_OPCODE 16 /* above the IBV_WR_* values a mix may hold */
+#define WL_ATOMIC_SIZE 8
+
+struct wl_spec_t {
+	int			num_ops;
+	enum ibv_wr_opcode	ops[WL_MAX_ENTRIES];
+	uint32_t		op_weight[WL_MAX_ENTRIES];
+	int			num_sizes;
+	uint32_t		sizes[WL_MAX_SIZES];
+	uint32_t		size_weight[WL_MAX_SIZES];
+};
+
+/*
+ * One WR of the schedule. It is also the on-disk trace record (see trace.h),
+ * so a mmap-ed trace is posted in place.
+ */
+struct wl_entry_t {
+	uint64_t	ts;	/* [ns] from trace start, 0 in a generated schedule */
+	uint32_t	size;
+	uint16_t	dest;
+	uint8_t		opcode;	/* enum ibv_wr_opcode */
+	uint8_t		phase;
+} __attribute__ ((packed));
+
+struct wl_op_stats_t {
+	uint64_t	posted;
+	uint64_t	completed;
+	uint64_t	bytes;
+	cycles_t	post_cycles;	/* batch post time, split over its WRs */
+	cycles_t	lat_cycles;	/* post to completion */
+};
+
+int wl_parse_ops(struct wl_spec_t *spec, const char *str);
+int wl_parse_sizes(struct wl_spec_t *spec, const char *str);
+const char *wl_opcode_str(int opcode);
+uint32_t wl_op_mask(const struct wl_spec_t *spec);
+uint32_t wl_max_size(const struct wl_spec_t *spec);
+uint32_t wl_build_schedule(const struct wl_spec_t *spec, struct wl_entry_t *sched);
+uint64_t wl_count_ops(const struct wl_entry_t *sched, uint64_t iters, uint32_t op_mask);
+
+static inline int wl_op_needs_raddr(int opcode)
+{
+	return opcode == IBV_WR_RDMA_WRITE ||
+	       opcode == IBV_WR_RDMA_WRITE_WITH_IMM ||
+	       opcode == IBV_WR_RDMA_READ ||
+	       opcode == IBV_WR_ATOMIC_FETCH_AND_ADD ||
+	       opcode == IBV_WR_ATOMIC_CMP_AND_SWP;
+}
+
+/* Opcodes which consume a receive WR on the responder */
+#define WL_RECV_OPS_MASK				\
+	((1 << IBV_WR_SEND) |				\
+	 (1 << IBV_WR_SEND_WITH_IMM) |			\
+	 (1 << IBV_WR_RDMA_WRITE_WITH_IMM))
+
+#endif /* WORKLOAD_H */
@@ -0,0 +1,473 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <vl.h>
+#include "types.h"
+#include "xrc_procs.h"
+
+extern struct config_t config;
+
+struct xrc_worker_t {
+	struct ibv_context	*context;
+	struct ibv_pd		*pd;
+	int			fd;
+	struct ibv_xrcd		*xrcd;
+	struct ibv_cq		*cq;
+	struct ibv_srq		*srq;
+	void			*buf;
+	struct ibv_mr		*mr;
+	struct ibv_wc		*wc_arr;
+};
+
+static int read_full(int fd, void *buf, size_t size)
+{
+	char *p = buf;
+
+	while (size) {
+		ssize_t n = read(fd, p, size);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return FAIL;
+
+		p += n;
+		size -= n;
+	}
+
+	return SUCCESS;
+}
+
+/* Resident set of the process, what it touched of the rings and buffers */
+static long rss_kb(void)
+{
+	long size, resident;
+	FILE *f;
+
+	f = fopen("/proc/self/statm", "r");
+	if (!f)
+		return 0;
+
+	if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+		resident = 0;
+	fclose(f);
+
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* A verbs context can't cross fork(), the worker opens the device again */
+static struct ibv_context *open_device(void)
+{
+	struct ibv_context *context = NULL;
+	struct ibv_device **dev_list;
+	int num_devices, i;
+
+	dev_list = ibv_get_device_list(&num_devices);
+	if (!dev_list) {
+		VL_HCA_ERR(("ibv_get_device_list failed"));
+		return NULL;
+	}
+
+	for (i = 0; i < num_devices; i++)
+		if (!strcmp(ibv_get_device_name(dev_list[i]), config.hca_type)) {
+			context = ibv_open_device(dev_list[i]);
+			break;
+		}
+
+	if (!context)
+		VL_HCA_ERR(("Fail to open HCA ID %s", config.hca_type));
+
+	ibv_free_device_list(dev_list);
+
+	return context;
+}
+
+static int post_recv_slot(struct ibv_srq *srq, struct ibv_qp *qp, struct ibv_mr *mr,
+			  void *buf, uint32_t slot)
+{
+	struct ibv_recv_wr wr, *bad_wr = NULL;
+	struct ibv_sge sge = {
+		.addr = (uintptr_t)buf + (uint64_t)slot * config.msg_sz,
+		.length = config.msg_sz,
+		.lkey = mr->lkey,
+	};
+
+	memset(&wr, 0, sizeof(wr));
+	wr.wr_id = slot;
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+
+	return srq ? ibv_post_srq_recv(srq, &wr, &bad_wr) : ibv_post_recv(qp, &wr, &bad_wr);
+}
+
+static int alloc_ring(struct ibv_pd *pd, void **buf, struct ibv_mr **mr)
+{
+	size_t len = (size_t)config.ring_depth * config.msg_sz;
+
+	if (posix_memalign(buf, sysconf(_SC_PAGESIZE), len)) {
+		VL_MEM_ERR(("Fail to alloc a receive ring"));
+		return FAIL;
+	}
+	memset(*buf, 0, len);
+
+	*mr = ibv_reg_mr(pd, *buf, len, IBV_ACCESS_LOCAL_WRITE);
+	if (!*mr) {
+		VL_MEM_ERR(("Fail in ibv_reg_mr of a receive ring"));
+		free(*buf);
+		*buf = NULL;
+		return FAIL;
+	}
+
+	return SUCCESS;
+}
+
+static int xrc_worker_init(struct xrc_worker_t *w, long *kb)
+{
+	struct ibv_xrcd_init_attr xrcd_attr;
+	struct ibv_srq_init_attr_ex attr;
+	long base;
+	uint32_t i;
+
+	w->context = open_device();
+	if (!w->context)
+		return FAIL;
+
+	w->pd = ibv_alloc_pd(w->context);
+	if (!w->pd) {
+		VL_HCA_ERR(("Fail in ibv_alloc_pd"));
+		return FAIL;
+	}
+
+	/* Joins the domain of the parent, no O_CREAT */
+	w->fd = open(config.xrcd_path, O_RDONLY);
+	if (w->fd < 0) {
+		VL_DATA_ERR(("Fail to open the XRCD file %s (errno %d)", config.xrcd_path, errno));
+		return FAIL;
+	}
+
+	memset(&xrcd_attr, 0, sizeof(xrcd_attr));
+	xrcd_attr.comp_mask = IBV_XRCD_INIT_ATTR_FD | IBV_XRCD_INIT_ATTR_OFLAGS;
+	xrcd_attr.fd = w->fd;
+	xrcd_attr.oflags = 0;
+
+	w->xrcd = ibv_open_xrcd(w->context, &xrcd_attr);
+	if (!w->xrcd) {
+		VL_DATA_ERR(("Fail to open the XRCD of %s", config.xrcd_path));
+		return FAIL;
+	}
+
+	w->wc_arr = calloc(config.batch_size, sizeof(*w->wc_arr));
+	if (!w->wc_arr) {
+		VL_MEM_ERR(("Fail to alloc the worker WCs"));
+		return FAIL;
+	}
+
+	base = rss_kb();
+
+	w->cq = ibv_create_cq(w->context, config.ring_depth, NULL, NULL, 0);
+	if (!w->cq) {
+		VL_DATA_ERR(("Fail in ibv_create_cq"));
+		return FAIL;
+	}
+
+	if (alloc_ring(w->pd, &w->buf, &w->mr))
+		return FAIL;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.comp_mask = IBV_SRQ_INIT_ATTR_TYPE | IBV_SRQ_INIT_ATTR_PD |
+			 IBV_SRQ_INIT_ATTR_XRCD | IBV_SRQ_INIT_ATTR_CQ;
+	attr.attr.max_wr = config.ring_depth;
+	attr.attr.max_sge = 1;
+	attr.srq_type = IBV_SRQT_XRC;
+	attr.pd = w->pd;
+	attr.xrcd = w->xrcd;
+	attr.cq = w->cq;
+
+	w->srq = ibv_create_srq_ex(w->context, &attr);
+	if (!w->srq) {
+		VL_DATA_ERR(("Fail in ibv_create_srq_ex"));
+		return FAIL;
+	}
+
+	for (i = 0; i < config.ring_depth; i++)
+		if (post_recv_slot(w->srq, NULL, w->mr, w->buf, i)) {
+			VL_DATA_ERR(("Fail to fill the worker SRQ"));
+			return FAIL;
+		}
+
+	*kb = rss_kb() - base;
+
+	return SUCCESS;
+}
+
+/*
+ * The receive side the same process needs without XRC: a QP with its own
+ * RQ and buffers per peer, here one per worker. The QPs are only brought
+ * to INIT to take the receives, they are never connected.
+ */
+static int rc_footprint(struct xrc_worker_t *w, int num_qps, long *kb)
+{
+	struct ibv_qp *qp[XRC_MAX_PROCS] = {0};
+	struct ibv_mr *mr[XRC_MAX_PROCS] = {0};
+	void *buf[XRC_MAX_PROCS] = {0};
+	struct ibv_cq *cq;
+	long base = rss_kb();
+	int rc = SUCCESS;
+	int i;
+
+	cq = ibv_create_cq(w->context, config.ring_depth * num_qps, NULL, NULL, 0);
+	if (!cq) {
+		VL_DATA_ERR(("Fail in ibv_create_cq"));
+		return FAIL;
+	}
+
+	for (i = 0; i < num_qps && rc == SUCCESS; i++) {
+		struct ibv_qp_init_attr attr = {
+			.send_cq = cq,
+			.recv_cq = cq,
+			.cap = {
+				.max_send_wr = 1,
+				.max_recv_wr = config.ring_depth,
+				.max_send_sge = 1,
+				.max_recv_sge = 1,
+			},
+			.qp_type = IBV_QPT_RC,
+		};
+		struct ibv_qp_attr qp_attr = {
+			.qp_state = IBV_QPS_INIT,
+			.port_num = IB_PORT,
+			.qp_access_flags = IBV_ACCESS_LOCAL_WRITE,
+		};
+		uint32_t j;
+
+		qp[i] = ibv_create_qp(w->pd, &attr);
+		if (!qp[i] || alloc_ring(w->pd, &buf[i], &mr[i]) ||
+		    ibv_modify_qp(qp[i], &qp_attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX |
+				  IBV_QP_PORT | IBV_QP_ACCESS_FLAGS)) {
+			VL_DATA_ERR(("Fail to create RC QP %d of the footprint", i));
+			rc = FAIL;
+			break;
+		}
+
+		for (j = 0; j < config.ring_depth; j++)
+			if (post_recv_slot(NULL, qp[i], mr[i], buf[i], j)) {
+				VL_DATA_ERR(("Fail to fill the RQ of RC QP %d", i));
+				rc = FAIL;
+				break;
+			}
+	}
+
+	*kb = rss_kb() - base;
+
+	for (i = 0; i < num_qps; i++) {
+		if (qp[i])
+			ibv_destroy_qp(qp[i]);
+		if (mr[i])
+			ibv_dereg_mr(mr[i]);
+		free(buf[i]);
+	}
+	ibv_destroy_cq(cq);
+
+	return rc;
+}
+
+static int xrc_worker_recv(struct xrc_worker_t *w, struct xrc_proc_t *proc)
+{
+	struct xrc_proc_result_t *res = &proc->res;
+	uint64_t posted = config.ring_depth;
+
+	while (res->msgs < proc->quota) {
+		int rc, i;
+
+		rc = ibv_poll_cq(w->cq, config.batch_size, w->wc_arr);
+		if (rc < 0) {
+			VL_MISC_ERR(("in ibv_poll_cq (%s)", strerror(rc)));
+			return FAIL;
+		}
+		if (!rc)
+			continue;
+
+		res->last = get_cycles();
+		if (!res->msgs)
+			res->first = res->last;
+
+		for (i = 0; i < rc; i++) {
+			if (w->wc_arr[i].status != IBV_WC_SUCCESS) {
+				VL_MISC_ERR(("got WC with error (%d)", w->wc_arr[i].status));
+				return FAIL;
+			}
+
+			if (posted < proc->quota &&
+			    post_recv_slot(w->srq, NULL, w->mr, w->buf, w->wc_arr[i].wr_id)) {
+				VL_DATA_ERR(("Fail to refill the worker SRQ"));
+				return FAIL;
+			}
+			posted++;
+		}
+
+		res->msgs += rc;
+	}
+
+	return SUCCESS;
+}
+
+static void xrc_worker_destroy(struct xrc_worker_t *w)
+{
+	if (w->srq)
+		ibv_destroy_srq(w->srq);
+	if (w->mr)
+		ibv_dereg_mr(w->mr);
+	free(w->buf);
+	if (w->cq)
+		ibv_destroy_cq(w->cq);
+	if (w->xrcd)
+		ibv_close_xrcd(w->xrcd);
+	if (w->fd >= 0)
+		close(w->fd);
+	if (w->pd)
+		ibv_dealloc_pd(w->pd);
+	if (w->context)
+		ibv_close_device(w->context);
+	free(w->wc_arr);
+}
+
+/* Runs in the child: SRQ number up the pipe, receive the quota, results up the pipe */
+static void xrc_worker(struct xrc_proc_t *proc, int num, int wfd)
+{
+	struct xrc_worker_t w = { .fd = -1 };
+	struct xrc_proc_result_t *res = &proc->res;
+	uint32_t srqn;
+
+	memset(res, 0, sizeof(*res));
+	res->error = 1;
+
+	if (xrc_worker_init(&w, &res->xrc_kb) ||
+	    ibv_get_srq_num(w.srq, &srqn) ||
+	    write(wfd, &srqn, sizeof(srqn)) != sizeof(srqn))
+		goto out;
+
+	if (xrc_worker_recv(&w, proc) ||
+	    rc_footprint(&w, num, &res->rc_kb))
+		goto out;
+
+	res->error = 0;
+
+out:
+	if (write(wfd, res, sizeof(*res)) != sizeof(*res))
+		res->error = 1;
+	xrc_worker_destroy(&w);
+	_exit(res->error ? 1 : 0);
+}
+
+static void xrc_procs_kill(struct xrc_procs_t *procs)
+{
+	int i;
+
+	for (i = 0; i < procs->num; i++) {
+		if (procs->proc[i].pid > 0) {
+			kill(procs->proc[i].pid, SIGKILL);
+			waitpid(procs->proc[i].pid, NULL, 0);
+			procs->proc[i].pid = 0;
+		}
+		if (procs->proc[i].fd >= 0) {
+			close(procs->proc[i].fd);
+			procs->proc[i].fd = -1;
+		}
+	}
+}
+
+/*
+ * Fork num workers and collect their SRQ numbers. The client spreads its
+ * iters messages round-robin over the SRQs, so a worker expects its share.
+ */
+int xrc_procs_start(struct xrc_procs_t *procs, int num, uint64_t iters)
+{
+	int i;
+
+	memset(procs, 0, sizeof(*procs));
+
+	for (i = 0; i < num; i++) {
+		struct xrc_proc_t *proc = &procs->proc[i];
+		int fds[2];
+
+		proc->fd = -1;
+		proc->quota = iters / num + ((uint64_t)i < iters % num);
+
+		if (pipe(fds)) {
+			VL_MISC_ERR(("Fail to create the worker pipe (errno %d)", errno));
+			goto err;
+		}
+
+		proc->pid = fork();
+		if (proc->pid < 0) {
+			VL_MISC_ERR(("Fail to fork XRC worker %d (errno %d)", i, errno));
+			close(fds[0]);
+			close(fds[1]);
+			goto err;
+		}
+
+		if (!proc->pid) {
+			/* Don't outlive a parent which failed before reaping us */
+			prctl(PR_SET_PDEATHSIG, SIGKILL);
+			close(fds[0]);
+			xrc_worker(proc, num, fds[1]);
+		}
+
+		close(fds[1]);
+		proc->fd = fds[0];
+		procs->num++;
+	}
+
+	for (i = 0; i < num; i++) {
+		if (read_full(procs->proc[i].fd, &procs->proc[i].srqn, sizeof(uint32_t))) {
+			VL_MISC_ERR(("XRC worker %d failed to start", i));
+			goto err;
+		}
+
+		VL_DATA_TRACE1(("XRC worker %d pid %d receives on SRQ 0x%x", i,
+				procs->proc[i].pid, procs->proc[i].srqn));
+	}
+
+	return SUCCESS;
+
+err:
+	xrc_procs_kill(procs);
+	return FAIL;
+}
+
+int xrc_procs_wait(struct xrc_procs_t *procs)
+{
+	int rc = SUCCESS;
+	int i;
+
+	for (i = 0; i < procs->num; i++) {
+		struct xrc_proc_t *proc = &procs->proc[i];
+		int status;
+
+		if (read_full(proc->fd, &proc->res, sizeof(proc->res)) || proc->res.error) {
+			VL_MISC_ERR(("XRC worker %d failed", i));
+			rc = FAIL;
+			break;
+		}
+
+		close(proc->fd);
+		proc->fd = -1;
+
+		if (waitpid(proc->pid, &status, 0) < 0 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status)) {
+			VL_MISC_ERR(("XRC worker %d exited abnormally", i));
+			rc = FAIL;
+		}
+		proc->pid = 0;
+	}
+
+	if (rc)
+		xrc_procs_kill(procs);
+
+	return rc;
+}
@@ -0,0 +1,41 @@
+#ifndef XRC_PROCS_H
+#define XRC_PROCS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "get_clock.h"
+
+#define XRC_MAX_PROCS 64
+
+/* What a worker sends back once its receives are done */
+struct xrc_proc_result_t {
+	uint64_t	msgs;
+	cycles_t	first;		/* first and last reaped CQE */
+	cycles_t	last;
+	long		xrc_kb;		/* CQ, XRC SRQ and receive buffers */
+	long		rc_kb;		/* the same ring on an RQ per RC QP, a QP per worker */
+	int		error;
+};
+
+struct xrc_proc_t {
+	pid_t			pid;
+	int			fd;		/* worker to parent pipe */
+	uint32_t		srqn;
+	uint64_t		quota;		/* receives the client sends to its SRQ */
+	struct xrc_proc_result_t res;
+};
+
+/*
+ * Server worker processes on one XRC domain. Each worker opens the XRCD
+ * through the shared file and receives on an SRQ of its own, the XRC
+ * target QP of the parent delivers to all of them.
+ */
+struct xrc_procs_t {
+	int			num;
+	struct xrc_proc_t	proc[XRC_MAX_PROCS];
+};
+
+int xrc_procs_start(struct xrc_procs_t *procs, int num, uint64_t iters);
+int xrc_procs_wait(struct xrc_procs_t *procs);
+
+#endif /* XRC_PROCS_H */